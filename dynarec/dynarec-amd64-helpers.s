@@ -1,22 +1,43 @@
 /* offsetof(struct dynarec_state, regs) */
 .EQU STATE_REG_OFFSET, 64
 
-.EQU AT_REG_OFFSET,    (STATE_REG_OFFSET + 4 * 0)
-.EQU V0_REG_OFFSET,    (STATE_REG_OFFSET + 4 * 1)
-.EQU V1_REG_OFFSET,    (STATE_REG_OFFSET + 4 * 2)
-.EQU A0_REG_OFFSET,    (STATE_REG_OFFSET + 4 * 3)
-.EQU A1_REG_OFFSET,    (STATE_REG_OFFSET + 4 * 4)
-.EQU T0_REG_OFFSET,    (STATE_REG_OFFSET + 4 * 7)
-.EQU SP_REG_OFFSET,    (STATE_REG_OFFSET + 4 * 28)
-.EQU RA_REG_OFFSET,    (STATE_REG_OFFSET + 4 * 30)
 .EQU DT_REG_OFFSET,    (STATE_REG_OFFSET + 4 * 31)
 
+/* Save the registers allocated to PSX registers that are not
+ * preserved by function calls. Together with the return address this
+ * keeps the stack aligned on 16 bytes for the call */
+.macro SAVE_SCRATCH_REGS
+        push    %rdi
+        push    %r8
+        push    %r9
+        push    %r10
+        push    %r11
+.endm
+
+/* Restore the registers saved by SAVE_SCRATCH_REGS */
+.macro RESTORE_SCRATCH_REGS
+        pop     %r11
+        pop     %r10
+        pop     %r9
+        pop     %r8
+        pop     %rdi
+.endm
+
+/* Split a struct dynarec_load_val returned in %rax: value in %eax,
+ * counter in %ecx */
+.macro SPLIT_LOAD_VAL
+        mov     %rax, %rcx
+        shr     $32, %rcx
+        mov     %eax, %eax
+.endm
+
 .text
 
 .global dynasm_execute
 .type   dynasm_execute, function
 /* Switch to dynarec register layout, call the dynarec code then
- * revert to the proper C calling convention. */
+ * revert to the proper C calling convention. Returns the updated
+ * cycle counter. */
 dynasm_execute:
         /* Be a good function and create a stack frame */
         push    %rbp
@@ -30,35 +51,23 @@ dynasm_execute:
         push    %r13
         push    %r12
 
-        /* Load the "cached" PSX registers into the host's */
-        mov     AT_REG_OFFSET(%rdi), %r8d
-        mov     V0_REG_OFFSET(%rdi), %r9d
-        mov     V1_REG_OFFSET(%rdi), %r10d
-        mov     A0_REG_OFFSET(%rdi), %r11d
-        mov     A1_REG_OFFSET(%rdi), %r12d
-        mov     T0_REG_OFFSET(%rdi), %r13d
-        mov     SP_REG_OFFSET(%rdi), %r14d
-        mov     RA_REG_OFFSET(%rdi), %r15d
-        mov     DT_REG_OFFSET(%rdi), %rbx
-
-        /* Move cycles_to_run to %ecx */
-        mov     %edx, %ecx
-
-        /* Call dynarec'd code */
-        call    *%rsi
-
-        /* Store the "cached" PSX registers back into the state struct.
-         * Dynarec'd code always keeps the dynarec_state pointer in
-	 * %rdi, so we don't have to worry about preserving it here. */
-        mov     %r8d,  AT_REG_OFFSET(%rdi)
-        mov     %r9d,  V0_REG_OFFSET(%rdi)
-        mov     %r10d, V1_REG_OFFSET(%rdi)
-        mov     %r11d, A0_REG_OFFSET(%rdi)
-        mov     %r12d, A1_REG_OFFSET(%rdi)
-        mov     %r13d, T0_REG_OFFSET(%rdi)
-        mov     %r14d, SP_REG_OFFSET(%rdi)
-        mov     %r15d, RA_REG_OFFSET(%rdi)
-        mov     %rbx,  DT_REG_OFFSET(%rdi)
+        mov     DT_REG_OFFSET(%rdi), %ebx
+
+        /* The cycle counter is already in %ecx. Call the page entry
+         * with the target in %rsi, it loads the PSX registers
+         * allocated for the page and jumps to the target. */
+        mov     %rsi, %rax
+        mov     %rdx, %rsi
+        call    *%rax
+
+        /* The recompiled code always stores the allocated registers
+         * back into the state struct before returning. It also keeps
+         * the dynarec_state pointer in %rdi, so we don't have to worry
+         * about preserving it here. */
+        mov     %ebx,  DT_REG_OFFSET(%rdi)
+
+        /* Return the cycle counter */
+        mov     %ecx, %eax
 
         /* Pop the preserved registers */
         pop     %r12
@@ -70,80 +79,183 @@ dynasm_execute:
         pop     %rbp
         ret
 
-.global dynabi_device_sw
-.type   dynabi_device_sw, function
-/* Called by the dynarec code when a SW instruction targets device
- * memory */
-dynabi_device_sw:
-        /* Bank the registers not preserved by function calls */
-        mov     %r8d,  AT_REG_OFFSET(%rdi)
-        mov     %r9d,  V0_REG_OFFSET(%rdi)
-        mov     %r10d, V1_REG_OFFSET(%rdi)
-        mov     %r11d, A0_REG_OFFSET(%rdi)
-
-	/* Preserve dynarec_state pointer */
-        push    %rdi
+/* Device stores: value in %esi, address in %edx, counter in %ecx. That
+ * matches the C calling convention of the callback. */
+.macro DEVICE_STORE name, callback
+.global \name
+.type   \name, function
+\name:
+        SAVE_SCRATCH_REGS
 
         /* Call emulator code */
-        call    dynarec_callback_sw
+        call    \callback
 
         /* Move return value to the counter */
         mov     %eax, %ecx
 
-        /* Restore dynarec_state pointer */
-        pop     %rdi
+        RESTORE_SCRATCH_REGS
+
+        ret
+.endm
+
+/* Device loads: address in %edx, counter in %ecx. The value is
+ * returned zero-extended in %eax. */
+.macro DEVICE_LOAD name, callback
+.global \name
+.type   \name, function
+\name:
+        SAVE_SCRATCH_REGS
+
+        mov     %edx, %esi
+        mov     %ecx, %edx
+        call    \callback
+
+        SPLIT_LOAD_VAL
+
+        RESTORE_SCRATCH_REGS
+
+        ret
+.endm
+
+/* LWL/LWR: current value of the target register in %esi, address in
+ * %edx, counter in %ecx. The new value is returned in %eax */
+.macro UNALIGNED_LOAD name, callback
+.global \name
+.type   \name, function
+\name:
+        SAVE_SCRATCH_REGS
+
+        call    \callback
+
+        SPLIT_LOAD_VAL
+
+        RESTORE_SCRATCH_REGS
+
+        ret
+.endm
+
+DEVICE_STORE dynabi_device_sb, dynarec_callback_sb
+DEVICE_STORE dynabi_device_sh, dynarec_callback_sh
+DEVICE_STORE dynabi_device_sw, dynarec_callback_sw
+DEVICE_STORE dynabi_swl, dynarec_callback_swl
+DEVICE_STORE dynabi_swr, dynarec_callback_swr
+
+DEVICE_LOAD dynabi_device_lb, dynarec_callback_lb
+DEVICE_LOAD dynabi_device_lh, dynarec_callback_lh
+DEVICE_LOAD dynabi_device_lw, dynarec_callback_lw
+
+UNALIGNED_LOAD dynabi_lwl, dynarec_callback_lwl
+UNALIGNED_LOAD dynabi_lwr, dynarec_callback_lwr
+
+/* GTE instructions: instruction in %esi, operand in %edx, counter in
+ * %ecx. Same convention as the device stores. */
+DEVICE_STORE dynabi_gte, dynarec_callback_gte
+
+/* MFC2/CFC2: instruction in %esi, counter in %ecx. The value is
+ * returned in %eax */
+.global dynabi_gte_read
+.type   dynabi_gte_read, function
+dynabi_gte_read:
+        SAVE_SCRATCH_REGS
 
-        /* Reload registers */
-        mov     AT_REG_OFFSET(%rdi), %r8d
-        mov     V0_REG_OFFSET(%rdi), %r9d
-        mov     V1_REG_OFFSET(%rdi), %r10d
-        mov     A0_REG_OFFSET(%rdi), %r11d
+        mov     %ecx, %edx
+        call    dynarec_callback_gte_read
+
+        SPLIT_LOAD_VAL
+
+        RESTORE_SCRATCH_REGS
 
         ret
 
-.global dynabi_device_sh
-.type   dynabi_device_sh, function
-/* Called by the dynarec code when a Sh instruction targets device
- * memory */
-dynabi_device_sh:
-        int $3
+.global dynabi_invalidate
+.type   dynabi_invalidate, function
+/* Called by the dynarec code when it writes to a page that has been
+ * recompiled. Page index in %eax. All registers are preserved since
+ * the store hasn't taken place yet. */
+dynabi_invalidate:
+        SAVE_SCRATCH_REGS
+
+        push    %rsi
+        push    %rdx
+        push    %rcx
+        push    %rax
+
+        mov     %eax, %esi
+        call    dynarec_invalidate_page
 
-.global dynabi_device_lw
-.type   dynabi_device_lw, function
-/* Called by the dynarec code when a LW instruction targets device
- * memory */
-dynabi_device_lw:
-        int $3
+        pop     %rax
+        pop     %rcx
+        pop     %rdx
+        pop     %rsi
+
+        RESTORE_SCRATCH_REGS
+
+        ret
 
 .global dynabi_exception
 .type   dynabi_exception, function
 /* Called by the dynarec code when an exception must be
- * generated. Exception number is in %rsi, exception PC in %rdx. */
+ * generated. Exception number is in %esi, exception PC in %edx, the
+ * bad virtual address (for address errors) in %eax. This function
+ * doesn't return to the caller, it returns directly from
+ * dynasm_execute's call to the recompiled code. The allocated PSX
+ * registers must have been stored in the state struct already. */
 dynabi_exception:
-        /* TODO */
-        int $3
-
-.global dynabi_set_cop0_sr
-.type   dynabi_set_cop0_sr, function
-/* Called by the dynarec code when storing the value of the SR
- * register. The value is in %esi.*/
-dynabi_set_cop0_sr:
-        /* TODO: check for interrupt, check for cache isolation. */
-        int $3
-
-.global dynabi_set_cop0_cause
-.type   dynabi_set_cop0_cause, function
-/* Called by the dynarec code when storing the value of the CAUSE
- * register. The value is in %esi.*/
-dynabi_set_cop0_cause:
-        /* TODO: check for interrupt, check for cache isolation. */
-        int $3
-
-.global dynabi_set_cop0_misc
-.type   dynabi_set_cop0_misc, function
-/* Called by the dynarec code when storing the value of a COP0
- * register that's neither SR or CAUSE. The value is in %esi, the
- * register index in %edx */
-dynabi_set_cop0_misc:
-        /* TODO: check for interrupt, check for cache isolation. */
-        int $3
+        push    %rdi
+
+        mov     %eax, %r8d
+        call    dynarec_callback_exception
+        mov     %eax, %ecx
+
+        pop     %rdi
+
+        /* Drop our return address, return to dynasm_execute */
+        add     $8, %rsp
+        ret
+
+.global dynabi_cop
+.type   dynabi_cop, function
+/* Called by the dynarec code to run a coprocessor
+ * instruction. Instruction in %esi, PC in %edx, operand in %eax. The
+ * value for the target register (if any) is returned in %eax. If the
+ * emulator asks for an exit (exception, pending interrupt...) we
+ * return directly to dynasm_execute like dynabi_exception, so the
+ * allocated PSX registers must have been stored in the state
+ * struct. */
+dynabi_cop:
+        SAVE_SCRATCH_REGS
+
+        mov     %eax, %r8d
+        call    dynarec_callback_cop
+
+        RESTORE_SCRATCH_REGS
+
+        /* %eax: counter, upper %rax: exit flag, %edx: value */
+        mov     %eax, %ecx
+        shr     $32, %rax
+        jnz     1f
+
+        mov     %edx, %eax
+        ret
+1:
+        add     $8, %rsp
+        ret
+
+.global dynabi_idle_loop
+.type   dynabi_idle_loop, function
+/* Called by the dynarec code when it takes the branch of an idle loop
+ * candidate. Branch PC in %esi, counter in %ecx. The allocated PSX
+ * registers must have been stored in the state struct. Returns the
+ * updated counter in %ecx. */
+dynabi_idle_loop:
+        SAVE_SCRATCH_REGS
+
+        mov     %ecx, %edx
+        call    dynarec_idle_loop
+        mov     %eax, %ecx
+
+        RESTORE_SCRATCH_REGS
+
+        ret
+
+.section .note.GNU-stack,"",@progbits
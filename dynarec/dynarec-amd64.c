@@ -19,62 +19,75 @@ enum X86_REG {
    REG_SI  = 6,  /* Temporary variable, func arg 1 */
    REG_DI  = 7,  /* struct dynarec_state pointer, func arg 0 */
    REG_SP  = 4,  /* Host stack [PAFC] */
-   REG_R8  = 8,  /* PSX AT */
-   REG_R9  = 9,  /* PSX V0 */
-   REG_R10 = 10, /* PSX V1 */
-   REG_R11 = 11, /* PSX A0 */
-   REG_R12 = 12, /* PSX A1 [PAFC] */
-   REG_R13 = 13, /* PSX T0 [PAFC] */
-   REG_R14 = 14, /* PSX SP [PAFC] */
-   REG_R15 = 15, /* PSX RA [PAFC] */
+   REG_R8  = 8,  /* Allocated PSX register */
+   REG_R9  = 9,  /* Allocated PSX register */
+   REG_R10 = 10, /* Allocated PSX register */
+   REG_R11 = 11, /* Allocated PSX register */
+   REG_R12 = 12, /* Allocated PSX register [PAFC] */
+   REG_R13 = 13, /* Allocated PSX register [PAFC] */
+   REG_R14 = 14, /* Allocated PSX register [PAFC] */
+   REG_R15 = 15, /* Allocated PSX register [PAFC] */
 };
 
 #define STATE_REG  REG_DI
 
+/* Host registers used for the allocation slots computed by
+   `dynarec_allocate_registers`. The most used registers get the
+   lowest slots so we put the registers preserved across function
+   calls first, that way they don't have to be saved when we call the
+   helpers. */
+static const enum X86_REG slot_registers[DYNAREC_ALLOCATABLE_REGS] = {
+   REG_R12, REG_R13, REG_R14, REG_R15,
+   REG_R8,  REG_R9,  REG_R10, REG_R11,
+};
+
 /* Returns the host register location for the PSX-emulated register
    `reg`. Returns -1 if no host register is allocated, in which case
-   it must be accessed in memory.
-
-   If you change this don't forget to change `dynarec_execute` as
-   well. */
-static int register_location(enum PSX_REG reg) {
-   switch (reg) {
-   case PSX_REG_AT:
-      return REG_R8;
-   case PSX_REG_V0:
-      return REG_R9;
-   case PSX_REG_V1:
-      return REG_R10;
-   case PSX_REG_A0:
-      return REG_R11;
-   case PSX_REG_A1:
-      return REG_R12;
-   case PSX_REG_T0:
-      return REG_R13;
-   case PSX_REG_SP:
-      return REG_R14;
-   case PSX_REG_RA:
-      return REG_R15;
-   case PSX_REG_DT:
+   it must be accessed in memory. */
+static int register_location(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg) {
+   if (reg == PSX_REG_DT) {
       return REG_BX;
-   default:
+   }
+
+   if (reg == PSX_REG_R0 || reg >= 32 || compiler->reg_slot[reg] < 0) {
       return -1;
    }
-}
 
-#define UNIMPLEMENTED do {                                      \
-      printf("%s:%d not implemented\n", __func__, __LINE__);    \
-      abort();                                                  \
-   } while (0)
+   return slot_registers[compiler->reg_slot[reg]];
+}
 
 /*******************************************
  * Helper "assembler" functions and macros *
  *******************************************/
 
+/* Patch the jump offset at `patch` (rel8 or rel32) to point at
+   `target` */
+static void patch_jump(uint8_t *patch, uint8_t *target, bool long_jump) {
+   if (long_jump) {
+      int32_t off = target - (patch + 4);
+      int i;
+
+      for (i = 0; i < 4; i++) {
+         patch[i] = off & 0xff;
+         off >>= 8;
+      }
+   } else {
+      int32_t off = target - (patch + 1);
+
+      assert(off >= -0x80 && off <= 0x7f);
+      *patch = off;
+   }
+}
+
 /* A set of rather ugly macros to generate if/else statements. The
  * "else" part can be ommited. These statemens introduce a new scope
  * and can be nested. These macros use the 2 byte jump instructions so
- * the bodies must not be bigger than 127 bytes.
+ * the bodies must not be bigger than 127 bytes, use the IF_LONG
+ * variants for bigger bodies.
+ *
+ * The opcode is the one of the short conditional jump taken when the
+ * condition is *false*.
  *
  * "else if" statements can be implementing by nesting the elses:
  *
@@ -88,29 +101,53 @@ static int register_location(enum PSX_REG reg) {
  *                                     }
  *                                  }
  */
-#define IF(_opcode) do {                        \
-   uint8_t *_jump_patch;                        \
-   *((compiler)->map++) = (_opcode);            \
-   _jump_patch = (compiler)->map++;
+#define IF_JCC(_opcode, _long) do {                     \
+   uint8_t *_jump_patch;                                \
+   bool _jump_long = (_long);                           \
+   if (_jump_long) {                                    \
+      /* Jcc rel32 */                                   \
+      *((compiler)->map++) = 0x0f;                      \
+      *((compiler)->map++) = (_opcode) + 0x10;          \
+      _jump_patch = (compiler)->map;                    \
+      (compiler)->map += 4;                             \
+   } else {                                             \
+      *((compiler)->map++) = (_opcode);                 \
+      _jump_patch = (compiler)->map++;                  \
+   }
 
 #define ELSE {                                                  \
-      uint32_t _jump_off = ((compiler)->map - _jump_patch) + 1; \
-      assert(_jump_off < 128);                                  \
-      *_jump_patch = _jump_off;                                 \
-      /* JMP imms8 */                                           \
-      *((compiler)->map++) = 0xeb;                              \
-      _jump_patch = (compiler)->map++;                          \
+      uint8_t *_else_patch;                                     \
+      if (_jump_long) {                                         \
+         /* JMP rel32 */                                        \
+         *((compiler)->map++) = 0xe9;                           \
+         _else_patch = (compiler)->map;                         \
+         (compiler)->map += 4;                                  \
+      } else {                                                  \
+         /* JMP rel8 */                                         \
+         *((compiler)->map++) = 0xeb;                           \
+         _else_patch = (compiler)->map++;                       \
+      }                                                         \
+      patch_jump(_jump_patch, (compiler)->map, _jump_long);     \
+      _jump_patch = _else_patch;                                \
    }
 
 #define ENDIF {                                                 \
-      uint32_t _jump_off = ((compiler)->map - _jump_patch) - 1; \
-      assert(_jump_off < 128);                                  \
-      *_jump_patch = _jump_off;                                 \
+      patch_jump(_jump_patch, (compiler)->map, _jump_long);     \
    }} while (0)
 
+#define IF(_opcode)      IF_JCC((_opcode), false)
+#define IF_LONG(_opcode) IF_JCC((_opcode), true)
+
 #define IF_OVERFLOW      IF(0x71)
 #define IF_NOT_EQUAL     IF(0x74)
+#define IF_EQUAL         IF(0x75)
 #define IF_LESS_THAN     IF(0x73)
+#define IF_GREATER_EQUAL IF(0x72)
+#define IF_LESS_EQUAL    IF(0x7f)
+#define IF_NOT_ZERO      IF_NOT_EQUAL
+#define IF_ZERO          IF_EQUAL
+#define IF_ZERO_LONG     IF_LONG(0x75)
+#define IF_EQUAL_LONG    IF_LONG(0x75)
 
 /* 64bit "REX" prefix used to specify extended registers among other
    things. See the "Intel 64 and IA-32 Architecture Software
@@ -130,6 +167,34 @@ static void emit_rex_prefix(struct dynarec_compiler *compiler,
    }
 }
 
+/* Same as above but with the W bit set to use 64bit operands */
+static void emit_rex_w_prefix(struct dynarec_compiler *compiler,
+                              enum X86_REG base,
+                              enum X86_REG modr_m,
+                              enum X86_REG index) {
+   uint8_t rex = 0x48;
+
+   rex |= (modr_m >= 8) << 2; /* R */
+   rex |= (index >= 8)  << 1; /* X */
+   rex |= (base >= 8)   << 0; /* B */
+
+   *(compiler->map++) = rex;
+}
+
+/* REX prefix for instructions using `byte_reg` as an 8bit
+   register. Without a REX prefix the encodings 4 to 7 refer to AH, CH,
+   DH and BH instead of SPL, BPL, SIL and DIL. */
+static void emit_rex_prefix_r8(struct dynarec_compiler *compiler,
+                               enum X86_REG base,
+                               enum X86_REG modr_m,
+                               enum X86_REG byte_reg) {
+   if (byte_reg >= 4 && byte_reg < 8 && base < 8 && modr_m < 8) {
+      *(compiler->map++) = 0x40;
+   } else {
+      emit_rex_prefix(compiler, base, modr_m, 0);
+   }
+}
+
 /* Scale Index Base addressing mode encoding */
 static void emit_sib(struct dynarec_compiler *compiler,
                      enum X86_REG base,
@@ -193,6 +258,29 @@ static void emit_imms8(struct dynarec_compiler *compiler,
    *(compiler->map++) = val & 0xff;
 }
 
+/* Emit the Mod R/M byte (and the offset) for an `off(%base)`
+   operand */
+static void emit_modrm_off(struct dynarec_compiler *compiler,
+                           enum X86_REG reg,
+                           uint32_t off,
+                           enum X86_REG base) {
+   uint8_t mod = is_imms8(off) ? 0x40 : 0x80;
+
+   *(compiler->map++) = mod | (base & 7) | ((reg & 7) << 3);
+
+   if ((base & 7) == 4) {
+      /* %rsp and %r12 can only be used as base through a SIB
+         byte */
+      *(compiler->map++) = 0x24;
+   }
+
+   if (is_imms8(off)) {
+      emit_imms8(compiler, off);
+   } else {
+      emit_imm32(compiler, off);
+   }
+}
+
 /* XOR %reg32, %reg32 */
 static void emit_clear_reg(struct dynarec_compiler *compiler,
                            enum X86_REG reg) {
@@ -229,14 +317,7 @@ static void emit_mov_u32_off_pr64(struct dynarec_compiler *compiler,
 
    *(compiler->map++) = 0xc7;
 
-   /* We can use a denser encoding for small offsets */
-   if (is_imms8(off)) {
-      *(compiler->map++) = 0x40 | (reg & 7);
-      emit_imms8(compiler, off);
-   } else {
-      *(compiler->map++) = 0x80 | (reg & 7);
-      emit_imm32(compiler, off);
-   }
+   emit_modrm_off(compiler, 0, off, reg);
    emit_imm32(compiler, val);
 }
 #define MOV_U32_OFF_PR64(_v, _off, _r)                  \
@@ -260,18 +341,10 @@ static void emit_mop_off_pr64_r32(struct dynarec_compiler *compiler,
                                   enum X86_REG base,
                                   enum X86_REG target) {
    emit_rex_prefix(compiler, base, target, 0);
-   target &= 7;
-   base   &= 7;
 
    *(compiler->map++) = op;
 
-   if (is_imms8(off)) {
-      *(compiler->map++) = 0x40 | base | (target << 3);
-      emit_imms8(compiler, off);
-   } else {
-      *(compiler->map++) = 0x80 | base | (target << 3);
-      emit_imm32(compiler, off);
-   }
+   emit_modrm_off(compiler, target, off, base);
 }
 #define MOV_OFF_PR64_R32(_off, _r1, _r2)                        \
    emit_mop_off_pr64_r32(compiler, 0x8b, (_off), (_r1), (_r2))
@@ -283,18 +356,10 @@ static void emit_mop_r32_off_pr64(struct dynarec_compiler *compiler,
                                   uint32_t off,
                                   enum X86_REG base) {
    emit_rex_prefix(compiler, base, source, 0);
-   source &= 7;
-   base   &= 7;
 
    *(compiler->map++) = op;
 
-   if (is_imms8(off)) {
-      *(compiler->map++) = 0x40 | base | (source << 3);
-      emit_imms8(compiler, off);
-   } else {
-      *(compiler->map++) = 0x80 | base | (source << 3);
-      emit_imm32(compiler, off);
-   }
+   emit_modrm_off(compiler, source, off, base);
 }
 #define MOV_R32_OFF_PR64(_r1, _off, _r2)                         \
    emit_mop_r32_off_pr64(compiler, 0x89, (_r1), (_off), (_r2))
@@ -312,16 +377,34 @@ static void emit_mop_off_pr32_r32(struct dynarec_compiler *compiler,
 #define LEA_OFF_PR32_R32(_off, _r1, _r2)                        \
    emit_mop_off_pr32_r32(compiler, 0x8d, (_off), (_r1), (_r2))
 
-/* MOV $imm32, off(%base64, %index64, $scale) */
-static void emit_mov_u32_off_sib(struct dynarec_compiler *compiler,
-                                 uint32_t val,
-                                 uint32_t off,
-                                 enum X86_REG base,
-                                 enum X86_REG index,
-                                 uint32_t scale) {
+/* MOP off(%base64), %target64 */
+static void emit_mop_off_pr64_r64(struct dynarec_compiler *compiler,
+                                  uint8_t op,
+                                  uint32_t off,
+                                  enum X86_REG base,
+                                  enum X86_REG target) {
+   emit_rex_w_prefix(compiler, base, target, 0);
+
+   *(compiler->map++) = op;
+
+   emit_modrm_off(compiler, target, off, base);
+}
+#define ADD_OFF_PR64_R64(_off, _r1, _r2)                        \
+   emit_mop_off_pr64_r64(compiler, 0x03, (_off), (_r1), (_r2))
+#define MOV_R64_OFF_PR64(_r1, _off, _r2)                        \
+   emit_mop_off_pr64_r64(compiler, 0x89, (_off), (_r2), (_r1))
+
+/* MOV $imm8, off(%base64, %index64, $scale) */
+static void emit_mov_u8_off_sib(struct dynarec_compiler *compiler,
+                                uint8_t val,
+                                uint32_t off,
+                                enum X86_REG base,
+                                enum X86_REG index,
+                                uint32_t scale) {
    emit_rex_prefix(compiler, base, 0, index);
 
-   *(compiler->map++) = 0xc7;
+   *(compiler->map++) = 0xc6;
+
    if (is_imms8(off)) {
       *(compiler->map++) = 0x44;
    } else {
@@ -336,10 +419,40 @@ static void emit_mov_u32_off_sib(struct dynarec_compiler *compiler,
       emit_imm32(compiler, off);
    }
 
-   emit_imm32(compiler, val);
+   emit_imm8(compiler, val);
+}
+#define MOV_U8_OFF_SIB(_v, _o, _b, _i, _s)                      \
+   emit_mov_u8_off_sib(compiler, (_v), (_o), (_b), (_i), (_s))
+
+/* CMPB $imm8, off(%base64, %index64, $scale) */
+static void emit_cmp_u8_off_sib(struct dynarec_compiler *compiler,
+                                uint8_t val,
+                                uint32_t off,
+                                enum X86_REG base,
+                                enum X86_REG index,
+                                uint32_t scale) {
+   emit_rex_prefix(compiler, base, 0, index);
+
+   *(compiler->map++) = 0x80;
+
+   if (is_imms8(off)) {
+      *(compiler->map++) = 0x7c;
+   } else {
+      *(compiler->map++) = 0xbc;
+   }
+
+   emit_sib(compiler, base, index, scale);
+
+   if (is_imms8(off)) {
+      emit_imms8(compiler, off);
+   } else {
+      emit_imm32(compiler, off);
+   }
+
+   emit_imm8(compiler, val);
 }
-#define MOV_U32_OFF_SIB(_v, _o, _b, _i, _s)                     \
-   emit_mov_u32_off_sib(compiler, (_v), (_o), (_b), (_i), (_s))
+#define CMP_U8_OFF_SIB(_v, _o, _b, _i, _s)                      \
+   emit_cmp_u8_off_sib(compiler, (_v), (_o), (_b), (_i), (_s))
 
 /* MOV %val32, (%target64) */
 static void emit_mov_r32_pr64(struct dynarec_compiler *compiler,
@@ -366,6 +479,17 @@ static void emit_mov_r16_pr64(struct dynarec_compiler *compiler,
 }
 #define MOV_R16_PR64(_v, _t) emit_mov_r16_pr64(compiler, (_v), (_t))
 
+/* MOV %val8, (%target64) */
+static void emit_mov_r8_pr64(struct dynarec_compiler *compiler,
+                             enum X86_REG val,
+                             enum X86_REG target) {
+
+   emit_rex_prefix_r8(compiler, target, val, val);
+   *(compiler->map++) = 0x88;
+   *(compiler->map++) = (target & 7) | ((val & 7) << 3);
+}
+#define MOV_R8_PR64(_v, _t) emit_mov_r8_pr64(compiler, (_v), (_t))
+
 /* MOV (%target64), %r32 */
 static void emit_mov_pr64_r32(struct dynarec_compiler *compiler,
                               enum X86_REG addr,
@@ -375,68 +499,66 @@ static void emit_mov_pr64_r32(struct dynarec_compiler *compiler,
    *(compiler->map++) = 0x8b;
    *(compiler->map++) = (addr & 7) | ((target & 7) << 3);
 }
-#define MOV_PR64_R32(_a, _t) emit_mov_r32_pr64(compiler, (_a), (_t))
-
-/* MOV $imm8, off(%base64, %index64, $scale) */
-static void emit_mov_u8_off_sib(struct dynarec_compiler *compiler,
-                                uint8_t val,
-                                uint32_t off,
-                                enum X86_REG base,
-                                enum X86_REG index,
-                                uint32_t scale) {
-   emit_rex_prefix(compiler, base, 0, index);
-
-   *(compiler->map++) = 0xc6;
-
-   if (is_imms8(off)) {
-      *(compiler->map++) = 0x44;
-   } else {
-      *(compiler->map++) = 0x84;
-   }
-
-   emit_sib(compiler, base, index, scale);
+#define MOV_PR64_R32(_a, _t) emit_mov_pr64_r32(compiler, (_a), (_t))
 
-   if (is_imms8(off)) {
-      emit_imms8(compiler, off);
-   } else {
-      emit_imm32(compiler, off);
-   }
+/* MOVZX/MOVSX (%addr64), %r32 */
+static void emit_movx_pr64_r32(struct dynarec_compiler *compiler,
+                               uint8_t op,
+                               enum X86_REG addr,
+                               enum X86_REG target) {
 
-   emit_imm8(compiler, val);
+   emit_rex_prefix(compiler, addr, target, 0);
+   *(compiler->map++) = 0x0f;
+   *(compiler->map++) = op;
+   *(compiler->map++) = (addr & 7) | ((target & 7) << 3);
 }
-#define MOV_U8_OFF_SIB(_v, _o, _b, _i, _s)                      \
-   emit_mov_u8_off_sib(compiler, (_v), (_o), (_b), (_i), (_s))
-
-/* PUSH %reg64 */
-static void emit_push_r64(struct dynarec_compiler *compiler,
-                          enum X86_REG reg) {
-   emit_rex_prefix(compiler, reg, 0, 0);
-
-   *(compiler->map++) = 0x50 | (reg & 7);
+#define MOVZB_PR64_R32(_a, _t) emit_movx_pr64_r32(compiler, 0xb6, (_a), (_t))
+#define MOVZW_PR64_R32(_a, _t) emit_movx_pr64_r32(compiler, 0xb7, (_a), (_t))
+#define MOVSB_PR64_R32(_a, _t) emit_movx_pr64_r32(compiler, 0xbe, (_a), (_t))
+#define MOVSW_PR64_R32(_a, _t) emit_movx_pr64_r32(compiler, 0xbf, (_a), (_t))
+
+/* MOVZX/MOVSX %source8/16, %target32 */
+static void emit_movx_r_r32(struct dynarec_compiler *compiler,
+                            uint8_t op,
+                            enum X86_REG source,
+                            enum X86_REG target) {
+
+   emit_rex_prefix_r8(compiler, source, target, source);
+   *(compiler->map++) = 0x0f;
+   *(compiler->map++) = op;
+   *(compiler->map++) = 0xc0 | (source & 7) | ((target & 7) << 3);
 }
-#define PUSH_R64(_r) emit_push_r64(compiler, (_r))
-
-/* POP %reg64 */
-static void emit_pop_r64(struct dynarec_compiler *compiler,
-                         enum X86_REG reg) {
-   emit_rex_prefix(compiler, reg, 0, 0);
-
-   *(compiler->map++) = 0x58 | (reg & 7);
+#define MOVSB_R8_R32(_s, _t) emit_movx_r_r32(compiler, 0xbe, (_s), (_t))
+#define MOVSW_R16_R32(_s, _t) emit_movx_r_r32(compiler, 0xbf, (_s), (_t))
+
+/* MOVSXD %source32, %target64 */
+static void emit_movsxd_r32_r64(struct dynarec_compiler *compiler,
+                                enum X86_REG source,
+                                enum X86_REG target) {
+   emit_rex_w_prefix(compiler, source, target, 0);
+   *(compiler->map++) = 0x63;
+   *(compiler->map++) = 0xc0 | (source & 7) | ((target & 7) << 3);
 }
-#define POP_R64(_r) emit_pop_r64(compiler, (_r))
+#define MOVSXD_R32_R64(_s, _t) emit_movsxd_r32_r64(compiler, (_s), (_t))
 
-/* SETB %reg8 */
-static void emit_setb(struct dynarec_compiler *compiler,
-                      enum X86_REG reg) {
-   emit_rex_prefix(compiler, reg, 0, 0);
+/* SETcc %reg8 */
+static void emit_setcc(struct dynarec_compiler *compiler,
+                       uint8_t op,
+                       enum X86_REG reg) {
+   emit_rex_prefix_r8(compiler, reg, 0, reg);
 
    reg &= 7;
 
    *(compiler->map++) = 0x0f;
-   *(compiler->map++) = 0x92;
+   *(compiler->map++) = op;
    *(compiler->map++) = 0xc0 + reg;
 }
-#define SETB_R8(_r) emit_setb(compiler, (_r))
+#define SETE_R8(_r)  emit_setcc(compiler, 0x94, (_r))
+#define SETNE_R8(_r) emit_setcc(compiler, 0x95, (_r))
+#define SETL_R8(_r)  emit_setcc(compiler, 0x9c, (_r))
+#define SETGE_R8(_r) emit_setcc(compiler, 0x9d, (_r))
+#define SETLE_R8(_r) emit_setcc(compiler, 0x9e, (_r))
+#define SETG_R8(_r)  emit_setcc(compiler, 0x9f, (_r))
 
 /******************
  * ALU operations *
@@ -471,12 +593,12 @@ static void emit_alu_u32_r32(struct dynarec_compiler *compiler,
 #define XOR_U32_R32(_v, _r) emit_alu_u32_r32(compiler, 0xf0, (_v), (_r))
 #define CMP_U32_R32(_v, _r) emit_alu_u32_r32(compiler, 0xf8, (_v), (_r))
 
-/* ALU %reg32, %reg32 */
+/* ALU %op0_32, %op1_32. The result is stored in op1. */
 static void emit_alu_r32_r32(struct dynarec_compiler *compiler,
                              uint8_t op,
                              enum X86_REG op0,
                              enum X86_REG op1) {
-   emit_rex_prefix(compiler, op0, op1, 0);
+   emit_rex_prefix(compiler, op1, op0, 0);
 
    op0 &= 7;
    op1 &= 7;
@@ -490,6 +612,7 @@ static void emit_alu_r32_r32(struct dynarec_compiler *compiler,
 #define SUB_R32_R32(_op0, _op1) emit_alu_r32_r32(compiler, 0x29, (_op0), (_op1))
 #define XOR_R32_R32(_op0, _op1) emit_alu_r32_r32(compiler, 0x31, (_op0), (_op1))
 #define CMP_R32_R32(_op0, _op1) emit_alu_r32_r32(compiler, 0x39, (_op0), (_op1))
+#define TEST_R32_R32(_op0, _op1) emit_alu_r32_r32(compiler, 0x85, (_op0), (_op1))
 
 /* ALU off(%base64), %target32 */
 static void emit_alu_off_pr64_r32(struct dynarec_compiler *compiler,
@@ -500,16 +623,10 @@ static void emit_alu_off_pr64_r32(struct dynarec_compiler *compiler,
    emit_rex_prefix(compiler, base, target, 0);
    *(compiler->map++) = op;
 
-   if (is_imms8(off)) {
-      *(compiler->map++) = 0x40 | (base & 7) | ((target & 7) << 3);
-      emit_imms8(compiler, off);
-   } else {
-      *(compiler->map++) = 0x80 | (base & 7) | ((target & 7) << 3);
-      emit_imm32(compiler, off);
-   }
+   emit_modrm_off(compiler, target, off, base);
 }
-#define ADD_OFF_PR64_R32(_o, _b, _t)                            \
-   emit_alu_off_pr64_r32(compiler, 0x03, (_o), (_b), (_t))
+#define OR_OFF_PR64_R32(_o, _b, _t)                            \
+   emit_alu_off_pr64_r32(compiler, 0x0b, (_o), (_b), (_t))
 #define AND_OFF_PR64_R32(_o, _b, _t)                            \
    emit_alu_off_pr64_r32(compiler, 0x23, (_o), (_b), (_t))
 
@@ -550,6 +667,36 @@ static void emit_alu_u32_off_pr64(struct dynarec_compiler *compiler,
    emit_alu_u32_off_pr64(compiler, 0x08, (_v), (_o), (_b))
 #define AND_U32_OFF_PR64(_v, _o, _b)                            \
    emit_alu_u32_off_pr64(compiler, 0x20, (_v), (_o), (_b))
+#define XOR_U32_OFF_PR64(_v, _o, _b)                            \
+   emit_alu_u32_off_pr64(compiler, 0x30, (_v), (_o), (_b))
+#define CMP_U32_OFF_PR64(_v, _o, _b)                            \
+   emit_alu_u32_off_pr64(compiler, 0x38, (_v), (_o), (_b))
+
+/* TEST $u32, off(%base64) */
+static void emit_test_u32_off_pr64(struct dynarec_compiler *compiler,
+                                   uint32_t v,
+                                   uint32_t off,
+                                   enum X86_REG base) {
+   emit_rex_prefix(compiler, base, 0, 0);
+
+   *(compiler->map++) = 0xf7;
+   emit_modrm_off(compiler, 0, off, base);
+   emit_imm32(compiler, v);
+}
+#define TEST_U32_OFF_PR64(_v, _o, _b)                   \
+   emit_test_u32_off_pr64(compiler, (_v), (_o), (_b))
+
+/* TEST $u8, %reg8. Only supports AL, CL, DL and BL */
+static void emit_test_u8_r8(struct dynarec_compiler *compiler,
+                            uint8_t v,
+                            enum X86_REG reg) {
+   assert(reg < 4);
+
+   *(compiler->map++) = 0xf6;
+   *(compiler->map++) = 0xc0 | reg;
+   emit_imm8(compiler, v);
+}
+#define TEST_U8_R8(_v, _r) emit_test_u8_r8(compiler, (_v), (_r))
 
 /* ALU off(%b64, %i64, $s), %target32 */
 static void emit_alu_off_sib_r32(struct dynarec_compiler *compiler,
@@ -573,11 +720,45 @@ static void emit_alu_off_sib_r32(struct dynarec_compiler *compiler,
       emit_imm32(compiler, off);
    }
 }
-#define ADD_OFF_SIB_R32(_o, _b, _i, _s, _t)                             \
-   emit_alu_off_sib_r32(compiler, 0x03, (_o), (_b), (_i), (_s), (_t))
 #define AND_OFF_SIB_R32(_o, _b, _i, _s, _t)                             \
    emit_alu_off_sib_r32(compiler, 0x23, (_o), (_b), (_i), (_s), (_t))
 
+/* Single operand arithmetic: NOT, NEG, MUL, DIV... */
+static void emit_unary_r32(struct dynarec_compiler *compiler,
+                           uint8_t op,
+                           enum X86_REG reg) {
+   emit_rex_prefix(compiler, reg, 0, 0);
+
+   *(compiler->map++) = 0xf7;
+   *(compiler->map++) = op | (reg & 7);
+}
+#define NOT_R32(_r)  emit_unary_r32(compiler, 0xd0, (_r))
+#define NEG_R32(_r)  emit_unary_r32(compiler, 0xd8, (_r))
+/* Unsigned division of %edx:%eax by reg */
+#define DIV_R32(_r)  emit_unary_r32(compiler, 0xf0, (_r))
+/* Signed division of %edx:%eax by reg */
+#define IDIV_R32(_r) emit_unary_r32(compiler, 0xf8, (_r))
+
+/* Sign extend %eax into %edx */
+#define CDQ() do { *(compiler->map++) = 0x99; } while (0)
+
+/* XCHG %eax, %ecx */
+#define XCHG_EAX_ECX() do { *(compiler->map++) = 0x91; } while (0)
+
+#define RET() do { *(compiler->map++) = 0xc3; } while (0)
+
+/* IMUL %source64, %target64 */
+static void emit_imul_r64_r64(struct dynarec_compiler *compiler,
+                              enum X86_REG source,
+                              enum X86_REG target) {
+   emit_rex_w_prefix(compiler, source, target, 0);
+
+   *(compiler->map++) = 0x0f;
+   *(compiler->map++) = 0xaf;
+   *(compiler->map++) = 0xc0 | (source & 7) | ((target & 7) << 3);
+}
+#define IMUL_R64_R64(_s, _t) emit_imul_r64_r64(compiler, (_s), (_t))
+
 /* SHIFT $shift, %reg32 */
 static void emit_shift_u32_r32(struct dynarec_compiler *compiler,
                                uint8_t op,
@@ -595,25 +776,29 @@ static void emit_shift_u32_r32(struct dynarec_compiler *compiler,
 #define SHR_U32_R32(_u, _v) emit_shift_u32_r32(compiler, 0xe8, (_u), (_v))
 #define SAR_U32_R32(_u, _v) emit_shift_u32_r32(compiler, 0xf8, (_u), (_v))
 
-/* IMUL $a, %b32, %target32 */
-static void emit_imul_u32_r32_r32(struct dynarec_compiler *compiler,
-                                  uint32_t a,
-                                  enum X86_REG b,
-                                  enum X86_REG target) {
-   emit_rex_prefix(compiler, b, target, 0);
+/* SHR $shift, %reg64 */
+static void emit_shr_u32_r64(struct dynarec_compiler *compiler,
+                             uint32_t shift,
+                             enum X86_REG reg) {
+   assert(shift < 64);
 
-   if (is_imms8(a)) {
-      *(compiler->map++) = 0x6b;
-      *(compiler->map++) = 0xc0 | (b & 7) | ((target & 7) << 3);
-      emit_imms8(compiler, a);
-   } else {
-      *(compiler->map++) = 0x69;
-      *(compiler->map++) = 0xc0 | (b & 7) | ((target & 7) << 3);
-      emit_imm32(compiler, a);
-   }
+   emit_rex_w_prefix(compiler, reg, 0, 0);
+
+   *(compiler->map++) = 0xc1;
+   *(compiler->map++) = 0xe8 | (reg & 7);
+   *(compiler->map++) = shift;
+}
+#define SHR_U32_R64(_u, _v) emit_shr_u32_r64(compiler, (_u), (_v))
+
+/* SHIFT %cl, %reg32 */
+static void emit_shift_cl_r32(struct dynarec_compiler *compiler,
+                              uint8_t op,
+                              enum X86_REG reg) {
+   emit_rex_prefix(compiler, reg, 0, 0);
+
+   *(compiler->map++) = 0xd3;
+   *(compiler->map++) = op | (reg & 7);
 }
-#define IMUL_U32_R32_R32(_a, _b, _t)                    \
-   emit_imul_u32_r32_r32(compiler, (_a), (_b), (_t))
 
 /* JMP off. Offset is from the address of this instruction (so off = 0
    points at this jump) */
@@ -629,40 +814,124 @@ static void emit_jmp_off(struct dynarec_compiler *compiler,
 }
 #define EMIT_JMP(_o) emit_jmp_off(compiler, (_o))
 
-/* CALL *off(%reg64) */
-static void emit_call_off_pr64(struct dynarec_compiler *compiler,
-                               uint32_t off,
-                               enum X86_REG reg) {
-   emit_rex_prefix(compiler, reg, 0, 0);
-
-   *(compiler->map++) = 0xff;
-   if (is_imms8(off)) {
-      *(compiler->map++) = 0x50 | (reg & 7);
-      emit_imms8(compiler, off);
+/* JZ off. Offset is from the address of this instruction */
+static void emit_jz_off(struct dynarec_compiler *compiler,
+                        uint32_t off) {
+   if (is_imms8(off - 2)) {
+      *(compiler->map++) = 0x74;
+      emit_imms8(compiler, off - 2);
    } else {
-      *(compiler->map++) = 0x90 | (reg & 7);
-      emit_imm32(compiler, off);
+      *(compiler->map++) = 0x0f;
+      *(compiler->map++) = 0x84;
+      emit_imm32(compiler, off - 6);
    }
 }
-#define CALL_OFF_PR64(_o, _r) emit_call_off_pr64(compiler, (_o), (_r))
+#define EMIT_JZ(_o) emit_jz_off(compiler, (_o))
+
+/* Relocation kinds for `dynasm_relocate` */
+enum AMD64_RELOC {
+   /* 32bit offset relative to the end of the field */
+   AMD64_RELOC_REL32,
+   /* 64bit absolute address */
+   AMD64_RELOC_ABS64,
+};
 
 static void emit_call(struct dynarec_compiler *compiler,
                       dynarec_fn_t fn) {
    uint8_t *target = (void*)fn;
    intptr_t offset = target - compiler->map;
 
-   printf("%p %p offset: %ld\n", target, compiler->map, offset);
-
-   assert(is_imms32(offset));
-
    /* Offset is relative to the end of the instruction */
    offset -= 5;
 
-   *(compiler->map++) = 0xe8;
-   emit_imm32(compiler, offset);
+   if (is_imms32(offset)) {
+      *(compiler->map++) = 0xe8;
+      dynarec_add_reloc(compiler, compiler->map, AMD64_RELOC_REL32, target);
+      emit_imm32(compiler, offset);
+   } else {
+      /* The target is too far away for a relative call, this can
+         happen if the map ended up far from the emulator's code. We
+         can't clobber any register here so we store the absolute
+         address in the code stream and call through it. */
+      uint64_t addr = (uintptr_t)target;
+      int i;
+
+      /* CALL *2(%rip) */
+      *(compiler->map++) = 0xff;
+      *(compiler->map++) = 0x15;
+      emit_imm32(compiler, 2);
+      /* JMP over the address when we return */
+      *(compiler->map++) = 0xeb;
+      *(compiler->map++) = 8;
+
+      dynarec_add_reloc(compiler, compiler->map, AMD64_RELOC_ABS64, target);
+      for (i = 0; i < 8; i++) {
+         *(compiler->map++) = addr & 0xff;
+         addr >>= 8;
+      }
+   }
 }
 #define CALL(_fn) emit_call(compiler, (dynarec_fn_t)_fn)
 
+/* JMP to an arbitrary address, with the same fallback as
+   `emit_call` */
+static void emit_jmp_abs(struct dynarec_compiler *compiler,
+                         dynarec_fn_t fn) {
+   uint8_t *target = (void*)fn;
+   intptr_t offset = target - compiler->map;
+
+   offset -= 5;
+
+   if (is_imms32(offset)) {
+      *(compiler->map++) = 0xe9;
+      dynarec_add_reloc(compiler, compiler->map, AMD64_RELOC_REL32, target);
+      emit_imm32(compiler, offset);
+   } else {
+      uint64_t addr = (uintptr_t)target;
+      int i;
+
+      /* JMP *0(%rip) */
+      *(compiler->map++) = 0xff;
+      *(compiler->map++) = 0x25;
+      emit_imm32(compiler, 0);
+
+      dynarec_add_reloc(compiler, compiler->map, AMD64_RELOC_ABS64, target);
+
+      for (i = 0; i < 8; i++) {
+         *(compiler->map++) = addr & 0xff;
+         addr >>= 8;
+      }
+   }
+}
+#define JMP_ABS(_fn) emit_jmp_abs(compiler, (dynarec_fn_t)_fn)
+
+bool dynasm_relocate(uint8_t *page, const struct dynarec_reloc *reloc) {
+   uint8_t *site = page + reloc->offset;
+   uint8_t *target = (uint8_t *)dynasm_execute + reloc->target;
+   uint64_t addr = (uintptr_t)target;
+   intptr_t offset;
+   int i;
+
+   switch (reloc->kind) {
+   case AMD64_RELOC_REL32:
+      offset = target - (site + 4);
+      if (!is_imms32(offset)) {
+         /* The map ended up too far from the target this time */
+         return false;
+      }
+      patch_jump(site, target, true);
+      return true;
+   case AMD64_RELOC_ABS64:
+      for (i = 0; i < 8; i++) {
+         site[i] = addr & 0xff;
+         addr >>= 8;
+      }
+      return true;
+   }
+
+   return false;
+}
+
 #define MOVE_TO_BANKED(_host_reg, _psx_reg)             \
    MOV_R32_OFF_PR64(_host_reg,                          \
                     DYNAREC_STATE_REG_OFFSET(_psx_reg), \
@@ -673,33 +942,169 @@ static void emit_call(struct dynarec_compiler *compiler,
                     STATE_REG,                          \
                     _host_reg);                         \
 
-void dynasm_emit_exception(struct dynarec_compiler *compiler,
-                           enum PSX_CPU_EXCEPTION exception) {
-   MOV_U32_R32(exception, REG_SI);
-   MOV_U32_R32(compiler->pc, REG_DX);
-   CALL(dynabi_exception);
+/* Write all the registers allocated for this page back to
+   `dynarec_state.regs` */
+static void emit_spill_allocated(struct dynarec_compiler *compiler) {
+   enum PSX_REG reg;
+
+   for (reg = PSX_REG_AT; reg <= PSX_REG_RA; reg++) {
+      int host = register_location(compiler, reg);
+
+      if (host >= 0) {
+         MOVE_TO_BANKED(host, reg);
+      }
+   }
 }
 
-void dynasm_counter_maintenance(struct dynarec_compiler *compiler,
-                                unsigned cycles) {
-   SUB_U32_R32(cycles, REG_CX);
+/* Load all the registers allocated for this page from
+   `dynarec_state.regs` */
+static void emit_fill_allocated(struct dynarec_compiler *compiler) {
+   enum PSX_REG reg;
+
+   for (reg = PSX_REG_AT; reg <= PSX_REG_RA; reg++) {
+      int host = register_location(compiler, reg);
+
+      if (host >= 0) {
+         MOVE_FROM_BANKED(reg, host);
+      }
+   }
 }
 
-/************************
- * Opcode recompilation *
- ************************/
+/* Return a host register containing the value of PSX register
+   `reg`. If it's not cached in a host register it's loaded into
+   `tmp`. */
+static enum X86_REG emit_load_psx_reg(struct dynarec_compiler *compiler,
+                                      enum PSX_REG reg,
+                                      enum X86_REG tmp) {
+   int host = register_location(compiler, reg);
 
-void dynasm_emit_mov(struct dynarec_compiler *compiler,
-                      enum PSX_REG reg_target,
-                      enum PSX_REG reg_source) {
-   const int target = register_location(reg_target);
-   const int source = register_location(reg_source);
+   if (host >= 0) {
+      return host;
+   }
 
-   assert(reg_target != 0);
-   assert(reg_source != 0);
+   if (reg == PSX_REG_R0) {
+      CLEAR_REG(tmp);
+   } else {
+      MOVE_FROM_BANKED(reg, tmp);
+   }
+
+   return tmp;
+}
+
+/* Return the host register where the value of PSX register `reg`
+   should be computed. If it's not cached in a host register that's
+   `tmp` and `emit_store_psx_reg` must be used afterwards. */
+static enum X86_REG target_psx_reg(struct dynarec_compiler *compiler,
+                                   enum PSX_REG reg,
+                                   enum X86_REG tmp) {
+   int host = register_location(compiler, reg);
+
+   return (host >= 0) ? host : tmp;
+}
+
+/* Move the value of `host` into PSX register `reg` */
+static void emit_store_psx_reg(struct dynarec_compiler *compiler,
+                               enum PSX_REG reg,
+                               enum X86_REG host) {
+   int target = register_location(compiler, reg);
+
+   if (reg == PSX_REG_R0) {
+      return;
+   }
 
    if (target >= 0) {
-      if (source >= 0) {
+      if (target != host) {
+         MOV_R32_R32(host, target);
+      }
+   } else {
+      MOVE_TO_BANKED(host, reg);
+   }
+}
+
+/* PC of the instruction being recompiled as passed to the
+   callbacks */
+static uint32_t callback_pc(struct dynarec_compiler *compiler) {
+   uint32_t pc = compiler->pc;
+
+   if (compiler->in_delay_slot) {
+      pc |= DYNAREC_PC_DELAY_SLOT;
+   }
+
+   return pc;
+}
+
+/* Move the pending load (if any) to its target register. Since this
+   is used from within the helpers below we can't use `dynasm_emit_mov`
+   which clobbers %eax, use `tmp` instead */
+static void emit_commit_pending_load(struct dynarec_compiler *compiler,
+                                     enum X86_REG tmp) {
+   enum PSX_REG reg = compiler->pending_load_reg;
+   enum PSX_REG reg_tmp = compiler->pending_load_tmp;
+   int target;
+
+   if (reg == PSX_REG_R0) {
+      return;
+   }
+
+   target = register_location(compiler, reg);
+
+   if (target >= 0) {
+      MOVE_FROM_BANKED(reg_tmp, target);
+   } else {
+      MOVE_FROM_BANKED(reg_tmp, tmp);
+      MOVE_TO_BANKED(tmp, reg);
+   }
+}
+
+/* Raise an exception. If `bad_vaddr_in_dx` is true the faulting
+   address is in %edx */
+static void emit_exception(struct dynarec_compiler *compiler,
+                           enum PSX_CPU_EXCEPTION exception,
+                           bool bad_vaddr_in_dx) {
+   /* The exception is raised after the load delay has elapsed */
+   emit_commit_pending_load(compiler, REG_AX);
+
+   /* We're not coming back, the counter must account for the
+      instructions we've run */
+   if (compiler->pending_cycles > 0) {
+      dynasm_counter_maintenance(compiler, compiler->pending_cycles);
+   }
+
+   if (bad_vaddr_in_dx) {
+      MOV_R32_R32(REG_DX, REG_AX);
+   }
+
+   MOV_U32_R32(exception, REG_SI);
+   MOV_U32_R32(callback_pc(compiler), REG_DX);
+   /* This never returns */
+   CALL(compiler->stub_exception);
+}
+
+void dynasm_emit_exception(struct dynarec_compiler *compiler,
+                           enum PSX_CPU_EXCEPTION exception) {
+   emit_exception(compiler, exception, false);
+}
+
+void dynasm_counter_maintenance(struct dynarec_compiler *compiler,
+                                int32_t cycles) {
+   SUB_U32_R32((uint32_t)cycles, REG_CX);
+}
+
+/************************
+ * Opcode recompilation *
+ ************************/
+
+void dynasm_emit_mov(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_source) {
+   const int target = register_location(compiler, reg_target);
+   const int source = register_location(compiler, reg_source);
+
+   assert(reg_target != 0);
+   assert(reg_source != 0);
+
+   if (target >= 0) {
+      if (source >= 0) {
          MOV_R32_R32(source, target);
       } else {
          MOVE_FROM_BANKED(reg_source, target);
@@ -722,24 +1127,97 @@ void dynasm_emit_mov(struct dynarec_compiler *compiler,
    }
 }
 
-extern void dynasm_emit_sll(struct dynarec_compiler *compiler,
-                            enum PSX_REG reg_target,
-                            enum PSX_REG reg_op0,
-                            uint8_t shift) {
-   UNIMPLEMENTED;
+static void emit_shift_imm(struct dynarec_compiler *compiler,
+                           uint8_t op,
+                           enum PSX_REG reg_target,
+                           enum PSX_REG reg_op,
+                           uint8_t shift) {
+   int target = target_psx_reg(compiler, reg_target, REG_AX);
+   int source = emit_load_psx_reg(compiler, reg_op, target);
+
+   if (source != target) {
+      MOV_R32_R32(source, target);
+   }
+
+   emit_shift_u32_r32(compiler, op, shift, target);
+
+   emit_store_psx_reg(compiler, reg_target, target);
+}
+
+void dynasm_emit_sll(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op,
+                     uint8_t shift) {
+   emit_shift_imm(compiler, 0xe0, reg_target, reg_op, shift);
+}
+
+void dynasm_emit_srl(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op,
+                     uint8_t shift) {
+   emit_shift_imm(compiler, 0xe8, reg_target, reg_op, shift);
+}
+
+void dynasm_emit_sra(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op,
+                     uint8_t shift) {
+   emit_shift_imm(compiler, 0xf8, reg_target, reg_op, shift);
+}
+
+/* Shift by register amount. x86 masks the shift amount to 5 bits just
+   like the R3000 does. */
+static void emit_shift_reg(struct dynarec_compiler *compiler,
+                           uint8_t op,
+                           enum PSX_REG reg_target,
+                           enum PSX_REG reg_op0,
+                           enum PSX_REG reg_op1) {
+   int value = emit_load_psx_reg(compiler, reg_op0, REG_SI);
+   int shift;
+
+   if (value != REG_SI) {
+      MOV_R32_R32(value, REG_SI);
+   }
+
+   shift = emit_load_psx_reg(compiler, reg_op1, REG_AX);
+   if (shift != REG_AX) {
+      MOV_R32_R32(shift, REG_AX);
+   }
+
+   /* The shift amount must be in %cl, which contains the cycle
+      counter. Swap them for the duration of the shift */
+   XCHG_EAX_ECX();
+   emit_shift_cl_r32(compiler, op, REG_SI);
+   XCHG_EAX_ECX();
+
+   emit_store_psx_reg(compiler, reg_target, REG_SI);
+}
+
+void dynasm_emit_sllv(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   emit_shift_reg(compiler, 0xe0, reg_target, reg_op0, reg_op1);
+}
+
+void dynasm_emit_srlv(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   emit_shift_reg(compiler, 0xe8, reg_target, reg_op0, reg_op1);
 }
 
-extern void dynasm_emit_sra(struct dynarec_compiler *compiler,
-                            enum PSX_REG reg_target,
-                            enum PSX_REG reg_op0,
-                            uint8_t shift) {
-   UNIMPLEMENTED;
+void dynasm_emit_srav(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   emit_shift_reg(compiler, 0xf8, reg_target, reg_op0, reg_op1);
 }
 
 void dynasm_emit_li(struct dynarec_compiler *compiler,
                     enum PSX_REG reg_t,
                     uint32_t val) {
-   const int target = register_location(reg_t);
+   const int target = register_location(compiler, reg_t);
 
    if (target >= 0) {
       if (val > 0) {
@@ -754,57 +1232,59 @@ void dynasm_emit_li(struct dynarec_compiler *compiler,
    }
 }
 
-void dynasm_emit_addiu(struct dynarec_compiler *compiler,
-                       enum PSX_REG reg_t,
-                       enum PSX_REG reg_s,
-                       uint32_t val) {
-   int target = register_location(reg_t);
-   int source = register_location(reg_s);
+/* Immediate ALU operation. `op` is the Mod R/M opcode extension
+   (0x00 for ADD, 0x08 for OR...) */
+static void emit_alu_imm(struct dynarec_compiler *compiler,
+                         uint8_t op,
+                         enum PSX_REG reg_t,
+                         enum PSX_REG reg_s,
+                         uint32_t val) {
+   int target = register_location(compiler, reg_t);
 
    if (reg_t == reg_s) {
-      /* We add the register to itself */
-      if (target < 0) {
-         ADD_U32_OFF_PR64(val,
-                          DYNAREC_STATE_REG_OFFSET(reg_t),
-                          STATE_REG);
+      /* Shortcut when we're modifying a register in place */
+      if (target >= 0) {
+         emit_alu_u32_r32(compiler, 0xc0 | op, val, target);
       } else {
-         ADD_U32_R32(val, target);
+         emit_alu_u32_off_pr64(compiler,
+                               op,
+                               val,
+                               DYNAREC_STATE_REG_OFFSET(reg_t),
+                               STATE_REG);
       }
    } else {
-      if (target < 0) {
-         /* Use SI as intermediary */
-         target = REG_SI;
-      }
+      int source;
 
-      if (source < 0) {
-         MOVE_FROM_BANKED(reg_s, target);
-      } else {
+      target = target_psx_reg(compiler, reg_t, REG_AX);
+      source = emit_load_psx_reg(compiler, reg_s, target);
+
+      if (source != target) {
          MOV_R32_R32(source, target);
       }
 
-      ADD_U32_R32(val, target);
+      emit_alu_u32_r32(compiler, 0xc0 | op, val, target);
 
-      if (target == REG_SI) {
-         MOVE_TO_BANKED(target, reg_t);
-      }
+      emit_store_psx_reg(compiler, reg_t, target);
    }
 }
 
+void dynasm_emit_addiu(struct dynarec_compiler *compiler,
+                       enum PSX_REG reg_t,
+                       enum PSX_REG reg_s,
+                       uint32_t val) {
+   emit_alu_imm(compiler, 0x00, reg_t, reg_s, val);
+}
+
 void dynasm_emit_addi(struct dynarec_compiler *compiler,
                       enum PSX_REG reg_t,
                       enum PSX_REG reg_s,
                       uint32_t val) {
-   const int target = register_location(reg_t);
-   const int source = register_location(reg_s);
+   const int source = emit_load_psx_reg(compiler, reg_s, REG_AX);
 
    /* Add to EAX (the target register shouldn't be modified in case of
       an overflow) */
-   if (source >= 0) {
+   if (source != REG_AX) {
       MOV_R32_R32(source, REG_AX);
-   } else {
-      MOV_OFF_PR64_R32(DYNAREC_STATE_REG_OFFSET(reg_s),
-                       STATE_REG,
-                       REG_AX);
    }
 
    ADD_U32_R32(val, REG_AX);
@@ -812,176 +1292,324 @@ void dynasm_emit_addi(struct dynarec_compiler *compiler,
       dynasm_emit_exception(compiler, PSX_OVERFLOW);
    } ENDIF;
 
-   if (target >= 0) {
-      MOV_R32_R32(REG_AX, target);
-   } else if (reg_t != PSX_REG_R0) {
-      MOV_R32_OFF_PR64(REG_AX,
-                       DYNAREC_STATE_REG_OFFSET(reg_t),
-                       STATE_REG);
+   emit_store_psx_reg(compiler, reg_t, REG_AX);
+}
+
+/* Emit `reg_target = reg_op0 OP reg_op1` and return the host
+   register containing the result. The caller must then use
+   `emit_store_psx_reg`. */
+static int emit_alu_3op(struct dynarec_compiler *compiler,
+                        uint8_t op,
+                        bool commutative,
+                        enum PSX_REG reg_target,
+                        enum PSX_REG reg_op0,
+                        enum PSX_REG reg_op1) {
+   int target = target_psx_reg(compiler, reg_target, REG_AX);
+   int op0 = emit_load_psx_reg(compiler, reg_op0, REG_SI);
+   int op1 = emit_load_psx_reg(compiler, reg_op1, REG_DX);
+
+   if (target == op1 && target != op0) {
+      if (commutative) {
+         emit_alu_r32_r32(compiler, op, op0, target);
+         return target;
+      }
+
+      /* We're about to overwrite op1, move it to a temporary */
+      MOV_R32_R32(op1, REG_DX);
+      op1 = REG_DX;
+   }
+
+   if (target != op0) {
+      MOV_R32_R32(op0, target);
    }
+
+   emit_alu_r32_r32(compiler, op, op1, target);
+
+   return target;
 }
 
 void dynasm_emit_addu(struct dynarec_compiler *compiler,
                       enum PSX_REG reg_target,
                       enum PSX_REG reg_op0,
                       enum PSX_REG reg_op1) {
-   UNIMPLEMENTED;
+   int target = emit_alu_3op(compiler, 0x01, true,
+                             reg_target, reg_op0, reg_op1);
+
+   emit_store_psx_reg(compiler, reg_target, target);
+}
+
+void dynasm_emit_subu(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   int target = emit_alu_3op(compiler, 0x29, false,
+                             reg_target, reg_op0, reg_op1);
+
+   emit_store_psx_reg(compiler, reg_target, target);
+}
+
+void dynasm_emit_and(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   int target = emit_alu_3op(compiler, 0x21, true,
+                             reg_target, reg_op0, reg_op1);
+
+   emit_store_psx_reg(compiler, reg_target, target);
 }
 
 void dynasm_emit_or(struct dynarec_compiler *compiler,
                     enum PSX_REG reg_target,
                     enum PSX_REG reg_op0,
                     enum PSX_REG reg_op1) {
-   UNIMPLEMENTED;
+   int target = emit_alu_3op(compiler, 0x09, true,
+                             reg_target, reg_op0, reg_op1);
+
+   emit_store_psx_reg(compiler, reg_target, target);
 }
 
-void dynasm_emit_ori(struct dynarec_compiler *compiler,
-                     enum PSX_REG reg_t,
-                     enum PSX_REG reg_s,
-                     uint32_t val) {
-   const int target = register_location(reg_t);
-   const int source = register_location(reg_s);
+void dynasm_emit_xor(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   int target = emit_alu_3op(compiler, 0x31, true,
+                             reg_target, reg_op0, reg_op1);
 
-   if (reg_t == reg_s) {
-      /* Shortcut when we're and'ing a register with itself */
-      if (target >= 0) {
-         OR_U32_R32(val, target);
-      } else {
-         OR_U32_OFF_PR64(val,
-                         DYNAREC_STATE_REG_OFFSET(reg_t),
-                         STATE_REG);
-      }
-   } else {
-      int tmp_target;
+   emit_store_psx_reg(compiler, reg_target, target);
+}
 
-      if (target >= 0) {
-         tmp_target = target;
-      } else {
-         tmp_target = REG_AX;
-      }
+void dynasm_emit_nor(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   int target = emit_alu_3op(compiler, 0x09, true,
+                             reg_target, reg_op0, reg_op1);
 
-      if (source >= 0) {
-         MOV_R32_R32(source, tmp_target);
-      } else {
-         MOV_OFF_PR64_R32(DYNAREC_STATE_REG_OFFSET(reg_s),
-                          STATE_REG,
-                          tmp_target);
-      }
+   NOT_R32(target);
+
+   emit_store_psx_reg(compiler, reg_target, target);
+}
 
-      OR_U32_R32(val, tmp_target);
+/* ADD and SUB: like ADDU and SUBU but raise an exception on signed
+   overflow */
+static void emit_alu_overflow(struct dynarec_compiler *compiler,
+                              uint8_t op,
+                              enum PSX_REG reg_target,
+                              enum PSX_REG reg_op0,
+                              enum PSX_REG reg_op1) {
+   int op0 = emit_load_psx_reg(compiler, reg_op0, REG_SI);
+   int op1 = emit_load_psx_reg(compiler, reg_op1, REG_DX);
 
-      if (target != tmp_target) {
-         MOV_R32_OFF_PR64(tmp_target,
-                          DYNAREC_STATE_REG_OFFSET(reg_t),
-                          STATE_REG);
-      }
-   }
+   /* Compute in EAX, the target register shouldn't be modified in case
+      of an overflow */
+   MOV_R32_R32(op0, REG_AX);
+   emit_alu_r32_r32(compiler, op, op1, REG_AX);
+
+   IF_OVERFLOW {
+      dynasm_emit_exception(compiler, PSX_OVERFLOW);
+   } ENDIF;
+
+   emit_store_psx_reg(compiler, reg_target, REG_AX);
+}
+
+void dynasm_emit_add(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   emit_alu_overflow(compiler, 0x01, reg_target, reg_op0, reg_op1);
+}
+
+void dynasm_emit_sub(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   emit_alu_overflow(compiler, 0x29, reg_target, reg_op0, reg_op1);
+}
+
+void dynasm_emit_ori(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_t,
+                     enum PSX_REG reg_s,
+                     uint32_t val) {
+   emit_alu_imm(compiler, 0x08, reg_t, reg_s, val);
 }
 
 void dynasm_emit_andi(struct dynarec_compiler *compiler,
                      enum PSX_REG reg_t,
                      enum PSX_REG reg_s,
                      uint32_t val) {
-   const int target = register_location(reg_t);
-   const int source = register_location(reg_s);
+   emit_alu_imm(compiler, 0x20, reg_t, reg_s, val);
+}
 
-   if (reg_t == reg_s) {
-      /* Shortcut when we're and'ing a register with itself */
-      if (target >= 0) {
-         AND_U32_R32(val, target);
-      } else {
-         AND_U32_OFF_PR64(val,
-                          DYNAREC_STATE_REG_OFFSET(reg_t),
-                          STATE_REG);
-      }
-   } else {
-      int tmp_target;
+void dynasm_emit_xori(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_t,
+                      enum PSX_REG reg_s,
+                      uint32_t val) {
+   emit_alu_imm(compiler, 0x30, reg_t, reg_s, val);
+}
 
-      if (target >= 0) {
-         tmp_target = target;
-      } else {
-         tmp_target = REG_AX;
-      }
+/* Set `reg_target` to 1 if `reg_op0 < reg_op1`, 0 otherwise. `setcc`
+   is the opcode of the SETcc instruction used for the comparison */
+static void emit_slt(struct dynarec_compiler *compiler,
+                     uint8_t setcc,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   int op0 = emit_load_psx_reg(compiler, reg_op0, REG_SI);
+   int op1 = emit_load_psx_reg(compiler, reg_op1, REG_DX);
+
+   /* The target could be one of the operands so we can't clear it
+      before the comparison. Use EAX instead. */
+   CLEAR_REG(REG_AX);
+   CMP_R32_R32(op1, op0);
+   emit_setcc(compiler, setcc, REG_AX);
 
-      if (source >= 0) {
-         MOV_R32_R32(source, tmp_target);
-      } else {
-         MOV_OFF_PR64_R32(DYNAREC_STATE_REG_OFFSET(reg_s),
-                          STATE_REG,
-                          tmp_target);
-      }
+   emit_store_psx_reg(compiler, reg_target, REG_AX);
+}
 
-      AND_U32_R32(val, tmp_target);
+void dynasm_emit_slt(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   emit_slt(compiler, 0x9c, reg_target, reg_op0, reg_op1);
+}
 
-      if (target != tmp_target) {
-         MOVE_TO_BANKED(tmp_target, reg_t);
-      }
-   }
+void dynasm_emit_sltu(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   emit_slt(compiler, 0x92, reg_target, reg_op0, reg_op1);
 }
 
-extern void dynasm_emit_sltu(struct dynarec_compiler *compiler,
-                             enum PSX_REG reg_target,
-                             enum PSX_REG reg_op0,
-                             enum PSX_REG reg_op1) {
-   int target = register_location(reg_target);
-   int op0 = register_location(reg_op0);
-   int op1 = register_location(reg_op1);
+static void emit_slti(struct dynarec_compiler *compiler,
+                      uint8_t setcc,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op,
+                      uint32_t val) {
+   int op = emit_load_psx_reg(compiler, reg_op, REG_SI);
 
-   if (target < 0) {
-      /* Use AX as temporary */
-      target = REG_AX;
-   }
+   CLEAR_REG(REG_AX);
+   CMP_U32_R32(val, op);
+   emit_setcc(compiler, setcc, REG_AX);
 
-   if (op0 < 0) {
-      /* Use SI as temporary */
-      op0 = REG_SI;
+   emit_store_psx_reg(compiler, reg_target, REG_AX);
+}
 
-      MOVE_FROM_BANKED(reg_op0, REG_SI);
-   }
+void dynasm_emit_slti(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op,
+                      uint32_t val) {
+   emit_slti(compiler, 0x9c, reg_target, reg_op, val);
+}
 
-   if (op1 < 0) {
-      /* Use DX as temporary */
-      op1 = REG_DX;
+void dynasm_emit_sltiu(struct dynarec_compiler *compiler,
+                       enum PSX_REG reg_target,
+                       enum PSX_REG reg_op,
+                       uint32_t val) {
+   emit_slti(compiler, 0x92, reg_target, reg_op, val);
+}
 
-      MOVE_FROM_BANKED(reg_op1, REG_DX);
-   }
+/* Store the 64bit result in %rax into LO and HI */
+static void emit_store_hilo(struct dynarec_compiler *compiler) {
+   MOVE_TO_BANKED(REG_AX, PSX_REG_LO);
+   SHR_U32_R64(32, REG_AX);
+   MOVE_TO_BANKED(REG_AX, PSX_REG_HI);
+}
 
-   CLEAR_REG(target);
-   CMP_R32_R32(op1, op0);
-   SETB_R8(target);
+void dynasm_emit_mult(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   int op0 = emit_load_psx_reg(compiler, reg_op0, REG_SI);
+   int op1 = emit_load_psx_reg(compiler, reg_op1, REG_DX);
 
-   if (target == REG_AX) {
-      MOVE_TO_BANKED(target, reg_target);
-   }
+   MOVSXD_R32_R64(op0, REG_AX);
+   MOVSXD_R32_R64(op1, REG_DX);
+   IMUL_R64_R64(REG_DX, REG_AX);
+
+   emit_store_hilo(compiler);
 }
 
-extern void dynasm_emit_sltiu(struct dynarec_compiler *compiler,
-                              enum PSX_REG reg_target,
-                              enum PSX_REG reg_op,
-                              uint32_t val) {
-   int target = register_location(reg_target);
-   int op = register_location(reg_op);
+void dynasm_emit_multu(struct dynarec_compiler *compiler,
+                       enum PSX_REG reg_op0,
+                       enum PSX_REG reg_op1) {
+   int op0 = emit_load_psx_reg(compiler, reg_op0, REG_SI);
+   int op1 = emit_load_psx_reg(compiler, reg_op1, REG_DX);
 
-   if (target < 0) {
-      /* Use AX as temporary */
-      target = REG_AX;
-   }
+   /* 32bit moves clear the high half of the 64bit register */
+   MOV_R32_R32(op0, REG_AX);
+   MOV_R32_R32(op1, REG_DX);
+   /* We only care about the low 64bits of the result so the
+      signedness doesn't matter */
+   IMUL_R64_R64(REG_DX, REG_AX);
+
+   emit_store_hilo(compiler);
+}
 
-   if (op < 0) {
-      /* Use SI as temporary */
-      op = REG_SI;
+/* Load the dividend in EAX and return the register containing the
+   divisor. The flags are set by testing the divisor. */
+static int emit_load_div_operands(struct dynarec_compiler *compiler,
+                                  enum PSX_REG reg_op0,
+                                  enum PSX_REG reg_op1) {
+   int divisor = emit_load_psx_reg(compiler, reg_op1, REG_SI);
+   int dividend = emit_load_psx_reg(compiler, reg_op0, REG_AX);
 
-      MOVE_FROM_BANKED(reg_op, REG_SI);
+   if (dividend != REG_AX) {
+      MOV_R32_R32(dividend, REG_AX);
    }
 
-   CLEAR_REG(target);
-   CMP_U32_R32(val, op);
-   SETB_R8(target);
+   TEST_R32_R32(divisor, divisor);
 
-   if (target == REG_AX) {
-      MOVE_TO_BANKED(target, reg_target);
-   }
+   return divisor;
+}
+
+void dynasm_emit_div(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   int divisor = emit_load_div_operands(compiler, reg_op0, reg_op1);
+
+   IF_ZERO {
+      /* Division by zero: HI = dividend, LO = (dividend < 0) ? 1 : -1 */
+      MOVE_TO_BANKED(REG_AX, PSX_REG_HI);
+      SAR_U32_R32(31, REG_AX);
+      ADD_R32_R32(REG_AX, REG_AX);
+      NOT_R32(REG_AX);
+      MOVE_TO_BANKED(REG_AX, PSX_REG_LO);
+   } ELSE {
+      CMP_U32_R32(0xffffffff, divisor);
+      IF_EQUAL {
+         /* Dividing by -1 is just a negation. We must special-case it
+            since 0x80000000 / -1 would raise an exception on x86. On
+            the PSX it returns 0x80000000 which is what NEG does. */
+         NEG_R32(REG_AX);
+         MOVE_TO_BANKED(REG_AX, PSX_REG_LO);
+         MOV_U32_OFF_PR64(0,
+                          DYNAREC_STATE_REG_OFFSET(PSX_REG_HI),
+                          STATE_REG);
+      } ELSE {
+         CDQ();
+         IDIV_R32(divisor);
+         MOVE_TO_BANKED(REG_AX, PSX_REG_LO);
+         MOVE_TO_BANKED(REG_DX, PSX_REG_HI);
+      } ENDIF;
+   } ENDIF;
+}
+
+void dynasm_emit_divu(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   int divisor = emit_load_div_operands(compiler, reg_op0, reg_op1);
 
+   IF_ZERO {
+      /* Division by zero: HI = dividend, LO = 0xffffffff */
+      MOVE_TO_BANKED(REG_AX, PSX_REG_HI);
+      MOV_U32_OFF_PR64(0xffffffff,
+                       DYNAREC_STATE_REG_OFFSET(PSX_REG_LO),
+                       STATE_REG);
+   } ELSE {
+      CLEAR_REG(REG_DX);
+      DIV_R32(divisor);
+      MOVE_TO_BANKED(REG_AX, PSX_REG_LO);
+      MOVE_TO_BANKED(REG_DX, PSX_REG_HI);
+   } ENDIF;
 }
 
 enum MEM_DIR {
@@ -995,16 +1623,12 @@ enum MEM_WIDTH {
    WIDTH_WORD = 4,
 };
 
-static void dynasm_emit_mem_rw(struct dynarec_compiler *compiler,
-                               enum PSX_REG reg_addr,
-                               int16_t offset,
-                               enum PSX_REG reg_val,
-                               enum MEM_DIR dir,
-                               enum MEM_WIDTH width) {
-   int addr_r  = register_location(reg_addr);
-   int value_r = register_location(reg_val);
+/* Load `reg_addr + offset` into %edx */
+static void emit_load_address(struct dynarec_compiler *compiler,
+                              enum PSX_REG reg_addr,
+                              int16_t offset) {
+   int addr_r = register_location(compiler, reg_addr);
 
-   /* First we load the address into %edx and we add the offset */
    if (addr_r >= 0) {
       if (offset != 0) {
          LEA_OFF_PR32_R32((int32_t)offset, addr_r, REG_DX);
@@ -1013,9 +1637,8 @@ static void dynasm_emit_mem_rw(struct dynarec_compiler *compiler,
       }
    } else {
       if (reg_addr == PSX_REG_R0) {
-         /* XXX We could optimize this since it means that the offset
-            is static. Not sure if this is common enough to be worth
-            it. */
+         /* Regular loads and stores with a static address go
+            through `emit_static_access` instead */
          MOV_U32_R32((int32_t)offset, REG_DX);
       } else {
          MOV_OFF_PR64_R32(DYNAREC_STATE_REG_OFFSET(reg_addr),
@@ -1026,45 +1649,163 @@ static void dynasm_emit_mem_rw(struct dynarec_compiler *compiler,
          }
       }
    }
+}
 
-   if (value_r < 0) {
-      /* Use %rsi as temporary register */
-
-      if (dir == DIR_STORE) {
-         /* Load value to be stored */
-         if (reg_val == PSX_REG_R0) {
-            CLEAR_REG(REG_SI);
+/* Access host memory at (%base). For loads the value is sign or zero
+   extended into value_r */
+static void emit_host_access(struct dynarec_compiler *compiler,
+                             enum X86_REG base,
+                             int value_r,
+                             enum MEM_DIR dir,
+                             enum MEM_WIDTH width,
+                             bool sign_extend) {
+   if (dir == DIR_STORE) {
+      switch (width) {
+      case WIDTH_WORD:
+         MOV_R32_PR64(value_r, base);
+         break;
+      case WIDTH_HALFWORD:
+         MOV_R16_PR64(value_r, base);
+         break;
+      case WIDTH_BYTE:
+         MOV_R8_PR64(value_r, base);
+         break;
+      }
+   } else {
+      switch (width) {
+      case WIDTH_WORD:
+         MOV_PR64_R32(base, value_r);
+         break;
+      case WIDTH_HALFWORD:
+         if (sign_extend) {
+            MOVSW_PR64_R32(base, value_r);
+         } else {
+            MOVZW_PR64_R32(base, value_r);
+         }
+         break;
+      case WIDTH_BYTE:
+         if (sign_extend) {
+            MOVSB_PR64_R32(base, value_r);
          } else {
-            MOV_OFF_PR64_R32(DYNAREC_STATE_REG_OFFSET(reg_val),
-                             STATE_REG,
-                             REG_SI);
+            MOVZB_PR64_R32(base, value_r);
          }
+         break;
       }
-
-      value_r = REG_SI;
    }
+}
 
-   if (width != WIDTH_BYTE) {
-      /* Copy address to %eax */
-      MOV_R32_R32(REG_DX, REG_AX);
-
-      /* Check alignment */
-      AND_U32_R32((uint32_t)width - 1, REG_AX);
+/* Call the emulator to access device memory. The address is in
+   %edx */
+static void emit_device_access(struct dynarec_compiler *compiler,
+                               int value_r,
+                               enum MEM_DIR dir,
+                               enum MEM_WIDTH width,
+                               bool sign_extend) {
+   const int32_t pending = compiler->pending_cycles;
+
+   /* The emulator needs an accurate timestamp to access devices. This
+      might be a conditional path so we give the cycles back
+      afterwards, they'll be accounted for at the next flush. */
+   if (pending > 0) {
+      dynasm_counter_maintenance(compiler, pending);
+   }
 
-      IF_NOT_EQUAL {
-         /* Address is not aligned correctly. */
-         enum PSX_CPU_EXCEPTION e;
+   if (dir == DIR_STORE) {
+      /* Make sure the value is in %rsi (arg1) */
+      if (value_r != REG_SI) {
+         MOV_R32_R32(value_r, REG_SI);
+      }
 
-         if (dir == DIR_LOAD) {
-            e = PSX_EXCEPTION_LOAD_ALIGN;
-         } else {
-            e = PSX_EXCEPTION_STORE_ALIGN;
-         }
+      switch (width) {
+      case WIDTH_WORD:
+         CALL(dynabi_device_sw);
+         break;
+      case WIDTH_HALFWORD:
+         CALL(dynabi_device_sh);
+         break;
+      case WIDTH_BYTE:
+         CALL(dynabi_device_sb);
+         break;
+      }
+   } else {
+      switch (width) {
+      case WIDTH_WORD:
+         CALL(dynabi_device_lw);
+         break;
+      case WIDTH_HALFWORD:
+         CALL(dynabi_device_lh);
+         break;
+      case WIDTH_BYTE:
+         CALL(dynabi_device_lb);
+         break;
+      }
+
+      /* The value is returned zero-extended in %eax */
+      if (sign_extend && width == WIDTH_BYTE) {
+         MOVSB_R8_R32(REG_AX, value_r);
+      } else if (sign_extend && width == WIDTH_HALFWORD) {
+         MOVSW_R16_R32(REG_AX, value_r);
+      } else {
+         MOV_R32_R32(REG_AX, value_r);
+      }
+   }
+
+   if (pending > 0) {
+      dynasm_counter_maintenance(compiler, -pending);
+   }
+}
 
-         dynasm_emit_exception(compiler, e);
+/* Access RAM at the offset in %edx */
+static void emit_ram_offset_access(struct dynarec_compiler *compiler,
+                                   int value_r,
+                                   enum MEM_DIR dir,
+                                   enum MEM_WIDTH width,
+                                   bool sign_extend) {
+   if (dir == DIR_STORE &&
+       !(compiler->state->options & DYNAREC_OPT_LAZY_INVALIDATE)) {
+      /* Compute page index in %eax */
+      MOV_R32_R32(REG_DX, REG_AX);
+      SHR_U32_R32(DYNAREC_PAGE_SIZE_SHIFT, REG_AX);
+
+      /* If the page has been recompiled we have to invalidate
+         it. The helper also unlinks the jumps going into it. */
+      CMP_U8_OFF_SIB(0,
+                     offsetof(struct dynarec_state, page_valid),
+                     STATE_REG,
+                     REG_AX,
+                     1);
+      IF_NOT_ZERO {
+         CALL(dynabi_invalidate);
       } ENDIF;
    }
 
+   /* Add the address of the RAM buffer in host memory */
+   ADD_OFF_PR64_R64(offsetof(struct dynarec_state, ram),
+                    STATE_REG,
+                    REG_DX);
+
+   emit_host_access(compiler, REG_DX, value_r, dir, width, sign_extend);
+}
+
+/* Access RAM, the address in %edx is assumed to target it (possibly
+   through a mirror or another region) */
+static void emit_ram_access(struct dynarec_compiler *compiler,
+                            int value_r,
+                            enum MEM_DIR dir,
+                            enum MEM_WIDTH width,
+                            bool sign_extend) {
+   /* Mask the address in case it was in one of the mirrors */
+   AND_U32_R32(PSX_RAM_SIZE - 1, REG_DX);
+
+   emit_ram_offset_access(compiler, value_r, dir, width, sign_extend);
+}
+
+/* Emit the memory access proper, once the address is in %edx */
+static void emit_mem_access(struct dynarec_compiler *compiler,
+                            int value_r,
+                            enum MEM_DIR dir,
+                            enum MEM_WIDTH width,
+                            bool sign_extend) {
    /* Move address to %eax */
    MOV_R32_R32(REG_DX, REG_AX);
 
@@ -1083,60 +1824,7 @@ static void dynasm_emit_mem_rw(struct dynarec_compiler *compiler,
 
    IF_LESS_THAN {
       /* We're targetting RAM */
-
-      /* Mask the address in case it was in one of the mirrors */
-      AND_U32_R32(PSX_RAM_SIZE - 1, REG_DX);
-
-      /* Compute page index in %eax */
-      MOV_R32_R32(REG_DX, REG_AX);
-      SHR_U32_R32(DYNAREC_PAGE_SIZE_SHIFT, REG_AX);
-
-      if (dir == DIR_STORE) {
-         /* Clear valid flag */
-         MOV_U8_OFF_SIB(0,
-                        offsetof(struct dynarec_state, page_valid),
-                        STATE_REG,
-                        REG_AX,
-                        1);
-      }
-
-      /* Add the address of the RAM buffer in host memory */
-      ADD_OFF_PR64_R32(offsetof(struct dynarec_state, ram),
-                       STATE_REG,
-                       REG_DX);
-
-      switch (dir) {
-      case DIR_STORE:
-         switch (width) {
-         case WIDTH_WORD:
-            MOV_R32_PR64(value_r, REG_DX);
-            break;
-         case WIDTH_HALFWORD:
-            MOV_R16_PR64(value_r, REG_DX);
-            break;
-         default:
-            UNIMPLEMENTED;
-         }
-         break;
-      case DIR_LOAD:
-         switch (width) {
-         case WIDTH_WORD:
-            MOV_PR64_R32(REG_DX, value_r);
-            break;
-         default:
-            UNIMPLEMENTED;
-         }
-
-         /* If we were using SI as temporary register and the target
-            register isn't R0 we have to store the value to the real
-            register location */
-         if (value_r == REG_SI && reg_val != PSX_REG_R0) {
-            MOV_R32_OFF_PR64(REG_SI,
-                             DYNAREC_STATE_REG_OFFSET(reg_val),
-                             STATE_REG);
-         }
-      }
-
+      emit_ram_access(compiler, value_r, dir, width, sign_extend);
    } ELSE {
       /* Test if the address is in the scratchpad */
       MOV_R32_R32(REG_DX, REG_AX);
@@ -1145,189 +1833,730 @@ static void dynasm_emit_mem_rw(struct dynarec_compiler *compiler,
 
       IF_LESS_THAN {
          /* We're targetting the scratchpad. This is the simplest
-            case, no invalidation needed, we can store it directly in
+            case, no invalidation needed, we can access it directly in
             the scratchpad buffer */
 
-         /* Add the address of the RAM buffer in host memory */
-         ADD_OFF_PR64_R32(offsetof(struct dynarec_state, scratchpad),
+         /* Add the address of the scratchpad buffer in host memory */
+         ADD_OFF_PR64_R64(offsetof(struct dynarec_state, scratchpad),
                           STATE_REG,
                           REG_AX);
 
-         switch (dir) {
-         case DIR_STORE:
-            switch (width) {
-            case WIDTH_WORD:
-               MOV_R32_PR64(value_r, REG_DX);
-               break;
-            case WIDTH_HALFWORD:
-               MOV_R16_PR64(value_r, REG_DX);
-               break;
-            default:
-               UNIMPLEMENTED;
-            }
-            break;
-         case DIR_LOAD:
-            switch (width) {
-            case WIDTH_WORD:
-               MOV_PR64_R32(REG_DX, value_r);
-               break;
-            default:
-               UNIMPLEMENTED;
-            }
-
-            /* If we were using SI as temporary register and the target
-               register isn't R0 we have to store the value to the real
-               register location */
-            if (value_r == REG_SI && reg_val != PSX_REG_R0) {
-               MOV_R32_OFF_PR64(REG_SI,
-                                DYNAREC_STATE_REG_OFFSET(reg_val),
-                                STATE_REG);
-            }
-         }
+         emit_host_access(compiler, REG_AX, value_r, dir, width, sign_extend);
       } ELSE {
          /* We're accessing some device's memory, call the emulator
             code */
+         emit_device_access(compiler, value_r, dir, width, sign_extend);
+      } ENDIF;
+   } ENDIF;
+}
 
-         /* Make sure the value is in %rsi (arg1) */
-         if (value_r >= 0) {
-            MOV_R32_R32(value_r, REG_SI);
-         }
+/* Access memory through the regular path: region masking, RAM and
+   scratchpad range checks and device callbacks. The address is in
+   %edx. */
+static void emit_checked_access(struct dynarec_compiler *compiler,
+                                int value_r,
+                                enum MEM_DIR dir,
+                                enum MEM_WIDTH width,
+                                bool sign_extend) {
+   if (dir == DIR_STORE) {
+      /* If the cache is isolated the stores don't reach the memory,
+         let the emulator deal with it */
+      TEST_U32_OFF_PR64(1U << 16,
+                        offsetof(struct dynarec_state, sr),
+                        STATE_REG);
+
+      IF_ZERO_LONG {
+         emit_mem_access(compiler, value_r, dir, width, sign_extend);
+      } ELSE {
+         emit_device_access(compiler, value_r, dir, width, sign_extend);
+      } ENDIF;
+   } else {
+      emit_mem_access(compiler, value_r, dir, width, sign_extend);
+   }
+}
+
+/* Length of the patchable access in fastmem mode, the access
+   instruction is padded with NOPs */
+#define FASTMEM_SITE_LEN 4
+/* Length of the JMP rel32 over the slow path following it */
+#define FASTMEM_SKIP_LEN 5
+
+/* Access memory through the fastmem window, the address is in
+   %edx. The access itself is a single instruction followed by a jump
+   over the regular code:
+ *
+ *   mov     %edx, %eax
+ *   add     fastmem(%rdi), %rax
+ *   mov     (%rax), value      ; site, padded to FASTMEM_SITE_LEN
+ *   jmp     1f
+ *   <emit_checked_access>
+ * 1:
+ *
+ * Everything but RAM is unmapped (or write-protected, see
+ * dynarec.c) in the window so the site faults if it targets
+ * anything else and `dynasm_fastmem_fault` replaces it by a jump to
+ * the regular code, which still has the address in %edx. */
+static void emit_fastmem_access(struct dynarec_compiler *compiler,
+                                int value_r,
+                                enum MEM_DIR dir,
+                                enum MEM_WIDTH width,
+                                bool sign_extend) {
+   uint8_t *site;
+   uint8_t *skip_patch;
+
+   MOV_R32_R32(REG_DX, REG_AX);
+   ADD_OFF_PR64_R64(offsetof(struct dynarec_state, fastmem),
+                    STATE_REG,
+                    REG_AX);
 
-         switch (dir) {
-         case DIR_STORE:
-            switch (width) {
-            case WIDTH_WORD:
-               CALL(dynabi_device_sw);
-               break;
-            case WIDTH_HALFWORD:
-               CALL(dynabi_device_sh);
-               break;
-            default:
-               UNIMPLEMENTED;
-            }
-            break;
-         case DIR_LOAD:
-            switch (width) {
-            case WIDTH_WORD:
-               CALL(dynabi_device_lw);
-               break;
-            default:
-               UNIMPLEMENTED;
-            }
-            break;
+   site = compiler->map;
+   emit_host_access(compiler, REG_AX, value_r, dir, width, sign_extend);
+
+   assert(compiler->map - site <= FASTMEM_SITE_LEN);
+   while (compiler->map < site + FASTMEM_SITE_LEN) {
+      /* NOP */
+      *(compiler->map++) = 0x90;
+   }
+
+   /* JMP rel32 */
+   *(compiler->map++) = 0xe9;
+   skip_patch = compiler->map;
+   compiler->map += 4;
+
+   emit_checked_access(compiler, value_r, dir, width, sign_extend);
+
+   patch_jump(skip_patch, compiler->map, true);
+}
+
+bool dynasm_fastmem_fault(uint8_t **pc, bool patch) {
+   uint8_t *site = *pc;
+   uint8_t *slow_path = site + FASTMEM_SITE_LEN + FASTMEM_SKIP_LEN;
+
+   if (site[FASTMEM_SITE_LEN] != 0xe9) {
+      return false;
+   }
+
+   if (patch) {
+      /* JMP rel8 to the slow path */
+      site[0] = 0xeb;
+      site[1] = slow_path - (site + 2);
+   }
+
+   *pc = slow_path;
+
+   return true;
+}
+
+/* Access RAM or the scratchpad at the canonical address
+   `canonical` */
+static void emit_static_mem_access(struct dynarec_compiler *compiler,
+                                   uint32_t canonical,
+                                   int value_r,
+                                   enum MEM_DIR dir,
+                                   enum MEM_WIDTH width,
+                                   bool sign_extend) {
+   if (canonical < PSX_RAM_SIZE * 4) {
+      MOV_U32_R32(canonical & (PSX_RAM_SIZE - 1), REG_DX);
+      emit_ram_offset_access(compiler, value_r, dir, width, sign_extend);
+   } else {
+      MOV_U32_R32(canonical - PSX_SCRATCHPAD_BASE, REG_AX);
+      ADD_OFF_PR64_R64(offsetof(struct dynarec_state, scratchpad),
+                       STATE_REG,
+                       REG_AX);
+      emit_host_access(compiler, REG_AX, value_r, dir, width, sign_extend);
+   }
+}
+
+/* Access memory at the static address `addr`. Since we know which
+   region it targets we can skip the region masking and the range
+   checks. */
+static void emit_static_access(struct dynarec_compiler *compiler,
+                               uint32_t addr,
+                               int value_r,
+                               enum MEM_DIR dir,
+                               enum MEM_WIDTH width,
+                               bool sign_extend) {
+   uint32_t canonical = addr & compiler->state->region_mask[addr >> 29];
+
+   if (canonical >= PSX_RAM_SIZE * 4 &&
+       canonical - PSX_SCRATCHPAD_BASE >= PSX_SCRATCHPAD_SIZE) {
+      /* Device memory, call the emulator directly */
+      MOV_U32_R32(addr, REG_DX);
+      emit_device_access(compiler, value_r, dir, width, sign_extend);
+   } else if (dir == DIR_STORE) {
+      /* If the cache is isolated the stores don't reach the memory,
+         let the emulator deal with it */
+      TEST_U32_OFF_PR64(1U << 16,
+                        offsetof(struct dynarec_state, sr),
+                        STATE_REG);
+
+      IF_ZERO_LONG {
+         emit_static_mem_access(compiler, canonical,
+                                value_r, dir, width, sign_extend);
+      } ELSE {
+         MOV_U32_R32(addr, REG_DX);
+         emit_device_access(compiler, value_r, dir, width, sign_extend);
+      } ENDIF;
+   } else {
+      emit_static_mem_access(compiler, canonical,
+                             value_r, dir, width, sign_extend);
+   }
+}
+
+/* Access memory at `reg_addr + offset` */
+static void emit_dynamic_access(struct dynarec_compiler *compiler,
+                                enum PSX_REG reg_addr,
+                                int16_t offset,
+                                int value_r,
+                                enum MEM_DIR dir,
+                                enum MEM_WIDTH width,
+                                bool sign_extend) {
+   /* First we load the address into %edx and we add the offset */
+   emit_load_address(compiler, reg_addr, offset);
+
+   if (width != WIDTH_BYTE) {
+      /* Check alignment */
+      TEST_U8_R8((uint32_t)width - 1, REG_DX);
+
+      IF_NOT_ZERO {
+         /* Address is not aligned correctly. */
+         enum PSX_CPU_EXCEPTION e;
+
+         if (dir == DIR_LOAD) {
+            e = PSX_EXCEPTION_LOAD_ALIGN;
+         } else {
+            e = PSX_EXCEPTION_STORE_ALIGN;
          }
 
+         emit_exception(compiler, e, true);
       } ENDIF;
-   } ENDIF;
+   }
+
+   if (reg_addr == PSX_REG_SP &&
+       (compiler->state->options & DYNAREC_OPT_FAST_SP)) {
+      /* Assume that we're accessing the stack in RAM */
+#ifdef DYNAREC_DEBUG
+      /* Make sure that it's actually the case */
+      MOV_R32_R32(REG_DX, REG_AX);
+      SHR_U32_R32(29, REG_AX);
+      AND_OFF_SIB_R32(offsetof(struct dynarec_state, region_mask),
+                      STATE_REG,
+                      REG_AX,
+                      4,
+                      REG_DX);
+      CMP_U32_R32(PSX_RAM_SIZE * 4, REG_DX);
+      IF_GREATER_EQUAL {
+         MOV_R32_R32(REG_DX, REG_SI);
+         MOV_U32_R32(callback_pc(compiler), REG_DX);
+         CALL(dynarec_fast_sp_fault);
+      } ENDIF;
+#endif
+      emit_ram_access(compiler, value_r, dir, width, sign_extend);
+   } else if (compiler->state->options & DYNAREC_OPT_FASTMEM) {
+      emit_fastmem_access(compiler, value_r, dir, width, sign_extend);
+   } else {
+      emit_checked_access(compiler, value_r, dir, width, sign_extend);
+   }
+}
+
+/* Compare PSX register `reg` with `val` */
+static void emit_cmp_psx_reg(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg,
+                             uint32_t val) {
+   int host = register_location(compiler, reg);
+
+   if (host >= 0) {
+      CMP_U32_R32(val, host);
+   } else {
+      CMP_U32_OFF_PR64(val, DYNAREC_STATE_REG_OFFSET(reg), STATE_REG);
+   }
+}
+
+static void dynasm_emit_mem_rw(struct dynarec_compiler *compiler,
+                               enum PSX_REG reg_addr,
+                               int16_t offset,
+                               enum PSX_REG reg_val,
+                               enum MEM_DIR dir,
+                               enum MEM_WIDTH width,
+                               bool sign_extend) {
+   bool fast_sp = reg_addr == PSX_REG_SP &&
+      (compiler->state->options & DYNAREC_OPT_FAST_SP);
+   uint32_t base;
+   uint32_t addr;
+   int value_r;
+
+   if (dir == DIR_STORE) {
+      /* Load value to be stored, using %rsi as temporary register if
+         needed */
+      value_r = emit_load_psx_reg(compiler, reg_val, REG_SI);
+   } else {
+      value_r = target_psx_reg(compiler, reg_val, REG_SI);
+   }
+
+   if (!fast_sp && dynarec_known_reg(compiler, reg_addr, &base) &&
+       ((base + (int32_t)offset) & ((uint32_t)width - 1)) == 0) {
+      /* The address is most likely static. Misaligned addresses are
+         left to the regular code. */
+      addr = base + (int32_t)offset;
+
+      if (reg_addr == PSX_REG_R0) {
+         emit_static_access(compiler, addr, value_r, dir, width, sign_extend);
+      } else {
+         /* We might have been entered from elsewhere with another
+            value in the register */
+         emit_cmp_psx_reg(compiler, reg_addr, base);
+
+         IF_EQUAL_LONG {
+            emit_static_access(compiler, addr,
+                               value_r, dir, width, sign_extend);
+         } ELSE {
+            emit_dynamic_access(compiler, reg_addr, offset,
+                                value_r, dir, width, sign_extend);
+         } ENDIF;
+      }
+   } else {
+      emit_dynamic_access(compiler, reg_addr, offset,
+                          value_r, dir, width, sign_extend);
+   }
+
+   if (dir == DIR_LOAD) {
+      /* If we were using SI as temporary register and the target
+         register isn't R0 we have to store the value to the real
+         register location */
+      emit_store_psx_reg(compiler, reg_val, value_r);
+   }
+}
+
+void dynasm_emit_sb(struct dynarec_compiler *compiler,
+                    enum PSX_REG reg_addr,
+                    int16_t offset,
+                    enum PSX_REG reg_val) {
+   dynasm_emit_mem_rw(compiler, reg_addr, offset, reg_val,
+                      DIR_STORE, WIDTH_BYTE, false);
 }
 
 void dynasm_emit_sh(struct dynarec_compiler *compiler,
                     enum PSX_REG reg_addr,
                     int16_t offset,
                     enum PSX_REG reg_val) {
-   dynasm_emit_mem_rw(compiler,
-                      reg_addr,
-                      offset,
-                      reg_val,
-                      DIR_STORE, WIDTH_HALFWORD);
+   dynasm_emit_mem_rw(compiler, reg_addr, offset, reg_val,
+                      DIR_STORE, WIDTH_HALFWORD, false);
 }
 
 void dynasm_emit_sw(struct dynarec_compiler *compiler,
                     enum PSX_REG reg_addr,
                     int16_t offset,
                     enum PSX_REG reg_val) {
-   dynasm_emit_mem_rw(compiler,
-                      reg_addr,
-                      offset,
-                      reg_val,
-                      DIR_STORE, WIDTH_WORD);
+   dynasm_emit_mem_rw(compiler, reg_addr, offset, reg_val,
+                      DIR_STORE, WIDTH_WORD, false);
+}
+
+void dynasm_emit_lb(struct dynarec_compiler *compiler,
+                    enum PSX_REG reg_target,
+                    int16_t offset,
+                    enum PSX_REG reg_addr) {
+   dynasm_emit_mem_rw(compiler, reg_addr, offset, reg_target,
+                      DIR_LOAD, WIDTH_BYTE, true);
+}
+
+void dynasm_emit_lbu(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     int16_t offset,
+                     enum PSX_REG reg_addr) {
+   dynasm_emit_mem_rw(compiler, reg_addr, offset, reg_target,
+                      DIR_LOAD, WIDTH_BYTE, false);
+}
+
+void dynasm_emit_lh(struct dynarec_compiler *compiler,
+                    enum PSX_REG reg_target,
+                    int16_t offset,
+                    enum PSX_REG reg_addr) {
+   dynasm_emit_mem_rw(compiler, reg_addr, offset, reg_target,
+                      DIR_LOAD, WIDTH_HALFWORD, true);
+}
+
+void dynasm_emit_lhu(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     int16_t offset,
+                     enum PSX_REG reg_addr) {
+   dynasm_emit_mem_rw(compiler, reg_addr, offset, reg_target,
+                      DIR_LOAD, WIDTH_HALFWORD, false);
 }
 
 void dynasm_emit_lw(struct dynarec_compiler *compiler,
                     enum PSX_REG reg_target,
                     int16_t offset,
                     enum PSX_REG reg_addr) {
-   dynasm_emit_mem_rw(compiler,
-                      reg_addr,
-                      offset,
-                      reg_target,
-                      DIR_LOAD,
-                      WIDTH_WORD);
+   dynasm_emit_mem_rw(compiler, reg_addr, offset, reg_target,
+                      DIR_LOAD, WIDTH_WORD, false);
 }
 
-void dynasm_emit_page_local_jump(struct dynarec_compiler *compiler,
-                                 int32_t offset,
-                                 bool placeholder) {
-   if (placeholder == false) {
-      EMIT_JMP(offset);
-   } else {
-      /* We're adding placeholder code we'll patch later. */
-      /* XXX for not I assume the worst case scenario and make room
-         for a 32bit relative jump. Since "offset" contains the worst
-         case scenario we could use it to see if we could use a near
-         jump instead. */
-      /* JMP off32 */
-      *(compiler->map++) = 0xe9;
-      /* I'm supposed to put the offset here, but I don't know what it
-         is yet. I use 0x90 because it's a NOP, this way we'll be able
-         to patch a shorter instruction if we want later and not run
-         into any issues. */
-      *(compiler->map++) = 0x90;
-      *(compiler->map++) = 0x90;
-      *(compiler->map++) = 0x90;
-      *(compiler->map++) = 0x90;
+/* LWL and LWR are rare enough that we let the emulator handle
+   them */
+static void emit_lwlr(struct dynarec_compiler *compiler,
+                      dynarec_fn_t helper,
+                      enum PSX_REG reg_target,
+                      int16_t offset,
+                      enum PSX_REG reg_addr,
+                      enum PSX_REG reg_cur) {
+   int cur;
+
+   emit_load_address(compiler, reg_addr, offset);
+
+   cur = emit_load_psx_reg(compiler, reg_cur, REG_SI);
+   if (cur != REG_SI) {
+      MOV_R32_R32(cur, REG_SI);
    }
+
+   emit_call(compiler, helper);
+
+   emit_store_psx_reg(compiler, reg_target, REG_AX);
 }
 
-void dynasm_emit_mfhi(struct dynarec_compiler *compiler,
-                      enum PSX_REG ret_target) {
-   dynasm_emit_exception(compiler, PSX_DYNAREC_UNIMPLEMENTED);
+void dynasm_emit_lwl(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     int16_t offset,
+                     enum PSX_REG reg_addr,
+                     enum PSX_REG reg_cur) {
+   emit_lwlr(compiler, dynabi_lwl, reg_target, offset, reg_addr, reg_cur);
 }
 
-void dynasm_emit_mtlo(struct dynarec_compiler *compiler,
-                      enum PSX_REG ret_source) {
-   dynasm_emit_exception(compiler, PSX_DYNAREC_UNIMPLEMENTED);
+void dynasm_emit_lwr(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     int16_t offset,
+                     enum PSX_REG reg_addr,
+                     enum PSX_REG reg_cur) {
+   emit_lwlr(compiler, dynabi_lwr, reg_target, offset, reg_addr, reg_cur);
 }
 
-void dynasm_emit_mtc0(struct dynarec_compiler *compiler,
-                      enum PSX_REG reg_source,
-                      enum PSX_COP0_REG reg_cop0) {
-   int source = register_location(reg_source);
+static void emit_swlr(struct dynarec_compiler *compiler,
+                      dynarec_fn_t helper,
+                      enum PSX_REG reg_addr,
+                      int16_t offset,
+                      enum PSX_REG reg_val) {
+   int val;
 
-   /* Move value to SI */
-   if (source >= 0) {
-      MOV_R32_R32(source, REG_SI);
+   emit_load_address(compiler, reg_addr, offset);
+
+   val = emit_load_psx_reg(compiler, reg_val, REG_SI);
+   if (val != REG_SI) {
+      MOV_R32_R32(val, REG_SI);
+   }
+
+   emit_call(compiler, helper);
+}
+
+void dynasm_emit_swl(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_addr,
+                     int16_t offset,
+                     enum PSX_REG reg_val) {
+   emit_swlr(compiler, dynabi_swl, reg_addr, offset, reg_val);
+}
+
+void dynasm_emit_swr(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_addr,
+                     int16_t offset,
+                     enum PSX_REG reg_val) {
+   emit_swlr(compiler, dynabi_swr, reg_addr, offset, reg_val);
+}
+
+void dynasm_emit_cop(struct dynarec_compiler *compiler,
+                     uint32_t instruction,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op) {
+   /* Put the operand in %eax */
+   if ((instruction >> 26) >= 0x30) {
+      /* LWCn/SWCn: compute the address */
+      emit_load_address(compiler, reg_op, instruction & 0xffff);
+      MOV_R32_R32(REG_DX, REG_AX);
    } else {
-      if (reg_source == 0) {
-         CLEAR_REG(REG_SI);
-      } else {
-         MOV_OFF_PR64_R32(DYNAREC_STATE_REG_OFFSET(reg_source),
-                          STATE_REG,
-                          REG_SI);
+      int op = emit_load_psx_reg(compiler, reg_op, REG_AX);
+
+      if (op != REG_AX) {
+         MOV_R32_R32(op, REG_AX);
+      }
+   }
+
+   /* The emulator might raise an exception, make sure we're in a
+      consistent state */
+   emit_commit_pending_load(compiler, REG_DX);
+   compiler->pending_load_reg = PSX_REG_R0;
+
+   MOV_U32_R32(instruction, REG_SI);
+   MOV_U32_R32(callback_pc(compiler), REG_DX);
+   CALL(compiler->stub_cop);
+
+   emit_store_psx_reg(compiler, reg_target, REG_AX);
+}
+
+void dynasm_emit_gte(struct dynarec_compiler *compiler,
+                     uint32_t instruction,
+                     enum PSX_REG reg_op) {
+   const uint32_t opcode = instruction >> 26;
+
+   /* Put the operand in %edx */
+   if (opcode >= 0x30) {
+      /* LWC2/SWC2: compute the address */
+      emit_load_address(compiler, reg_op, instruction & 0xffff);
+
+      TEST_U8_R8(3, REG_DX);
+      IF_NOT_ZERO {
+         if (opcode == 0x32) {
+            emit_exception(compiler, PSX_EXCEPTION_LOAD_ALIGN, true);
+         } else {
+            emit_exception(compiler, PSX_EXCEPTION_STORE_ALIGN, true);
+         }
+      } ENDIF;
+   } else {
+      int op = emit_load_psx_reg(compiler, reg_op, REG_DX);
+
+      if (op != REG_DX) {
+         MOV_R32_R32(op, REG_DX);
       }
    }
 
-   switch (reg_cop0) {
-   case PSX_COP0_SR:
-      CALL(dynabi_set_cop0_sr);
+   MOV_U32_R32(instruction, REG_SI);
+   emit_call(compiler, dynabi_gte);
+}
+
+void dynasm_emit_gte_read(struct dynarec_compiler *compiler,
+                          uint32_t instruction,
+                          enum PSX_REG reg_target) {
+   MOV_U32_R32(instruction, REG_SI);
+   emit_call(compiler, dynabi_gte_read);
+
+   emit_store_psx_reg(compiler, reg_target, REG_AX);
+}
+
+void dynasm_emit_cop_check(struct dynarec_compiler *compiler,
+                           unsigned cop) {
+   TEST_U32_OFF_PR64(1U << (28 + cop),
+                     offsetof(struct dynarec_state, sr),
+                     STATE_REG);
+   IF_ZERO {
+      dynasm_emit_exception(compiler, PSX_COPROCESSOR_ERROR);
+   } ENDIF;
+}
+
+void dynasm_emit_branch_cond(struct dynarec_compiler *compiler,
+                             enum PSX_BRANCH_COND cond,
+                             enum PSX_REG reg_op0,
+                             enum PSX_REG reg_op1) {
+   const int dt = register_location(compiler, PSX_REG_DT);
+   int op0;
+
+   /* Must be done before the comparison since it clobbers the
+      flags */
+   CLEAR_REG(dt);
+
+   op0 = emit_load_psx_reg(compiler, reg_op0, REG_SI);
+
+   if ((cond == PSX_BRANCH_EQ || cond == PSX_BRANCH_NE) &&
+       reg_op1 != PSX_REG_R0) {
+      int op1 = emit_load_psx_reg(compiler, reg_op1, REG_DX);
+
+      CMP_R32_R32(op1, op0);
+   } else {
+      TEST_R32_R32(op0, op0);
+   }
+
+   switch (cond) {
+   case PSX_BRANCH_EQ:
+      SETE_R8(dt);
       break;
-   case PSX_COP0_CAUSE:
-      CALL(dynabi_set_cop0_cause);
+   case PSX_BRANCH_NE:
+      SETNE_R8(dt);
       break;
-   case PSX_COP0_BPC:
-   case PSX_COP0_BDA:
-   case PSX_COP0_DCIC:
-   case PSX_COP0_BDAM:
-   case PSX_COP0_BPCM:
-      /* Move COP0 register index to DX */
-      MOV_U32_R32(reg_cop0, REG_DX);
-
-      CALL(dynabi_set_cop0_misc);
+   case PSX_BRANCH_LEZ:
+      SETLE_R8(dt);
       break;
-   case PSX_COP0_JUMPDEST:
-      /* NOP */
+   case PSX_BRANCH_GTZ:
+      SETG_R8(dt);
       break;
-   default:
-      UNIMPLEMENTED;
+   case PSX_BRANCH_LTZ:
+      SETL_R8(dt);
+      break;
+   case PSX_BRANCH_GEZ:
+      SETGE_R8(dt);
+      break;
+   }
+}
+
+void dynasm_emit_link(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      uint32_t addr) {
+   int target = target_psx_reg(compiler, reg_target, REG_AX);
+
+   MOV_U32_R32(addr, target);
+   OR_OFF_PR64_R32(offsetof(struct dynarec_state, region),
+                   STATE_REG,
+                   target);
+
+   emit_store_psx_reg(compiler, reg_target, target);
+}
+
+void dynasm_emit_exit(struct dynarec_compiler *compiler,
+                      uint32_t target) {
+   MOV_U32_R32(target, REG_AX);
+   EMIT_JMP(compiler->stub_exit - compiler->map);
+}
+
+void dynasm_emit_linkable_exit(struct dynarec_compiler *compiler,
+                               uint32_t target) {
+   TEST_R32_R32(REG_CX, REG_CX);
+   IF_LESS_EQUAL {
+      dynasm_emit_exit(compiler, target);
+   } ENDIF;
+
+   /* We're leaving the page */
+   emit_spill_allocated(compiler);
+
+   /* This is the code patched by dynasm_link: the address of the
+      target instruction and a jump to the target page's entry. When
+      unlinked it jumps to the code immediately following it. */
+   /* MOV $imm64, %rsi */
+   *(compiler->map++) = 0x48;
+   *(compiler->map++) = 0xbe;
+   emit_imm32(compiler, 0);
+   emit_imm32(compiler, 0);
+   /* JMP off32 */
+   *(compiler->map++) = 0xe9;
+   emit_imm32(compiler, 0);
+
+   /* Store the address of the MOV in `link_site`:
+      LEA -22(%rip), %rax */
+   *(compiler->map++) = 0x48;
+   *(compiler->map++) = 0x8d;
+   *(compiler->map++) = 0x05;
+   emit_imm32(compiler, -22);
+   MOV_R64_OFF_PR64(REG_AX,
+                    offsetof(struct dynarec_state, link_site),
+                    STATE_REG);
+
+   /* The registers have already been spilled, skip that */
+   MOV_U32_R32(target, REG_AX);
+   OR_OFF_PR64_R32(offsetof(struct dynarec_state, region),
+                   STATE_REG,
+                   REG_AX);
+   MOV_R32_OFF_PR64(REG_AX,
+                    offsetof(struct dynarec_state, pc),
+                    STATE_REG);
+   RET();
+}
+
+void dynasm_link(uint8_t *site, void *page_entry, void *target) {
+   uint64_t addr = (uintptr_t)target;
+   int i;
+
+   for (i = 0; i < 8; i++) {
+      site[2 + i] = addr & 0xff;
+      addr >>= 8;
+   }
+
+   patch_jump(site + 11, page_entry, true);
+}
+
+void dynasm_unlink(uint8_t *site) {
+   patch_jump(site + 11, site + 15, true);
+}
+
+void dynasm_emit_exit_dt(struct dynarec_compiler *compiler) {
+   MOV_R32_R32(register_location(compiler, PSX_REG_DT), REG_AX);
+   EMIT_JMP(compiler->stub_exit_abs - compiler->map);
+}
+
+void dynasm_emit_page_prologue(struct dynarec_compiler *compiler) {
+   /* Page entry, called by dynasm_execute or jumped to by linked
+      exits with the target instruction in %rsi */
+   emit_fill_allocated(compiler);
+   /* JMP *%rsi */
+   *(compiler->map++) = 0xff;
+   *(compiler->map++) = 0xe6;
+
+   /* Exceptions and coprocessor instructions may return directly to
+      dynarec_run, the registers must be in the state struct. They
+      also look at `state->regs`. */
+   compiler->stub_exception = compiler->map;
+   emit_spill_allocated(compiler);
+   JMP_ABS(dynabi_exception);
+
+   compiler->stub_cop = compiler->map;
+   emit_spill_allocated(compiler);
+   JMP_ABS(dynabi_cop);
+
+   /* Idle loop detection looks at `state->regs` too */
+   if (compiler->state->options & DYNAREC_OPT_IDLE_SKIP) {
+      compiler->stub_idle = compiler->map;
+      emit_spill_allocated(compiler);
+      JMP_ABS(dynabi_idle_loop);
+   }
+
+   /* Page exit: canonical target address in %eax */
+   compiler->stub_exit = compiler->map;
+   OR_OFF_PR64_R32(offsetof(struct dynarec_state, region),
+                   STATE_REG,
+                   REG_AX);
+   /* Same thing with a target that already has the region bits */
+   compiler->stub_exit_abs = compiler->map;
+   MOV_R32_OFF_PR64(REG_AX,
+                    offsetof(struct dynarec_state, pc),
+                    STATE_REG);
+   emit_spill_allocated(compiler);
+   RET();
+}
+
+void dynasm_emit_idle_loop(struct dynarec_compiler *compiler) {
+   MOV_U32_R32(compiler->pc, REG_SI);
+   CALL(compiler->stub_idle);
+}
+
+void dynasm_emit_counter_check(struct dynarec_compiler *compiler,
+                               uint32_t target) {
+   TEST_R32_R32(REG_CX, REG_CX);
+   IF_LESS_EQUAL {
+      dynasm_emit_exit(compiler, target);
+   } ENDIF;
+}
+
+void dynasm_emit_page_local_jump(struct dynarec_compiler *compiler,
+                                 int32_t offset,
+                                 bool placeholder,
+                                 enum DYNAREC_JUMP_COND cond) {
+   if (cond == DYNAREC_JUMP_DT_CLEAR) {
+      const int dt = register_location(compiler, PSX_REG_DT);
+
+      TEST_R32_R32(dt, dt);
+      /* Offset is relative to the start of the TEST */
+      offset -= 2;
+
+      if (placeholder == false) {
+         EMIT_JZ(offset);
+      } else {
+         /* JZ off32 */
+         *(compiler->map++) = 0x0f;
+         *(compiler->map++) = 0x84;
+         *(compiler->map++) = 0x90;
+         *(compiler->map++) = 0x90;
+         *(compiler->map++) = 0x90;
+         *(compiler->map++) = 0x90;
+      }
+   } else {
+      if (placeholder == false) {
+         EMIT_JMP(offset);
+      } else {
+         /* We're adding placeholder code we'll patch later. We assume
+            the worst case scenario and make room for a 32bit relative
+            jump. */
+         /* JMP off32 */
+         *(compiler->map++) = 0xe9;
+         /* I'm supposed to put the offset here, but I don't know what
+            it is yet. I use 0x90 because it's a NOP, this way we'll
+            be able to patch a shorter instruction if we want later
+            and not run into any issues. */
+         *(compiler->map++) = 0x90;
+         *(compiler->map++) = 0x90;
+         *(compiler->map++) = 0x90;
+         *(compiler->map++) = 0x90;
+      }
    }
 }
@@ -3,17 +3,45 @@
 #ifndef __DYNAREC_AMD64_H__
 #define __DYNAREC_AMD64_H__
 
-/* Maximum length of a recompiled instruction in bytes. */
-#define DYNAREC_INSTRUCTION_MAX_LEN  (121U * 2)
+/* Maximum length of a recompiled instruction in bytes. That's for
+   both versions of an instruction in a load delay slot, including the
+   inline delay slot for branches. */
+#define DYNAREC_INSTRUCTION_MAX_LEN  768U
+
+/* Maximum length of the code giving back the pending cycles when
+   jumping to an instruction from elsewhere, see `emit_entry_stubs` */
+#define DYNAREC_ENTRY_STUB_MAX_LEN   11U
+
+/* Number of host registers available to hold PSX registers (%r8 to
+   %r15) */
+#define DYNAREC_ALLOCATABLE_REGS     8U
+
+/* Memory accesses can go through the fastmem window */
+#define DYNAREC_HAVE_FASTMEM
+
+/* Recompiled pages can be relocated, see `dynasm_relocate` */
+#define DYNAREC_HAVE_CODE_CACHE
+
+/* EM_X86_64, for the jitdump */
+#define DYNAREC_ELF_MACHINE          62U
 
 /* Helper assembly functions. They use a custom ABI and are not meant
  * to be called directly from C code */
 extern void dynabi_exception(void);
-extern void dynabi_device_sw(void);
+extern void dynabi_cop(void);
+extern void dynabi_gte(void);
+extern void dynabi_gte_read(void);
+extern void dynabi_device_sb(void);
 extern void dynabi_device_sh(void);
+extern void dynabi_device_sw(void);
+extern void dynabi_device_lb(void);
+extern void dynabi_device_lh(void);
 extern void dynabi_device_lw(void);
-extern void dynabi_set_cop0_sr(void);
-extern void dynabi_set_cop0_cause(void);
-extern void dynabi_set_cop0_misc(void);
+extern void dynabi_lwl(void);
+extern void dynabi_lwr(void);
+extern void dynabi_swl(void);
+extern void dynabi_swr(void);
+extern void dynabi_invalidate(void);
+extern void dynabi_idle_loop(void);
 
 #endif /* __DYNAREC_AMD64_H__ */
@@ -0,0 +1,363 @@
+/* Persistent translation cache: recompiled pages are saved to disk,
+   keyed by a hash of their code, and loaded back instead of being
+   recompiled the next time the same code runs. See DESIGN.md. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "dynarec-compiler.h"
+
+#ifdef DYNAREC_HAVE_CODE_CACHE
+
+/* Maximum size of the files in the cache directory. The least
+   recently used ones are removed beyond that, see
+   `dynarec_cache_prune`. */
+#define DYNAREC_CACHE_MAX_SIZE (64U << 20)
+
+/* Must be bumped when the file format changes. Files written by
+   another build are rejected anyway, see `cache_build_id`. */
+#define DYNAREC_CACHE_VERSION 1U
+/* "PSXD" */
+#define DYNAREC_CACHE_MAGIC   0x44585350U
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+/* Header of a cache file. It's followed by the page's code and its
+   relocations. */
+struct dynarec_cache_header {
+   uint32_t magic;
+   uint32_t version;
+   uint64_t build_id;
+   uint32_t page_index;
+   uint32_t options;
+   /* Length of the code in bytes */
+   uint32_t code_len;
+   /* Number of `struct dynarec_reloc` following the code */
+   uint32_t reloc_len;
+   /* The emulated code followed by the first instruction of the next
+      page. Compared in full on load so hash collisions are harmless. */
+   uint32_t source[DYNAREC_PAGE_INSTRUCTIONS + 1];
+   /* Offset of each instruction's code from the start of the page */
+   uint32_t instructions[DYNAREC_PAGE_INSTRUCTIONS];
+};
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+   const uint8_t *p = data;
+   size_t i;
+
+   for (i = 0; i < len; i++) {
+      h = (h ^ p[i]) * FNV_PRIME;
+   }
+
+   return h;
+}
+
+/* The code and the relocations depend on the layout of the binary
+   that generated them, so we only reuse files from the same build */
+static uint64_t cache_build_id(void) {
+   static const char build[] = __DATE__ " " __TIME__;
+
+   return fnv1a(FNV_OFFSET, build, sizeof(build));
+}
+
+/* The options affecting the generated code */
+static uint32_t cache_options(struct dynarec_state *state) {
+   return state->options &
+      ~(DYNAREC_OPT_TIERED | DYNAREC_OPT_CODE_CACHE | DYNAREC_OPT_JITDUMP |
+        DYNAREC_OPT_HLE_BIOS);
+}
+
+static bool cache_enabled(struct dynarec_state *state) {
+   return state->cache_dir != NULL &&
+      (state->options & DYNAREC_OPT_CODE_CACHE);
+}
+
+static void cache_path(char *path,
+                       size_t len,
+                       struct dynarec_state *state,
+                       uint32_t page_index,
+                       const uint32_t *emulated_page,
+                       uint32_t next_page_instruction) {
+   const uint32_t key[3] = {
+      DYNAREC_CACHE_VERSION,
+      page_index,
+      cache_options(state),
+   };
+   uint64_t h;
+
+   h = fnv1a(FNV_OFFSET, key, sizeof(key));
+   h = fnv1a(h, emulated_page, DYNAREC_PAGE_SIZE);
+   h = fnv1a(h, &next_page_instruction, sizeof(next_page_instruction));
+
+   snprintf(path, len, "%s/%016llx.bin",
+            state->cache_dir, (unsigned long long)h);
+}
+
+/* A file in the cache directory, for `dynarec_cache_prune` */
+struct cache_file {
+   char   name[32];
+   time_t mtime;
+   off_t  size;
+};
+
+static int cache_file_cmp(const void *a, const void *b) {
+   const struct cache_file *fa = a;
+   const struct cache_file *fb = b;
+
+   if (fa->mtime != fb->mtime) {
+      return fa->mtime < fb->mtime ? -1 : 1;
+   }
+
+   return strcmp(fa->name, fb->name);
+}
+
+/* Remove the oldest files of the cache directory `dir` until it's
+   back under DYNAREC_CACHE_MAX_SIZE. Files are touched when they're
+   loaded so the oldest are the least recently used. Called when the
+   directory is set, the cache only grows by the code of one game
+   (and its variations) between two calls. */
+void dynarec_cache_prune(const char *dir) {
+   struct cache_file *files = NULL;
+   struct dirent     *entry;
+   struct stat        st;
+   char               path[4096];
+   uint64_t           total = 0;
+   size_t             count = 0;
+   size_t             size = 0;
+   size_t             i;
+   DIR               *d;
+
+   d = opendir(dir);
+   if (d == NULL) {
+      return;
+   }
+
+   while ((entry = readdir(d)) != NULL) {
+      if (strlen(entry->d_name) >= sizeof(files->name)) {
+         continue;
+      }
+
+      snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+      if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+         continue;
+      }
+
+      if (count == size) {
+         struct cache_file *n;
+
+         size = size ? size * 2 : 256;
+         n = realloc(files, size * sizeof(*files));
+         if (n == NULL) {
+            break;
+         }
+         files = n;
+      }
+
+      strcpy(files[count].name, entry->d_name);
+      files[count].mtime = st.st_mtime;
+      files[count].size = st.st_size;
+      total += st.st_size;
+      count++;
+   }
+
+   closedir(d);
+
+   if (total > DYNAREC_CACHE_MAX_SIZE) {
+      qsort(files, count, sizeof(*files), cache_file_cmp);
+
+      for (i = 0; i < count && total > DYNAREC_CACHE_MAX_SIZE; i++) {
+         snprintf(path, sizeof(path), "%s/%s", dir, files[i].name);
+
+         if (remove(path) == 0) {
+            total -= files[i].size;
+         }
+      }
+
+      DYNAREC_LOG("Removed %u files from the translation cache\n",
+                  (unsigned)i);
+   }
+
+   free(files);
+}
+
+/* Load the code of page `page_index` from the cache if we've already
+   compiled the same instructions. Returns the length of the code or 0
+   if it's not cached, in which case the page's code may have been
+   clobbered. Files written by another build can never be used again,
+   they're removed. */
+uint32_t dynarec_cache_load(struct dynarec_state *state,
+                            uint32_t page_index,
+                            const uint32_t *emulated_page,
+                            uint32_t next_page_instruction) {
+   struct dynarec_cache_header header;
+   struct dynarec_reloc        reloc;
+   uint8_t                    *page;
+   uint32_t                   *instructions;
+   char                        path[4096];
+   FILE                       *f;
+   bool                        ok = false;
+   bool                        dead = false;
+   unsigned                    i;
+
+   if (!cache_enabled(state)) {
+      return 0;
+   }
+
+   cache_path(path, sizeof(path),
+              state, page_index, emulated_page, next_page_instruction);
+
+   f = fopen(path, "rb");
+   if (f == NULL) {
+      return 0;
+   }
+
+   page = dynarec_page_start(state, page_index);
+   instructions = state->page_instructions[page_index];
+
+   if (fread(&header, sizeof(header), 1, f) != 1 ||
+       header.magic != DYNAREC_CACHE_MAGIC ||
+       header.version != DYNAREC_CACHE_VERSION ||
+       header.build_id != cache_build_id()) {
+      dead = true;
+      goto out;
+   }
+
+   if (header.page_index != page_index ||
+       header.options != cache_options(state) ||
+       header.code_len == 0 ||
+       header.code_len > state->page_len[page_index] ||
+       header.reloc_len > DYNAREC_MAX_RELOCS ||
+       memcmp(header.source, emulated_page, DYNAREC_PAGE_SIZE) != 0 ||
+       header.source[DYNAREC_PAGE_INSTRUCTIONS] != next_page_instruction) {
+      goto out;
+   }
+
+   if (fread(page, 1, header.code_len, f) != header.code_len) {
+      goto out;
+   }
+
+   for (i = 0; i < header.reloc_len; i++) {
+      if (fread(&reloc, sizeof(reloc), 1, f) != 1 ||
+          reloc.offset >= header.code_len ||
+          !dynasm_relocate(page, &reloc)) {
+         goto out;
+      }
+   }
+
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
+      if (header.instructions[i] >= header.code_len) {
+         goto out;
+      }
+
+      instructions[i] = header.instructions[i];
+   }
+
+   ok = true;
+
+out:
+   fclose(f);
+
+   if (dead) {
+      /* It's written again with the page */
+      DYNAREC_LOG("Removing stale cache file %s\n", path);
+      remove(path);
+      return 0;
+   }
+
+   if (!ok) {
+      DYNAREC_LOG("Ignoring stale cache file %s\n", path);
+      return 0;
+   }
+
+   /* Keep track of the last use for `dynarec_cache_prune` */
+   utime(path, NULL);
+
+   return header.code_len;
+}
+
+/* Save the page that was just compiled by `compiler`. `code_len` is
+   the length of its code. */
+void dynarec_cache_store(struct dynarec_compiler *compiler,
+                         const uint32_t *emulated_page,
+                         uint32_t next_page_instruction,
+                         uint32_t code_len) {
+   struct dynarec_state       *state = compiler->state;
+   struct dynarec_cache_header header;
+   char                        path[4096];
+   char                        tmp_path[4096 + 4];
+   FILE                       *f;
+   bool                        ok;
+   unsigned                    i;
+
+   if (!cache_enabled(state) || compiler->reloc_len > DYNAREC_MAX_RELOCS) {
+      return;
+   }
+
+   memset(&header, 0, sizeof(header));
+   header.magic = DYNAREC_CACHE_MAGIC;
+   header.version = DYNAREC_CACHE_VERSION;
+   header.build_id = cache_build_id();
+   header.page_index = compiler->page_index;
+   header.options = cache_options(state);
+   header.code_len = code_len;
+   header.reloc_len = compiler->reloc_len;
+   memcpy(header.source, emulated_page, DYNAREC_PAGE_SIZE);
+   header.source[DYNAREC_PAGE_INSTRUCTIONS] = next_page_instruction;
+
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
+      header.instructions[i] =
+         (uint8_t *)compiler->dynarec_instructions[i] - compiler->page_start;
+   }
+
+   cache_path(path, sizeof(path),
+              state, compiler->page_index,
+              emulated_page, next_page_instruction);
+   snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+   /* Write to a temporary file first so that another instance never
+      sees a partial page */
+   f = fopen(tmp_path, "wb");
+   if (f == NULL) {
+      DYNAREC_LOG("Can't create %s\n", tmp_path);
+      return;
+   }
+
+   ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+      fwrite(compiler->page_start, 1, code_len, f) == code_len &&
+      fwrite(compiler->relocs,
+             sizeof(struct dynarec_reloc),
+             compiler->reloc_len,
+             f) == compiler->reloc_len;
+
+   if (fclose(f) != 0) {
+      ok = false;
+   }
+
+   if (!ok || rename(tmp_path, path) != 0) {
+      DYNAREC_LOG("Can't write %s\n", path);
+      remove(tmp_path);
+   }
+}
+#else
+void dynarec_cache_prune(const char *dir) {
+}
+
+uint32_t dynarec_cache_load(struct dynarec_state *state,
+                            uint32_t page_index,
+                            const uint32_t *emulated_page,
+                            uint32_t next_page_instruction) {
+   return 0;
+}
+
+void dynarec_cache_store(struct dynarec_compiler *compiler,
+                         const uint32_t *emulated_page,
+                         uint32_t next_page_instruction,
+                         uint32_t code_len) {
+}
+#endif
@@ -1,30 +1,55 @@
 #include <assert.h>
 #include <stdio.h>
-#include <unistd.h>
-#include <fcntl.h>
 
 #include "dynarec-compiler.h"
 
 /* Keep track of an unresolved local jump (i.e. within the same page)
    that will have to be patched once we're done recompiling the
    page. `patch_loc` is the location of the jump to be patched in the
-   dynarec'd code, `target` is the address (in PSX memory) of the
-   target instruction that *must* be within the same page. */
+   dynarec'd code, `target_index` is the index of the target
+   instruction within the page. */
 static void add_local_patch(struct dynarec_compiler *compiler,
                             uint8_t *patch_loc,
-                            uint32_t target) {
+                            uint32_t target_index,
+                            enum DYNAREC_JUMP_COND cond) {
 
    uint32_t pos = compiler->local_patch_len;
 
-   /* Jumps should always be 32bit-aligned*/
-   assert((target & 3) == 0);
+   assert(target_index < DYNAREC_PAGE_INSTRUCTIONS + 2);
 
-   assert(pos < DYNAREC_PAGE_INSTRUCTIONS);
+   assert(pos < DYNAREC_MAX_LOCAL_PATCHES);
    compiler->local_patch[pos].patch_loc = patch_loc;
-   compiler->local_patch[pos].target = target;
+   compiler->local_patch[pos].target_index = target_index;
+   compiler->local_patch[pos].cond = cond;
    compiler->local_patch_len++;
 }
 
+void dynarec_add_reloc(struct dynarec_compiler *compiler,
+                       const uint8_t *site,
+                       uint32_t kind,
+                       const void *target) {
+   const uint8_t *map = compiler->state->map;
+   struct dynarec_reloc *reloc;
+
+   if ((const uint8_t *)target >= map &&
+       (const uint8_t *)target < map + compiler->state->map_len) {
+      /* References within the map (the page's stubs) don't move
+         relative to the page */
+      return;
+   }
+
+   if (compiler->reloc_len >= DYNAREC_MAX_RELOCS) {
+      /* Too many, we won't cache this page */
+      compiler->reloc_len = DYNAREC_MAX_RELOCS + 1;
+      return;
+   }
+
+   reloc = &compiler->relocs[compiler->reloc_len++];
+   reloc->offset = site - compiler->page_start;
+   reloc->kind = kind;
+   reloc->target = (intptr_t)target - (intptr_t)dynasm_execute;
+}
+
 /* Called when we're done recompiling a page to "patch" the correct
    target addresses */
 static void resolve_local_patches(struct dynarec_compiler *compiler) {
@@ -32,15 +57,16 @@ static void resolve_local_patches(struct dynarec_compiler *compiler) {
 
    for (i = 0; i < compiler->local_patch_len; i++) {
       uint8_t *patch_loc = compiler->local_patch[i].patch_loc;
-      uint32_t target    = compiler->local_patch[i].target;
+      uint32_t target    = compiler->local_patch[i].target_index;
       uint8_t *target_loc;
       int32_t offset;
 
-      /* We know for sure that the target is within the same page,
-         compute the relative offset */
-      target = target & (DYNAREC_PAGE_SIZE - 1);
-
-      target_loc = compiler->dynarec_instructions[target >> 2];
+      if (target < DYNAREC_PAGE_INSTRUCTIONS) {
+         target_loc = compiler->dynarec_instructions[target];
+      } else {
+         /* We're falling through the end of the page */
+         target_loc = compiler->page_exit[target - DYNAREC_PAGE_INSTRUCTIONS];
+      }
 
       offset = target_loc - patch_loc;
 
@@ -48,72 +74,91 @@ static void resolve_local_patches(struct dynarec_compiler *compiler) {
 
       dynasm_emit_page_local_jump(compiler,
                                   offset,
-                                  false);
+                                  false,
+                                  compiler->local_patch[i].cond);
    }
 }
 
-static void emit_jump(struct dynarec_compiler *compiler,
-                      uint32_t instruction) {
-   uint32_t imm_jump = (instruction & 0x3ffffff) << 2;
-   uint32_t target;
-   int32_t target_page;
+/* Return the index of the instruction at `addr` relative to the start
+   of the page being recompiled. `addr` must be within the page or at
+   most two instructions past the end. */
+static uint32_t page_local_index(struct dynarec_compiler *compiler,
+                                 uint32_t addr) {
+   uint32_t page_base = compiler->pc & ~(DYNAREC_PAGE_SIZE - 1);
 
-   target = compiler->pc & 0xf0000000;
-   target |= imm_jump;
+   return (addr - page_base) >> 2;
+}
 
-   /* Test if the target is in the current page */
-   target_page = dynarec_find_page_index(compiler->state, target);
-   if (target_page < 0) {
-      printf("Dynarec: jump to unhandled address 0x%08x", target);
+/* Emit a page-local jump to the instruction at index `target_index`
+   in the current page. */
+static void emit_local_jump(struct dynarec_compiler *compiler,
+                            uint32_t target_index,
+                            enum DYNAREC_JUMP_COND cond) {
+   uint8_t *patch_pos = compiler->map;
+
+   /* We don't know where the target is going to end up yet (we might
+      not even have recompiled it) so we add placeholder code and
+      patch the right address at the end. The placeholder must be
+      able to accomodate any offset within the page. */
+   dynasm_emit_page_local_jump(compiler,
+                               0,
+                               true,
+                               cond);
+   add_local_patch(compiler, patch_pos, target_index, cond);
+}
+
+/* Leave the current page and continue at `target` (canonical
+   address) */
+static void emit_page_exit(struct dynarec_compiler *compiler,
+                           uint32_t target) {
+   if (dynarec_find_page_index(compiler->state, target) >= 0) {
+      /* The target can be recompiled, we'll be able to link the jump
+         directly once we know where it ends up */
+      dynasm_emit_linkable_exit(compiler, target);
+   } else {
+      dynasm_emit_exit(compiler, target);
    }
+}
+
+/* Emit an unconditional jump to the instruction at `target`
+   (canonical address). */
+static void emit_jump_to(struct dynarec_compiler *compiler,
+                         uint32_t target) {
+   int32_t target_page;
+
+   target_page = dynarec_find_page_index(compiler->state, target);
 
-   if (target_page == compiler->page_index) {
+   if (target_page == (int32_t)compiler->page_index) {
       /* We're aiming at the current page, we don't have to worry
          about the target being invalidated and we can hardcode the
          jump target */
-      uint32_t pc_index = compiler->pc % DYNAREC_PAGE_SIZE;
-      uint32_t target_index = target % DYNAREC_PAGE_SIZE;
-
-      /* Convert from bytes to instructions */
-      pc_index >>= 2;
-      target_index >>= 2;
+      uint32_t pc_index = (compiler->pc % DYNAREC_PAGE_SIZE) >> 2;
+      uint32_t target_index = (target % DYNAREC_PAGE_SIZE) >> 2;
 
       if (target_index <= pc_index) {
-         /* We're jumping backwards, we already know the offset of the
-            target instruction */
-         printf("Patch backward call\n");
-         abort();
-      } else {
-         /* We're jumping forward, we don't know where we're going (do
-            we ever?). Add placeholder code and patch the right
-            address later. */
-         /* As a hint we compute the maximum possible offset */
-         int32_t max_offset =
-            (target_index - pc_index) * DYNAREC_INSTRUCTION_MAX_LEN;
-
-         uint8_t *patch_pos = compiler->map;
-
-         dynasm_emit_page_local_jump(compiler,
-                                     max_offset,
-                                     true);
-         add_local_patch(compiler, patch_pos, target);
+         /* We're jumping backwards, this could be a loop so we need
+            to make sure that we return to the emulator once we've run
+            out of cycles */
+         dynasm_emit_counter_check(compiler, target);
       }
+
+      emit_local_jump(compiler, target_index, DYNAREC_JUMP_ALWAYS);
    } else {
-      /* Non-local jump */
-      dynasm_emit_exception(compiler, PSX_DYNAREC_UNIMPLEMENTED);
+      /* Non-local jump, return to dynarec_run, it'll lookup the
+         target (and recompile it if needed) and link the jump */
+      emit_page_exit(compiler, target);
    }
 }
 
-static void emit_bne(struct dynarec_compiler *compiler,
-                     uint32_t instruction) {
-   (void)instruction;
-   dynasm_emit_exception(compiler, PSX_DYNAREC_UNIMPLEMENTED);
-}
-
-static void emit_blez(struct dynarec_compiler *compiler,
-                      uint32_t instruction) {
-   (void)instruction;
-   dynasm_emit_exception(compiler, PSX_DYNAREC_UNIMPLEMENTED);
+/* If a load is waiting to be committed after a load delay slot move
+   it to its target register */
+static void emit_commit_pending_load(struct dynarec_compiler *compiler) {
+   if (compiler->pending_load_reg != PSX_REG_R0) {
+      dynasm_emit_mov(compiler,
+                      compiler->pending_load_reg,
+                      compiler->pending_load_tmp);
+      compiler->pending_load_reg = PSX_REG_R0;
+   }
 }
 
 typedef void (*shift_emit_fn_t)(struct dynarec_compiler *compiler,
@@ -144,17 +189,47 @@ static void emit_shift_imm(struct dynarec_compiler *compiler,
    emit_fn(compiler, reg_target, reg_source, shift);
 }
 
+typedef void (*alu_emit_fn_t)(struct dynarec_compiler *compiler,
+                              enum PSX_REG reg_target,
+                              enum PSX_REG reg_op0,
+                              enum PSX_REG reg_op1);
+
+static void emit_shift_reg(struct dynarec_compiler *compiler,
+                           enum PSX_REG reg_target,
+                           enum PSX_REG reg_source,
+                           enum PSX_REG reg_shift,
+                           alu_emit_fn_t emit_fn) {
+   if (reg_target == 0) {
+      /* NOP */
+      return;
+   }
+
+   if (reg_shift == 0) {
+      emit_shift_imm(compiler, reg_target, reg_source, 0, NULL);
+      return;
+   }
+
+   if (reg_source == 0) {
+      dynasm_emit_li(compiler, reg_target, 0);
+      return;
+   }
+
+   emit_fn(compiler, reg_target, reg_source, reg_shift);
+}
+
 static void emit_addi(struct dynarec_compiler *compiler,
                       enum PSX_REG reg_target,
                       enum PSX_REG reg_source,
-                      uint16_t imm) {
+                      uint32_t imm) {
    if (reg_source == 0) {
-      dynasm_emit_li(compiler, reg_target, imm);
+      if (reg_target != 0) {
+         dynasm_emit_li(compiler, reg_target, imm);
+      }
       return;
    }
 
    if (imm == 0) {
-      if (reg_target != reg_source) {
+      if (reg_target != 0 && reg_target != reg_source) {
          dynasm_emit_mov(compiler, reg_target, reg_source);
       }
       return;
@@ -169,7 +244,7 @@ static void emit_addi(struct dynarec_compiler *compiler,
 static void emit_addiu(struct dynarec_compiler *compiler,
                      enum PSX_REG reg_target,
                      enum PSX_REG reg_source,
-                     uint16_t imm) {
+                     uint32_t imm) {
    if (reg_target == 0) {
       /* NOP */
       return;
@@ -201,16 +276,23 @@ static void emit_andi(struct dynarec_compiler *compiler,
 
    if (imm == 0 || reg_source == 0) {
       dynasm_emit_li(compiler, reg_target, 0);
+      return;
    }
 
    dynasm_emit_andi(compiler, reg_target, reg_source, imm);
-
 }
 
+typedef void (*imm_emit_fn_t)(struct dynarec_compiler *compiler,
+                              enum PSX_REG reg_t,
+                              enum PSX_REG reg_s,
+                              uint32_t val);
+
+/* ORI and XORI */
 static void emit_ori(struct dynarec_compiler *compiler,
                      enum PSX_REG reg_target,
                      enum PSX_REG reg_source,
-                     uint16_t imm) {
+                     uint16_t imm,
+                     imm_emit_fn_t emit_fn) {
    if (reg_target == 0) {
       /* NOP */
       return;
@@ -228,13 +310,15 @@ static void emit_ori(struct dynarec_compiler *compiler,
       return;
    }
 
-   dynasm_emit_ori(compiler, reg_target, reg_source, imm);
+   emit_fn(compiler, reg_target, reg_source, imm);
 }
 
+/* ADDU, OR and XOR: operations where 0 is the identity element */
 static void emit_addu(struct dynarec_compiler *compiler,
                       enum PSX_REG reg_target,
                       enum PSX_REG reg_op0,
-                      enum PSX_REG reg_op1) {
+                      enum PSX_REG reg_op1,
+                      alu_emit_fn_t emit_fn) {
    if (reg_target == 0) {
       /* NOP */
       return;
@@ -254,47 +338,85 @@ static void emit_addu(struct dynarec_compiler *compiler,
             dynasm_emit_mov(compiler, reg_target, reg_op0);
          }
       } else {
-         dynasm_emit_addu(compiler, reg_target, reg_op0, reg_op1);
+         emit_fn(compiler, reg_target, reg_op0, reg_op1);
       }
    }
 }
 
-static void emit_or(struct dynarec_compiler *compiler,
-                    enum PSX_REG reg_target,
-                    enum PSX_REG reg_op0,
-                    enum PSX_REG reg_op1) {
+static void emit_subu(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
    if (reg_target == 0) {
       /* NOP */
       return;
    }
 
-   if (reg_op0 == 0) {
-      if (reg_op1 == 0) {
-         dynasm_emit_li(compiler, reg_target, 0);
-      } else {
-         if (reg_target != reg_op1) {
-            dynasm_emit_mov(compiler, reg_target, reg_op1);
-         }
+   if (reg_op0 == reg_op1) {
+      dynasm_emit_li(compiler, reg_target, 0);
+      return;
+   }
+
+   if (reg_op1 == 0) {
+      if (reg_target != reg_op0) {
+         dynasm_emit_mov(compiler, reg_target, reg_op0);
       }
-   } else {
-      if (reg_op1 == 0) {
-         if (reg_target != reg_op0) {
-            dynasm_emit_mov(compiler, reg_target, reg_op0);
-         }
-      } else {
-         dynasm_emit_or(compiler, reg_target, reg_op0, reg_op1);
+      return;
+   }
+
+   dynasm_emit_subu(compiler, reg_target, reg_op0, reg_op1);
+}
+
+static void emit_and(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   if (reg_target == 0) {
+      /* NOP */
+      return;
+   }
+
+   if (reg_op0 == 0 || reg_op1 == 0) {
+      dynasm_emit_li(compiler, reg_target, 0);
+      return;
+   }
+
+   if (reg_op0 == reg_op1) {
+      if (reg_target != reg_op0) {
+         dynasm_emit_mov(compiler, reg_target, reg_op0);
       }
+      return;
+   }
+
+   dynasm_emit_and(compiler, reg_target, reg_op0, reg_op1);
+}
+
+static void emit_alu(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1,
+                     alu_emit_fn_t emit_fn) {
+   if (reg_target == 0) {
+      /* NOP */
+      return;
    }
+
+   emit_fn(compiler, reg_target, reg_op0, reg_op1);
 }
 
-static void emit_skip_next_instruction(struct dynarec_compiler *compiler) {
-   uint8_t *patch_pos;
+static void emit_mthilo(struct dynarec_compiler *compiler,
+                        enum PSX_REG reg_target,
+                        enum PSX_REG reg_source) {
+   if (reg_target == 0) {
+      /* MFHI/MFLO to R0: NOP */
+      return;
+   }
 
-   patch_pos = compiler->map;
-   dynasm_emit_page_local_jump(compiler,
-                               DYNAREC_INSTRUCTION_MAX_LEN,
-                               true);
-   add_local_patch(compiler, patch_pos, compiler->pc + 8);
+   if (reg_source == 0) {
+      dynasm_emit_li(compiler, reg_target, 0);
+   } else {
+      dynasm_emit_mov(compiler, reg_target, reg_source);
+   }
 }
 
 enum delay_slot {
@@ -308,7 +430,7 @@ enum delay_slot {
  * registers. For instruction that reference fewer registers the
  * remaining arguments are set to PSX_REG_R0.
  *
- * Returns the number of cycles taken by this instruction to execute.
+ * Returns the type of delay slot following the instruction (if any).
  */
 static enum delay_slot dynarec_instruction_registers(uint32_t instruction,
                                                      enum PSX_REG *reg_target,
@@ -327,36 +449,75 @@ static enum delay_slot dynarec_instruction_registers(uint32_t instruction,
    case 0x00:
       switch (instruction & 0x3f) {
       case 0x00: /* SLL */
+      case 0x02: /* SRL */
       case 0x03: /* SRA */
          *reg_target = reg_d;
          *reg_op0    = reg_t;
          break;
+      case 0x04: /* SLLV */
+      case 0x06: /* SRLV */
+      case 0x07: /* SRAV */
+         *reg_target = reg_d;
+         *reg_op0    = reg_t;
+         *reg_op1    = reg_s;
+         break;
       case 0x08: /* JR */
          *reg_op0 = reg_s;
          ds = BRANCH_DELAY_SLOT;
          break;
+      case 0x09: /* JALR */
+         *reg_target = reg_d;
+         *reg_op0 = reg_s;
+         ds = BRANCH_DELAY_SLOT;
+         break;
       case 0x10: /* MFHI */
          *reg_target = reg_d;
+         *reg_op0 = PSX_REG_HI;
+         break;
+      case 0x11: /* MTHI */
+         *reg_target = PSX_REG_HI;
+         *reg_op0 = reg_s;
+         break;
+      case 0x12: /* MFLO */
+         *reg_target = reg_d;
+         *reg_op0 = PSX_REG_LO;
          break;
       case 0x13: /* MTLO */
+         *reg_target = PSX_REG_LO;
          *reg_op0 = reg_s;
          break;
+      case 0x18: /* MULT */
+      case 0x19: /* MULTU */
+      case 0x1a: /* DIV */
+      case 0x1b: /* DIVU */
+         *reg_op0 = reg_s;
+         *reg_op1 = reg_t;
+         break;
+      case 0x20: /* ADD */
       case 0x21: /* ADDU */
+      case 0x22: /* SUB */
+      case 0x23: /* SUBU */
+      case 0x24: /* AND */
       case 0x25: /* OR */
+      case 0x26: /* XOR */
+      case 0x27: /* NOR */
+      case 0x2a: /* SLT */
       case 0x2b: /* SLTU */
          *reg_target = reg_d;
          *reg_op0 = reg_s;
          *reg_op1 = reg_t;
          break;
-      case 0x1f:
-      case 0x34:
-         /* Illegal */
-         break;
       default:
-         printf("Dynarec encountered unsupported instruction %08x\n",
-                instruction);
-         abort();
+         /* SYSCALL, BREAK and illegal instructions */
+         break;
+      }
+      break;
+   case 0x01: /* BGEZ, BLTZ, BGEZAL, BLTZAL */
+      *reg_op0 = reg_s;
+      if ((reg_t & 0x1e) == 0x10) {
+         *reg_target = PSX_REG_RA;
       }
+      ds = BRANCH_DELAY_SLOT;
       break;
    case 0x02: /* J */
       ds = BRANCH_DELAY_SLOT;
@@ -365,20 +526,24 @@ static enum delay_slot dynarec_instruction_registers(uint32_t instruction,
       ds = BRANCH_DELAY_SLOT;
       *reg_target = PSX_REG_RA;
       break;
+   case 0x04: /* BEQ */
    case 0x05: /* BNE */
       *reg_op0 = reg_s;
       *reg_op1 = reg_t;
       ds = BRANCH_DELAY_SLOT;
       break;
    case 0x06: /* BLEZ */
+   case 0x07: /* BGTZ */
       *reg_op0 = reg_s;
       ds = BRANCH_DELAY_SLOT;
       break;
    case 0x08: /* ADDI */
    case 0x09: /* ADDIU */
+   case 0x0a: /* SLTI */
    case 0x0b: /* SLTIU */
    case 0x0c: /* ANDI */
    case 0x0d: /* ORI */
+   case 0x0e: /* XORI */
       *reg_target = reg_t;
       *reg_op0    = reg_s;
       break;
@@ -386,47 +551,103 @@ static enum delay_slot dynarec_instruction_registers(uint32_t instruction,
       *reg_target = reg_t;
       break;
    case 0x10: /* COP0 */
-      switch ((instruction >> 21) & 0x1f) {
-      case 0x00: /* MFC0 */
-         *reg_target = reg_t;
+   case 0x11: /* COP1 */
+   case 0x12: /* COP2 */
+   case 0x13: /* COP3 */
+      switch (reg_s) {
+      case 0x00: /* MFCn */
+      case 0x02: /* CFCn */
+         if ((instruction >> 26) == 0x10 || (instruction >> 26) == 0x12) {
+            *reg_target = reg_t;
+            ds = LOAD_DELAY_SLOT;
+         }
          break;
-      case 0x04: /* MTC0 */
+      case 0x04: /* MTCn */
+      case 0x06: /* CTCn */
          *reg_op0 = reg_t;
          break;
-      case 0x10: /* RFE */
+      case 0x08: /* BCnF, BCnT */
+      case 0x0c:
+         ds = BRANCH_DELAY_SLOT;
          break;
       default:
-         printf("Dynarec encountered unsupported COP0 instruction %08x\n",
-                instruction);
-         abort();
+         break;
       }
       break;
+   case 0x20: /* LB */
+   case 0x21: /* LH */
    case 0x23: /* LW */
+   case 0x24: /* LBU */
+   case 0x25: /* LHU */
+      *reg_target = reg_t;
+      *reg_op0 = reg_s;
+      ds = LOAD_DELAY_SLOT;
+      break;
+   case 0x22: /* LWL */
+   case 0x26: /* LWR */
+      /* These two also read the target register since they only
+         partially overwrite it */
       *reg_target = reg_t;
       *reg_op0 = reg_s;
+      *reg_op1 = reg_t;
       ds = LOAD_DELAY_SLOT;
       break;
+   case 0x28: /* SB */
    case 0x29: /* SH */
+   case 0x2a: /* SWL */
    case 0x2b: /* SW */
+   case 0x2e: /* SWR */
       *reg_op0 = reg_s;
       *reg_op1 = reg_t;
       break;
-   case 0x18:
-   case 0x19:
-   case 0x1b:
-   case 0x1d:
-   case 0x1e:
-         /* Illegal */
-         break;
+   case 0x30: /* LWC0 */
+   case 0x31: /* LWC1 */
+   case 0x32: /* LWC2 */
+   case 0x33: /* LWC3 */
+   case 0x38: /* SWC0 */
+   case 0x39: /* SWC1 */
+   case 0x3a: /* SWC2 */
+   case 0x3b: /* SWC3 */
+      *reg_op0 = reg_s;
+      break;
    default:
-      printf("Dynarec encountered unsupported instruction %08x\n",
-             instruction);
-      abort();
+      /* Illegal */
+      break;
    }
 
    return ds;
 }
 
+/* Returns true if `instruction` is always implemented by calling the
+   emulator, which needs an accurate cycle counter */
+static bool calls_emulator(uint32_t instruction) {
+   switch (instruction >> 26) {
+   case 0x10: /* COP0 */
+   case 0x11: /* COP1 */
+   case 0x12: /* COP2 */
+   case 0x13: /* COP3 */
+   case 0x22: /* LWL */
+   case 0x26: /* LWR */
+   case 0x2a: /* SWL */
+   case 0x2e: /* SWR */
+   case 0x30: /* LWC0 */
+   case 0x31: /* LWC1 */
+   case 0x32: /* LWC2 */
+   case 0x33: /* LWC3 */
+   case 0x38: /* SWC0 */
+   case 0x39: /* SWC1 */
+   case 0x3a: /* SWC2 */
+   case 0x3b: /* SWC3 */
+      return true;
+   default:
+      return false;
+   }
+}
+
+/* Emit a non-branch instruction. `reg_target`, `reg_op0` and
+   `reg_op1` are the values returned by
+   `dynarec_instruction_registers`, except for loads where
+   `reg_target` might have been replaced by a load delay temporary. */
 static void dynarec_emit_instruction(struct dynarec_compiler *compiler,
                                      uint32_t instruction,
                                      enum PSX_REG reg_target,
@@ -436,6 +657,11 @@ static void dynarec_emit_instruction(struct dynarec_compiler *compiler,
    uint16_t imm = instruction & 0xffff;
    uint32_t imm_se = (int32_t)((int16_t)(instruction & 0xffff));
    uint8_t  shift = (instruction >> 6) & 0x1f;
+   enum PSX_REG reg_cur;
+
+   if (calls_emulator(instruction)) {
+      dynarec_flush_cycles(compiler);
+   }
 
    switch (instruction >> 26) {
    case 0x00:
@@ -446,6 +672,14 @@ static void dynarec_emit_instruction(struct dynarec_compiler *compiler,
                         reg_op0,
                         shift,
                         dynasm_emit_sll);
+         break;
+      case 0x02: /* SRL */
+         emit_shift_imm(compiler,
+                        reg_target,
+                        reg_op0,
+                        shift,
+                        dynasm_emit_srl);
+         break;
       case 0x03: /* SRA */
          emit_shift_imm(compiler,
                         reg_target,
@@ -453,65 +687,132 @@ static void dynarec_emit_instruction(struct dynarec_compiler *compiler,
                         shift,
                         dynasm_emit_sra);
          break;
-      case 0x08: /* J */
-         dynasm_emit_exception(compiler, PSX_DYNAREC_UNIMPLEMENTED);
+      case 0x04: /* SLLV */
+         emit_shift_reg(compiler, reg_target, reg_op0, reg_op1,
+                        dynasm_emit_sllv);
          break;
-      case 0x10: /* MFHI */
-         dynasm_emit_mfhi(compiler, reg_target);
+      case 0x06: /* SRLV */
+         emit_shift_reg(compiler, reg_target, reg_op0, reg_op1,
+                        dynasm_emit_srlv);
          break;
+      case 0x07: /* SRAV */
+         emit_shift_reg(compiler, reg_target, reg_op0, reg_op1,
+                        dynasm_emit_srav);
+         break;
+      case 0x0c: /* SYSCALL */
+         dynasm_emit_exception(compiler, PSX_EXCEPTION_SYSCALL);
+         break;
+      case 0x0d: /* BREAK */
+         dynasm_emit_exception(compiler, PSX_EXCEPTION_BREAK);
+         break;
+      case 0x10: /* MFHI */
+      case 0x11: /* MTHI */
+      case 0x12: /* MFLO */
       case 0x13: /* MTLO */
-         dynasm_emit_mtlo(compiler, reg_op0);
+         emit_mthilo(compiler, reg_target, reg_op0);
+         break;
+      case 0x18: /* MULT */
+         dynasm_emit_mult(compiler, reg_op0, reg_op1);
+         break;
+      case 0x19: /* MULTU */
+         dynasm_emit_multu(compiler, reg_op0, reg_op1);
+         break;
+      case 0x1a: /* DIV */
+         dynasm_emit_div(compiler, reg_op0, reg_op1);
+         break;
+      case 0x1b: /* DIVU */
+         dynasm_emit_divu(compiler, reg_op0, reg_op1);
+         break;
+      case 0x20: /* ADD */
+         if (reg_op0 == 0 || reg_op1 == 0) {
+            /* Can't overflow */
+            emit_addu(compiler, reg_target, reg_op0, reg_op1,
+                      dynasm_emit_addu);
+         } else {
+            dynasm_emit_add(compiler, reg_target, reg_op0, reg_op1);
+         }
          break;
       case 0x21: /* ADDU */
-         emit_addu(compiler,
-                   reg_target,
-                   reg_op0,
-                   reg_op1);
+         emit_addu(compiler, reg_target, reg_op0, reg_op1,
+                   dynasm_emit_addu);
+         break;
+      case 0x22: /* SUB */
+         if (reg_op1 == 0) {
+            /* Can't overflow */
+            emit_subu(compiler, reg_target, reg_op0, reg_op1);
+         } else {
+            dynasm_emit_sub(compiler, reg_target, reg_op0, reg_op1);
+         }
+         break;
+      case 0x23: /* SUBU */
+         emit_subu(compiler, reg_target, reg_op0, reg_op1);
+         break;
+      case 0x24: /* AND */
+         emit_and(compiler, reg_target, reg_op0, reg_op1);
          break;
       case 0x25: /* OR */
-         emit_or(compiler,
-                 reg_target,
-                 reg_op0,
-                 reg_op1);
+         emit_addu(compiler, reg_target, reg_op0, reg_op1,
+                   dynasm_emit_or);
+         break;
+      case 0x26: /* XOR */
+         if (reg_op0 == reg_op1) {
+            if (reg_target != 0) {
+               dynasm_emit_li(compiler, reg_target, 0);
+            }
+            break;
+         }
+         emit_addu(compiler, reg_target, reg_op0, reg_op1,
+                   dynasm_emit_xor);
+         break;
+      case 0x27: /* NOR */
+         emit_alu(compiler, reg_target, reg_op0, reg_op1, dynasm_emit_nor);
+         break;
+      case 0x2a: /* SLT */
+         if (reg_op0 == reg_op1) {
+            /* Nothing is less than itself */
+            if (reg_target != 0) {
+               dynasm_emit_li(compiler, reg_target, 0);
+            }
+            break;
+         }
+         emit_alu(compiler, reg_target, reg_op0, reg_op1, dynasm_emit_slt);
          break;
       case 0x2b: /* SLTU */
-         if (reg_op1 == PSX_REG_R0) {
+         if (reg_op1 == PSX_REG_R0 || reg_op0 == reg_op1) {
             /* Nothing is less than 0 */
-            dynasm_emit_li(compiler, reg_target, 0);
+            if (reg_target != 0) {
+               dynasm_emit_li(compiler, reg_target, 0);
+            }
             break;
          }
 
-         dynasm_emit_sltu(compiler, reg_target, reg_op0, reg_op1);
+         emit_alu(compiler, reg_target, reg_op0, reg_op1, dynasm_emit_sltu);
          break;
-      case 0x1f:
-      case 0x34:
+      default:
          /* Illegal */
          dynasm_emit_exception(compiler, PSX_EXCEPTION_ILLEGAL_INSTRUCTION);
          break;
-      default:
-         printf("Dynarec encountered unsupported instruction %08x\n",
-                instruction);
-         abort();
       }
       break;
-   case 0x02: /* J */
-      emit_jump(compiler, instruction);
-      break;
-   case 0x03: /* JAL */
-      dynasm_emit_exception(compiler, PSX_DYNAREC_UNIMPLEMENTED);
-      break;
-   case 0x05: /* BNE */
-      emit_bne(compiler, instruction);
-      break;
-   case 0x06: /* BLEZ */
-      emit_blez(compiler, instruction);
-      break;
    case 0x08: /* ADDI */
       emit_addi(compiler, reg_target, reg_op0, imm_se);
       break;
    case 0x09: /* ADDIU */
       emit_addiu(compiler, reg_target, reg_op0, imm_se);
       break;
+   case 0x0a: /* SLTI */
+      if (reg_target == PSX_REG_R0) {
+         /* NOP */
+         break;
+      }
+
+      if (reg_op0 == PSX_REG_R0) {
+         dynasm_emit_li(compiler, reg_target, 0 < (int32_t)imm_se);
+         break;
+      }
+
+      dynasm_emit_slti(compiler, reg_target, reg_op0, imm_se);
+      break;
    case 0x0b: /* SLTIU */
       if (reg_target == PSX_REG_R0) {
          /* NOP */
@@ -524,13 +825,21 @@ static void dynarec_emit_instruction(struct dynarec_compiler *compiler,
          break;
       }
 
+      if (reg_op0 == PSX_REG_R0) {
+         dynasm_emit_li(compiler, reg_target, 1);
+         break;
+      }
+
       dynasm_emit_sltiu(compiler, reg_target, reg_op0, imm_se);
       break;
    case 0x0c: /* ANDI */
       emit_andi(compiler, reg_target, reg_op0, imm);
       break;
    case 0x0d: /* ORI */
-      emit_ori(compiler, reg_target, reg_op0, imm);
+      emit_ori(compiler, reg_target, reg_op0, imm, dynasm_emit_ori);
+      break;
+   case 0x0e: /* XORI */
+      emit_ori(compiler, reg_target, reg_op0, imm, dynasm_emit_xori);
       break;
    case 0x0f: /* LUI */
       if (reg_target == PSX_REG_R0) {
@@ -540,311 +849,1159 @@ static void dynarec_emit_instruction(struct dynarec_compiler *compiler,
 
       dynasm_emit_li(compiler, reg_target, ((uint32_t)imm) << 16);
       break;
-   case 0x10: /* COP0 */
+   case 0x12: /* COP2 */
+      /* GTE instructions are very common in 3D games, we call the
+         GTE directly instead of going through the generic
+         coprocessor code. */
+      if (instruction & (1U << 25)) {
+         /* GTE command */
+         dynasm_emit_cop_check(compiler, 2);
+         dynasm_emit_gte(compiler, instruction, PSX_REG_R0);
+         break;
+      }
+
       switch ((instruction >> 21) & 0x1f) {
-      case 0x04: /* MTC0 */
-         dynasm_emit_mtc0(compiler, reg_op0, (instruction >> 11) & 0x1f);
+      case 0x00: /* MFC2 */
+      case 0x02: /* CFC2 */
+         dynasm_emit_cop_check(compiler, 2);
+         dynasm_emit_gte_read(compiler, instruction, reg_target);
+         break;
+      case 0x04: /* MTC2 */
+      case 0x06: /* CTC2 */
+         dynasm_emit_cop_check(compiler, 2);
+         dynasm_emit_gte(compiler, instruction, reg_op0);
          break;
-      case 0x00: /* MFC0 */
-      case 0x10: /* RFE */
       default:
-         printf("Dynarec encountered unsupported COP0 instruction %08x\n",
-                instruction);
-         abort();
+         dynasm_emit_cop(compiler,
+                         instruction,
+                         reg_target,
+                         (instruction >> 16) & 0x1f);
+         break;
+      }
+      break;
+   case 0x10: /* COP0 */
+   case 0x11: /* COP1 */
+   case 0x13: /* COP3 */
+      /* We let the emulator deal with those, they're not very
+         common */
+      dynasm_emit_cop(compiler,
+                      instruction,
+                      reg_target,
+                      (instruction >> 16) & 0x1f);
+      break;
+   case 0x20: /* LB */
+      dynasm_emit_lb(compiler, reg_target, imm, reg_op0);
+      break;
+   case 0x21: /* LH */
+      dynasm_emit_lh(compiler, reg_target, imm, reg_op0);
+      break;
+   case 0x22: /* LWL */
+   case 0x26: /* LWR */
+      /* If the previous instruction was a load targeting the same
+         register we must merge with the value that's still pending */
+      reg_cur = reg_op1;
+      if (compiler->pending_load_reg == reg_cur &&
+          reg_cur != PSX_REG_R0) {
+         reg_cur = compiler->pending_load_tmp;
+         /* This instruction replaces the pending load */
+         compiler->pending_load_reg = PSX_REG_R0;
+      }
+
+      if ((instruction >> 26) == 0x22) {
+         dynasm_emit_lwl(compiler, reg_target, imm, reg_op0, reg_cur);
+      } else {
+         dynasm_emit_lwr(compiler, reg_target, imm, reg_op0, reg_cur);
       }
       break;
    case 0x23: /* LW */
       dynasm_emit_lw(compiler, reg_target, imm, reg_op0);
       break;
+   case 0x24: /* LBU */
+      dynasm_emit_lbu(compiler, reg_target, imm, reg_op0);
+      break;
+   case 0x25: /* LHU */
+      dynasm_emit_lhu(compiler, reg_target, imm, reg_op0);
+      break;
+   case 0x28: /* SB */
+      dynasm_emit_sb(compiler, reg_op0, imm, reg_op1);
+      break;
    case 0x29: /* SH */
       dynasm_emit_sh(compiler, reg_op0, imm, reg_op1);
       break;
+   case 0x2a: /* SWL */
+      dynasm_emit_swl(compiler, reg_op0, imm, reg_op1);
+      break;
    case 0x2b: /* SW */
       dynasm_emit_sw(compiler, reg_op0, imm, reg_op1);
       break;
-   case 0x18:
-   case 0x19:
-   case 0x1b:
-   case 0x1d:
-   case 0x1e:
+   case 0x2e: /* SWR */
+      dynasm_emit_swr(compiler, reg_op0, imm, reg_op1);
+      break;
+   case 0x32: /* LWC2 */
+   case 0x3a: /* SWC2 */
+      /* Not subject to the coprocessor check, like in the
+         interpreter */
+      dynasm_emit_gte(compiler, instruction, reg_op0);
+      break;
+   case 0x30: /* LWC0 */
+   case 0x31: /* LWC1 */
+   case 0x33: /* LWC3 */
+   case 0x38: /* SWC0 */
+   case 0x39: /* SWC1 */
+   case 0x3b: /* SWC3 */
+      dynasm_emit_cop(compiler, instruction, PSX_REG_R0, reg_op0);
+      break;
+   default:
       /* Illegal */
       dynasm_emit_exception(compiler, PSX_EXCEPTION_ILLEGAL_INSTRUCTION);
       break;
-   default:
-      printf("Dynarec encountered unsupported instruction %08x\n",
-             instruction);
-      abort();
    }
 }
 
-int dynarec_recompile(struct dynarec_state *state,
-                             uint32_t page_index) {
-   struct dynarec_page     *page;
-   const uint32_t          *emulated_page;
-   const uint32_t          *next_page;
-   uint8_t                 *page_start;
-   struct dynarec_compiler  compiler = { 0 };
-   unsigned                 i;
-
-   DYNAREC_LOG("Recompiling page %u\n", page_index);
-
-   state->page_valid[page_index] = 0;
-
-   page_start = dynarec_page_start(state, page_index);
-
-   compiler.state = state;
-   compiler.page_index = page_index;
-   compiler.local_patch_len = 0;
-   compiler.map = page_start;
-
-   /* We'll fill up each individual's instruction address as we
-      recompile them */
-   compiler.dynarec_instructions =
-      &state->dynarec_instructions[page_index * DYNAREC_PAGE_INSTRUCTIONS];
-
-   if (page_index < DYNAREC_RAM_PAGES) {
-      uint32_t ram_index = page_index;
-
-      emulated_page = state->ram + DYNAREC_PAGE_INSTRUCTIONS * ram_index;
-      compiler.pc = DYNAREC_PAGE_SIZE * ram_index;
+/* Emit the branch `instruction` followed by the instruction in its
+   delay slot. */
+static void dynarec_emit_branch(struct dynarec_compiler *compiler,
+                                uint32_t instruction,
+                                enum PSX_REG reg_target,
+                                enum PSX_REG reg_op0,
+                                enum PSX_REG reg_op1,
+                                uint32_t ds_instruction) {
+   const uint32_t pc = compiler->pc;
+   uint32_t imm_se = (int32_t)((int16_t)(instruction & 0xffff));
+   uint32_t target = pc + 4 + (imm_se << 2);
+   uint32_t fallthrough;
+   enum PSX_BRANCH_COND cond = PSX_BRANCH_EQ;
+   bool conditional = true;
+   bool never_taken = false;
+   bool register_jump = false;
+   enum PSX_REG ds_target;
+   enum PSX_REG ds_op0;
+   enum PSX_REG ds_op1;
+   enum delay_slot ds_delay_slot;
 
-      /* XXX This is not accurate if we're at the very end of the last
-         mirror of memory. Not that I expect that it matters much. */
-      ram_index = (ram_index + 1) % DYNAREC_RAM_PAGES;
-      next_page = state->ram + DYNAREC_PAGE_INSTRUCTIONS * ram_index;
-   } else {
-      uint32_t bios_index = page_index - DYNAREC_RAM_PAGES;
+   switch (instruction >> 26) {
+   case 0x00: /* JR, JALR */
+      conditional = false;
+      register_jump = true;
+      break;
+   case 0x01: /* BGEZ, BLTZ, BGEZAL, BLTZAL */
+      if (instruction & (1U << 16)) {
+         cond = PSX_BRANCH_GEZ;
+      } else {
+         cond = PSX_BRANCH_LTZ;
+      }
+      break;
+   case 0x02: /* J */
+   case 0x03: /* JAL */
+      conditional = false;
+      target = (pc & 0xf0000000) | ((instruction & 0x3ffffff) << 2);
+      break;
+   case 0x04: /* BEQ */
+      cond = PSX_BRANCH_EQ;
+      if (reg_op0 == reg_op1) {
+         /* BEQ $r, $r is commonly used as an unconditional branch */
+         conditional = false;
+      }
+      break;
+   case 0x05: /* BNE */
+      cond = PSX_BRANCH_NE;
+      if (reg_op0 == reg_op1) {
+         conditional = false;
+         never_taken = true;
+      }
+      break;
+   case 0x06: /* BLEZ */
+      cond = PSX_BRANCH_LEZ;
+      break;
+   case 0x07: /* BGTZ */
+      cond = PSX_BRANCH_GTZ;
+      break;
+   case 0x11: /* COP1 */
+   case 0x12: /* COP2 */
+   case 0x13: /* COP3 */
+      dynasm_emit_cop_check(compiler, (instruction >> 26) & 3);
+      /* Fallthrough */
+   case 0x10: /* COP0 */
+      /* BCnF is always taken, BCnT never is since the coprocessor
+         condition inputs are not connected */
+      conditional = false;
+      never_taken = (instruction >> 16) & 1;
+      break;
+   default:
+      DYNAREC_FATAL("Unexpected branch instruction 0x%08x\n", instruction);
+   }
 
-      emulated_page = state->bios + DYNAREC_PAGE_INSTRUCTIONS * bios_index;
-      compiler.pc = PSX_BIOS_BASE + DYNAREC_PAGE_SIZE * bios_index;
+   if (conditional) {
+      dynasm_emit_branch_cond(compiler, cond, reg_op0, reg_op1);
+   } else if (register_jump) {
+      /* Save the target address in case the delay slot overwrites
+         the register */
+      if (reg_op0 == PSX_REG_R0) {
+         dynasm_emit_li(compiler, PSX_REG_DT, 0);
+      } else {
+         dynasm_emit_mov(compiler, PSX_REG_DT, reg_op0);
+      }
+   }
 
-      /* XXX This is not accurate if we're at the very end of the
-         BIOS. Not that I expect that it matters much. */
-      bios_index = (bios_index + 1) % DYNAREC_BIOS_PAGES;
-      next_page = state->bios + DYNAREC_PAGE_INSTRUCTIONS * bios_index;
+   /* Branches take place after the load delay has elapsed */
+   emit_commit_pending_load(compiler);
+
+   if (reg_target != PSX_REG_R0) {
+      dynasm_emit_link(compiler, reg_target, pc + 8);
    }
 
-   /* Helper macros for instruction decoding */
-   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++, compiler.pc += 4) {
-      uint32_t instruction = emulated_page[i];
+   /* Emit the instruction in the delay slot */
+   ds_delay_slot = dynarec_instruction_registers(ds_instruction,
+                                                 &ds_target,
+                                                 &ds_op0,
+                                                 &ds_op1);
+
+   if (ds_delay_slot == BRANCH_DELAY_SLOT) {
+      /* A branch in a branch delay slot. The MIPS manual says that
+         this is undefined behaviour and I'm not aware of any game
+         relying on it. We treat the second branch as a NOP if the
+         first one is taken, otherwise it's run normally as part of
+         the fallthrough code. */
+      DYNAREC_LOG("Branch in delay slot at 0x%08x\n", pc);
+      fallthrough = pc + 4;
+   } else {
+      compiler->pc += 4;
+      compiler->in_delay_slot = true;
+      dynarec_emit_instruction(compiler, ds_instruction,
+                               ds_target, ds_op0, ds_op1);
+      compiler->in_delay_slot = false;
+      compiler->pc -= 4;
+
+      fallthrough = pc + 8;
+   }
+
+   if (register_jump) {
+      dynasm_emit_exit_dt(compiler);
+   } else if (never_taken) {
+      emit_jump_to(compiler, fallthrough);
+   } else {
+      if (conditional) {
+         /* If the branch is not taken we jump over the delay slot
+            (we've already executed it above) */
+         emit_local_jump(compiler,
+                         page_local_index(compiler, fallthrough),
+                         DYNAREC_JUMP_DT_CLEAR);
+      }
+
+      if ((compiler->state->options & DYNAREC_OPT_IDLE_SKIP) &&
+          dynarec_idle_loop_check(compiler->emulated_page, pc, NULL)) {
+         dynasm_emit_idle_loop(compiler);
+      }
+
+      emit_jump_to(compiler, target);
+   }
+}
+
+/* Recompile a single instruction. If `last_in_page` is true
+   `next_instruction` is in the next page. */
+static void dynarec_compile_instruction(struct dynarec_compiler *compiler,
+                                        uint32_t instruction,
+                                        uint32_t next_instruction,
+                                        bool last_in_page) {
+   const uint32_t index = (compiler->pc % DYNAREC_PAGE_SIZE) >> 2;
+   const uint32_t cycles = compiler->cycles[index];
+   const uint32_t pending_cycles = compiler->pending_cycles;
+   const uint8_t pending_reg = compiler->pending_load_reg;
+   const uint8_t pending_tmp = compiler->pending_load_tmp;
+   enum PSX_REG reg_target;
+   enum PSX_REG reg_op0;
+   enum PSX_REG reg_op1;
+   enum PSX_REG value_target;
+   enum delay_slot delay_slot;
+   bool load_delayed = false;
+   uint8_t *jump_over = NULL;
+   unsigned version;
+
+   DYNAREC_LOG("Compiling 0x%08x\n", instruction);
+
+   delay_slot = dynarec_instruction_registers(instruction,
+                                              &reg_target,
+                                              &reg_op0,
+                                              &reg_op1);
+
+   value_target = reg_target;
+
+   if (delay_slot == LOAD_DELAY_SLOT &&
+       reg_target != PSX_REG_R0 &&
+       !last_in_page) {
+      /* We have to check if the next instruction references the
+         load target, in which case it must still see the old
+         value. */
+      enum PSX_REG next_target;
+      enum PSX_REG next_op0;
+      enum PSX_REG next_op1;
+
+      dynarec_instruction_registers(next_instruction,
+                                    &next_target,
+                                    &next_op0,
+                                    &next_op1);
+
+      if (next_op0 == reg_target || next_op1 == reg_target) {
+         /* Load the value in a temporary register, it'll be moved to
+            the real target after the next instruction. If we already
+            have a load pending we use the other temporary. */
+         load_delayed = true;
+
+         if (pending_reg != PSX_REG_R0 && pending_tmp == PSX_REG_LT0) {
+            value_target = PSX_REG_LT1;
+         } else {
+            value_target = PSX_REG_LT0;
+         }
+      }
+   }
+
+   /* If we have a load pending we emit the instruction twice: first
+      with the pending load followed by the code committing it, then
+      a version without it for when we jump directly to this
+      instruction. */
+   for (version = 0; version < 2; version++) {
+      if (version == 1) {
+         if (pending_reg == PSX_REG_R0) {
+            break;
+         }
+
+         if (delay_slot != BRANCH_DELAY_SLOT) {
+            /* Step over the second version */
+            jump_over = compiler->map;
+            dynasm_emit_page_local_jump(compiler,
+                                        0,
+                                        true,
+                                        DYNAREC_JUMP_ALWAYS);
+         }
+
+         compiler->pending_load_reg = PSX_REG_R0;
+         compiler->pending_cycles = pending_cycles;
+      }
+
+      compiler->dynarec_instructions[index] = compiler->map;
+
+      if (version == 1 && pending_cycles > 0) {
+         /* We've been entered from elsewhere, the previous
+            instructions haven't run */
+         dynasm_counter_maintenance(compiler, -(int32_t)pending_cycles);
+      }
+
+      if (delay_slot == BRANCH_DELAY_SLOT) {
+         /* We might leave the page, the counter must be up to date.
+            That includes the delay slot. */
+         compiler->pending_cycles += cycles + compiler->cycles[index + 1];
+         dynarec_flush_cycles(compiler);
+         dynarec_emit_branch(compiler, instruction,
+                             reg_target, reg_op0, reg_op1,
+                             next_instruction);
+      } else {
+         compiler->pending_cycles += cycles;
+         dynarec_emit_instruction(compiler, instruction,
+                                  value_target, reg_op0, reg_op1);
+
+         if (compiler->pending_load_reg != reg_target) {
+            /* The load delay has elapsed. If the instruction
+               overwrote the load target the pending value is simply
+               discarded. */
+            emit_commit_pending_load(compiler);
+         }
+         compiler->pending_load_reg = PSX_REG_R0;
+      }
+   }
+
+   /* If we only have one version jumping to this instruction from
+      elsewhere has to go through an entry stub giving back the
+      cycles of the previous instructions, see `emit_entry_stubs` */
+   compiler->entry_cycles[index] =
+      (pending_reg == PSX_REG_R0) ? pending_cycles : 0;
+
+   if (jump_over) {
+      uint8_t *end = compiler->map;
+
+      compiler->map = jump_over;
+      dynasm_emit_page_local_jump(compiler,
+                                  end - jump_over,
+                                  false,
+                                  DYNAREC_JUMP_ALWAYS);
+      compiler->map = end;
+   }
+
+   if (load_delayed) {
+      compiler->pending_load_reg = reg_target;
+      compiler->pending_load_tmp = value_target;
+   } else {
+      compiler->pending_load_reg = PSX_REG_R0;
+   }
+}
+
+/* If `instruction` at address `pc` is a branch or jump to an
+   instruction in the same page return the index of its target within
+   the page, otherwise return -1 */
+static int32_t local_branch_target(uint32_t instruction, uint32_t pc) {
+   const uint32_t page_mask = ~(DYNAREC_PAGE_SIZE - 1);
+   uint32_t target;
+
+   switch (instruction >> 26) {
+   case 0x01: /* BGEZ, BLTZ, BGEZAL, BLTZAL */
+   case 0x04: /* BEQ */
+   case 0x05: /* BNE */
+   case 0x06: /* BLEZ */
+   case 0x07: /* BGTZ */
+      target = pc + 4 + ((int32_t)(int16_t)(instruction & 0xffff) << 2);
+      break;
+   case 0x02: /* J */
+      target = (pc & 0xf0000000) | ((instruction & 0x3ffffff) << 2);
+      break;
+   default:
+      return -1;
+   }
+
+   if ((target & page_mask) != (pc & page_mask)) {
+      return -1;
+   }
+
+   return (target % DYNAREC_PAGE_SIZE) >> 2;
+}
+
+/* If `instruction` at address `pc` is a branch to an earlier
+   instruction in the same page return the index of its target within
+   the page, otherwise return -1 */
+static int32_t local_loop_start(uint32_t instruction, uint32_t pc) {
+   int32_t target = local_branch_target(instruction, pc);
 
-      /* Various decodings of the fields, of course they won't all be
-         valid for a given instruction. For now I'll trust the
-         compiler to optimize this correctly, otherwise it might be
-         better to move them to the instructions where they make
-         sense.*/
+   if (target > (int32_t)((pc % DYNAREC_PAGE_SIZE) >> 2)) {
+      return -1;
+   }
+
+   return target;
+}
+
+void dynarec_flush_cycles(struct dynarec_compiler *compiler) {
+   if (compiler->pending_cycles > 0) {
+      dynasm_counter_maintenance(compiler, compiler->pending_cycles);
+      compiler->pending_cycles = 0;
+   }
+}
+
+bool dynarec_known_reg(struct dynarec_compiler *compiler,
+                       enum PSX_REG reg,
+                       uint32_t *val) {
+   if (reg == PSX_REG_R0) {
+      *val = 0;
+      return true;
+   }
+
+   if (reg >= 32 || !(compiler->const_regs & (1U << reg))) {
+      return false;
+   }
+
+   *val = compiler->const_val[reg];
+   return true;
+}
+
+/* Compute the value written by `instruction` if it only depends on
+   known registers. Returns false otherwise. */
+static bool const_eval(struct dynarec_compiler *compiler,
+                       uint32_t instruction,
+                       uint32_t *val) {
+   uint16_t imm = instruction & 0xffff;
+   uint32_t imm_se = (int32_t)((int16_t)(instruction & 0xffff));
+   uint8_t  shift = (instruction >> 6) & 0x1f;
+   enum PSX_REG reg_target;
+   enum PSX_REG reg_op0;
+   enum PSX_REG reg_op1;
+   uint32_t op0;
+   uint32_t op1;
+
+   dynarec_instruction_registers(instruction,
+                                 &reg_target,
+                                 &reg_op0,
+                                 &reg_op1);
+
+   if (!dynarec_known_reg(compiler, reg_op0, &op0) ||
+       !dynarec_known_reg(compiler, reg_op1, &op1)) {
+      return false;
+   }
+
+   switch (instruction >> 26) {
+   case 0x00:
+      switch (instruction & 0x3f) {
+      case 0x00: /* SLL */
+         *val = op0 << shift;
+         return true;
+      case 0x02: /* SRL */
+         *val = op0 >> shift;
+         return true;
+      case 0x03: /* SRA */
+         *val = (int32_t)op0 >> shift;
+         return true;
+      case 0x20: /* ADD */
+      case 0x21: /* ADDU */
+         /* If ADD overflows the target isn't written but we don't
+            fall through either */
+         *val = op0 + op1;
+         return true;
+      case 0x22: /* SUB */
+      case 0x23: /* SUBU */
+         *val = op0 - op1;
+         return true;
+      case 0x24: /* AND */
+         *val = op0 & op1;
+         return true;
+      case 0x25: /* OR */
+         *val = op0 | op1;
+         return true;
+      case 0x26: /* XOR */
+         *val = op0 ^ op1;
+         return true;
+      case 0x27: /* NOR */
+         *val = ~(op0 | op1);
+         return true;
+      default:
+         return false;
+      }
+   case 0x08: /* ADDI */
+   case 0x09: /* ADDIU */
+      *val = op0 + imm_se;
+      return true;
+   case 0x0c: /* ANDI */
+      *val = op0 & imm;
+      return true;
+   case 0x0d: /* ORI */
+      *val = op0 | imm;
+      return true;
+   case 0x0e: /* XORI */
+      *val = op0 ^ imm;
+      return true;
+   case 0x0f: /* LUI */
+      *val = ((uint32_t)imm) << 16;
+      return true;
+   default:
+      return false;
+   }
+}
+
+/* Update the known registers after `instruction` */
+static void const_update(struct dynarec_compiler *compiler,
+                         uint32_t instruction) {
+   enum PSX_REG reg_target;
+   enum PSX_REG reg_op0;
+   enum PSX_REG reg_op1;
+   uint32_t val;
+
+   dynarec_instruction_registers(instruction,
+                                 &reg_target,
+                                 &reg_op0,
+                                 &reg_op1);
+
+   if (reg_target == PSX_REG_R0 || reg_target >= 32) {
+      return;
+   }
+
+   if (const_eval(compiler, instruction, &val)) {
+      compiler->const_regs |= 1U << reg_target;
+      compiler->const_val[reg_target] = val;
+   } else {
+      compiler->const_regs &= ~(1U << reg_target);
+   }
+}
+
+/* Compute `const_forget` for `page`. When an instruction is the
+   target of a local branch the registers written between the branch
+   and its target might hold a different value when it's taken. The
+   instructions following a jump are only reached from elsewhere. */
+static void dynarec_const_prepare(struct dynarec_compiler *compiler,
+                                  const uint32_t *page) {
+   uint32_t written[DYNAREC_PAGE_INSTRUCTIONS];
+   unsigned i;
+
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
       enum PSX_REG reg_target;
       enum PSX_REG reg_op0;
       enum PSX_REG reg_op1;
-      enum delay_slot delay_slot;
-      uint8_t *instruction_start;
-      unsigned cycles;
-      uint32_t ds_instruction;
-
-      DYNAREC_LOG("Compiling 0x%08x\n", instruction);
-
-      delay_slot =
-         dynarec_instruction_registers(instruction,
-                                       &reg_target,
-                                       &reg_op0,
-                                       &reg_op1);
-
-      instruction_start = compiler.map;
-      compiler.dynarec_instructions[i] = instruction_start;
-
-      /* For now I assume every instruction takes exactly 5 cycles to
-         execute. It's a pretty decent average but obviously in practice
-         it varies a lot depending on the instruction, the icache, memory
-         latency etc... */
-      cycles = 5;
-
-      if (i + 1 < DYNAREC_PAGE_INSTRUCTIONS) {
-         ds_instruction = emulated_page[i + 1];
+
+      dynarec_instruction_registers(page[i], &reg_target, &reg_op0, &reg_op1);
+
+      if (reg_target != PSX_REG_R0 && reg_target < 32) {
+         written[i] = 1U << reg_target;
+      } else {
+         written[i] = 0;
+      }
+
+      compiler->const_forget[i] = 0;
+   }
+
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
+      uint32_t op = page[i] >> 26;
+      int32_t target = local_branch_target(page[i], compiler->pc + i * 4);
+      uint32_t mask = 0;
+      unsigned first;
+      unsigned last;
+      unsigned j;
+
+      if (i + 2 < DYNAREC_PAGE_INSTRUCTIONS &&
+          (op == 0x02 || op == 0x03 ||
+           (op == 0x00 && ((page[i] & 0x3e) == 0x08)))) {
+         /* J, JAL, JR and JALR */
+         compiler->const_forget[i + 2] = ~0U;
+      }
+
+      if (target < 0) {
+         continue;
+      }
+
+      if ((unsigned)target <= i) {
+         /* Loop, including the delay slot */
+         first = target;
+         last = i + 1;
       } else {
-         ds_instruction = next_page[0];
-      }
-
-      if (delay_slot == LOAD_DELAY_SLOT &&
-          reg_target != PSX_REG_R0 &&
-          ds_instruction != 0) {
-         /* We have to check if the next instruction references the
-            load target */
-         enum delay_slot ds_delay_slot;
-         enum PSX_REG ds_target;
-         enum PSX_REG ds_op0;
-         enum PSX_REG ds_op1;
-
-         ds_delay_slot =
-            dynarec_instruction_registers(ds_instruction,
-                                          &ds_target,
-                                          &ds_op0,
-                                          &ds_op1);
-
-         if (ds_target == reg_target) {
-            /* The instruction in the delay slot overwrites the value,
-               effectively making the LW useless (or only useful for
-               side-effect). Seems odd but easy enough to implement,
-               we can just pretend that this load just targets R0
-               since it's functionally equivalent. */
-            reg_target = PSX_REG_R0;
-         } else if (reg_target == ds_op0 || reg_target == ds_op1) {
-            /* That's a bit trickier, we need to make sure that the
-               previous value of `reg_target` is used in the load
-               delay. The only way to have this work in all cases
-               (consider if we have a branch in the delay slot for
-               instance) */
-
-            if (ds_delay_slot != NO_DELAY) {
-               /* If the instruction in the delay slot is a branch we
-                  can't reorder (otherwise we'll jump away before we
-                  have a chance to execute the load). If this needs
-                  implementing we'll have to be clever. */
-               DYNAREC_FATAL("Nested delay slot in load delay slot\n");
-            } else {
-               /* We can simply swap the order of the instructions
-                  (while keeping the old value in a temporary register,
-                  like branch delay slots). We need to be careful however
-                  if the load references the target as operand. */
-               int needs_dt = 0;
-
-               if (reg_op0 == ds_target) {
-                  needs_dt = 1;
-                  reg_op0 = PSX_REG_DT;
-               }
-
-               if (reg_op1 == ds_target) {
-                  needs_dt = 1;
-                  reg_op1 = PSX_REG_DT;
-               }
-
-               if (needs_dt) {
-                  /* The instruction in the delay slot targets a register
-                     used by the branch, we need to keep a copy. */
-                  dynasm_emit_mov(&compiler, PSX_REG_DT, ds_target);
-
-                  /* Emit instruction in load delay slot */
-                  compiler.pc += 4;
-                  dynarec_emit_instruction(&compiler, ds_instruction,
-                                           ds_target, ds_op0, ds_op1);
-                  compiler.pc -= 4;
-
-                  /* Emit load instruction */
-                  dynarec_emit_instruction(&compiler, instruction,
-                                           reg_target, reg_op0, reg_op1);
-
-                  /* Then we want to step over the instruction in the
-                     delay slot that's going to be emitted next since
-                     we've already executed it here. */
-                  emit_skip_next_instruction(&compiler);
-               }
-               dynasm_counter_maintenance(&compiler, cycles * 2);
+         /* Forward branch, skipping over the instructions following
+            the delay slot */
+         first = i + 2;
+         last = target - 1;
+      }
+
+      for (j = first; j <= last && j < DYNAREC_PAGE_INSTRUCTIONS; j++) {
+         mask |= written[j];
+      }
+
+      compiler->const_forget[target] |= mask;
+   }
+}
+
+/* If `instruction` can be part of an idle loop returns the width of
+   its memory access (0 if it doesn't access memory), otherwise
+   returns -1. That's loads and ALU operations that can't raise an
+   exception, anything else has side effects. */
+static int idle_loop_access(uint32_t instruction) {
+   switch (instruction >> 26) {
+   case 0x00:
+      switch (instruction & 0x3f) {
+      case 0x00: /* SLL */
+      case 0x02: /* SRL */
+      case 0x03: /* SRA */
+      case 0x04: /* SLLV */
+      case 0x06: /* SRLV */
+      case 0x07: /* SRAV */
+      case 0x21: /* ADDU */
+      case 0x23: /* SUBU */
+      case 0x24: /* AND */
+      case 0x25: /* OR */
+      case 0x26: /* XOR */
+      case 0x27: /* NOR */
+      case 0x2a: /* SLT */
+      case 0x2b: /* SLTU */
+         return 0;
+      default:
+         return -1;
+      }
+   case 0x09: /* ADDIU */
+   case 0x0a: /* SLTI */
+   case 0x0b: /* SLTIU */
+   case 0x0c: /* ANDI */
+   case 0x0d: /* ORI */
+   case 0x0e: /* XORI */
+   case 0x0f: /* LUI */
+      return 0;
+   case 0x20: /* LB */
+   case 0x24: /* LBU */
+      return 1;
+   case 0x21: /* LH */
+   case 0x25: /* LHU */
+      return 2;
+   case 0x23: /* LW */
+      return 4;
+   default:
+      return -1;
+   }
+}
+
+/* Returns true if reading `addr` can only return a different value
+   after an event: RAM, scratchpad and BIOS, which are only modified
+   by the CPU and DMA, and the IRQ and GPU status registers */
+static bool idle_loop_address(uint32_t addr, unsigned width) {
+   if ((addr & (width - 1)) || addr >= 0xc0000000) {
+      /* Unaligned or KSEG2 */
+      return false;
+   }
+
+   addr &= 0x1fffffff;
+
+   return addr < PSX_RAM_SIZE * 4 ||
+      (addr >= PSX_SCRATCHPAD_BASE &&
+       addr < PSX_SCRATCHPAD_BASE + PSX_SCRATCHPAD_SIZE) ||
+      (addr >= PSX_BIOS_BASE && addr < PSX_BIOS_BASE + PSX_BIOS_SIZE) ||
+      /* I_STAT, I_MASK */
+      (addr >= 0x1f801070 && addr < 0x1f801078) ||
+      /* GPUSTAT */
+      (addr >= 0x1f801814 && addr < 0x1f801818);
+}
+
+bool dynarec_idle_loop_check(const uint32_t *page,
+                             uint32_t pc,
+                             const uint32_t *regs) {
+   const uint32_t branch = (pc % DYNAREC_PAGE_SIZE) >> 2;
+   const uint32_t instruction = page[branch];
+   /* Registers written by the loop */
+   uint32_t written = 0;
+   /* Registers written by the loads in the loop */
+   uint32_t loaded = 0;
+   /* Registers already written in the current iteration */
+   uint32_t done = 0;
+   /* Load waiting for its delay slot */
+   uint32_t pending = 0;
+   int32_t start;
+   uint32_t i;
+
+   switch (instruction >> 26) {
+   case 0x01: /* BGEZ, BLTZ, BGEZAL, BLTZAL */
+      if ((instruction >> 16) & 0x10) {
+         /* Link */
+         return false;
+      }
+      break;
+   case 0x02: /* J */
+   case 0x04: /* BEQ */
+   case 0x05: /* BNE */
+   case 0x06: /* BLEZ */
+   case 0x07: /* BGTZ */
+      break;
+   default:
+      return false;
+   }
+
+   start = local_loop_start(instruction, pc);
+
+   if (start < 0 ||
+       branch + 1 >= DYNAREC_PAGE_INSTRUCTIONS ||
+       branch + 2 - start > DYNAREC_IDLE_LOOP_MAX) {
+      return false;
+   }
+
+   for (i = start; i <= branch + 1; i++) {
+      enum PSX_REG target;
+      enum PSX_REG op0;
+      enum PSX_REG op1;
+      int width;
+
+      if (i == branch) {
+         continue;
+      }
+
+      width = idle_loop_access(page[i]);
+      if (width < 0) {
+         return false;
+      }
+
+      dynarec_instruction_registers(page[i], &target, &op0, &op1);
+
+      written |= 1U << target;
+      if (width > 0) {
+         loaded |= 1U << target;
+      }
+   }
+
+   written &= ~1U;
+
+   /* Walk one iteration in order. A register written by the loop
+      must not be read before it's written, otherwise its value
+      depends on the previous iteration. Loaded values only become
+      visible after the load delay slot. */
+   for (i = start; i <= branch + 1; i++) {
+      enum PSX_REG target;
+      enum PSX_REG op0;
+      enum PSX_REG op1;
+      int width;
+
+      dynarec_instruction_registers(page[i], &target, &op0, &op1);
+
+      if (((1U << op0) | (1U << op1)) & written & ~done) {
+         return false;
+      }
+
+      done |= pending;
+      pending = 0;
+
+      if (i == branch) {
+         continue;
+      }
+
+      width = idle_loop_access(page[i]);
+
+      if (width > 0) {
+         /* The address must be the same for every iteration, which
+            wouldn't be the case for pointers loaded by the loop */
+         if (loaded & (1U << op0)) {
+            return false;
+         }
+
+         if (regs != NULL) {
+            uint32_t addr = op0 ? regs[op0 - 1] : 0;
+
+            addr += (int16_t)(page[i] & 0xffff);
+
+            if (!idle_loop_address(addr, width)) {
+               return false;
             }
-         } else {
-            /* We don't have any hazard, we can emit the load */
-            dynasm_counter_maintenance(&compiler, cycles);
-            dynarec_emit_instruction(&compiler, instruction,
-                                     reg_target, reg_op0, reg_op1);
          }
+      }
 
-      } else if (delay_slot == BRANCH_DELAY_SLOT &&
-                 /* Special case a NOP in the delay slot since it's
-                    fairly common. A branch with a NOP in the delay
-                    slot behaves like a common instruction. */
-                 ds_instruction != 0) {
-         /* We have to run the delay slot before the actual
-          * jump. First let's make sure that we don't have a data
-          * hazard.
-          */
-         enum PSX_REG ds_target;
-         enum PSX_REG ds_op0;
-         enum PSX_REG ds_op1;
-         enum delay_slot ds_delay_slot;
-         int needs_dt = 0;
-
-         ds_delay_slot =
-            dynarec_instruction_registers(ds_instruction,
-                                          &ds_target,
-                                          &ds_op0,
-                                          &ds_op1);
-
-         if (ds_delay_slot == BRANCH_DELAY_SLOT) {
-            /* This would be a pain to implement. Let's not the
-               average game doesn't require something like that. */
-            dynasm_emit_exception(&compiler, PSX_DYNAREC_UNIMPLEMENTED);
-         } else if (ds_delay_slot == LOAD_DELAY_SLOT) {
-            /* This is technically inaccurate but probably fine the
-               vast majority of the time (relying on load delay slot
-               behaviour across a jump sounds nasty, but who
-               knows). Remove after running more tests. */
-            dynasm_emit_exception(&compiler, PSX_DYNAREC_UNIMPLEMENTED);
+      if (target != PSX_REG_R0) {
+         if (done & (1U << target)) {
+            /* Written twice */
+            return false;
          }
 
-         if (ds_target != 0) {
-            /* Check for data hazard */
-            if (ds_target == reg_target) {
-               DYNAREC_FATAL("Register race on branch target\n");
-            }
+         if (width > 0) {
+            pending = 1U << target;
+         } else {
+            done |= 1U << target;
+         }
+      }
+   }
 
-            if (ds_target == reg_op0) {
-               needs_dt = 1;
-               reg_op0 = PSX_REG_DT;
-            }
+   return true;
+}
 
-            if (ds_target == reg_op1) {
-               needs_dt = 1;
-               reg_op0 = PSX_REG_DT;
-            }
+/* Store in `loops` the number of local loops each instruction of
+   `page` is part of */
+static void dynarec_loop_depth(struct dynarec_compiler *compiler,
+                               const uint32_t *page,
+                               int32_t *loops) {
+   int32_t loop_delta[DYNAREC_PAGE_INSTRUCTIONS + 2] = { 0 };
+   int32_t depth = 0;
+   unsigned i;
+
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
+      int32_t start = local_loop_start(page[i], compiler->pc + i * 4);
+
+      if (start >= 0) {
+         /* The loop includes the branch delay slot */
+         loop_delta[start]++;
+         loop_delta[i + 2]--;
+      }
+   }
 
-            if (needs_dt) {
-               /* The instruction in the delay slot targets a register
-                  used by the branch, we need to keep a copy. */
-               dynasm_emit_mov(&compiler, PSX_REG_DT, ds_target);
-            }
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
+      depth += loop_delta[i];
+      loops[i] = depth;
+   }
+}
+
+/* Estimate how many cycles `instruction` takes in the interpreter.
+   Timings that depend on the state of the emulator (device accesses,
+   GTE stalls) are accounted for at runtime by the emulator itself. */
+static uint32_t instruction_cycles(uint32_t instruction,
+                                   bool bios,
+                                   bool in_loop) {
+   uint32_t cycles = 1;
+
+   if (bios) {
+      /* The BIOS is usually run uncached */
+      cycles += 4;
+   } else if (!in_loop) {
+      /* Instruction cache line fills, amortized. Local loops are
+         assumed to run from the cache. */
+      cycles += 1;
+   }
+
+   switch (instruction >> 26) {
+   case 0x00:
+      switch (instruction & 0x3f) {
+      case 0x18: /* MULT */
+      case 0x19: /* MULTU */
+         /* Average latency, the interpreter only stalls if the
+            result is read early but it usually is */
+         cycles += 6;
+         break;
+      case 0x1a: /* DIV */
+      case 0x1b: /* DIVU */
+         cycles += 35;
+         break;
+      }
+      break;
+   case 0x20: /* LB */
+   case 0x21: /* LH */
+   case 0x22: /* LWL */
+   case 0x23: /* LW */
+   case 0x24: /* LBU */
+   case 0x25: /* LHU */
+   case 0x26: /* LWR */
+      /* Memory read latency, minus what's absorbed by the following
+         instructions */
+      cycles += 2;
+      break;
+   }
+
+   return cycles;
+}
+
+/* Compute the estimated cost of each instruction of `page`, see
+   `instruction_cycles` */
+static void dynarec_cycles_prepare(struct dynarec_compiler *compiler,
+                                   const uint32_t *page,
+                                   uint32_t next_page_instruction) {
+   const bool bios = compiler->page_index >= DYNAREC_RAM_PAGES;
+   int32_t loops[DYNAREC_PAGE_INSTRUCTIONS];
+   unsigned i;
+
+   dynarec_loop_depth(compiler, page, loops);
+
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
+      compiler->cycles[i] = instruction_cycles(page[i], bios, loops[i] > 0);
+   }
+
+   /* Only used for delay slots at the end of the page */
+   compiler->cycles[i] = instruction_cycles(next_page_instruction,
+                                            bios,
+                                            false);
+}
+
+/* Pick the PSX registers that are going to be kept in host registers
+   for the whole page. Every instruction in a page can be the target
+   of a jump from outside so a register allocated here lives from the
+   start to the end of the page, there's no point in computing finer
+   live ranges. Instead we do a single linear pass over the page to
+   count how often each register is referenced (references within
+   local loops weigh more) and keep the most used ones. */
+static void dynarec_allocate_registers(struct dynarec_compiler *compiler,
+                                       const uint32_t *page) {
+   int32_t loops[DYNAREC_PAGE_INSTRUCTIONS];
+   uint32_t weight[32] = { 0 };
+   unsigned i;
+   unsigned slot;
+
+   for (i = 0; i < 32; i++) {
+      compiler->reg_slot[i] = -1;
+   }
+
+   dynarec_loop_depth(compiler, page, loops);
+
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
+      enum PSX_REG regs[3];
+      uint32_t w;
+      unsigned r;
+
+      w = loops[i] > 0 ? 8 : 1;
+
+      dynarec_instruction_registers(page[i], &regs[0], &regs[1], &regs[2]);
+
+      for (r = 0; r < 3; r++) {
+         if (regs[r] != PSX_REG_R0 && regs[r] < 32) {
+            weight[regs[r]] += w;
          }
+      }
+   }
 
-         dynasm_counter_maintenance(&compiler, cycles * 2);
+   for (slot = 0; slot < DYNAREC_ALLOCATABLE_REGS; slot++) {
+      uint32_t best_weight = 0;
+      unsigned best = 0;
 
-         /* Emit instruction in branch delay slot */
-         compiler.pc += 4;
-         dynarec_emit_instruction(&compiler, ds_instruction,
-                                  ds_target, ds_op0, ds_op1);
-         compiler.pc -= 4;
+      for (i = 1; i < 32; i++) {
+         if (compiler->reg_slot[i] < 0 && weight[i] > best_weight) {
+            best = i;
+            best_weight = weight[i];
+         }
+      }
+
+      if (best == 0) {
+         /* The rest of the registers are not referenced at all */
+         break;
+      }
 
-         /* Emit branch instruction */
-         dynarec_emit_instruction(&compiler, instruction,
-                                  reg_target, reg_op0, reg_op1);
+      compiler->reg_slot[best] = slot;
+   }
+}
 
-         /* In case this is a conditional branch we want to jump over
-            the delay slot if it's not taken (otherwise we'll execute
-            the instruction twice). */
-         emit_skip_next_instruction(&compiler);
-      } else {
-         /* Boring old instruction, no delay slot involved. */
-         dynasm_counter_maintenance(&compiler, cycles);
-         dynarec_emit_instruction(&compiler, instruction,
-                                  reg_target, reg_op0, reg_op1);
+/* Returns the emulated instructions of page `page_index` */
+const uint32_t *dynarec_page_code(struct dynarec_state *state,
+                                  uint32_t page_index) {
+   if (page_index < DYNAREC_RAM_PAGES) {
+      return state->ram + DYNAREC_PAGE_INSTRUCTIONS * page_index;
+   } else {
+      uint32_t bios_index = page_index - DYNAREC_RAM_PAGES;
+
+      return state->bios + DYNAREC_PAGE_INSTRUCTIONS * bios_index;
+   }
+}
+
+/* The counter is only updated at the end of each block, so an
+   instruction reached by falling through from the previous one has
+   `entry_cycles` not accounted for yet. Jumping to it from elsewhere
+   must go through a stub giving these cycles back first. Must be
+   called before the local jumps are resolved. */
+static void emit_entry_stubs(struct dynarec_compiler *compiler) {
+   unsigned i;
+
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
+      uint8_t *stub;
+
+      if (compiler->entry_cycles[i] == 0) {
+         continue;
       }
 
-      assert(compiler.map - instruction_start <= DYNAREC_INSTRUCTION_MAX_LEN);
+      stub = compiler->map;
+      dynasm_counter_maintenance(compiler,
+                                 -(int32_t)compiler->entry_cycles[i]);
+      dynasm_emit_page_local_jump(compiler,
+                                  compiler->dynarec_instructions[i] -
+                                  compiler->map,
+                                  false,
+                                  DYNAREC_JUMP_ALWAYS);
+      compiler->dynarec_instructions[i] = stub;
+   }
+}
+
+/* Returns the first instruction following page `page_index` */
+uint32_t dynarec_page_next_instruction(struct dynarec_state *state,
+                                       uint32_t page_index) {
+   uint32_t next_index;
 
-      printf("Emited:");
-      for (; instruction_start != compiler.map; instruction_start++) {
-         printf(" %02x", *instruction_start);
+   /* XXX This is not accurate if we're at the very end of the last
+      mirror of memory or of the BIOS. Not that I expect that it
+      matters much. */
+   if (page_index < DYNAREC_RAM_PAGES) {
+      next_index = (page_index + 1) % DYNAREC_RAM_PAGES;
+   } else {
+      next_index = page_index + 1;
+      if (next_index == DYNAREC_TOTAL_PAGES) {
+         next_index = DYNAREC_RAM_PAGES;
       }
-      printf("\n");
+   }
+
+   return dynarec_page_code(state, next_index)[0];
+}
+
+uint32_t dynarec_compile_page(struct dynarec_state *state,
+                              uint32_t page_index,
+                              const uint32_t *emulated_page,
+                              uint32_t next_page_instruction) {
+   struct dynarec_compiler  compiler = { 0 };
+   uint32_t                 code_len;
+   unsigned                 i;
 
-#if 1
-      {
-         int fd = open("/tmp/dump.amd64", O_WRONLY | O_CREAT| O_TRUNC, 0644);
+   code_len = dynarec_cache_load(state,
+                                 page_index,
+                                 emulated_page,
+                                 next_page_instruction);
+   if (code_len > 0) {
+      DYNAREC_LOG("Page %u loaded from the cache\n", page_index);
+      return code_len;
+   }
+
+   compiler.state = state;
+   compiler.page_index = page_index;
+   compiler.local_patch_len = 0;
+   compiler.map = dynarec_page_start(state, page_index);
+   compiler.page_start = compiler.map;
+   compiler.emulated_page = emulated_page;
+   compiler.pending_load_reg = PSX_REG_R0;
+
+   if (page_index < DYNAREC_RAM_PAGES) {
+      compiler.pc = DYNAREC_PAGE_SIZE * page_index;
+   } else {
+      compiler.pc = PSX_BIOS_BASE +
+         DYNAREC_PAGE_SIZE * (page_index - DYNAREC_RAM_PAGES);
+   }
+
+   dynarec_allocate_registers(&compiler, emulated_page);
+   dynarec_const_prepare(&compiler, emulated_page);
+   dynarec_cycles_prepare(&compiler, emulated_page, next_page_instruction);
 
-         write(fd, page_start, compiler.map - page_start);
+   /* Code shared by the whole page, it must be at the very start
+      since that's where dynarec_run enters the page */
+   dynasm_emit_page_prologue(&compiler);
 
-         close(fd);
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++, compiler.pc += 4) {
+      uint8_t *instruction_start = compiler.map;
+      bool last = (i + 1 == DYNAREC_PAGE_INSTRUCTIONS);
+      uint32_t next_instruction;
+
+      if (last) {
+         next_instruction = next_page_instruction;
+      } else {
+         next_instruction = emulated_page[i + 1];
       }
-#endif
+
+      compiler.const_regs &= ~compiler.const_forget[i];
+
+      dynarec_compile_instruction(&compiler,
+                                  emulated_page[i],
+                                  next_instruction,
+                                  last);
+
+      const_update(&compiler, emulated_page[i]);
+
+      assert(compiler.map - instruction_start +
+             DYNAREC_ENTRY_STUB_MAX_LEN <= DYNAREC_INSTRUCTION_MAX_LEN);
    }
 
+   /* If the last instruction in the page doesn't jump away we end up
+      here, return to dynarec_run to continue in the next page. We
+      also need an exit for the second instruction of the next page
+      in case of a conditional branch in the last instruction of this
+      one, the not-taken path has to skip the delay slot. Local jumps
+      to the exits have already updated the counter. */
+   dynarec_flush_cycles(&compiler);
+   compiler.page_exit[0] = compiler.map;
+   emit_page_exit(&compiler, compiler.pc);
+   compiler.page_exit[1] = compiler.map;
+   emit_page_exit(&compiler, compiler.pc + 4);
+
+   /* Rewind the PC for `page_local_index` */
+   compiler.pc -= DYNAREC_PAGE_SIZE;
+
+   emit_entry_stubs(&compiler);
+
+   code_len = compiler.map - compiler.page_start;
+
    resolve_local_patches(&compiler);
+
+   for (i = 0; i < DYNAREC_PAGE_INSTRUCTIONS; i++) {
+      state->page_instructions[page_index][i] =
+         compiler.dynarec_instructions[i] - compiler.page_start;
+   }
+
+   dynarec_cache_store(&compiler,
+                       emulated_page,
+                       next_page_instruction,
+                       code_len);
+
+   return code_len;
+}
+
+/* Forget the current code of page `page_index` before it's
+   recompiled */
+void dynarec_retire_page(struct dynarec_state *state,
+                         uint32_t page_index) {
+   state->page_valid[page_index] = 0;
+
+   /* The jumps into this page are about to become invalid and the
+      ones going out of it are going to be overwritten */
+   dynarec_unlink_page(state, page_index);
+   state->page_generation[page_index]++;
+}
+
+int dynarec_recompile(struct dynarec_state *state,
+                      uint32_t page_index) {
+   uint32_t code_len;
+
+   DYNAREC_LOG("Recompiling page %u\n", page_index);
+
+   dynarec_retire_page(state, page_index);
+
+   if (dynarec_arena_alloc(state, page_index) < 0) {
+      return -1;
+   }
+
+   code_len =
+      dynarec_compile_page(state,
+                           page_index,
+                           dynarec_page_code(state, page_index),
+                           dynarec_page_next_instruction(state, page_index));
+
+   dynarec_arena_trim(state, page_index, code_len);
+
    state->page_valid[page_index] = 1;
    return 0;
 }
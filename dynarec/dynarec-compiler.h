@@ -45,6 +45,17 @@ enum PSX_REG {
    /* Dynarec temporary: not a real hardware register, used by the
       dynarec when it needs to reorder code for delay slots. */
    PSX_REG_DT = 32,
+   /* Multiplication/division result registers. They're not general
+      purpose but it's convenient to handle them the same way. */
+   PSX_REG_HI = DYNAREC_REG_HI,
+   PSX_REG_LO = DYNAREC_REG_LO,
+   /* Load delay temporaries: when the instruction following a load
+      references the load's target the value is first loaded in one
+      of these and only moved to the real target register after the
+      next instruction has executed. We need two of them in case of
+      back-to-back loads. */
+   PSX_REG_LT0 = 35,
+   PSX_REG_LT1 = 36,
 };
 
 /* Coprocessor 0 registers (accessed with mtc0/mfc0) */
@@ -84,8 +95,23 @@ enum PSX_CPU_EXCEPTION {
     PSX_COPROCESSOR_ERROR = 0xb,
     /// Arithmetic overflow
     PSX_OVERFLOW = 0xc,
-    /// Fake exception for dynarec use
-    PSX_DYNAREC_UNIMPLEMENTED = 0xdead,
+};
+
+/* Conditions for dynasm_emit_branch_cond */
+enum PSX_BRANCH_COND {
+   PSX_BRANCH_EQ,   /* op0 == op1 */
+   PSX_BRANCH_NE,   /* op0 != op1 */
+   PSX_BRANCH_LEZ,  /* (int32_t)op0 <= 0 */
+   PSX_BRANCH_GTZ,  /* (int32_t)op0 > 0 */
+   PSX_BRANCH_LTZ,  /* (int32_t)op0 < 0 */
+   PSX_BRANCH_GEZ,  /* (int32_t)op0 >= 0 */
+};
+
+/* Conditions for page-local jumps */
+enum DYNAREC_JUMP_COND {
+   DYNAREC_JUMP_ALWAYS,
+   /* Only jump if PSX_REG_DT is 0 */
+   DYNAREC_JUMP_DT_CLEAR,
 };
 
 
@@ -98,10 +124,34 @@ enum PSX_CPU_EXCEPTION {
 struct dynarec_page_local_patch {
    /* Location of the instruction that needs patching */
    uint8_t *patch_loc;
-   /* Address of the target PSX instruction */
-   uint32_t target;
+   /* Index of the target instruction within the page. May point one
+      or two instructions past the end of the page, see
+      `dynarec_compiler.page_exit` */
+   uint32_t target_index;
+   /* Condition of the jump */
+   enum DYNAREC_JUMP_COND cond;
 };
 
+/* Maximum number of local patches in a page: a conditional branch
+   needs two. */
+#define DYNAREC_MAX_LOCAL_PATCHES (DYNAREC_PAGE_INSTRUCTIONS * 2)
+
+/* Reference from the recompiled code to something outside of the map
+   (helpers, callbacks). They're recorded so that pages loaded from
+   the translation cache can be fixed up, see `dynasm_relocate`. */
+struct dynarec_reloc {
+   /* Offset of the reference from the start of the page */
+   uint32_t offset;
+   /* Backend-specific encoding of the reference */
+   uint32_t kind;
+   /* Address of the target relative to `dynasm_execute` */
+   int64_t  target;
+};
+
+/* Maximum number of relocations in a page. Pages with more than that
+   aren't cached. */
+#define DYNAREC_MAX_RELOCS (DYNAREC_PAGE_INSTRUCTIONS * 4)
+
 /* Structure holding the temporary variables during the recompilation
    sequence */
 struct dynarec_compiler {
@@ -115,11 +165,64 @@ struct dynarec_compiler {
    uint32_t page_index;
    /* Number of entries in local_patch */
    uint32_t local_patch_len;
-   /* Pointer towards the dynarec's `dynarec_instruction` array for
-      the current page */
-   void   **dynarec_instructions;
+   /* Address of each instruction's code, copied to the page's
+      `page_instructions` once we're done */
+   uint8_t *dynarec_instructions[DYNAREC_PAGE_INSTRUCTIONS];
+   /* Code returning to dynarec_run with the PC set to the first and
+      second instruction of the next page. Used as targets for local
+      jumps that fall through the end of the page. */
+   uint8_t *page_exit[2];
+   /* True if we're currently emitting the instruction in a branch
+      delay slot */
+   bool     in_delay_slot;
+   /* Register whose value is currently held in `pending_load_tmp`
+      because of a load delay. PSX_REG_R0 if no load is pending. */
+   uint8_t  pending_load_reg;
+   /* PSX_REG_LT0 or PSX_REG_LT1 */
+   uint8_t  pending_load_tmp;
+   /* Host register slot allocated to each general purpose register
+      for the whole page (between 0 and DYNAREC_ALLOCATABLE_REGS - 1)
+      or -1 if the register lives in `dynarec_state.regs`. See
+      `dynarec_allocate_registers`. */
+   int8_t   reg_slot[32];
+   /* Registers whose value is known when the current instruction is
+      reached by falling through from the previous one (bit n for
+      register n) and their values, see `dynarec_known_reg` */
+   uint32_t const_regs;
+   uint32_t const_val[32];
+   /* Registers whose value can't be known anymore when reaching each
+      instruction of the page because it's the target of a local
+      branch or follows a jump */
+   uint32_t const_forget[DYNAREC_PAGE_INSTRUCTIONS];
+   /* Estimated cost of each instruction of the page in CPU cycles,
+      followed by the first instruction of the next page. See
+      `dynarec_cycles_prepare`. */
+   uint8_t  cycles[DYNAREC_PAGE_INSTRUCTIONS + 1];
+   /* Cycles of the instructions emitted since the last time the
+      counter was updated, see `dynarec_flush_cycles` */
+   uint32_t pending_cycles;
+   /* Value of `pending_cycles` when reaching each instruction by
+      falling through from the previous one. Jumping directly to the
+      instruction must give them back. */
+   uint32_t entry_cycles[DYNAREC_PAGE_INSTRUCTIONS];
+   /* Code shared by the whole page, emitted by
+      `dynasm_emit_page_prologue`. Their meaning is up to the
+      backend. */
+   uint8_t *stub_exit;
+   uint8_t *stub_exit_abs;
+   uint8_t *stub_exception;
+   uint8_t *stub_cop;
+   uint8_t *stub_idle;
+   /* Start of the page's code */
+   uint8_t *page_start;
+   /* The emulated instructions being recompiled */
+   const uint32_t *emulated_page;
    /* Contains offset of instructions that need patching */
-   struct dynarec_page_local_patch local_patch[DYNAREC_PAGE_INSTRUCTIONS];
+   struct dynarec_page_local_patch local_patch[DYNAREC_MAX_LOCAL_PATCHES];
+   /* Number of entries in `relocs`, DYNAREC_MAX_RELOCS + 1 if it
+      overflowed */
+   uint32_t reloc_len;
+   struct dynarec_reloc relocs[DYNAREC_MAX_RELOCS];
 };
 
 typedef void (*dynarec_fn_t)(void);
@@ -127,14 +230,100 @@ typedef void (*dynarec_fn_t)(void);
 
 extern int dynarec_recompile(struct dynarec_state *state,
                              uint32_t page_index);
+/* Emit the code of page `page_index` for the instructions in
+   `emulated_page` in the page's allocation (see
+   `dynarec_arena_alloc`). `next_page_instruction` is the first
+   instruction of the following page. Only the page's code and its
+   `page_instructions` entries are modified so this can run on another
+   thread while the page is invalid, see `dynarec_retire_page`.
+   Returns the length of the code. */
+extern uint32_t dynarec_compile_page(struct dynarec_state *state,
+                                     uint32_t page_index,
+                                     const uint32_t *emulated_page,
+                                     uint32_t next_page_instruction);
+extern void dynarec_retire_page(struct dynarec_state *state,
+                                uint32_t page_index);
+extern const uint32_t *dynarec_page_code(struct dynarec_state *state,
+                                         uint32_t page_index);
+extern uint32_t dynarec_page_next_instruction(struct dynarec_state *state,
+                                              uint32_t page_index);
+extern void dynarec_unlink_page(struct dynarec_state *state,
+                                uint32_t page_index);
+extern void dynarec_fast_sp_fault(struct dynarec_state *state,
+                                  uint32_t addr,
+                                  uint32_t pc);
+/* Record a reference to `target` from the code at `site`, for the
+   translation cache. `kind` is up to the backend. */
+extern void dynarec_add_reloc(struct dynarec_compiler *compiler,
+                              const uint8_t *site,
+                              uint32_t kind,
+                              const void *target);
+
+/* Returns true if the branch at `pc` (canonical) in `page` closes a
+   loop that can't observe anything until the next event, see
+   DESIGN.md. If `regs` is NULL only the instructions are checked,
+   otherwise the addresses of the loads are computed from `regs` and
+   must not target registers that can change on their own. */
+extern bool dynarec_idle_loop_check(const uint32_t *page,
+                                    uint32_t pc,
+                                    const uint32_t *regs);
+/* Called by the recompiled code when it takes the branch of an idle
+   loop candidate. Returns the updated counter. */
+extern int32_t dynarec_idle_loop(struct dynarec_state *state,
+                                 uint32_t pc,
+                                 int32_t counter);
+
+/* Returns true if the value of `reg` is known at the current
+   instruction and stores it in `val`. Except for R0 it's only valid
+   if the instruction is reached by falling through from the previous
+   one, the backend must check it at runtime since any instruction can
+   be entered from elsewhere. See DESIGN.md. */
+extern bool dynarec_known_reg(struct dynarec_compiler *compiler,
+                              enum PSX_REG reg,
+                              uint32_t *val);
+
+/* Subtract the pending cycles from the counter. Must be called
+   before leaving the page or calling code that looks at the
+   counter. */
+extern void dynarec_flush_cycles(struct dynarec_compiler *compiler);
+
+/* Code arena, see dynarec.c */
+extern int dynarec_arena_alloc(struct dynarec_state *state,
+                               uint32_t page_index);
+extern void dynarec_arena_trim(struct dynarec_state *state,
+                               uint32_t page_index,
+                               uint32_t code_len);
+extern void dynarec_arena_free(struct dynarec_state *state,
+                               uint32_t page_index);
+
+/* Translation cache, see dynarec-cache.c */
+extern void dynarec_cache_prune(const char *dir);
+extern uint32_t dynarec_cache_load(struct dynarec_state *state,
+                                   uint32_t page_index,
+                                   const uint32_t *emulated_page,
+                                   uint32_t next_page_instruction);
+extern void dynarec_cache_store(struct dynarec_compiler *compiler,
+                                const uint32_t *emulated_page,
+                                uint32_t next_page_instruction,
+                                uint32_t code_len);
 
 /* These methods are provided by the various architecture-dependent
    backends */
+/* Subtract `cycles` from the cycle counter. A negative value gives
+   cycles back. */
 extern void dynasm_counter_maintenance(struct dynarec_compiler *compiler,
-                                       unsigned cycles);
+                                       int32_t cycles);
+/* Run the recompiled code at `target`. `page_entry` is the start of
+   the page containing it. */
 extern int32_t dynasm_execute(struct dynarec_state *state,
+                              dynarec_fn_t page_entry,
                               dynarec_fn_t target,
                               int32_t counter);
+/* Emit the code at the start of the page. This is where the page is
+   entered from dynarec_run and linked jumps, it must load the
+   registers allocated for the page and jump to the target
+   instruction. */
+extern void dynasm_emit_page_prologue(struct dynarec_compiler *compiler);
 extern void dynasm_emit_exception(struct dynarec_compiler *compiler,
                                   enum PSX_CPU_EXCEPTION exception);
 extern void dynasm_emit_li(struct dynarec_compiler *compiler,
@@ -147,10 +336,26 @@ extern void dynasm_emit_sll(struct dynarec_compiler *compiler,
                             enum PSX_REG reg_target,
                             enum PSX_REG reg_op,
                             uint8_t shift);
+extern void dynasm_emit_srl(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            enum PSX_REG reg_op,
+                            uint8_t shift);
 extern void dynasm_emit_sra(struct dynarec_compiler *compiler,
                             enum PSX_REG reg_target,
                             enum PSX_REG reg_op,
                             uint8_t shift);
+extern void dynasm_emit_sllv(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg_target,
+                             enum PSX_REG reg_op0,
+                             enum PSX_REG reg_op1);
+extern void dynasm_emit_srlv(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg_target,
+                             enum PSX_REG reg_op0,
+                             enum PSX_REG reg_op1);
+extern void dynasm_emit_srav(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg_target,
+                             enum PSX_REG reg_op0,
+                             enum PSX_REG reg_op1);
 extern void dynasm_emit_addi(struct dynarec_compiler *compiler,
                              enum PSX_REG reg_t,
                              enum PSX_REG reg_s,
@@ -159,14 +364,38 @@ extern void dynasm_emit_addiu(struct dynarec_compiler *compiler,
                               enum PSX_REG reg_t,
                               enum PSX_REG reg_s,
                               uint32_t val);
+extern void dynasm_emit_add(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            enum PSX_REG reg_op0,
+                            enum PSX_REG reg_op1);
 extern void dynasm_emit_addu(struct dynarec_compiler *compiler,
                              enum PSX_REG reg_target,
                              enum PSX_REG reg_op0,
                              enum PSX_REG reg_op1);
+extern void dynasm_emit_sub(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            enum PSX_REG reg_op0,
+                            enum PSX_REG reg_op1);
+extern void dynasm_emit_subu(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg_target,
+                             enum PSX_REG reg_op0,
+                             enum PSX_REG reg_op1);
+extern void dynasm_emit_and(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            enum PSX_REG reg_op0,
+                            enum PSX_REG reg_op1);
 extern void dynasm_emit_or(struct dynarec_compiler *compiler,
                            enum PSX_REG reg_target,
                            enum PSX_REG reg_op0,
                            enum PSX_REG reg_op1);
+extern void dynasm_emit_xor(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            enum PSX_REG reg_op0,
+                            enum PSX_REG reg_op1);
+extern void dynasm_emit_nor(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            enum PSX_REG reg_op0,
+                            enum PSX_REG reg_op1);
 extern void dynasm_emit_ori(struct dynarec_compiler *compiler,
                             enum PSX_REG reg_t,
                             enum PSX_REG reg_s,
@@ -175,15 +404,39 @@ extern void dynasm_emit_andi(struct dynarec_compiler *compiler,
                              enum PSX_REG reg_t,
                              enum PSX_REG reg_s,
                              uint32_t val);
+extern void dynasm_emit_xori(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg_t,
+                             enum PSX_REG reg_s,
+                             uint32_t val);
+extern void dynasm_emit_slt(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            enum PSX_REG reg_op0,
+                            enum PSX_REG reg_op1);
 extern void dynasm_emit_sltu(struct dynarec_compiler *compiler,
                              enum PSX_REG reg_target,
                              enum PSX_REG reg_op0,
                              enum PSX_REG reg_op1);
+extern void dynasm_emit_slti(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg_t,
+                             enum PSX_REG reg_s,
+                             uint32_t val);
 extern void dynasm_emit_sltiu(struct dynarec_compiler *compiler,
                               enum PSX_REG reg_t,
                               enum PSX_REG reg_s,
                               uint32_t val);
-extern void dynasm_emit_sw(struct dynarec_compiler *compiler,
+extern void dynasm_emit_mult(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg_op0,
+                             enum PSX_REG reg_op1);
+extern void dynasm_emit_multu(struct dynarec_compiler *compiler,
+                              enum PSX_REG reg_op0,
+                              enum PSX_REG reg_op1);
+extern void dynasm_emit_div(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_op0,
+                            enum PSX_REG reg_op1);
+extern void dynasm_emit_divu(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg_op0,
+                             enum PSX_REG reg_op1);
+extern void dynasm_emit_sb(struct dynarec_compiler *compiler,
                            enum PSX_REG reg_addr,
                            int16_t offset,
                            enum PSX_REG reg_val);
@@ -191,20 +444,124 @@ extern void dynasm_emit_sh(struct dynarec_compiler *compiler,
                            enum PSX_REG reg_addr,
                            int16_t offset,
                            enum PSX_REG reg_val);
+extern void dynasm_emit_sw(struct dynarec_compiler *compiler,
+                           enum PSX_REG reg_addr,
+                           int16_t offset,
+                           enum PSX_REG reg_val);
+extern void dynasm_emit_swl(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_addr,
+                            int16_t offset,
+                            enum PSX_REG reg_val);
+extern void dynasm_emit_swr(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_addr,
+                            int16_t offset,
+                            enum PSX_REG reg_val);
+extern void dynasm_emit_lb(struct dynarec_compiler *compiler,
+                           enum PSX_REG reg_target,
+                           int16_t offset,
+                           enum PSX_REG reg_addr);
+extern void dynasm_emit_lbu(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            int16_t offset,
+                            enum PSX_REG reg_addr);
+extern void dynasm_emit_lh(struct dynarec_compiler *compiler,
+                           enum PSX_REG reg_target,
+                           int16_t offset,
+                           enum PSX_REG reg_addr);
+extern void dynasm_emit_lhu(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            int16_t offset,
+                            enum PSX_REG reg_addr);
 extern void dynasm_emit_lw(struct dynarec_compiler *compiler,
                            enum PSX_REG reg_target,
                            int16_t offset,
                            enum PSX_REG reg_addr);
+/* For LWL and LWR `reg_cur` contains the value that's merged with the
+   value loaded from memory. It's generally the same as `reg_target`
+   except when there's a pending load delay. */
+extern void dynasm_emit_lwl(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            int16_t offset,
+                            enum PSX_REG reg_addr,
+                            enum PSX_REG reg_cur);
+extern void dynasm_emit_lwr(struct dynarec_compiler *compiler,
+                            enum PSX_REG reg_target,
+                            int16_t offset,
+                            enum PSX_REG reg_addr,
+                            enum PSX_REG reg_cur);
+/* Call the emulator to execute a coprocessor instruction. `reg_op` is
+   the source register for MTCn/CTCn, the address register for
+   LWCn/SWCn (in which case the address offset is taken from the
+   instruction). `reg_target` receives the result of MFCn/CFCn. */
+extern void dynasm_emit_cop(struct dynarec_compiler *compiler,
+                            uint32_t instruction,
+                            enum PSX_REG reg_target,
+                            enum PSX_REG reg_op);
+/* Call the GTE directly for command `instruction`, MTC2/CTC2
+   (`reg_op` is the source register) or LWC2/SWC2 (`reg_op` is the
+   address register). Unlike `dynasm_emit_cop` nothing is spilled and
+   the emulator can't raise an exception, so the "coprocessor
+   unusable" check must be emitted separately. */
+extern void dynasm_emit_gte(struct dynarec_compiler *compiler,
+                            uint32_t instruction,
+                            enum PSX_REG reg_op);
+/* Same for MFC2/CFC2, the value is stored in `reg_target` */
+extern void dynasm_emit_gte_read(struct dynarec_compiler *compiler,
+                                 uint32_t instruction,
+                                 enum PSX_REG reg_target);
+/* Raise a "coprocessor unusable" exception if coprocessor `cop` is
+   disabled in SR */
+extern void dynasm_emit_cop_check(struct dynarec_compiler *compiler,
+                                  unsigned cop);
+/* Set PSX_REG_DT to 1 if the condition is true, 0 otherwise */
+extern void dynasm_emit_branch_cond(struct dynarec_compiler *compiler,
+                                    enum PSX_BRANCH_COND cond,
+                                    enum PSX_REG reg_op0,
+                                    enum PSX_REG reg_op1);
+/* Load `addr` (canonical) with the current region bits into
+   `reg_target` */
+extern void dynasm_emit_link(struct dynarec_compiler *compiler,
+                             enum PSX_REG reg_target,
+                             uint32_t addr);
+/* Return to dynarec_run with the PC set to `target` (canonical) */
+extern void dynasm_emit_exit(struct dynarec_compiler *compiler,
+                             uint32_t target);
+/* Same as dynasm_emit_exit but `target` is in another page and the
+   exit can be replaced by a direct jump using `dynasm_link`. It must
+   also return to dynarec_run if we've run out of cycles since a chain
+   of linked jumps can loop forever. */
+extern void dynasm_emit_linkable_exit(struct dynarec_compiler *compiler,
+                                      uint32_t target);
+/* Patch the linkable exit at `site` (the value stored in
+   `state->link_site`) to jump directly to `target` through the page
+   entry `page_entry` */
+extern void dynasm_link(uint8_t *site, void *page_entry, void *target);
+/* Revert a jump previously patched by `dynasm_link` */
+extern void dynasm_unlink(uint8_t *site);
+/* Return to dynarec_run with the PC set to the value of PSX_REG_DT */
+extern void dynasm_emit_exit_dt(struct dynarec_compiler *compiler);
+/* Call `dynarec_idle_loop` for the branch at `compiler->pc`, it
+   may consume cycles */
+extern void dynasm_emit_idle_loop(struct dynarec_compiler *compiler);
+/* Return to dynarec_run with the PC set to `target` if we've run out
+   of cycles */
+extern void dynasm_emit_counter_check(struct dynarec_compiler *compiler,
+                                      uint32_t target);
+/* Called by the SIGSEGV handler when the fastmem access at `*pc`
+   faults. Points `*pc` at the regular code for the access and, if
+   `patch` is true, patches the access to always go there. Returns
+   false if `*pc` isn't a fastmem access. Only needed if the backend
+   defines DYNAREC_HAVE_FASTMEM. */
+extern bool dynasm_fastmem_fault(uint8_t **pc, bool patch);
+/* Fix up the reference described by `reloc` in the page starting at
+   `page` for the current location of the target. Returns false if it
+   can't be encoded anymore. Only needed if the backend defines
+   DYNAREC_HAVE_CODE_CACHE. */
+extern bool dynasm_relocate(uint8_t *page,
+                            const struct dynarec_reloc *reloc);
 extern void dynasm_emit_page_local_jump(struct dynarec_compiler *compiler,
                                         int32_t offset,
-                                        bool placeholder);
-extern void dynasm_emit_mfhi(struct dynarec_compiler *compiler,
-                             enum PSX_REG ret_target);
-extern void dynasm_emit_mtlo(struct dynarec_compiler *compiler,
-                             enum PSX_REG ret_source);
-
-extern void dynasm_emit_mtc0(struct dynarec_compiler *compiler,
-                             enum PSX_REG reg_source,
-                             enum PSX_COP0_REG reg_cop0);
+                                        bool placeholder,
+                                        enum DYNAREC_JUMP_COND cond);
 
 #endif /* __DYNAREC_COMPILER_H__ */
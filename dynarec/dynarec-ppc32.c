@@ -148,17 +148,22 @@ static void save_psx_reg(struct dynarec_compiler* compiler,
 
 /*  TODO: ask what this is supposed to do */
 void dynasm_counter_maintenance(struct dynarec_compiler *compiler,
-                                unsigned cycles) {
+                                int32_t cycles) {
    PPC_UNIMPLEMENTED();
 }
 
 int32_t dynasm_execute(struct dynarec_state *state,
+                       dynarec_fn_t page_entry,
                        dynarec_fn_t target,
                        int32_t counter) {
    PPC_UNIMPLEMENTED();
    return 0;
 }
 
+void dynasm_emit_page_prologue(struct dynarec_compiler *compiler) {
+   PPC_UNIMPLEMENTED();
+}
+
 void dynasm_emit_exception(struct dynarec_compiler *compiler,
                            enum PSX_CPU_EXCEPTION exception) {
    PPC_UNIMPLEMENTED();
@@ -166,7 +171,8 @@ void dynasm_emit_exception(struct dynarec_compiler *compiler,
 
 void dynasm_emit_page_local_jump(struct dynarec_compiler *compiler,
                                  int32_t offset,
-                                 bool placeholder) {
+                                 bool placeholder,
+                                 enum DYNAREC_JUMP_COND cond) {
    PPC_UNIMPLEMENTED();
 }
 
@@ -416,17 +422,250 @@ void dynasm_emit_lw(struct dynarec_compiler *compiler,
    PPC_UNIMPLEMENTED();
 }
 
-void dynasm_emit_mfhi(struct dynarec_compiler *compiler,
-                             enum PSX_REG reg_target) {
+void dynasm_emit_srl(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op,
+                     uint8_t shift) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_sllv(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_srlv(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_srav(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_add(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_sub(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_subu(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_and(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_xor(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_nor(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_slt(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_xori(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_t,
+                      enum PSX_REG reg_s,
+                      uint32_t val) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_slti(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      enum PSX_REG reg_op,
+                      uint32_t val) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_mult(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_multu(struct dynarec_compiler *compiler,
+                       enum PSX_REG reg_op0,
+                       enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_div(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_op0,
+                     enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_divu(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_op0,
+                      enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_sb(struct dynarec_compiler *compiler,
+                    enum PSX_REG reg_addr,
+                    int16_t offset,
+                    enum PSX_REG reg_val) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_swl(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_addr,
+                     int16_t offset,
+                     enum PSX_REG reg_val) {
    PPC_UNIMPLEMENTED();
 }
-void dynasm_emit_mtlo(struct dynarec_compiler *compiler,
-                             enum PSX_REG ret_source) {
+
+void dynasm_emit_swr(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_addr,
+                     int16_t offset,
+                     enum PSX_REG reg_val) {
    PPC_UNIMPLEMENTED();
 }
 
-void dynasm_emit_mtc0(struct dynarec_compiler *compiler,
-                             enum PSX_REG reg_source,
-                             enum PSX_COP0_REG reg_cop0) {
+void dynasm_emit_lb(struct dynarec_compiler *compiler,
+                    enum PSX_REG reg_target,
+                    int16_t offset,
+                    enum PSX_REG reg_addr) {
    PPC_UNIMPLEMENTED();
-}
\ No newline at end of file
+}
+
+void dynasm_emit_lbu(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     int16_t offset,
+                     enum PSX_REG reg_addr) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_lh(struct dynarec_compiler *compiler,
+                    enum PSX_REG reg_target,
+                    int16_t offset,
+                    enum PSX_REG reg_addr) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_lhu(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     int16_t offset,
+                     enum PSX_REG reg_addr) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_lwl(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     int16_t offset,
+                     enum PSX_REG reg_addr,
+                     enum PSX_REG reg_cur) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_lwr(struct dynarec_compiler *compiler,
+                     enum PSX_REG reg_target,
+                     int16_t offset,
+                     enum PSX_REG reg_addr,
+                     enum PSX_REG reg_cur) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_cop(struct dynarec_compiler *compiler,
+                     uint32_t instruction,
+                     enum PSX_REG reg_target,
+                     enum PSX_REG reg_op) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_gte(struct dynarec_compiler *compiler,
+                     uint32_t instruction,
+                     enum PSX_REG reg_op) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_gte_read(struct dynarec_compiler *compiler,
+                          uint32_t instruction,
+                          enum PSX_REG reg_target) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_cop_check(struct dynarec_compiler *compiler,
+                           unsigned cop) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_branch_cond(struct dynarec_compiler *compiler,
+                             enum PSX_BRANCH_COND cond,
+                             enum PSX_REG reg_op0,
+                             enum PSX_REG reg_op1) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_link(struct dynarec_compiler *compiler,
+                      enum PSX_REG reg_target,
+                      uint32_t addr) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_exit(struct dynarec_compiler *compiler,
+                      uint32_t target) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_linkable_exit(struct dynarec_compiler *compiler,
+                               uint32_t target) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_link(uint8_t *site, void *page_entry, void *target) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_unlink(uint8_t *site) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_exit_dt(struct dynarec_compiler *compiler) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_idle_loop(struct dynarec_compiler *compiler) {
+   PPC_UNIMPLEMENTED();
+}
+
+void dynasm_emit_counter_check(struct dynarec_compiler *compiler,
+                               uint32_t target) {
+   PPC_UNIMPLEMENTED();
+}
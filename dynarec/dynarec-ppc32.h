@@ -19,4 +19,13 @@
    12 is a safe bet for now? Will have to update as time goes on. */
 #define DYNAREC_INSTRUCTION_MAX_LEN  (12 * 4)
 
+/* addi + b */
+#define DYNAREC_ENTRY_STUB_MAX_LEN   (2 * 4)
+
+/* The register mapping is fixed for now, see load_psx_reg */
+#define DYNAREC_ALLOCATABLE_REGS     0U
+
+/* EM_PPC, for the jitdump */
+#define DYNAREC_ELF_MACHINE          20U
+
 #endif //__DYNAREC_PPC32_H__
\ No newline at end of file
@@ -1,11 +1,31 @@
+#ifndef _GNU_SOURCE
+/* For memfd_create and the register names in ucontext.h */
+# define _GNU_SOURCE
+#endif
+
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_THREADS
+# include <rthreads/rthreads.h>
+#endif
 
 #include "dynarec.h"
 #include "dynarec-compiler.h"
 
+#if defined(DYNAREC_HAVE_FASTMEM) && defined(__linux__)
+# define DYNAREC_FASTMEM_SUPPORTED
+# include <signal.h>
+# include <ucontext.h>
+#endif
+
 static const uint32_t region_mask[8] = {
    0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, /* KUSEG: 2048MB */
    0x7fffffff,                                     /* KSEG0:  512MB */
@@ -13,22 +33,654 @@ static const uint32_t region_mask[8] = {
    0xffffffff, 0xffffffff,                         /* KSEG2: 1024MB */
 };
 
+/* Entry point of the BIOS "A" functions, function number in T1 */
+#define BIOS_A_FUNCTIONS   0xa0U
+/* A(44h): FlushCache() */
+#define BIOS_A_FLUSH_CACHE 0x44U
+
+/* Bit 16 of SR: isolate the cache */
+#define SR_ISOLATE_CACHE   (1U << 16)
+
 /* Mask "addr" to remove the region bits and return a "canonical"
    address. */
 static uint32_t dynarec_mask_address(uint32_t addr) {
    return addr & region_mask[addr >> 29];
 }
 
+/* Set if we failed to setup the fastmem window, we don't try
+   again */
+static bool fastmem_unavailable;
+
+#ifdef DYNAREC_FASTMEM_SUPPORTED
+/* Size of a host page. Protections in the fastmem window are changed
+   with this granularity. */
+#define FASTMEM_HOST_PAGE_SIZE 4096U
+/* Number of host pages in RAM */
+#define FASTMEM_RAM_HOST_PAGES (PSX_RAM_SIZE / FASTMEM_HOST_PAGE_SIZE)
+
+/* Regions where RAM is mapped in the fastmem window. KSEG2 doesn't
+   contain RAM. */
+static const uint32_t fastmem_regions[3] = {
+   0x00000000, /* KUSEG */
+   0x80000000, /* KSEG0 */
+   0xa0000000, /* KSEG1 */
+};
+
+/* State owning the fastmem window, used by the signal handler */
+static struct dynarec_state *fastmem_state;
+/* SIGSEGV handler installed before ours */
+static struct sigaction fastmem_old_sigsegv;
+
+/* Change the protection of host pages [first, first + count) of RAM
+   in all the views of the fastmem window */
+static void dynarec_fastmem_mprotect(struct dynarec_state *state,
+                                     uint32_t first,
+                                     uint32_t count,
+                                     int prot) {
+   unsigned r, m;
+
+   for (r = 0; r < ARRAY_SIZE(fastmem_regions); r++) {
+      /* RAM is mirrored 4 times */
+      for (m = 0; m < 4; m++) {
+         uint8_t *p = state->fastmem + fastmem_regions[r] +
+            m * PSX_RAM_SIZE + first * FASTMEM_HOST_PAGE_SIZE;
+
+         if (mprotect(p, count * FASTMEM_HOST_PAGE_SIZE, prot) < 0) {
+            DYNAREC_FATAL("fastmem mprotect failed\n");
+         }
+      }
+   }
+}
+
+/* Returns the protection RAM host page `host_page` must have in the
+   fastmem window. Stores fault when the page contains recompiled
+   code (so that it gets invalidated) or when the cache is isolated
+   (since they don't reach RAM). */
+static int dynarec_fastmem_ram_prot(struct dynarec_state *state,
+                                    uint32_t host_page) {
+   const uint32_t pages = FASTMEM_HOST_PAGE_SIZE / DYNAREC_PAGE_SIZE;
+   uint32_t i;
+
+   if (state->sr & SR_ISOLATE_CACHE) {
+      return PROT_READ;
+   }
+
+   if (!(state->options & DYNAREC_OPT_LAZY_INVALIDATE)) {
+      for (i = 0; i < pages; i++) {
+         if (state->page_valid[host_page * pages + i]) {
+            return PROT_READ;
+         }
+      }
+   }
+
+   return PROT_READ | PROT_WRITE;
+}
+
+/* Update the protection of the host page containing dynarec page
+   `page_index` after it's been recompiled or invalidated */
+static void dynarec_fastmem_protect_page(struct dynarec_state *state,
+                                         uint32_t page_index) {
+   uint32_t host_page;
+
+   if (state->fastmem == NULL || page_index >= DYNAREC_RAM_PAGES) {
+      return;
+   }
+
+   if (state->options & DYNAREC_OPT_LAZY_INVALIDATE) {
+      /* Recompiled code isn't write-protected, the protection only
+         changes with the cache isolation */
+      return;
+   }
+
+   host_page = (page_index * DYNAREC_PAGE_SIZE) / FASTMEM_HOST_PAGE_SIZE;
+
+   dynarec_fastmem_mprotect(state, host_page, 1,
+                            dynarec_fastmem_ram_prot(state, host_page));
+}
+
+/* Update the protection of the whole RAM, merging consecutive pages
+   with the same protection to limit the number of syscalls */
+static void dynarec_fastmem_protect_all(struct dynarec_state *state) {
+   uint32_t first = 0;
+   uint32_t i;
+   int prot;
+
+   if (state->fastmem == NULL) {
+      return;
+   }
+
+   prot = dynarec_fastmem_ram_prot(state, 0);
+
+   for (i = 1; i <= FASTMEM_RAM_HOST_PAGES; i++) {
+      int p = -1;
+
+      if (i < FASTMEM_RAM_HOST_PAGES) {
+         p = dynarec_fastmem_ram_prot(state, i);
+      }
+
+      if (p != prot) {
+         dynarec_fastmem_mprotect(state, first, i - first, prot);
+         first = i;
+         prot = p;
+      }
+   }
+}
+
+/* Called by the signal handler when the recompiled code faults at
+   `addr` in the fastmem window. Returns false if the fault wasn't
+   caused by a fastmem access. */
+static bool dynarec_fastmem_fault(struct dynarec_state *state,
+                                  uint32_t addr,
+                                  void *context) {
+   ucontext_t *uc = context;
+   uint8_t **pc = (uint8_t **)&uc->uc_mcontext.gregs[REG_RIP];
+   uint32_t canonical = dynarec_mask_address(addr);
+
+   if (*pc < state->map || *pc >= state->map + state->map_len) {
+      /* Not from recompiled code */
+      return false;
+   }
+
+   if (canonical < PSX_RAM_SIZE * 4) {
+      /* RAM is always readable, this is a store to a write-protected
+         page */
+      uint32_t host_page = (canonical % PSX_RAM_SIZE) / FASTMEM_HOST_PAGE_SIZE;
+      const uint32_t pages = FASTMEM_HOST_PAGE_SIZE / DYNAREC_PAGE_SIZE;
+      uint32_t i;
+
+      if (state->sr & SR_ISOLATE_CACHE) {
+         /* Let the regular code send it to the cache. This is
+            temporary so we don't patch the access. */
+         return dynasm_fastmem_fault(pc, false);
+      }
+
+      /* The page contains recompiled code, invalidate it and retry
+         the store */
+      for (i = 0; i < pages; i++) {
+         dynarec_invalidate_page(state, host_page * pages + i);
+      }
+
+      dynarec_fastmem_protect_page(state, host_page * pages);
+
+      return true;
+   }
+
+   /* Device, scratchpad or BIOS access: that instruction won't
+      target RAM anytime soon, patch it to always take the slow
+      path */
+   return dynasm_fastmem_fault(pc, true);
+}
+
+static void dynarec_fastmem_sigsegv(int sig, siginfo_t *info, void *context) {
+   struct dynarec_state *state = fastmem_state;
+   uint8_t *addr = info->si_addr;
+
+   if (state != NULL && state->fastmem != NULL &&
+       addr >= state->fastmem &&
+       addr < state->fastmem + DYNAREC_FASTMEM_SIZE) {
+      if (dynarec_fastmem_fault(state, addr - state->fastmem, context)) {
+         return;
+      }
+   }
+
+   /* Not ours, forward it to the previous handler */
+   if (fastmem_old_sigsegv.sa_flags & SA_SIGINFO) {
+      fastmem_old_sigsegv.sa_sigaction(sig, info, context);
+   } else if (fastmem_old_sigsegv.sa_handler == SIG_DFL ||
+              fastmem_old_sigsegv.sa_handler == SIG_IGN) {
+      /* Restore the default action, the faulting instruction will
+         fault again when we return */
+      sigaction(SIGSEGV, &fastmem_old_sigsegv, NULL);
+   } else {
+      fastmem_old_sigsegv.sa_handler(sig);
+   }
+}
+
+/* Reserve the fastmem window and map RAM in it. RAM is moved to a
+   shared memory object in place so that the emulator keeps accessing
+   it at the same address, which means that it must be page-aligned. */
+static int dynarec_fastmem_enable(struct dynarec_state *state) {
+   struct sigaction sa;
+   uint8_t *ram = (uint8_t *)state->ram;
+   uint8_t *window;
+   uint8_t *tmp;
+   unsigned r, m;
+   int fd;
+
+   if (fastmem_state != NULL) {
+      DYNAREC_LOG("fastmem window already in use\n");
+      return -1;
+   }
+
+   if ((uintptr_t)ram % FASTMEM_HOST_PAGE_SIZE) {
+      DYNAREC_LOG("RAM buffer isn't page-aligned, can't use fastmem\n");
+      return -1;
+   }
+
+   fd = memfd_create("psx-ram", MFD_CLOEXEC);
+   if (fd < 0) {
+      return -1;
+   }
+
+   if (ftruncate(fd, PSX_RAM_SIZE) < 0) {
+      close(fd);
+      return -1;
+   }
+
+   window = mmap(NULL,
+                 DYNAREC_FASTMEM_SIZE,
+                 PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                 -1,
+                 0);
+   if (window == MAP_FAILED) {
+      close(fd);
+      return -1;
+   }
+
+   for (r = 0; r < ARRAY_SIZE(fastmem_regions); r++) {
+      for (m = 0; m < 4; m++) {
+         uint8_t *p = window + fastmem_regions[r] + m * PSX_RAM_SIZE;
+
+         if (mmap(p, PSX_RAM_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(window, DYNAREC_FASTMEM_SIZE);
+            close(fd);
+            return -1;
+         }
+      }
+   }
+
+   /* Copy the current RAM contents and replace the emulator's buffer
+      with the shared object */
+   memcpy(window, ram, PSX_RAM_SIZE);
+
+   tmp = mmap(ram, PSX_RAM_SIZE, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_FIXED, fd, 0);
+   close(fd);
+
+   if (tmp == MAP_FAILED) {
+      /* That's bad, we don't know what's at `ram` anymore */
+      DYNAREC_FATAL("Can't remap RAM for fastmem\n");
+   }
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_sigaction = dynarec_fastmem_sigsegv;
+   sa.sa_flags = SA_SIGINFO;
+   sigemptyset(&sa.sa_mask);
+
+   if (sigaction(SIGSEGV, &sa, &fastmem_old_sigsegv) < 0) {
+      DYNAREC_FATAL("Can't install the fastmem SIGSEGV handler\n");
+   }
+
+   state->fastmem = window;
+   fastmem_state = state;
+
+   DYNAREC_LOG("fastmem window at %p\n", window);
+
+   return 0;
+}
+
+/* Release the fastmem window and move RAM back to private memory */
+static void dynarec_fastmem_disable(struct dynarec_state *state) {
+   uint8_t *ram = (uint8_t *)state->ram;
+
+   if (state->fastmem == NULL) {
+      return;
+   }
+
+   sigaction(SIGSEGV, &fastmem_old_sigsegv, NULL);
+
+   /* KUSEG RAM is at the start of the window, we copy it back once
+      the anonymous mapping has replaced the shared one */
+   if (mmap(ram, PSX_RAM_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+      DYNAREC_FATAL("Can't remap RAM\n");
+   }
+
+   memcpy(ram, state->fastmem, PSX_RAM_SIZE);
+
+   munmap(state->fastmem, DYNAREC_FASTMEM_SIZE);
+   state->fastmem = NULL;
+   fastmem_state = NULL;
+}
+#else
+static void dynarec_fastmem_protect_page(struct dynarec_state *state,
+                                         uint32_t page_index) {
+}
+
+static void dynarec_fastmem_protect_all(struct dynarec_state *state) {
+}
+
+static int dynarec_fastmem_enable(struct dynarec_state *state) {
+   return -1;
+}
+
+static void dynarec_fastmem_disable(struct dynarec_state *state) {
+}
+#endif
+
+#ifdef HAVE_THREADS
+/* Number of pages that can be waiting for the worker thread */
+#define DYNAREC_WORKER_JOBS 16U
+
+enum dynarec_job_status {
+   JOB_FREE,
+   JOB_QUEUED,
+   JOB_COMPILING,
+   JOB_DONE,
+};
+
+/* A page compiled by the worker thread. The instructions are copied
+   when the job is queued and the result is only published if they
+   still match the emulated memory once it's done, since the emulator
+   keeps running in the meantime. */
+struct dynarec_job {
+   enum dynarec_job_status status;
+   uint32_t                page_index;
+   /* Length of the code once it's compiled */
+   uint32_t                code_len;
+   /* The page followed by the first instruction of the next one */
+   uint32_t                code[DYNAREC_PAGE_INSTRUCTIONS + 1];
+};
+
+struct dynarec_worker {
+   sthread_t          *thread;
+   slock_t            *lock;
+   /* Signaled when a job is queued or done and when the thread must
+      exit */
+   scond_t            *cond;
+   bool                quit;
+   /* Number of jobs in JOB_DONE state. The main thread reads it
+      without taking the lock to avoid locking on every jump. */
+   volatile uint32_t   done;
+   struct dynarec_job  jobs[DYNAREC_WORKER_JOBS];
+};
+
+static void dynarec_worker_thread(void *data) {
+   struct dynarec_state *state = data;
+   struct dynarec_worker *w = state->worker;
+
+   slock_lock(w->lock);
+
+   while (!w->quit) {
+      struct dynarec_job *job = NULL;
+      unsigned i;
+
+      for (i = 0; i < DYNAREC_WORKER_JOBS; i++) {
+         if (w->jobs[i].status == JOB_QUEUED) {
+            job = &w->jobs[i];
+            break;
+         }
+      }
+
+      if (job == NULL) {
+         scond_wait(w->cond, w->lock);
+         continue;
+      }
+
+      job->status = JOB_COMPILING;
+      slock_unlock(w->lock);
+
+      DYNAREC_LOG("Compiling page %u in the background\n", job->page_index);
+
+      job->code_len = dynarec_compile_page(state,
+                                           job->page_index,
+                                           job->code,
+                                           job->code[DYNAREC_PAGE_INSTRUCTIONS]);
+
+      slock_lock(w->lock);
+      job->status = JOB_DONE;
+      w->done++;
+      scond_broadcast(w->cond);
+   }
+
+   slock_unlock(w->lock);
+}
+
+static void dynarec_worker_start(struct dynarec_state *state) {
+   struct dynarec_worker *w;
+
+   w = calloc(1, sizeof(*w));
+   if (w == NULL) {
+      return;
+   }
+
+   w->lock = slock_new();
+   w->cond = scond_new();
+   state->worker = w;
+
+   if (w->lock == NULL || w->cond == NULL) {
+      goto fail;
+   }
+
+   w->thread = sthread_create(dynarec_worker_thread, state);
+   if (w->thread == NULL) {
+      goto fail;
+   }
+
+   return;
+
+fail:
+   DYNAREC_LOG("Can't start the worker thread, compiling synchronously\n");
+   if (w->cond) {
+      scond_free(w->cond);
+   }
+   if (w->lock) {
+      slock_free(w->lock);
+   }
+   free(w);
+   state->worker = NULL;
+}
+
+/* Drop all the jobs, waiting for the one being compiled (if any) */
+static void dynarec_worker_flush(struct dynarec_state *state) {
+   struct dynarec_worker *w = state->worker;
+   bool busy;
+   unsigned i;
+
+   if (w == NULL) {
+      return;
+   }
+
+   slock_lock(w->lock);
+
+   do {
+      busy = false;
+
+      for (i = 0; i < DYNAREC_WORKER_JOBS; i++) {
+         struct dynarec_job *job = &w->jobs[i];
+
+         if (job->status == JOB_COMPILING) {
+            busy = true;
+         } else {
+            job->status = JOB_FREE;
+         }
+      }
+
+      if (busy) {
+         scond_wait(w->cond, w->lock);
+      }
+   } while (busy);
+
+   w->done = 0;
+
+   slock_unlock(w->lock);
+}
+
+static void dynarec_worker_stop(struct dynarec_state *state) {
+   struct dynarec_worker *w = state->worker;
+
+   if (w == NULL) {
+      return;
+   }
+
+   slock_lock(w->lock);
+   w->quit = true;
+   scond_broadcast(w->cond);
+   slock_unlock(w->lock);
+
+   sthread_join(w->thread);
+
+   scond_free(w->cond);
+   slock_free(w->lock);
+   free(w);
+   state->worker = NULL;
+}
+
+/* Returns true if page `page_index` is waiting for the worker or
+   hasn't been published yet */
+static bool dynarec_worker_pending(struct dynarec_state *state,
+                                   uint32_t page_index) {
+   struct dynarec_worker *w = state->worker;
+   bool pending = false;
+   unsigned i;
+
+   if (w == NULL) {
+      return false;
+   }
+
+   slock_lock(w->lock);
+
+   for (i = 0; i < DYNAREC_WORKER_JOBS; i++) {
+      if (w->jobs[i].status != JOB_FREE &&
+          w->jobs[i].page_index == page_index) {
+         pending = true;
+         break;
+      }
+   }
+
+   slock_unlock(w->lock);
+
+   return pending;
+}
+
+/* Queue page `page_index` for compilation. If the queue is full we'll
+   try again the next time the page is entered. */
+static void dynarec_worker_queue(struct dynarec_state *state,
+                                 uint32_t page_index) {
+   struct dynarec_worker *w = state->worker;
+   struct dynarec_job *job = NULL;
+   unsigned i;
+
+   slock_lock(w->lock);
+
+   for (i = 0; i < DYNAREC_WORKER_JOBS; i++) {
+      if (w->jobs[i].status == JOB_FREE) {
+         job = &w->jobs[i];
+         break;
+      }
+   }
+
+   slock_unlock(w->lock);
+
+   if (job == NULL) {
+      return;
+   }
+
+   /* The worker is about to overwrite the page's code. Only this
+      thread queues jobs so the slot stays free in the meantime, but
+      the allocation may have to flush the worker so we can't hold the
+      lock. */
+   dynarec_retire_page(state, page_index);
+
+   if (dynarec_arena_alloc(state, page_index) < 0) {
+      return;
+   }
+
+   slock_lock(w->lock);
+
+   memcpy(job->code,
+          dynarec_page_code(state, page_index),
+          DYNAREC_PAGE_SIZE);
+   job->code[DYNAREC_PAGE_INSTRUCTIONS] =
+      dynarec_page_next_instruction(state, page_index);
+   job->page_index = page_index;
+   job->status = JOB_QUEUED;
+
+   scond_broadcast(w->cond);
+
+   slock_unlock(w->lock);
+}
+
+/* Publish the pages compiled by the worker. That's just a matter of
+   marking them valid since the code and the instruction table are
+   already in place, and giving back the unused end of their
+   allocation. */
+static void dynarec_worker_collect(struct dynarec_state *state) {
+   struct dynarec_worker *w = state->worker;
+   unsigned i;
+
+   if (w == NULL || w->done == 0) {
+      return;
+   }
+
+   slock_lock(w->lock);
+
+   for (i = 0; i < DYNAREC_WORKER_JOBS; i++) {
+      struct dynarec_job *job = &w->jobs[i];
+      uint32_t p = job->page_index;
+
+      if (job->status != JOB_DONE) {
+         continue;
+      }
+
+      if (memcmp(job->code,
+                 dynarec_page_code(state, p),
+                 DYNAREC_PAGE_SIZE) == 0 &&
+          job->code[DYNAREC_PAGE_INSTRUCTIONS] ==
+          dynarec_page_next_instruction(state, p)) {
+         dynarec_arena_trim(state, p, job->code_len);
+         state->page_valid[p] = 1;
+         dynarec_fastmem_protect_page(state, p);
+      } else {
+         /* The code has been modified while we were compiling it,
+            it'll have to get hot again */
+         DYNAREC_LOG("Page %u modified during compilation\n", p);
+         dynarec_arena_free(state, p);
+         state->page_hits[p] = 0;
+      }
+
+      job->status = JOB_FREE;
+      w->done--;
+   }
+
+   slock_unlock(w->lock);
+}
+#else
+static void dynarec_worker_start(struct dynarec_state *state) {
+}
+
+static void dynarec_worker_flush(struct dynarec_state *state) {
+}
+
+static void dynarec_worker_stop(struct dynarec_state *state) {
+}
+
+static bool dynarec_worker_pending(struct dynarec_state *state,
+                                   uint32_t page_index) {
+   return false;
+}
+
+static void dynarec_worker_queue(struct dynarec_state *state,
+                                 uint32_t page_index) {
+}
+
+static void dynarec_worker_collect(struct dynarec_state *state) {
+}
+#endif
+
 /* Returns the maximum size a recompiled page can take, in bytes. */
 static uint32_t dynarec_max_page_size(void) {
    uint32_t s;
 
-   /* We may end up duplicating instructions in the load delay slots,
-      and we need an additional pseudo-instruction at the end to jump
-      to the next page. The typical page size will be a fraction of
-      that but we'll rely on the kernel's lazy memory allocation to
-      avoid wasting memory. */
-   s = (DYNAREC_PAGE_INSTRUCTIONS * 2 + 1) * DYNAREC_INSTRUCTION_MAX_LEN;
+   /* DYNAREC_INSTRUCTION_MAX_LEN already accounts for the
+      instructions duplicated in the load delay slots, and we need
+      room for the page prologue and the pseudo-instructions at the end
+      to jump to the next page. The typical page size will be a
+      fraction of that but we'll rely on the kernel's lazy memory
+      allocation to avoid wasting memory. */
+   s = (DYNAREC_PAGE_INSTRUCTIONS + 2) * DYNAREC_INSTRUCTION_MAX_LEN;
 
    /* Align to a real hardware page size to avoid having a dynarec
       page starting at the end of a hardware page. Assume that pages
@@ -38,6 +690,307 @@ static uint32_t dynarec_max_page_size(void) {
    return s;
 }
 
+/* jitdump: `perf inject --jit` reads /tmp/jit-<pid>.dump to name the
+   samples taken in anonymous executable memory. Every time a page is
+   compiled we add a JIT_CODE_LOAD record with a copy of its code,
+   named after the address of the emulated code. Records are
+   timestamped so when the arena memory is reused perf knows which
+   page was there when a sample was taken. See the jitdump
+   specification in the Linux sources
+   (tools/perf/Documentation/jitdump-specification.txt). */
+
+/* "JiTD" */
+#define JITDUMP_MAGIC          0x4a695444U
+#define JITDUMP_VERSION        1U
+#define JITDUMP_CODE_LOAD      0U
+#define JITDUMP_CODE_CLOSE     3U
+
+struct jitdump_header {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t total_size;
+   uint32_t elf_mach;
+   uint32_t pad1;
+   uint32_t pid;
+   uint64_t timestamp;
+   uint64_t flags;
+};
+
+struct jitdump_record {
+   uint32_t id;
+   uint32_t total_size;
+   uint64_t timestamp;
+};
+
+/* Followed by the symbol name (NUL terminated) and the code */
+struct jitdump_code_load {
+   struct jitdump_record record;
+   uint32_t pid;
+   uint32_t tid;
+   uint64_t vma;
+   uint64_t code_addr;
+   uint64_t code_size;
+   uint64_t code_index;
+};
+
+/* perf has to be told to use the same clock with `-k mono` */
+static uint64_t dynarec_jitdump_timestamp(void) {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+static void dynarec_jitdump_open(struct dynarec_state *state) {
+   struct jitdump_header header;
+   char path[64];
+   FILE *f;
+
+   snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+
+   f = fopen(path, "w+");
+   if (f == NULL) {
+      DYNAREC_LOG("Can't create %s\n", path);
+      return;
+   }
+
+   memset(&header, 0, sizeof(header));
+   header.magic = JITDUMP_MAGIC;
+   header.version = JITDUMP_VERSION;
+   header.total_size = sizeof(header);
+   header.elf_mach = DYNAREC_ELF_MACHINE;
+   header.pid = getpid();
+   header.timestamp = dynarec_jitdump_timestamp();
+
+   if (fwrite(&header, sizeof(header), 1, f) != 1 || fflush(f) != 0) {
+      DYNAREC_LOG("Can't write %s\n", path);
+      fclose(f);
+      return;
+   }
+
+   /* perf only finds the file through an executable mapping of it in
+      the recording */
+   state->jitdump_marker_len = sysconf(_SC_PAGESIZE);
+   state->jitdump_marker = mmap(NULL, state->jitdump_marker_len,
+                                PROT_READ | PROT_EXEC, MAP_PRIVATE,
+                                fileno(f), 0);
+   if (state->jitdump_marker == MAP_FAILED) {
+      DYNAREC_LOG("Can't map %s\n", path);
+      state->jitdump_marker = NULL;
+      fclose(f);
+      return;
+   }
+
+   state->jitdump = f;
+}
+
+static void dynarec_jitdump_close(struct dynarec_state *state) {
+   struct jitdump_record record;
+
+   if (state->jitdump == NULL) {
+      return;
+   }
+
+   record.id = JITDUMP_CODE_CLOSE;
+   record.total_size = sizeof(record);
+   record.timestamp = dynarec_jitdump_timestamp();
+   fwrite(&record, sizeof(record), 1, state->jitdump);
+
+   munmap(state->jitdump_marker, state->jitdump_marker_len);
+   fclose(state->jitdump);
+   state->jitdump = NULL;
+   state->jitdump_marker = NULL;
+}
+
+/* Add a record for the code of page `page_index`. Called by the arena
+   when the page gets its final place, see `dynarec_arena_trim`. */
+static void dynarec_jitdump_page(struct dynarec_state *state,
+                                 uint32_t page_index,
+                                 uint32_t code_len) {
+   struct jitdump_code_load load;
+   const uint8_t *code;
+   char name[32];
+   uint32_t addr;
+
+   if (state->jitdump == NULL) {
+      return;
+   }
+
+   /* Name pages after the addresses code usually runs from: KSEG0
+      for RAM, KSEG1 for the BIOS */
+   if (page_index < DYNAREC_RAM_PAGES) {
+      addr = 0x80000000U + page_index * DYNAREC_PAGE_SIZE;
+   } else {
+      addr = 0xa0000000U + PSX_BIOS_BASE +
+         (page_index - DYNAREC_RAM_PAGES) * DYNAREC_PAGE_SIZE;
+   }
+
+   snprintf(name, sizeof(name), "psx_0x%08x", addr);
+   code = dynarec_page_start(state, page_index);
+
+   load.record.id = JITDUMP_CODE_LOAD;
+   load.record.total_size = sizeof(load) + strlen(name) + 1 + code_len;
+   load.pid = getpid();
+   load.tid = load.pid;
+   load.vma = (uintptr_t)code;
+   load.code_addr = (uintptr_t)code;
+   load.code_size = code_len;
+
+   load.record.timestamp = dynarec_jitdump_timestamp();
+   /* perf names the code after it, it must be unique */
+   load.code_index = state->jitdump_index++;
+
+   fwrite(&load, sizeof(load), 1, state->jitdump);
+   fwrite(name, 1, strlen(name) + 1, state->jitdump);
+   fwrite(code, 1, code_len, state->jitdump);
+   fflush(state->jitdump);
+}
+
+/* Code arena: pages are allocated one after the other, wrapping
+   around to the start when we reach the end, and the pages in the way
+   are evicted. That's FIFO eviction of the oldest pages. A page gets
+   the worst case size while it's being compiled and the rest is given
+   back once we know the actual length of its code.
+
+   Evicted code stays in place until the memory is handed to another
+   page, which then gets a jitdump record once its code is there. That
+   record is the unload of the previous pages in the range: perf
+   attributes the samples taken after it to the new page. */
+
+/* Evict page `page_index` from the arena to reuse its memory */
+static void dynarec_arena_evict(struct dynarec_state *state,
+                                uint32_t page_index) {
+   uint8_t *start = state->map + state->page_offset[page_index];
+
+   DYNAREC_LOG("Evicting page %u\n", page_index);
+
+   if (dynarec_worker_pending(state, page_index)) {
+      /* The worker is writing to this allocation */
+      dynarec_worker_flush(state);
+   }
+
+   if (state->link_site >= start &&
+       state->link_site < start + state->page_len[page_index]) {
+      state->link_site = NULL;
+   }
+
+   dynarec_invalidate_page(state, page_index);
+
+   /* Outgoing links recorded in other pages are gone too */
+   state->page_generation[page_index]++;
+
+   dynarec_arena_free(state, page_index);
+}
+
+/* Release the memory used by the code of page `page_index`. The code
+   stays in place until it's reused by another page. */
+void dynarec_arena_free(struct dynarec_state *state,
+                        uint32_t page_index) {
+   uint32_t offset = state->page_offset[page_index];
+   uint32_t g;
+
+   if (offset == DYNAREC_NO_CODE) {
+      return;
+   }
+
+   for (g = offset / DYNAREC_ARENA_GRANULE;
+        g < (offset + state->page_len[page_index]) / DYNAREC_ARENA_GRANULE;
+        g++) {
+      state->map_owner[g] = 0;
+   }
+
+   state->page_offset[page_index] = DYNAREC_NO_CODE;
+   state->page_len[page_index] = 0;
+}
+
+/* Allocate room for the code of page `page_index`, evicting older
+   pages if needed. Must not be called while running recompiled
+   code. */
+int dynarec_arena_alloc(struct dynarec_state *state,
+                        uint32_t page_index) {
+   const uint32_t len = dynarec_max_page_size();
+   uint32_t g;
+
+   if (state->page_instructions[page_index] == NULL) {
+      state->page_instructions[page_index] =
+         malloc(DYNAREC_PAGE_INSTRUCTIONS * sizeof(uint32_t));
+
+      if (state->page_instructions[page_index] == NULL) {
+         return -1;
+      }
+   }
+
+   dynarec_arena_free(state, page_index);
+
+   if (state->map_head + len > state->map_len) {
+      state->map_head = 0;
+   }
+
+   for (g = state->map_head / DYNAREC_ARENA_GRANULE;
+        g < (state->map_head + len) / DYNAREC_ARENA_GRANULE;
+        g++) {
+      if (state->map_owner[g] != 0) {
+         dynarec_arena_evict(state, state->map_owner[g] - 1);
+      }
+
+      state->map_owner[g] = page_index + 1;
+   }
+
+   state->page_offset[page_index] = state->map_head;
+   state->page_len[page_index] = len;
+   state->map_head += len;
+
+   return 0;
+}
+
+/* Give back the end of page `page_index`'s allocation now that we
+   know it only needs `code_len` bytes */
+void dynarec_arena_trim(struct dynarec_state *state,
+                        uint32_t page_index,
+                        uint32_t code_len) {
+   const uint32_t offset = state->page_offset[page_index];
+   const uint32_t old_end = offset + state->page_len[page_index];
+   uint32_t new_len;
+   uint32_t g;
+
+   new_len = (code_len + DYNAREC_ARENA_GRANULE - 1) &
+      ~(DYNAREC_ARENA_GRANULE - 1);
+
+   for (g = (offset + new_len) / DYNAREC_ARENA_GRANULE;
+        g < old_end / DYNAREC_ARENA_GRANULE;
+        g++) {
+      state->map_owner[g] = 0;
+   }
+
+   state->page_len[page_index] = new_len;
+
+   /* The page's code is final, whether it's just been compiled, loaded
+      from the translation cache or compiled by the worker */
+   dynarec_jitdump_page(state, page_index, code_len);
+
+   /* If nothing has been allocated after us we can continue right
+      after the code, otherwise the hole is reused when we wrap
+      around */
+   if (state->map_head == old_end) {
+      state->map_head = offset + new_len;
+   }
+}
+
+/* Forget all the pages at once, used when all the code has been
+   invalidated */
+static void dynarec_arena_reset(struct dynarec_state *state) {
+   uint32_t i;
+
+   for (i = 0; i < DYNAREC_TOTAL_PAGES; i++) {
+      state->page_offset[i] = DYNAREC_NO_CODE;
+      state->page_len[i] = 0;
+   }
+
+   memset(state->map_owner, 0, sizeof(state->map_owner));
+   state->map_head = 0;
+}
+
 struct dynarec_state *dynarec_init(uint32_t *ram,
                                    uint32_t *scratchpad,
                                    const uint32_t *bios) {
@@ -52,7 +1005,7 @@ struct dynarec_state *dynarec_init(uint32_t *ram,
    state->scratchpad = scratchpad;
    state->bios = bios;
 
-   state->map_len = dynarec_max_page_size() * DYNAREC_TOTAL_PAGES;
+   state->map_len = DYNAREC_ARENA_SIZE;
    state->map = mmap(NULL,
                      state->map_len,
 #ifdef DYNAREC_DEBUG
@@ -70,6 +1023,8 @@ struct dynarec_state *dynarec_init(uint32_t *ram,
 
    memcpy(state->region_mask, region_mask, sizeof(region_mask));
 
+   dynarec_arena_reset(state);
+
    return state;
 }
 
@@ -77,7 +1032,17 @@ void dynarec_delete(struct dynarec_state *state) {
    struct dynarec_page *page;
    unsigned i;
 
+   dynarec_worker_stop(state);
+   dynarec_fastmem_disable(state);
+   dynarec_jitdump_close(state);
    munmap(state->map, state->map_len);
+
+   for (i = 0; i < DYNAREC_TOTAL_PAGES; i++) {
+      free(state->page_instructions[i]);
+   }
+
+   free(state->cache_dir);
+   free(state->ram_copy);
    free(state);
 }
 
@@ -111,24 +1076,459 @@ int32_t dynarec_find_page_index(struct dynarec_state *state,
 
 uint8_t *dynarec_page_start(struct dynarec_state *state,
                             uint32_t page_index) {
-   return state->map + (dynarec_max_page_size() * page_index);
+   return state->map + state->page_offset[page_index];
 }
 
-int32_t dynarec_run(struct dynarec_state *state, int32_t cycles_to_run) {
-   struct dynarec_page *page;
-   int32_t page_index = dynarec_find_page_index(state, state->pc);
+/* Restore all the jumps linked into `page_index` so that they
+   return to dynarec_run instead. */
+void dynarec_unlink_page(struct dynarec_state *state,
+                         uint32_t page_index) {
+   struct dynarec_page_links *links = &state->page_links[page_index];
+   uint32_t i;
+
+   for (i = 0; i < links->len; i++) {
+      struct dynarec_link *l = &links->link[i];
+
+      /* If the page containing the jump has been recompiled since we
+         linked it the code at `site` is gone */
+      if (state->page_generation[l->page] == l->generation) {
+         dynasm_unlink(l->site);
+      }
+   }
+
+   links->len = 0;
+}
+
+/* Patch the jump at `site` to go directly to `target`, in page
+   `page_index` */
+static void dynarec_link(struct dynarec_state *state,
+                         uint8_t *site,
+                         uint32_t page_index,
+                         void *target) {
+   struct dynarec_page_links *links = &state->page_links[page_index];
+   uint32_t owner = state->map_owner[(site - state->map) / DYNAREC_ARENA_GRANULE];
+   uint32_t site_page;
+   struct dynarec_link *l;
+
+   if (owner == 0) {
+      /* The page containing the jump has been evicted */
+      return;
+   }
+
+   site_page = owner - 1;
+
+   if (!state->page_valid[site_page]) {
+      /* The page containing the jump has been invalidated while it
+         was running, it's going to be recompiled anyway */
+      return;
+   }
 
+   if (links->len == DYNAREC_MAX_PAGE_LINKS) {
+      /* Make some room by dropping the stale links */
+      uint32_t i, j;
+
+      for (i = 0, j = 0; i < links->len; i++) {
+         l = &links->link[i];
+
+         if (state->page_generation[l->page] == l->generation) {
+            links->link[j++] = *l;
+         }
+      }
+
+      links->len = j;
+
+      if (links->len == DYNAREC_MAX_PAGE_LINKS) {
+         /* Leave this one unlinked */
+         return;
+      }
+   }
+
+   l = &links->link[links->len++];
+
+   l->site = site;
+   l->page = site_page;
+   l->generation = state->page_generation[site_page];
+
+   dynasm_link(site, dynarec_page_start(state, page_index), target);
+}
+
+/* Mark page `page_index` as needing recompilation and unlink all the
+   jumps going into it */
+void dynarec_invalidate_page(struct dynarec_state *state,
+                             uint32_t page_index) {
+   if (state->page_valid[page_index]) {
+      state->page_valid[page_index] = 0;
+      dynarec_unlink_page(state, page_index);
+      dynarec_fastmem_protect_page(state, page_index);
+      /* In tiered mode it'll have to get hot again before we
+         recompile it */
+      state->page_hits[page_index] = 0;
+   }
+}
+
+/* Same as `dynarec_invalidate_ram` for a store at address `addr` from
+   the CPU's point of view (SWL/SWR, SWC2...) */
+void dynarec_invalidate(struct dynarec_state *state, uint32_t addr) {
+   addr = dynarec_mask_address(addr);
+
+   if (addr < (PSX_RAM_SIZE * 4)) {
+      dynarec_invalidate_ram(state, addr);
+   }
+}
+
+/* Drop all the recompiled RAM pages. Used in lazy invalidate mode when
+   the emulated code flushes the instruction cache and by the emulator
+   when the whole RAM is reloaded (savestates, reset...) */
+void dynarec_flush_cache(struct dynarec_state *state) {
+   uint32_t i;
+
+   DYNAREC_LOG("Invalidating all RAM pages\n");
+
+   for (i = 0; i < DYNAREC_RAM_PAGES; i++) {
+      dynarec_invalidate_page(state, i);
+   }
+}
+
+/* The frontend can write to RAM directly between two frames (cheats,
+   memory editors...) through the pointer from retro_get_memory_data,
+   we never see those stores. When the emulator asks for it we keep a
+   copy of the recompiled RAM pages at the end of each frame and
+   compare it with the RAM before the next one. In lazy invalidate
+   mode these writes are ignored like the others until the next cache
+   flush. */
+void dynarec_save_ram(struct dynarec_state *state) {
+   uint32_t i;
+
+   if (state->options & DYNAREC_OPT_LAZY_INVALIDATE) {
+      return;
+   }
+
+   if (state->ram_copy == NULL) {
+      state->ram_copy = malloc(PSX_RAM_SIZE);
+
+      if (state->ram_copy == NULL) {
+         return;
+      }
+   }
+
+   for (i = 0; i < DYNAREC_RAM_PAGES; i++) {
+      if (state->page_valid[i]) {
+         memcpy(state->ram_copy + i * DYNAREC_PAGE_INSTRUCTIONS,
+                dynarec_page_code(state, i),
+                DYNAREC_PAGE_SIZE);
+      }
+   }
+}
+
+/* Invalidate the recompiled RAM pages that changed since the last
+   `dynarec_save_ram`. Nothing can be compiled in between so the valid
+   pages have all been saved. */
+void dynarec_check_ram(struct dynarec_state *state) {
+   uint32_t i;
+
+   if (state->ram_copy == NULL ||
+       (state->options & DYNAREC_OPT_LAZY_INVALIDATE)) {
+      return;
+   }
+
+   for (i = 0; i < DYNAREC_RAM_PAGES; i++) {
+      if (state->page_valid[i] &&
+          memcmp(state->ram_copy + i * DYNAREC_PAGE_INSTRUCTIONS,
+                 dynarec_page_code(state, i),
+                 DYNAREC_PAGE_SIZE) != 0) {
+         DYNAREC_LOG("Page %u modified by the frontend\n", i);
+         dynarec_invalidate_page(state, i);
+      }
+   }
+}
+
+/* Change the DYNAREC_OPT_* flags. The recompiled code depends on them
+   so everything has to be recompiled if they change. */
+void dynarec_set_options(struct dynarec_state *state, uint32_t options) {
+   uint32_t i;
+
+   if (fastmem_unavailable) {
+      options &= ~DYNAREC_OPT_FASTMEM;
+   }
+
+   if (options == state->options) {
+      return;
+   }
+
+   /* The worker may be compiling with the old options */
+   dynarec_worker_flush(state);
+
+   if ((options & DYNAREC_OPT_FASTMEM) && state->fastmem == NULL) {
+      if (dynarec_fastmem_enable(state) < 0) {
+         DYNAREC_LOG("fastmem unavailable, disabling it\n");
+         fastmem_unavailable = true;
+         options &= ~DYNAREC_OPT_FASTMEM;
+      }
+   }
+
+   state->options = options;
+
+   for (i = 0; i < DYNAREC_TOTAL_PAGES; i++) {
+      dynarec_invalidate_page(state, i);
+   }
+
+   /* All the code is gone, start over with an empty arena */
+   dynarec_arena_reset(state);
+
+   if (options & DYNAREC_OPT_FASTMEM) {
+      /* The write protection of the RAM depends on the invalidation
+         mode */
+      dynarec_fastmem_protect_all(state);
+   } else {
+      dynarec_fastmem_disable(state);
+   }
+
+   if ((options & DYNAREC_OPT_TIERED) && state->worker == NULL) {
+      dynarec_worker_start(state);
+   } else if (!(options & DYNAREC_OPT_TIERED)) {
+      dynarec_worker_stop(state);
+   }
+
+   if ((options & DYNAREC_OPT_JITDUMP) && state->jitdump == NULL) {
+      dynarec_jitdump_open(state);
+   } else if (!(options & DYNAREC_OPT_JITDUMP)) {
+      dynarec_jitdump_close(state);
+   }
+}
+
+/* Set the directory used by DYNAREC_OPT_CODE_CACHE, it's created if
+   needed. NULL disables the cache. */
+void dynarec_set_cache_dir(struct dynarec_state *state, const char *dir) {
+   /* The worker may be reading it */
+   dynarec_worker_flush(state);
+
+   free(state->cache_dir);
+   state->cache_dir = NULL;
+
+   if (dir == NULL) {
+      return;
+   }
+
+   if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+      DYNAREC_LOG("Can't create the cache directory %s\n", dir);
+      return;
+   }
+
+   dynarec_cache_prune(dir);
+
+   state->cache_dir = strdup(dir);
+}
+
+/* Update the copy of the COP0 status register. In lazy invalidate mode
+   this is where we detect cache flushes: the BIOS (and some games)
+   flush the instruction cache by isolating it and writing to the cache
+   lines, we drop everything when the cache is reconnected. */
+void dynarec_set_sr(struct dynarec_state *state, uint32_t sr) {
+   const uint32_t changed = state->sr ^ sr;
+
+   if ((state->options & DYNAREC_OPT_LAZY_INVALIDATE) &&
+       (state->sr & SR_ISOLATE_CACHE) && !(sr & SR_ISOLATE_CACHE)) {
+      dynarec_flush_cache(state);
+   }
+
+   state->sr = sr;
+
+   if (changed & SR_ISOLATE_CACHE) {
+      /* Fastmem stores must fault while the cache is isolated */
+      dynarec_fastmem_protect_all(state);
+   }
+}
+
+/* Called by the recompiled code in debug builds when an SP-relative
+   access doesn't target RAM in fast SP mode */
+void dynarec_fast_sp_fault(struct dynarec_state *state,
+                           uint32_t addr,
+                           uint32_t pc) {
+   DYNAREC_FATAL("Fast SP access to 0x%08x outside of RAM at 0x%08x\n",
+                 addr, (pc & ~3U) | state->region);
+}
+
+/* Idle loop skipping. The branch of a loop that passes
+   `dynarec_idle_loop_check` calls us every time it's taken. Once two
+   consecutive iterations took the same number of cycles the loop is
+   in a steady state: its registers are recomputed from scratch every
+   time and it only reads memory that can't change before the next
+   event, so all the following iterations are going to be identical
+   until then. We skip all the ones that would complete before the
+   counter runs out, the last one runs normally. */
+int32_t dynarec_idle_loop(struct dynarec_state *state,
+                          uint32_t pc,
+                          int32_t counter) {
+   const int32_t cost = state->idle_counter - counter;
+
+   if (pc != state->idle_pc) {
+      state->idle_pc = pc;
+      state->idle_cost = 0;
+      state->idle_candidate = true;
+   } else if (cost != state->idle_cost) {
+      state->idle_cost = cost;
+   } else if (state->idle_candidate && cost > 0 && counter > cost) {
+      int32_t page_index = dynarec_find_page_index(state, pc);
+
+      if (page_index >= 0 &&
+          !(state->sr & SR_ISOLATE_CACHE) &&
+          dynarec_idle_loop_check(dynarec_page_code(state, page_index),
+                                  pc,
+                                  state->regs)) {
+         counter -= ((counter - 1) / cost) * cost;
+      } else {
+         state->idle_candidate = false;
+      }
+   }
+
+   state->idle_counter = counter;
+
+   return counter;
+}
+
+/* Tiered mode: called when the execution reaches `pc`. Returns true
+   if the dynarec can run it, otherwise the code must be interpreted
+   and we count the hit, compiling the page once it's hot. */
+bool dynarec_tier_ready(struct dynarec_state *state, uint32_t pc) {
+   int32_t page_index;
+
+   dynarec_worker_collect(state);
+
+   page_index = dynarec_find_page_index(state, pc);
    if (page_index < 0) {
-      DYNAREC_FATAL("Unhandled address PC 0x%08x\n", state->pc);
+      /* We can't compile that, keep interpreting it */
+      return false;
+   }
+
+   if (state->page_valid[page_index]) {
+      return true;
    }
 
-   if (!state->page_valid[page_index]) {
-      if (dynarec_recompile(state, page_index) < 0) {
-         DYNAREC_FATAL("Recompilation failed\n");
+   if (state->page_hits[page_index] < DYNAREC_HOT_THRESHOLD) {
+      state->page_hits[page_index]++;
+      return false;
+   }
+
+   if (state->worker) {
+      if (!dynarec_worker_pending(state, page_index)) {
+         dynarec_worker_queue(state, page_index);
       }
+      return false;
+   }
+
+   /* No worker thread, compile it right away */
+   if (dynarec_recompile(state, page_index) < 0) {
+      DYNAREC_FATAL("Recompilation failed\n");
    }
 
-   dynarec_fn_t f = (dynarec_fn_t)dynarec_page_start(state, page_index);
+   dynarec_fastmem_protect_page(state, page_index);
+
+   return true;
+}
+
+/* Run the recompiled code until `cycles_to_run` have elapsed (or
+   more precisely until we're past that point, we only check the
+   counter on page exits and backward jumps). Returns the updated
+   counter. In tiered mode it also returns early, with a positive
+   counter, when it reaches code that isn't compiled yet. It does the
+   same in any mode, setting `unsupported`, when it reaches code it
+   can't compile at all. */
+int32_t dynarec_run(struct dynarec_state *state, int32_t cycles_to_run) {
+   int32_t counter = cycles_to_run;
+
+   /* The PC might have been changed by the emulator since the last
+      exit, we can't link that jump */
+   state->link_site = NULL;
+
+   /* The counter doesn't count from the same event anymore */
+   state->idle_pc = ~0U;
+
+   while (counter > 0) {
+      int32_t page_index;
+      uint32_t pc = state->pc;
+      uint32_t index;
+      dynarec_fn_t f;
+
+      /* Keep track of the region we're running from, recompiled code
+         only deals with canonical addresses */
+      state->region = pc & 0xe0000000;
+
+      if (pc & 3) {
+         /* Jump to an unaligned address. We can't be in a delay slot
+            here, EPC is the address itself. */
+         counter = dynarec_callback_exception(state,
+                                              PSX_EXCEPTION_LOAD_ALIGN,
+                                              pc,
+                                              counter,
+                                              pc);
+         state->link_site = NULL;
+         continue;
+      }
+
+      if ((state->options & DYNAREC_OPT_LAZY_INVALIDATE) &&
+          dynarec_mask_address(pc) == BIOS_A_FUNCTIONS) {
+         /* BIOS call, catch FlushCache early. We can't link jumps
+            here or we wouldn't see the subsequent calls. */
+         if (dynarec_get_reg(state, PSX_REG_T1) == BIOS_A_FLUSH_CACHE) {
+            dynarec_flush_cache(state);
+         }
+
+         state->link_site = NULL;
+      }
+
+      if ((state->options & DYNAREC_OPT_HLE_BIOS) &&
+          dynarec_mask_address(pc) == BIOS_A_FUNCTIONS) {
+         /* Same thing, don't link the jump so that we see every
+            call */
+         state->link_site = NULL;
+
+         counter = dynarec_callback_hle_bios(state, counter);
+         if (state->pc != pc) {
+            continue;
+         }
+      }
+
+      if ((state->options & DYNAREC_OPT_TIERED) &&
+          !dynarec_tier_ready(state, pc)) {
+         /* Not compiled yet, let the emulator interpret it */
+         return counter;
+      }
+
+      page_index = dynarec_find_page_index(state, pc);
+      if (page_index < 0) {
+         /* Expansion ROM or scratchpad, let the emulator interpret
+            it */
+         DYNAREC_LOG("Unhandled address PC 0x%08x\n", pc);
+         state->unsupported = true;
+         return counter;
+      }
+
+      if (!state->page_valid[page_index]) {
+         if (dynarec_recompile(state, page_index) < 0) {
+            DYNAREC_FATAL("Recompilation failed\n");
+         }
+
+         /* Stores to the page must fault now */
+         dynarec_fastmem_protect_page(state, page_index);
+      }
+
+      index = (dynarec_mask_address(pc) % DYNAREC_PAGE_SIZE) >> 2;
+      f = (dynarec_fn_t)(dynarec_page_start(state, page_index) +
+                         state->page_instructions[page_index][index]);
+
+      if (state->link_site) {
+         /* We exited through a jump into another page, patch it to go
+            there directly next time */
+         dynarec_link(state, state->link_site, page_index, f);
+         state->link_site = NULL;
+      }
+
+      counter = dynasm_execute(state,
+                               (dynarec_fn_t)dynarec_page_start(state,
+                                                                page_index),
+                               f,
+                               counter);
+   }
 
-   return dynasm_execute(state, f, cycles_to_run);
+   return counter;
 }
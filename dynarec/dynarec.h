@@ -5,6 +5,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -62,6 +63,132 @@ extern "C" {
    } while(0)
 
 struct dynarec_state;
+struct dynarec_worker;
+
+/* Value returned by the load callbacks below. It's returned in a
+   single 64bit register on AMD64. */
+struct dynarec_load_val {
+   /* Value read from memory, zero-extended */
+   uint32_t value;
+   /* Updated cycle counter */
+   int32_t  counter;
+};
+
+/* Value returned by `dynarec_callback_cop` */
+struct dynarec_cop_ret {
+   /* Updated cycle counter */
+   int32_t  counter;
+   /* If non-zero the recompiled code must return immediately to
+      `dynarec_run`. `state->pc` contains the address of the next
+      instruction to be executed (for instance the exception
+      handler). */
+   uint32_t exit;
+   /* Value to be stored in the target register (MFCn, CFCn) */
+   uint32_t value;
+   uint32_t padding;
+};
+
+/* Maximum number of direct jumps from other pages into a single
+   page. Once a page is full additional jumps are simply not linked. */
+#define DYNAREC_MAX_PAGE_LINKS 64U
+
+/* A direct jump from recompiled code into another page. It's only
+   meaningful as long as the page containing the jump hasn't been
+   recompiled since, which is tracked using `page_generation`. */
+struct dynarec_link {
+   /* Location of the patchable jump */
+   uint8_t            *site;
+   /* Index of the page containing the jump */
+   uint32_t            page;
+   /* Generation of that page when the link was created */
+   uint32_t            generation;
+};
+
+/* List of the jumps linked into a given page, they need to be
+   unlinked when the page is invalidated */
+struct dynarec_page_links {
+   uint32_t            len;
+   struct dynarec_link link[DYNAREC_MAX_PAGE_LINKS];
+};
+
+/* Options for `dynarec_set_options` */
+
+/* Assume that stores don't modify code until the instruction cache is
+   flushed (through the BIOS FlushCache call or by isolating the
+   cache). Stores and `dynarec_invalidate` skip the invalidation checks
+   and all RAM pages are dropped at once when a flush is detected. */
+#define DYNAREC_OPT_LAZY_INVALIDATE (1U << 0)
+
+/* Assume that loads and stores using SP as base address target the
+   stack in RAM and access it directly, without checking for devices
+   or cache isolation. Debug builds abort if the assumption doesn't
+   hold. */
+#define DYNAREC_OPT_FAST_SP         (1U << 1)
+
+/* Map the PSX address space in a host memory window and access RAM
+   directly through it. Accesses to anything else fault and are
+   patched to go through the regular code. Only available with
+   backends defining DYNAREC_HAVE_FASTMEM, silently ignored
+   otherwise. */
+#define DYNAREC_OPT_FASTMEM         (1U << 2)
+
+/* Don't compile code the first time it runs: `dynarec_run` returns
+   early when it reaches a page that isn't compiled and the emulator
+   interprets it, calling `dynarec_tier_ready` when it jumps. Pages
+   entered DYNAREC_HOT_THRESHOLD times are compiled on a worker thread
+   (synchronously if threads aren't available). */
+#define DYNAREC_OPT_TIERED          (1U << 3)
+
+/* Save the recompiled pages in the directory set with
+   `dynarec_set_cache_dir` and load them back instead of recompiling
+   pages with the same code. Only available with backends defining
+   DYNAREC_HAVE_CODE_CACHE, silently ignored otherwise. */
+#define DYNAREC_OPT_CODE_CACHE      (1U << 4)
+
+/* Describe the recompiled pages in /tmp/jit-<pid>.dump so that
+   `perf inject --jit` can name the samples taken in the map after the
+   emulated code */
+#define DYNAREC_OPT_JITDUMP         (1U << 5)
+
+/* Detect loops that only poll memory and skip the iterations that
+   can't observe a change before the next event. See
+   `dynarec_idle_loop`. */
+#define DYNAREC_OPT_IDLE_SKIP       (1U << 6)
+
+/* Let the emulator run the BIOS "A" library functions natively when
+   they're called through 0xa0, see `dynarec_callback_hle_bios`. Calls
+   from recompiled code in the first RAM page are not caught. */
+#define DYNAREC_OPT_HLE_BIOS        (1U << 7)
+
+/* Number of times a page must be entered in tiered mode before we
+   compile it */
+#define DYNAREC_HOT_THRESHOLD       32U
+
+/* Maximum length in instructions of an idle loop, including the
+   branch and its delay slot */
+#define DYNAREC_IDLE_LOOP_MAX       16U
+
+/* Size of the executable arena holding the recompiled pages. When
+   it's full the oldest pages are evicted to make room. */
+#ifndef DYNAREC_ARENA_SIZE
+# define DYNAREC_ARENA_SIZE         (32U * 1024U * 1024U)
+#endif
+
+/* Allocation granularity in the arena */
+#define DYNAREC_ARENA_GRANULE       1024U
+
+/* Number of granules in the arena */
+#define DYNAREC_ARENA_GRANULES      (DYNAREC_ARENA_SIZE / DYNAREC_ARENA_GRANULE)
+
+/* `page_offset` of the pages without code in the arena */
+#define DYNAREC_NO_CODE             0xffffffffU
+
+/* Size of the fastmem window: the whole 32bit PSX address space */
+#define DYNAREC_FASTMEM_SIZE        (1ULL << 32)
+
+/* Flag set in the `pc` argument of the callbacks when the instruction
+   is in a branch delay slot. */
+#define DYNAREC_PC_DELAY_SLOT 1U
 
 struct dynarec_state {
    /* Current value of the PC */
@@ -75,20 +202,84 @@ struct dynarec_state {
    uint32_t           *scratchpad;
    /* Pointer to the PSX BIOS */
    const uint32_t     *bios;
-   /* All general purpose CPU registers except R0 plus the "dynarec
-      temporary" register. */
-   uint32_t            regs[32];
-   /* Cop0r12: status register */
+   /* All general purpose CPU registers except R0, followed by the
+      "dynarec temporary", HI, LO and the two load delay
+      temporaries. See `enum PSX_REG`. */
+   uint32_t            regs[36];
+   /* Cop0r12: status register. This is a copy of the emulator's
+      register, it's only modified by the callbacks through
+      `dynarec_set_sr`. */
    uint32_t            sr;
-   /* Executable region of memory containing the dynarec'd code */
+   /* DYNAREC_OPT_* flags */
+   uint32_t            options;
+   /* Region bits (KUSEG/KSEG0/KSEG1) of the code currently
+      running. Recompiled code works with canonical addresses, these
+      bits are added back when a PC value becomes visible to the
+      emulated code (link registers, exceptions etc...) */
+   uint32_t            region;
+   /* Set by the recompiled code when it exits through a jump that
+      could be linked directly to its target, NULL otherwise */
+   uint8_t            *link_site;
+   /* Host window mapping the PSX address space when
+      DYNAREC_OPT_FASTMEM is enabled, NULL otherwise */
+   uint8_t            *fastmem;
+   /* Executable arena containing the dynarec'd code */
    uint8_t            *map;
    /* Length of the map */
    uint32_t            map_len;
+   /* Offset in the map where the next page will be allocated */
+   uint32_t            map_head;
+   /* Page owning each granule of the map plus one, 0 if it's free */
+   uint16_t            map_owner[DYNAREC_ARENA_GRANULES];
    /* Keeps track of whether each page is valid or needs to be
       recompiled */
    uint8_t             page_valid[DYNAREC_TOTAL_PAGES];
-   /* Look up table for any (valid) recompiled instruction */
-   void               *dynarec_instructions[DYNAREC_TOTAL_INSTRUCTIONS];
+   /* Offset of each page's code in the map, DYNAREC_NO_CODE if it
+      has none */
+   uint32_t            page_offset[DYNAREC_TOTAL_PAGES];
+   /* Length of each page's allocation in the map */
+   uint32_t            page_len[DYNAREC_TOTAL_PAGES];
+   /* Offset of each recompiled instruction from the start of its
+      page. Allocated the first time a page is compiled, NULL
+      before. */
+   uint32_t           *page_instructions[DYNAREC_TOTAL_PAGES];
+   /* Incremented every time a page is recompiled */
+   uint32_t            page_generation[DYNAREC_TOTAL_PAGES];
+   /* Jumps from other pages linked into each page */
+   struct dynarec_page_links page_links[DYNAREC_TOTAL_PAGES];
+   /* Number of times each page has been entered while it wasn't
+      compiled, in tiered mode */
+   uint16_t            page_hits[DYNAREC_TOTAL_PAGES];
+   /* Background compilation thread for tiered mode, NULL if it's not
+      running */
+   struct dynarec_worker *worker;
+   /* Directory of the translation cache, NULL if not set */
+   char               *cache_dir;
+   /* Copy of the recompiled RAM pages, see `dynarec_save_ram`. NULL
+      until the first save. */
+   uint32_t           *ram_copy;
+   /* jitdump file when DYNAREC_OPT_JITDUMP is set, NULL otherwise */
+   FILE               *jitdump;
+   /* Executable mapping of the jitdump's first page, that's how perf
+      finds it */
+   void               *jitdump_marker;
+   size_t              jitdump_marker_len;
+   /* Index of the next JIT_CODE_LOAD record */
+   uint64_t            jitdump_index;
+   /* Branch of the last idle loop candidate we went through, see
+      `dynarec_idle_loop` */
+   uint32_t            idle_pc;
+   /* Cycle counter the last time we took that branch */
+   int32_t             idle_counter;
+   /* Cycles taken by the last iteration of the loop */
+   int32_t             idle_cost;
+   /* False once the loop turned out to access memory that can change
+      without an event */
+   bool                idle_candidate;
+   /* Set when `dynarec_run` returned because it reached code it
+      can't recompile (outside of RAM and BIOS), which must then be
+      interpreted */
+   bool                unsupported;
 };
 
 extern struct dynarec_state *dynarec_init(uint32_t *ram,
@@ -108,6 +299,146 @@ extern void dynarec_set_pc(struct dynarec_state *state,
                            uint32_t pc);
 extern int32_t dynarec_run(struct dynarec_state *state,
                            int32_t cycles_to_run);
+extern void dynarec_invalidate(struct dynarec_state *state,
+                               uint32_t addr);
+extern void dynarec_invalidate_page(struct dynarec_state *state,
+                                    uint32_t page_index);
+extern void dynarec_flush_cache(struct dynarec_state *state);
+extern void dynarec_save_ram(struct dynarec_state *state);
+extern void dynarec_check_ram(struct dynarec_state *state);
+extern void dynarec_set_options(struct dynarec_state *state,
+                                uint32_t options);
+extern void dynarec_set_sr(struct dynarec_state *state,
+                           uint32_t sr);
+extern bool dynarec_tier_ready(struct dynarec_state *state,
+                               uint32_t pc);
+extern void dynarec_set_cache_dir(struct dynarec_state *state,
+                                  const char *dir);
+
+/* Called by the emulator when it writes to RAM behind the dynarec's
+   back (DMA, pokes...). `offset` is the offset of the write in
+   RAM. Writes to pages that don't contain recompiled code only cost a
+   test of `page_valid`. */
+static inline void dynarec_invalidate_ram(struct dynarec_state *state,
+                                          uint32_t offset) {
+   const uint32_t page_index = (offset % PSX_RAM_SIZE) / DYNAREC_PAGE_SIZE;
+
+   if (state->page_valid[page_index] &&
+       !(state->options & DYNAREC_OPT_LAZY_INVALIDATE)) {
+      dynarec_invalidate_page(state, page_index);
+   }
+}
+
+/* Indexes of HI and LO for `dynarec_get_reg` and `dynarec_set_reg` */
+#define DYNAREC_REG_HI 33U
+#define DYNAREC_REG_LO 34U
+
+/* Read the value of the PSX general purpose register `reg` */
+static inline uint32_t dynarec_get_reg(const struct dynarec_state *state,
+                                       unsigned reg) {
+   return reg ? state->regs[reg - 1] : 0;
+}
+
+/* Set the value of the PSX general purpose register `reg` */
+static inline void dynarec_set_reg(struct dynarec_state *state,
+                                   unsigned reg,
+                                   uint32_t v) {
+   if (reg) {
+      state->regs[reg - 1] = v;
+   }
+}
+
+/* These callbacks are provided by the emulator. They're called by the
+   recompiled code (through the architecture-dependent helpers) when
+   it needs to do something that's not handled directly by the
+   dynarec.
+
+   `counter` is the number of cycles left before the next event, the
+   callbacks return the updated value. */
+
+/* Memory accesses that don't target RAM or the scratchpad */
+extern int32_t dynarec_callback_sb(struct dynarec_state *s,
+                                   uint32_t val,
+                                   uint32_t addr,
+                                   int32_t counter);
+extern int32_t dynarec_callback_sh(struct dynarec_state *s,
+                                   uint32_t val,
+                                   uint32_t addr,
+                                   int32_t counter);
+extern int32_t dynarec_callback_sw(struct dynarec_state *s,
+                                   uint32_t val,
+                                   uint32_t addr,
+                                   int32_t counter);
+extern struct dynarec_load_val dynarec_callback_lb(struct dynarec_state *s,
+                                                   uint32_t addr,
+                                                   int32_t counter);
+extern struct dynarec_load_val dynarec_callback_lh(struct dynarec_state *s,
+                                                   uint32_t addr,
+                                                   int32_t counter);
+extern struct dynarec_load_val dynarec_callback_lw(struct dynarec_state *s,
+                                                   uint32_t addr,
+                                                   int32_t counter);
+
+/* Unaligned memory accesses. `cur` is the current value of the target
+   register that's partially overwritten by the load. */
+extern struct dynarec_load_val dynarec_callback_lwl(struct dynarec_state *s,
+                                                    uint32_t cur,
+                                                    uint32_t addr,
+                                                    int32_t counter);
+extern struct dynarec_load_val dynarec_callback_lwr(struct dynarec_state *s,
+                                                    uint32_t cur,
+                                                    uint32_t addr,
+                                                    int32_t counter);
+extern int32_t dynarec_callback_swl(struct dynarec_state *s,
+                                    uint32_t val,
+                                    uint32_t addr,
+                                    int32_t counter);
+extern int32_t dynarec_callback_swr(struct dynarec_state *s,
+                                    uint32_t val,
+                                    uint32_t addr,
+                                    int32_t counter);
+
+/* Raise exception `code` for the instruction at `pc` (which may have
+   DYNAREC_PC_DELAY_SLOT set). Must set `s->pc` to the address of the
+   exception handler. `bad_vaddr` is only meaningful for address
+   errors. For an instruction fetch from an unaligned address `pc` is
+   that address, low bits included, and so is `bad_vaddr`. */
+extern int32_t dynarec_callback_exception(struct dynarec_state *s,
+                                          uint32_t code,
+                                          uint32_t pc,
+                                          int32_t counter,
+                                          uint32_t bad_vaddr);
+
+/* Called when reaching the BIOS "A" functions entry point with
+   DYNAREC_OPT_HLE_BIOS set. If the emulator runs the function itself
+   it sets `s->pc` to the return address. It should only do so if the
+   function fits in the `counter` cycles left before the next event,
+   otherwise the BIOS code runs. Returns the updated counter. */
+extern int32_t dynarec_callback_hle_bios(struct dynarec_state *s,
+                                         int32_t counter);
+
+/* Execute coprocessor instruction `instruction` at `pc` (COPn, LWCn
+   and SWCn, except for the branches). `operand` is the value of the
+   source register for MTCn/CTCn or the target address for LWCn/SWCn */
+extern struct dynarec_cop_ret dynarec_callback_cop(struct dynarec_state *s,
+                                                   uint32_t instruction,
+                                                   uint32_t pc,
+                                                   int32_t counter,
+                                                   uint32_t operand);
+
+/* GTE instructions called directly from the recompiled code, which
+   checks that the GTE is enabled and that the LWC2/SWC2 address is
+   aligned beforehand. `dynarec_callback_gte` runs the commands,
+   MTC2/CTC2 (`operand` is the value of the source register) and
+   LWC2/SWC2 (`operand` is the target address).
+   `dynarec_callback_gte_read` returns the value read by MFC2/CFC2. */
+extern int32_t dynarec_callback_gte(struct dynarec_state *s,
+                                    uint32_t instruction,
+                                    uint32_t operand,
+                                    int32_t counter);
+extern struct dynarec_load_val dynarec_callback_gte_read(struct dynarec_state *s,
+                                                         uint32_t instruction,
+                                                         int32_t counter);
 
 #ifdef __cplusplus
 }
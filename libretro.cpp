@@ -53,6 +53,10 @@ int64 cd_slow_timeout = 8000; // microseconds
 int32_t psx_overclock_factor = 0;
 // GPU rasterizer overclock shift
 unsigned psx_gpu_overclock_shift = 0;
+// Run the software renderer on its own thread
+bool psx_gpu_thread = false;
+// Number of threads sharing the software rendering, in bands of lines
+unsigned psx_gpu_threads = 1;
 
 // Sets how often (in number of output frames/retro_run invocations)
 // the internal framerace counter should be updated if
@@ -62,6 +66,19 @@ unsigned psx_gpu_overclock_shift = 0;
 static int psx_skipbios;
 
 bool psx_gte_overclock;
+bool psx_cpu_idle_skip;
+bool psx_cpu_hle_bios;
+unsigned psx_cpu_profiler;
+#ifdef HAVE_DYNAREC
+unsigned psx_dynarec_mode;
+bool psx_dynarec_lazy_invalidate;
+bool psx_dynarec_fast_sp;
+bool psx_dynarec_fastmem;
+bool psx_dynarec_tiered;
+bool psx_dynarec_cache;
+bool psx_dynarec_jitdump;
+bool psx_dynarec_ram_check;
+#endif
 static bool is_pal;
 enum dither_mode psx_gpu_dither_mode;
 
@@ -326,7 +343,8 @@ FrontIO *FIO = NULL;
 MultiAccessSizeMem<512 * 1024, uint32, false> *BIOSROM = NULL;
 static MultiAccessSizeMem<65536, uint32, false> *PIOMem = NULL;
 
-MultiAccessSizeMem<2048 * 1024, uint32, false> MainRAM;
+/* Page-aligned so that the dynarec can remap it for fastmem */
+MultiAccessSizeMem<2048 * 1024, uint32, false> MainRAM MDFN_ALIGN(4096);
 
 static uint32_t TextMem_Start;
 static std::vector<uint8> TextMem;
@@ -587,6 +605,12 @@ template<typename T, bool IsWrite, bool Access24> static INLINE void MemRW(int32
             V = MainRAM.Read<T>(A & 0x1FFFFF);
       }
 
+#ifdef HAVE_DYNAREC
+      /* Stores from the interpreter (tiered dynarec mode) */
+      if (IsWrite && dynarec_state)
+         dynarec_invalidate_ram(dynarec_state, A & 0x1FFFFF);
+#endif
+
       return;
    }
 
@@ -930,24 +954,6 @@ uint32_t MDFN_FASTCALL PSX_MemRead32(int32_t &timestamp, uint32_t A)
    return(V);
 }
 
-#ifdef HAVE_DYNAREC
-/* Callbacks used by the dynarec to handle device memory access */
-extern "C" int32_t dynarec_callback_sw(struct dynarec_state *s,
-                                       uint32_t val,
-                                       uint32_t addr,
-                                       int32_t counter) {
-   int32_t timestamp = CPU->GetEventNT() - counter;
-
-   printf("dynarec sw %08x @ %08x (%d)\n", val, addr, counter);
-
-   PSX_MemWrite32(timestamp, addr, val);
-
-   /* recompute the timestamp, it's possible that the "next event"
-      timestamp has been modified */
-   return CPU->GetEventNT() - timestamp;
-}
-#endif /* HAVE_DYNAREC */
-
 template<typename T, bool Access24> static INLINE uint32_t MemPeek(int32_t timestamp, uint32_t A)
 {
    if(A < 0x00800000)
@@ -1094,6 +1100,10 @@ static void PSX_Power(void)
    cd_warned_slow = false;
 
    memset(MainRAM.data32, 0, 2048 * 1024);
+#ifdef HAVE_DYNAREC
+   if (dynarec_state)
+      dynarec_flush_cache(dynarec_state);
+#endif
 
    for(i = 0; i < 9; i++)
       SysControl.Regs[i] = 0;
@@ -1127,6 +1137,10 @@ template<typename T, bool Access24> static INLINE void MemPoke(pscpu_timestamp_t
       else
          MainRAM.Write<T>(A & 0x1FFFFF, V);
 
+#ifdef HAVE_DYNAREC
+      if (dynarec_state)
+         dynarec_invalidate_ram(dynarec_state, A & 0x1FFFFF);
+#endif
       return;
    }
 
@@ -1137,6 +1151,11 @@ template<typename T, bool Access24> static INLINE void MemPoke(pscpu_timestamp_t
       else
          BIOSROM->Write<T>(A & 0x7FFFF, V);
 
+#ifdef HAVE_DYNAREC
+      if (dynarec_state)
+         dynarec_invalidate_page(dynarec_state,
+                                 dynarec_find_page_index(dynarec_state, A));
+#endif
       return;
    }
 
@@ -1177,6 +1196,11 @@ void PSX_GPULineHook(const int32_t timestamp, const int32_t line_timestamp, bool
    FIO->GPULineHook(timestamp, line_timestamp, vsync, pixels, format, width, pix_clock_offset, pix_clock, pix_clock_divider);
 }
 
+bool PSX_GPULineHookNeedsPixels(void)
+{
+   return FIO->RequireNoFrameskip();
+}
+
 static bool TestMagic(const char *name, RFILE *fp, int64_t size)
 {
    uint8_t header[8];
@@ -2020,6 +2044,12 @@ int StateAction(StateMem *sm, int load, int data_only)
    // Call SetDisc() BEFORE we load CDC state, since SetDisc() has emulation side effects.  We might want to clean this up in the future.
    if(load)
    {
+#ifdef HAVE_DYNAREC
+      // The whole RAM has been replaced, drop the recompiled code
+      if (dynarec_state)
+         dynarec_flush_cache(dynarec_state);
+#endif
+
       if(CD_IsPBP)
       {
          if((!cdifs || CD_SelectedDisc >= PBP_DiscCount) && PBP_DiscCount > 0)
@@ -2728,6 +2758,42 @@ static void check_variables(bool startup)
    else
       psx_gte_overclock = false;
 
+   var.key = option_cpu_idle_skip;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "enabled") == 0)
+         psx_cpu_idle_skip = true;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_cpu_idle_skip = false;
+   }
+   else
+      psx_cpu_idle_skip = false;
+
+   var.key = option_cpu_hle_bios;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "enabled") == 0)
+         psx_cpu_hle_bios = true;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_cpu_hle_bios = false;
+   }
+   else
+      psx_cpu_hle_bios = false;
+
+   var.key = option_cpu_profiler;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "disabled") == 0)
+         psx_cpu_profiler = 0;
+      else
+         psx_cpu_profiler = atoi(var.value);
+   }
+   else
+      psx_cpu_profiler = 0;
+
    var.key = option_gpu_overclock;
 
    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
@@ -2749,6 +2815,25 @@ static void check_variables(bool startup)
    else
       psx_gpu_overclock_shift = 0;
 
+   var.key = option_gpu_thread;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "enabled") == 0)
+         psx_gpu_thread = true;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_gpu_thread = false;
+   }
+   else
+      psx_gpu_thread = false;
+
+   var.key = option_gpu_threads;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      psx_gpu_threads = atoi(var.value);
+   else
+      psx_gpu_threads = 1;
+
    var.key = option_skip_bios;
 
    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
@@ -3126,6 +3211,106 @@ static void check_variables(bool startup)
       }
    else
       cd_2x_speedup = 1;
+
+#ifdef HAVE_DYNAREC
+   var.key = option_dynarec;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "auto") == 0)
+         psx_dynarec_mode = DYNAREC_MODE_AUTO;
+      else if (strcmp(var.value, "enabled") == 0)
+         psx_dynarec_mode = DYNAREC_MODE_ENABLED;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_dynarec_mode = DYNAREC_MODE_DISABLED;
+   }
+   else
+      psx_dynarec_mode = DYNAREC_MODE_AUTO;
+
+   var.key = option_dynarec_invalidate;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "lazy") == 0)
+         psx_dynarec_lazy_invalidate = true;
+      else if (strcmp(var.value, "full") == 0)
+         psx_dynarec_lazy_invalidate = false;
+   }
+   else
+      psx_dynarec_lazy_invalidate = false;
+
+   var.key = option_dynarec_fast_sp;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "enabled") == 0)
+         psx_dynarec_fast_sp = true;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_dynarec_fast_sp = false;
+   }
+   else
+      psx_dynarec_fast_sp = false;
+
+   var.key = option_dynarec_fastmem;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "enabled") == 0)
+         psx_dynarec_fastmem = true;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_dynarec_fastmem = false;
+   }
+   else
+      psx_dynarec_fastmem = false;
+
+   var.key = option_dynarec_tiered;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "enabled") == 0)
+         psx_dynarec_tiered = true;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_dynarec_tiered = false;
+   }
+   else
+      psx_dynarec_tiered = false;
+
+   var.key = option_dynarec_cache;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "enabled") == 0)
+         psx_dynarec_cache = true;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_dynarec_cache = false;
+   }
+   else
+      psx_dynarec_cache = false;
+
+   var.key = option_dynarec_jitdump;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "enabled") == 0)
+         psx_dynarec_jitdump = true;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_dynarec_jitdump = false;
+   }
+   else
+      psx_dynarec_jitdump = false;
+
+   var.key = option_dynarec_ram_check;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+   {
+      if (strcmp(var.value, "enabled") == 0)
+         psx_dynarec_ram_check = true;
+      else if (strcmp(var.value, "disabled") == 0)
+         psx_dynarec_ram_check = false;
+   }
+   else
+      psx_dynarec_ram_check = false;
+#endif
 }
 
 #ifdef NEED_CD
@@ -3558,6 +3743,12 @@ void retro_run(void)
 
    espec->skip = false;
 
+#ifdef HAVE_DYNAREC
+   // The frontend may have written to RAM since the last frame
+   if (dynarec_state && psx_dynarec_ram_check)
+      dynarec_check_ram(dynarec_state);
+#endif
+
    MDFNMP_ApplyPeriodicCheats();
 
 
@@ -3568,11 +3759,19 @@ void retro_run(void)
    GPU_StartFrame(espec);
 
    Running = -1;
-   timestamp = CPU->Run(timestamp, false, false);
+   timestamp = CPU->Run(timestamp, false, psx_cpu_idle_skip);
 
    assert(timestamp);
 
    ForceEventUpdates(timestamp);
+
+#ifdef HAVE_DYNAREC
+   if (dynarec_state && psx_dynarec_ram_check)
+      dynarec_save_ram(dynarec_state);
+#endif
+
+   // The render thread must be done with the frame
+   GPU_Sync();
 #if 0
    if(GPU_GetScanlineNum() < 100)
       PSX_DBG(PSX_DBG_ERROR, "[BUUUUUUUG] Frame timing end glitch; scanline=%u, st=%u\n", GPU_GetScanlineNum(), timestamp);
@@ -3838,7 +4037,14 @@ void retro_set_environment(retro_environment_t cb)
       { option_frame_duping, "Frame duping (speedup); disabled|enabled" },
       { option_cpu_freq_scale, "CPU frequency scaling (overclock); 100% (native)|110%|120%|130%|140%|150%|160%|170%|180%|190%|200%|210%|220%|230%|240%|250%|260%|265%|270%|280%|290%|300%|310%|320%|330%|340%|350%|360%|370%|380%|390%|400%|410%|420%|430%|440%|450%|460%|470%|480%|490%|500%|50%|60%|70%|80%|90%" },
       { option_gte_overclock, "GTE Overclock; disabled|enabled" },
+      { option_cpu_idle_skip, "CPU idle loop skipping; disabled|enabled" },
+      { option_cpu_hle_bios, "Native BIOS library calls (memcpy, memset...); disabled|enabled" },
+      { option_cpu_profiler, "CPU profiler sampling period (cycles); disabled|256|1024|4096|16384" },
       { option_gpu_overclock, "GPU rasterizer overclock; 1x(native)|2x|4x|8x|16x|32x" },
+#ifdef HAVE_THREADS
+      { option_gpu_thread, "Software renderer thread; disabled|enabled" },
+      { option_gpu_threads, "Software renderer threads (bands); 1|2|3|4|6|8|12|16" },
+#endif
       { option_skip_bios, "Skip BIOS; disabled|enabled" },
       { option_dither_mode, "Dithering pattern; 1x(native)|internal resolution|disabled" },
       { option_display_internal_fps, "Display internal FPS; disabled|enabled" },
@@ -3864,6 +4070,16 @@ void retro_set_environment(retro_environment_t cb)
       { option_memcard1_enable, "Enable memory card 1; enabled|disabled" },
       { option_memcard_shared, "Shared memcards (restart); disabled|enabled" },
       { option_cd_fastload, "Increase CD loading speed; 2x (native)|4x|6x|8x|10x|12x|14x" },
+#ifdef HAVE_DYNAREC
+      { option_dynarec, "Dynarec; auto|enabled|disabled" },
+      { option_dynarec_invalidate, "Dynarec code invalidation; full|lazy" },
+      { option_dynarec_fast_sp, "Dynarec fast stack accesses; disabled|enabled" },
+      { option_dynarec_fastmem, "Dynarec fastmem; disabled|enabled" },
+      { option_dynarec_tiered, "Dynarec tiered compilation; disabled|enabled" },
+      { option_dynarec_cache, "Dynarec translation cache; disabled|enabled" },
+      { option_dynarec_jitdump, "Dynarec perf jitdump; disabled|enabled" },
+      { option_dynarec_ram_check, "Dynarec frontend RAM writes check; disabled|enabled" },
+#endif
       { NULL, NULL },
    };
    cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)vars);
@@ -44,13 +44,26 @@
 #define option_gun_cursor            "beetle_psx_hw_gun_cursor"
 #define option_cpu_freq_scale        "beetle_psx_hw_cpu_freq_scale"
 #define option_gte_overclock         "beetle_psx_hw_gte_overclock"
+#define option_cpu_idle_skip         "beetle_psx_hw_cpu_idle_skip"
+#define option_cpu_hle_bios          "beetle_psx_hw_cpu_hle_bios"
+#define option_cpu_profiler          "beetle_psx_hw_cpu_profiler"
 #define option_gpu_overclock         "beetle_psx_hw_gpu_overclock"
+#define option_gpu_thread            "beetle_psx_hw_gpu_thread"
+#define option_gpu_threads           "beetle_psx_hw_gpu_threads"
 #define option_cd_access_method      "beetle_psx_hw_cd_access_method"
 #define option_skip_bios             "beetle_psx_hw_skipbios"
 #define option_memcard0_method       "beetle_psx_hw_use_mednafen_memcard0_method"
 #define option_memcard1_enable       "beetle_psx_hw_enable_memcard1"
 #define option_memcard_shared        "beetle_psx_hw_shared_memory_cards"
 #define option_cd_fastload           "beetle_psx_hw_cd_fastload"
+#define option_dynarec               "beetle_psx_hw_dynarec"
+#define option_dynarec_invalidate    "beetle_psx_hw_dynarec_invalidate"
+#define option_dynarec_fast_sp       "beetle_psx_hw_dynarec_fast_sp"
+#define option_dynarec_fastmem       "beetle_psx_hw_dynarec_fastmem"
+#define option_dynarec_tiered        "beetle_psx_hw_dynarec_tiered"
+#define option_dynarec_cache         "beetle_psx_hw_dynarec_cache"
+#define option_dynarec_jitdump       "beetle_psx_hw_dynarec_jitdump"
+#define option_dynarec_ram_check     "beetle_psx_hw_dynarec_ram_check"
 #else
 #define option_renderer              "beetle_psx_renderer"
 #define option_renderer_software_fb  "beetle_psx_renderer_software_fb"
@@ -83,11 +96,24 @@
 #define option_gun_cursor            "beetle_psx_gun_cursor"
 #define option_cpu_freq_scale        "beetle_psx_cpu_freq_scale"
 #define option_gte_overclock         "beetle_psx_gte_overclock"
+#define option_cpu_idle_skip         "beetle_psx_cpu_idle_skip"
+#define option_cpu_hle_bios          "beetle_psx_cpu_hle_bios"
+#define option_cpu_profiler          "beetle_psx_cpu_profiler"
 #define option_gpu_overclock         "beetle_psx_gpu_overclock"
+#define option_gpu_thread            "beetle_psx_gpu_thread"
+#define option_gpu_threads           "beetle_psx_gpu_threads"
 #define option_cd_access_method      "beetle_psx_cd_access_method"
 #define option_skip_bios             "beetle_psx_skipbios"
 #define option_memcard0_method       "beetle_psx_use_mednafen_memcard0_method"
 #define option_memcard1_enable       "beetle_psx_enable_memcard1"
 #define option_memcard_shared        "beetle_psx_shared_memory_cards"
 #define option_cd_fastload           "beetle_psx_cd_fastload"
+#define option_dynarec               "beetle_psx_dynarec"
+#define option_dynarec_invalidate    "beetle_psx_dynarec_invalidate"
+#define option_dynarec_fast_sp       "beetle_psx_dynarec_fast_sp"
+#define option_dynarec_fastmem       "beetle_psx_dynarec_fastmem"
+#define option_dynarec_tiered        "beetle_psx_dynarec_tiered"
+#define option_dynarec_cache         "beetle_psx_dynarec_cache"
+#define option_dynarec_jitdump       "beetle_psx_dynarec_jitdump"
+#define option_dynarec_ram_check     "beetle_psx_dynarec_ram_check"
 #endif
@@ -36,11 +36,34 @@
 #ifdef HAVE_DYNAREC
 #include "dynarec.h"
 
+#ifdef DYNAREC_LOCKSTEP
+#include <stdarg.h>
+#endif
+
 struct dynarec_state *dynarec_state = NULL;
 
 #endif
 
 extern bool psx_gte_overclock;
+extern bool psx_cpu_hle_bios;
+extern unsigned psx_cpu_profiler;
+extern char retro_save_directory[];
+#ifdef HAVE_DYNAREC
+extern bool psx_dynarec_lazy_invalidate;
+extern bool psx_dynarec_fast_sp;
+extern bool psx_dynarec_fastmem;
+extern bool psx_dynarec_tiered;
+extern bool psx_dynarec_cache;
+extern bool psx_dynarec_jitdump;
+extern unsigned psx_dynarec_mode;
+#endif
+
+#ifdef DYNAREC_LOCKSTEP
+// Interpret one block at a time and check the dynarec against it, see DynarecLockstep()
+static const bool dynarec_lockstep = true;
+#else
+static const bool dynarec_lockstep = false;
+#endif
 
 
 #if 0
@@ -79,6 +102,17 @@ PS_CPU::PS_CPU()
 
  Halted = false;
 
+ IdleLoopPC = ~0U;
+ IdleLoopTS = 0;
+ IdleLoopCost = 0;
+ IdleLoopCandidate = false;
+
+ EventNT = 0;
+ next_event_ts = 0;
+ ProfileSamples = 0;
+ ProfilePeriod = 0;
+ ProfileNextTS = 0x7FFFFFFF;
+
  memset(FastMap, 0, sizeof(FastMap));
  memset(DummyPage, 0xFF, sizeof(DummyPage));	// 0xFF to trigger an illegal instruction exception, so we'll know what's up when debugging.
 
@@ -88,6 +122,18 @@ PS_CPU::PS_CPU()
  CPUHook = NULL;
  ADDBT = NULL;
 
+#ifdef HAVE_DYNAREC
+ DynarecFallback = false;
+ DynarecSettling = false;
+#endif
+
+#ifdef DYNAREC_LOCKSTEP
+ LockstepMode = LOCKSTEP_OFF;
+ LockstepPos = 0;
+ memset(LockstepGTE, 0, sizeof(LockstepGTE));
+ LockstepError[0] = 0;
+#endif
+
  GTE_Init();
 
  for(unsigned i = 0; i < 24; i++)
@@ -106,7 +152,19 @@ PS_CPU::PS_CPU()
 
 PS_CPU::~PS_CPU()
 {
+ if(ProfileSamples)
+ {
+  char path[4096];
+
+  snprintf(path, sizeof(path), "%s/beetle_psx_profile.txt", retro_save_directory);
+  if(WriteProfile(path))
+   log_cb(RETRO_LOG_INFO, "CPU profile written to %s\n", path);
+ }
 
+#ifdef DYNAREC_LOCKSTEP
+ free(LockstepGTE[0].data);
+ free(LockstepGTE[1].data);
+#endif
 
 }
 
@@ -182,6 +240,8 @@ void PS_CPU::Power(void)
   ICache[i].Data = 0;
  }
 
+ RedecodeICache();
+
  GTE_Power();
 }
 
@@ -248,6 +308,8 @@ int PS_CPU::StateAction(StateMem *sm, const unsigned load, const bool data_only)
   ReadAbsorbWhich &= 0x1F;
   BACKED_LDWhich %= 0x21;
 
+  RedecodeICache();
+
   //printf("PC=0x%08x, new_PC=0x%08x, BDBT=0x%02x\n", BACKED_PC, BACKED_new_PC, BDBT);
  }
  return ret;
@@ -390,6 +452,14 @@ INLINE T PS_CPU::ReadMemory(pscpu_timestamp_t &timestamp, uint32 address, bool D
    return ScratchRAM.Read<T>(address & 0x3FF);
  }
 
+#ifdef DYNAREC_LOCKSTEP
+ if(MDFN_UNLIKELY(LockstepMode == LOCKSTEP_REPLAY) && address >= 0x00800000)
+ {
+  LDAbsorb = 0;
+  return LockstepReplay(address, 0, DS24 ? 3 : sizeof(T), false);
+ }
+#endif
+
  timestamp += (ReadFudge >> 4) & 2;
 
  //assert(!(CP0.SR & 0x10000));
@@ -416,12 +486,26 @@ INLINE T PS_CPU::ReadMemory(pscpu_timestamp_t &timestamp, uint32 address, bool D
  LDAbsorb = (lts - timestamp);
  timestamp = lts;
 
+#ifdef DYNAREC_LOCKSTEP
+ if(MDFN_UNLIKELY(LockstepMode == LOCKSTEP_RECORD) && address >= 0x00800000)
+ {
+  const LockstepAccess access = { address, (uint32)ret, (uint8)(DS24 ? 3 : sizeof(T)), false };
+
+  LockstepAccesses.push_back(access);
+ }
+#endif
+
  return(ret);
 }
 
 template<typename T>
 INLINE void PS_CPU::WriteMemory(pscpu_timestamp_t &timestamp, uint32 address, uint32 value, bool DS24)
 {
+#ifdef DYNAREC_LOCKSTEP
+ if(MDFN_UNLIKELY(LockstepMode != LOCKSTEP_OFF) && !LockstepWrite(address, value, DS24 ? 3 : sizeof(T)))
+  return;
+#endif
+
  if(MDFN_LIKELY(!(CP0.SR & 0x10000)))
  {
   address &= addr_mask[address >> 29];
@@ -466,6 +550,7 @@ INLINE void PS_CPU::WriteMemory(pscpu_timestamp_t &timestamp, uint32 address, ui
    else
    {
     ICache[(address & 0xFFC) >> 2].Data = value << ((address & 0x3) * 8);
+    DecodeInstruction(&ICacheDecoded[(address & 0xFFC) >> 2], ICache[(address & 0xFFC) >> 2].Data);
    }
   }
 
@@ -480,6 +565,26 @@ INLINE void PS_CPU::WriteMemory(pscpu_timestamp_t &timestamp, uint32 address, ui
  }
 }
 
+INLINE void PS_CPU::DecodeInstruction(__ICacheDecoded *d, uint32 instr)
+{
+ d->opf = instr & 0x3F;
+
+ if(instr & (0x3F << 26))
+  d->opf = 0x40 | (instr >> 26);
+
+ d->rs = (instr >> 21) & 0x1F;
+ d->rt = (instr >> 16) & 0x1F;
+ d->rd = (instr >> 11) & 0x1F;
+ d->shamt = (instr >> 6) & 0x1F;
+ d->immediate = (int32)(int16)(instr & 0xFFFF);
+}
+
+void PS_CPU::RedecodeICache(void)
+{
+ for(unsigned i = 0; i < 1024; i++)
+  DecodeInstruction(&ICacheDecoded[i], ICache[i].Data);
+}
+
 //
 // ICache emulation here is not very accurate.  More accurate emulation had about a 6% performance penalty for simple
 // code that just looped infinitely, with no tangible known benefit for commercially-released games.
@@ -500,11 +605,12 @@ INLINE void PS_CPU::WriteMemory(pscpu_timestamp_t &timestamp, uint32 address, ui
 // Fill size of 2-words seems to work on a PS1, and even behaves as if the line size is 2 words in regards to clearing
 // the valid bits(when the tag matches, of course), but is obviously not very efficient unless running code that's just endless branching.
 //
-INLINE uint32 PS_CPU::ReadInstruction(pscpu_timestamp_t &timestamp, uint32 address)
+INLINE uint32 PS_CPU::ReadInstruction(pscpu_timestamp_t &timestamp, uint32 address, const __ICacheDecoded **dec)
 {
  uint32 instr;
 
  instr = ICache[(address & 0xFFC) >> 2].Data;
+ *dec = &ICacheDecoded[(address & 0xFFC) >> 2];
 
  if(ICache[(address & 0xFFC) >> 2].TV != address)
  {
@@ -514,6 +620,8 @@ INLINE uint32 PS_CPU::ReadInstruction(pscpu_timestamp_t &timestamp, uint32 addre
   if(address >= 0xA0000000 || !(BIU & 0x800))
   {
    instr = MDFN_de32lsb<true>((uint8*)(FastMap[address >> FAST_MAP_SHIFT] + address));
+   DecodeInstruction(&UncachedDecoded, instr);
+   *dec = &UncachedDecoded;
 
    if (!psx_gte_overclock) {
       timestamp += 4;	// Approximate best-case cache-disabled time, per PS1 tests(executing out of 0xA0000000+); it can be 5 in *some* sequences of code(like a lot of sequential "nop"s, probably other simple instructions too).
@@ -522,6 +630,7 @@ INLINE uint32 PS_CPU::ReadInstruction(pscpu_timestamp_t &timestamp, uint32 addre
   else
   {
    __ICache *ICI = &ICache[((address & 0xFF0) >> 2)];
+   __ICacheDecoded *ICD = &ICacheDecoded[((address & 0xFF0) >> 2)];
    const uint8 *FMP = (uint8*)(FastMap[(address & 0xFFFFFFF0) >> FAST_MAP_SHIFT] + (address & 0xFFFFFFF0));
 
    // | 0x2 to simulate (in)validity bits.
@@ -542,24 +651,28 @@ INLINE uint32 PS_CPU::ReadInstruction(pscpu_timestamp_t &timestamp, uint32 addre
         }
         ICI[0x00].TV &= ~0x2;
 	ICI[0x00].Data = MDFN_de32lsb<true>(&FMP[0x0]);
+	DecodeInstruction(&ICD[0x00], ICI[0x00].Data);
     case 0x4:
         if (!psx_gte_overclock) {
            timestamp++;
         }
         ICI[0x01].TV &= ~0x2;
 	ICI[0x01].Data = MDFN_de32lsb<true>(&FMP[0x4]);
+	DecodeInstruction(&ICD[0x01], ICI[0x01].Data);
     case 0x8:
         if (!psx_gte_overclock) {
            timestamp++;
         }
         ICI[0x02].TV &= ~0x2;
 	ICI[0x02].Data = MDFN_de32lsb<true>(&FMP[0x8]);
+	DecodeInstruction(&ICD[0x02], ICI[0x02].Data);
     case 0xC:
         if (!psx_gte_overclock) {
            timestamp++;
         }
         ICI[0x03].TV &= ~0x2;
 	ICI[0x03].Data = MDFN_de32lsb<true>(&FMP[0xC]);
+	DecodeInstruction(&ICD[0x03], ICI[0x03].Data);
 	break;
    }
    instr = ICache[(address & 0xFFC) >> 2].Data;
@@ -641,7 +754,534 @@ uint32 NO_INLINE PS_CPU::Exception(uint32 code, uint32 PC, const uint32 NP, cons
 #define GPR_RES(n) { unsigned tn = (n); ReadAbsorb[tn] = 0; }
 #define GPR_DEPRES_END ReadAbsorb[0] = back; }
 
-template<bool DebugMode, bool BIOSPrintMode, bool ILHMode>
+//
+// Idle loop skipping.  Games and the BIOS spend a lot of time in short loops polling memory until an interrupt or
+// a DMA changes something.  Such a loop must only be made of loads and ALU operations that recompute all the
+// registers they write every iteration, and must only read memory that can't change before the next event(RAM,
+// scratchpad, BIOS, I_STAT/I_MASK and GPUSTAT).  The dynarec has the same check, see dynarec_idle_loop_check().
+//
+// Returns false if the loop closed by the branch at "pc" doesn't qualify.  If "gpr" is NULL, only the code is
+// checked, not the addresses of the loads.
+//
+bool PS_CPU::IdleLoopCheck(uint32 pc, const uint32 *gpr)
+{
+ uint32 branch_instr;
+ uint32 target;
+ uint32 written = 0;	// Registers written by the loop
+ uint32 loaded = 0;	// Registers written by its loads
+ uint32 done = 0;	// Registers already written in the current iteration
+ uint32 pending = 0;	// Load waiting for its delay slot
+
+ // Only code in RAM or BIOS, anything else isn't safe to peek.
+ if((pc & 0x3) || pc >= 0xC0000000 || ((pc & 0x1FFFFFFF) >= 0x800000 && (pc & 0x1FFFFFFF) < 0x1FC00000))
+  return false;
+
+ branch_instr = PeekMemory<uint32>(pc);
+
+ switch(branch_instr >> 26)
+ {
+  default:
+	return false;
+
+  case 0x01:	// BGEZ, BLTZ(not the linking variants)
+	if(branch_instr & (0x10 << 16))
+	 return false;
+	target = pc + 4 + ((int32)(int16)branch_instr << 2);
+	break;
+
+  case 0x02:	// J
+	target = ((pc + 4) & 0xF0000000) | ((branch_instr & 0x3FFFFFF) << 2);
+	break;
+
+  case 0x04:	// BEQ
+  case 0x05:	// BNE
+  case 0x06:	// BLEZ
+  case 0x07:	// BGTZ
+	target = pc + 4 + ((int32)(int16)branch_instr << 2);
+	break;
+ }
+
+ if(target > pc || (pc - target) > (IDLE_LOOP_MAX - 2) * 4)
+  return false;
+
+ for(unsigned pass = 0; pass < 2; pass++)
+ {
+  for(uint32 A = target; A <= pc + 4; A += 4)
+  {
+   const uint32 instr = PeekMemory<uint32>(A);
+   const unsigned rs = (instr >> 21) & 0x1F;
+   const unsigned rt = (instr >> 16) & 0x1F;
+   const unsigned rd = (instr >> 11) & 0x1F;
+   unsigned dst = 0;
+   uint32 src = 0;
+   unsigned width = 0;
+
+   if(A == pc)
+   {
+    // The branch itself
+    if((branch_instr >> 26) >= 0x04)
+     src = (1U << rs) | (1U << rt);
+    else if((branch_instr >> 26) == 0x01)
+     src = 1U << rs;
+   }
+   else switch(instr >> 26)
+   {
+    default:
+	return false;
+
+    case 0x00:
+	switch(instr & 0x3F)
+	{
+	 default:
+		return false;
+
+	 case 0x00:	// SLL
+	 case 0x02:	// SRL
+	 case 0x03:	// SRA
+		dst = rd;
+		src = 1U << rt;
+		break;
+
+	 case 0x04:	// SLLV
+	 case 0x06:	// SRLV
+	 case 0x07:	// SRAV
+	 case 0x21:	// ADDU
+	 case 0x23:	// SUBU
+	 case 0x24:	// AND
+	 case 0x25:	// OR
+	 case 0x26:	// XOR
+	 case 0x27:	// NOR
+	 case 0x2A:	// SLT
+	 case 0x2B:	// SLTU
+		dst = rd;
+		src = (1U << rs) | (1U << rt);
+		break;
+	}
+	break;
+
+    case 0x09:	// ADDIU
+    case 0x0A:	// SLTI
+    case 0x0B:	// SLTIU
+    case 0x0C:	// ANDI
+    case 0x0D:	// ORI
+    case 0x0E:	// XORI
+	dst = rt;
+	src = 1U << rs;
+	break;
+
+    case 0x0F:	// LUI
+	dst = rt;
+	break;
+
+    case 0x20:	// LB
+    case 0x24:	// LBU
+	width = 1;
+	dst = rt;
+	src = 1U << rs;
+	break;
+
+    case 0x21:	// LH
+    case 0x25:	// LHU
+	width = 2;
+	dst = rt;
+	src = 1U << rs;
+	break;
+
+    case 0x23:	// LW
+	width = 4;
+	dst = rt;
+	src = 1U << rs;
+	break;
+   }
+
+   if(pass == 0)
+   {
+    written |= (1U << dst) & ~1U;
+
+    if(width)
+     loaded |= (1U << dst) & ~1U;
+
+    continue;
+   }
+
+   // A register written by the loop must not be read before it's written in the same iteration, otherwise its
+   // value depends on the previous one.  Loaded values only become visible after the load delay slot.
+   if(src & written & ~done)
+    return false;
+
+   done |= pending;
+   pending = 0;
+
+   if(width)
+   {
+    // The address must be the same for every iteration.
+    if(loaded & (1U << rs))
+     return false;
+
+    if(gpr)
+    {
+     uint32 address = gpr[rs] + (int32)(int16)instr;
+
+     if((address & (width - 1)) || address >= 0xC0000000)
+      return false;
+
+     address &= 0x1FFFFFFF;
+
+     if(!(address < 0x800000 ||
+	(address >= 0x1F800000 && address < 0x1F800400) ||
+	(address >= 0x1FC00000 && address < 0x1FC80000) ||
+	(address >= 0x1F801070 && address < 0x1F801078) ||	// I_STAT, I_MASK
+	(address >= 0x1F801814 && address < 0x1F801818)))	// GPUSTAT
+      return false;
+    }
+   }
+
+   if(dst)
+   {
+    if(done & (1U << dst))	// Written twice
+     return false;
+
+    if(width)
+     pending = 1U << dst;
+    else
+     done |= 1U << dst;
+   }
+  }
+ }
+
+ return true;
+}
+
+//
+// Called every time the backward branch at "pc" is taken.  Once two consecutive iterations of the loop took the same
+// number of cycles it's in a steady state and, if IdleLoopCheck() agrees, every following iteration is going to be
+// identical until the next event.  We skip all the ones that would complete before next_event_ts, the last one runs
+// normally so the timing is the same as without skipping.
+//
+pscpu_timestamp_t PS_CPU::IdleLoop(pscpu_timestamp_t timestamp, uint32 pc)
+{
+ const pscpu_timestamp_t cost = timestamp - IdleLoopTS;
+
+ if(pc != IdleLoopPC)
+ {
+  IdleLoopPC = pc;
+  IdleLoopCost = 0;
+  IdleLoopCandidate = IdleLoopCheck(pc, NULL);
+ }
+ else if(cost != IdleLoopCost)
+  IdleLoopCost = cost;
+ else if(IdleLoopCandidate && cost > 0 && (next_event_ts - timestamp) > cost)
+ {
+  if(!(CP0.SR & 0x10000) && IdleLoopCheck(pc, GPR))
+   timestamp += (next_event_ts - timestamp - 1) / cost * cost;
+  else
+   IdleLoopCandidate = false;
+ }
+
+ IdleLoopTS = timestamp;
+
+ return timestamp;
+}
+
+//
+// HLE of the hottest BIOS A(xxh) library functions.  They run out of the uncached BIOS ROM so something like a
+// memcpy() costs tens of cycles per byte; games loading data through them can spend whole frames there.
+//
+// Only calls with "normal" arguments are handled: non-NULL pointers to buffers entirely within(one mirror of) RAM,
+// positive lengths, and no isolated cache.  Everything else, including the edge cases where the BIOS behaves
+// oddly, runs the real code.  The call completes atomically at the A0h entry point so there's no state to save.
+// Other than $v0 the registers the BIOS would have clobbered keep their value.
+//
+// The cycle counts approximate what the interpreter charges for the ROM routines(~5 cycles per instruction
+// fetched uncached): the table dispatch plus each iteration of their byte loop.
+//
+enum
+{
+ HLE_CALL_CYCLES = 60,
+ HLE_MEMCPY_CYCLES = 30,	// lb, sb, 3 x addiu, bgtz
+ HLE_MEMSET_CYCLES = 20,	// sb, 2 x addiu, bgtz
+ HLE_STRCPY_CYCLES = 25,	// lb, sb, 2 x addiu, bnez
+ HLE_STRLEN_CYCLES = 20,	// lb, 2 x addiu, bnez
+};
+
+// Converts [address, address + len) to an offset in MainRAM.  Returns false if it's not all in RAM.
+INLINE bool PS_CPU::HLERAMRange(uint32 address, uint32 len, uint32 *offset)
+{
+ if(address == 0 || (int32)len <= 0)
+  return false;
+
+ // KSEG2
+ if(address >= 0xC0000000)
+  return false;
+
+ address &= 0x1FFFFFFF;
+
+ if(address >= 0x00800000)
+  return false;
+
+ *offset = address & 0x1FFFFF;
+
+ // Don't wrap around to the next mirror
+ return len <= 0x200000 - *offset;
+}
+
+// Same thing for the NUL-terminated string at "address", its length(without the NUL) is stored in "len".
+INLINE bool PS_CPU::HLERAMString(uint32 address, uint32 *offset, uint32 *len)
+{
+ if(!HLERAMRange(address, 1, offset))
+  return false;
+
+ for(uint32 i = *offset; i < 0x200000; i++)
+ {
+  if(MainRAM.ReadU8(i) == 0)
+  {
+   *len = i - *offset;
+   return true;
+  }
+ }
+
+ return false;
+}
+
+INLINE void PS_CPU::HLERAMWritten(uint32 offset, uint32 len)
+{
+#ifdef HAVE_DYNAREC
+ if(dynarec_state)
+ {
+  for(uint32 o = offset & ~(DYNAREC_PAGE_SIZE - 1); o < offset + len; o += DYNAREC_PAGE_SIZE)
+   dynarec_invalidate_ram(dynarec_state, o);
+ }
+#endif
+}
+
+//
+// Run BIOS function A("fn") natively.  "args" are $a0-$a3.  On success the return value is stored in "ret" and the
+// cycles it took in "cycles", the caller must then return to $ra.  Returns false if the BIOS code must run instead.
+//
+// "budget" is the number of cycles left before the next event.  The whole call is charged at once, so a call that
+// would take longer (a large memcpy spanning a vblank or a timer IRQ...) runs the BIOS code instead, which lets
+// the event happen in the middle of the loop as it would on the console.  Nothing is modified in that case.
+//
+bool PS_CPU::HLEBIOSCall(uint32 fn, const uint32 *args, uint32 *ret, pscpu_timestamp_t *cycles, pscpu_timestamp_t budget)
+{
+ uint32 dst, src, len;
+
+ // Stores would go to the instruction cache
+ if(CP0.SR & 0x10000)
+  return false;
+
+ // PGXP tracks the values stored in memory
+ if(PGXP_GetModes() & PGXP_MODE_MEMORY)
+  return false;
+
+ switch(fn)
+ {
+  default:
+	return false;
+
+  case 0x19:	// strcpy(dst, src)
+	if(!HLERAMString(args[1], &src, &len) || !HLERAMRange(args[0], len + 1, &dst))
+	 return false;
+
+	// The BIOS would overwrite the string as it copies it
+	if(dst < src + len + 1 && src < dst + len + 1)
+	 return false;
+
+	*cycles = HLE_CALL_CYCLES + (len + 1) * HLE_STRCPY_CYCLES;
+	if(*cycles > budget)
+	 return false;
+
+	memcpy(&MainRAM.data8[dst], &MainRAM.data8[src], len + 1);
+	HLERAMWritten(dst, len + 1);
+	*ret = args[0];
+	return true;
+
+  case 0x1B:	// strlen(src)
+	if(!HLERAMString(args[0], &src, &len))
+	 return false;
+
+	*cycles = HLE_CALL_CYCLES + (len + 1) * HLE_STRLEN_CYCLES;
+	if(*cycles > budget)
+	 return false;
+
+	*ret = len;
+	return true;
+
+  case 0x28:	// bzero(dst, len)
+	len = args[1];
+	if(!HLERAMRange(args[0], len, &dst))
+	 return false;
+
+	*cycles = HLE_CALL_CYCLES + len * HLE_MEMSET_CYCLES;
+	if(*cycles > budget)
+	 return false;
+
+	memset(&MainRAM.data8[dst], 0, len);
+	HLERAMWritten(dst, len);
+	*ret = args[0];
+	return true;
+
+  case 0x2A:	// memcpy(dst, src, len)
+	len = args[2];
+	if(!HLERAMRange(args[0], len, &dst) || !HLERAMRange(args[1], len, &src))
+	 return false;
+
+	*cycles = HLE_CALL_CYCLES + len * HLE_MEMCPY_CYCLES;
+	if(*cycles > budget)
+	 return false;
+
+	// The BIOS copies forward one byte at a time, replicate that when the buffers overlap.
+	if(dst > src && dst < src + len)
+	{
+	 for(uint32 i = 0; i < len; i++)
+	  MainRAM.data8[dst + i] = MainRAM.data8[src + i];
+	}
+	else
+	 memmove(&MainRAM.data8[dst], &MainRAM.data8[src], len);
+
+	HLERAMWritten(dst, len);
+	*ret = args[0];
+	return true;
+
+  case 0x2B:	// memset(dst, fillbyte, len)
+	len = args[2];
+	if(!HLERAMRange(args[0], len, &dst))
+	 return false;
+
+	*cycles = HLE_CALL_CYCLES + len * HLE_MEMSET_CYCLES;
+	if(*cycles > budget)
+	 return false;
+
+	memset(&MainRAM.data8[dst], args[1] & 0xFF, len);
+	HLERAMWritten(dst, len);
+	*ret = args[0];
+	return true;
+ }
+}
+
+//
+// Guest PC sampling profiler.  When psx_cpu_profiler is set next_event_ts is clamped to ProfileNextTS, so both
+// RunReal() and RunDynarec() return to their event loop every psx_cpu_profiler cycles and record where the PC is.
+// The samples are kept per address and grouped by function when the report is written, see WriteProfile().
+//
+void PS_CPU::ProfileStart(pscpu_timestamp_t timestamp)
+{
+ ProfilePeriod = psx_cpu_profiler;
+ ProfileNextTS = ProfilePeriod ? timestamp + ProfilePeriod : 0x7FFFFFFF;
+ next_event_ts = std::min(EventNT, ProfileNextTS);
+}
+
+void PS_CPU::ProfileSample(pscpu_timestamp_t timestamp, uint32 pc)
+{
+ std::map<uint32, ProfileEntry>::iterator it = ProfileHits.find(pc);
+
+ if(it == ProfileHits.end())
+ {
+  const ProfileEntry e = { 0, ProfileFunction(pc) };
+
+  it = ProfileHits.insert(std::make_pair(pc, e)).first;
+ }
+
+ it->second.hits++;
+ ProfileSamples++;
+
+ ProfileNextTS = timestamp + ProfilePeriod;
+ next_event_ts = std::min(EventNT, ProfileNextTS);
+}
+
+//
+// Guess the start of the function containing "pc" by looking back for a stack frame allocation("addiu $sp, $sp, -n")
+// or the return of the previous function("jr $ra" and its delay slot).  Good enough for compiled code, assembly may
+// get attributed to whatever comes before it.  Done once per address, so the code that was there when it was first
+// sampled is used.
+//
+uint32 PS_CPU::ProfileFunction(uint32 pc)
+{
+ if(pc & 3)
+  return pc;
+
+ for(uint32 i = 0, a = pc; i < PROFILE_SCAN_MAX && a >= 4; i++, a -= 4)
+ {
+  const uint32 instr = PeekMemory<uint32>(a);
+
+  if((instr >> 16) == 0x27BD && (int16)instr < 0)
+   return a;
+
+  if(instr == 0x03E00008 && a + 8 <= pc)
+   return a + 8;
+ }
+
+ return pc;
+}
+
+void PS_CPU::ResetProfile(void)
+{
+ ProfileHits.clear();
+ ProfileSamples = 0;
+}
+
+//
+// Write the top functions and, for each of them, the addresses that were sampled the most.
+//
+bool PS_CPU::WriteProfile(const char *path)
+{
+ enum { TOP_FUNCTIONS = 64, TOP_ADDRESSES = 16 };
+ std::map<uint32, uint64> funcs;
+ std::vector<std::pair<uint64, uint32> > top;
+ FILE *fp;
+
+ if(!ProfileSamples)
+  return false;
+
+ if(!(fp = fopen(path, "w")))
+ {
+  log_cb(RETRO_LOG_WARN, "Can't write CPU profile to %s\n", path);
+  return false;
+ }
+
+ for(std::map<uint32, ProfileEntry>::const_iterator it = ProfileHits.begin(); it != ProfileHits.end(); ++it)
+  funcs[it->second.func] += it->second.hits;
+
+ for(std::map<uint32, uint64>::const_iterator it = funcs.begin(); it != funcs.end(); ++it)
+  top.push_back(std::make_pair(it->second, it->first));
+
+ std::sort(top.begin(), top.end(), std::greater<std::pair<uint64, uint32> >());
+
+ if(top.size() > TOP_FUNCTIONS)
+  top.resize(TOP_FUNCTIONS);
+
+ fprintf(fp, "%llu samples, one every %d cycles\n\n", (unsigned long long)ProfileSamples, ProfilePeriod);
+ fprintf(fp, "  samples       %%  function\n");
+
+ for(size_t i = 0; i < top.size(); i++)
+  fprintf(fp, "%9llu  %5.2f%%  0x%08x\n", (unsigned long long)top[i].first, 100.0 * top[i].first / ProfileSamples, top[i].second);
+
+ for(size_t i = 0; i < top.size(); i++)
+ {
+  std::vector<std::pair<uint32, uint32> > addrs;
+
+  for(std::map<uint32, ProfileEntry>::const_iterator it = ProfileHits.begin(); it != ProfileHits.end(); ++it)
+  {
+   if(it->second.func == top[i].second)
+    addrs.push_back(std::make_pair(it->second.hits, it->first));
+  }
+
+  std::sort(addrs.begin(), addrs.end(), std::greater<std::pair<uint32, uint32> >());
+
+  if(addrs.size() > TOP_ADDRESSES)
+   addrs.resize(TOP_ADDRESSES);
+
+  fprintf(fp, "\nfunction 0x%08x\n", top[i].second);
+
+  for(size_t j = 0; j < addrs.size(); j++)
+   fprintf(fp, "%9u  %5.2f%%  0x%08x  %08x\n", addrs[j].first, 100.0 * addrs[j].first / ProfileSamples, addrs[j].second,
+	(addrs[j].second & 3) ? 0 : PeekMemory<uint32>(addrs[j].second));
+ }
+
+ return fclose(fp) == 0;
+}
+
+template<bool DebugMode, bool BIOSPrintMode, bool ILHMode, bool DynarecTier>
 pscpu_timestamp_t PS_CPU::RunReal(pscpu_timestamp_t timestamp_in)
 {
  register pscpu_timestamp_t timestamp = timestamp_in;
@@ -660,11 +1300,23 @@ pscpu_timestamp_t PS_CPU::RunReal(pscpu_timestamp_t timestamp_in)
 
  do
  {
+  // An event may have changed what the loop reads
+  if(ILHMode)
+   IdleLoopPC = ~0U;
+
   //printf("Running: %d %d\n", timestamp, next_event_ts);
-  while(MDFN_LIKELY(timestamp < next_event_ts))
+  //
+  // When interpreting for the dynarec we can't stop in a branch delay slot or with a load pending, the dynarec
+  // has no way to represent that.  DynarecSettle() stops as soon as we're out of it.
+  //
+  // In lockstep mode we always run up to the end of the block, like the dynarec does.
+  //
+  while((MDFN_LIKELY(timestamp < next_event_ts) && !(DynarecTier && DynarecSettling)) ||
+        (DynarecTier && (dynarec_lockstep || new_PC != PC + 4 || LDWhich != 0x20)))
   {
    uint32 instr;
    uint32 opf;
+   const __ICacheDecoded *dec;
 
    // Zero must be zero...until the Master Plan is enacted.
    GPR[0] = 0;
@@ -713,18 +1365,35 @@ pscpu_timestamp_t PS_CPU::RunReal(pscpu_timestamp_t timestamp_in)
     goto OpDone;
    }
 
-   instr = ReadInstruction(timestamp, PC);
+   //
+   // BIOS library call, see HLEBIOSCall().  Not in the middle of a branch or load delay, and interrupts go first.
+   //
+   if(MDFN_UNLIKELY(!(PC & 0x1FFFFF0F)) && psx_cpu_hle_bios && (PC & 0x1FFFFFFF) == HLE_BIOS_A_FUNCTIONS &&
+      new_PC == PC + 4 && LDWhich == 0x20 && !IPCache && !(DynarecTier && dynarec_lockstep))
+   {
+    uint32 ret;
+    pscpu_timestamp_t cycles;
+
+    if(HLEBIOSCall(GPR[9], &GPR[4], &ret, &cycles, next_event_ts - timestamp))
+    {
+     GPR[2] = ret;
+     timestamp += cycles;
+     new_PC = GPR[31];
+     goto OpDone;
+    }
+   }
+
+   instr = ReadInstruction(timestamp, PC, &dec);
 
 
    // 
-   // Instruction decode
+   // Instruction decode, done once when the instruction was loaded in the ICache
    //
-   opf = instr & 0x3F;
-
-   if(instr & (0x3F << 26))
-    opf = 0x40 | (instr >> 26);
+   opf = dec->opf;
 
-   opf |= IPCache;
+   // The dynarec only takes interrupts between blocks
+   if(!(DynarecTier && dynarec_lockstep))
+    opf |= IPCache;
 
    if(ReadAbsorb[ReadAbsorbWhich])
     ReadAbsorb[ReadAbsorbWhich]--;
@@ -737,25 +1406,13 @@ pscpu_timestamp_t PS_CPU::RunReal(pscpu_timestamp_t timestamp_in)
 
 #ifdef DEBUG
 #define DEBUG_ADDBT() if(DebugMode && ADDBT) { ADDBT(PC, new_PC, false); }
-#define DEBUG_ILH() \
-	  if(ILHMode)						\
-	  {							\
-	   if(old_PC == (((new_PC - 4) & mask) + offset))	\
-	   {							\
-	    if(MDFN_densb<uint32, true>((uint8*)(FastMap[PC >> FAST_MAP_SHIFT] + PC)) == 0)	\
-	    {							\
-	     if(next_event_ts > timestamp) /* Necessary since next_event_ts might be set to something like "0" to force a call to the event handler. */		\
-	     {							\
-	      timestamp = next_event_ts;			\
-	     }							\
-	    }							\
-	   }							\
-	  }
 #else
 #define DEBUG_ADDBT()
-#define DEBUG_ILH()
 #endif
 
+   // Only backward branches short enough to close an idle loop, see IdleLoop()
+   #define DO_ILH() if(ILHMode && MDFN_UNLIKELY(new_PC <= old_PC) && (old_PC - new_PC) <= (IDLE_LOOP_MAX - 2) * 4) { timestamp = IdleLoop(timestamp, old_PC); }
+
    #define DO_BRANCH(arg_cond, arg_offset, arg_mask, arg_dolink, arg_linkreg)\
 	{							\
 	 const bool cond = (arg_cond);				\
@@ -774,19 +1431,19 @@ pscpu_timestamp_t PS_CPU::RunReal(pscpu_timestamp_t timestamp_in)
 								\
 	 if(cond)						\
 	 {							\
-     DEBUG_ILH() \
 	  new_PC = ((new_PC - 4) & mask) + offset;		\
 	  BDBT = 3;						\
+	  DO_ILH();						\
      DEBUG_ADDBT() \
 	 }							\
 								\
 	 goto SkipNPCStuff;					\
 	}
 
-   #define ITYPE uint32 rs MDFN_NOWARN_UNUSED = (instr >> 21) & 0x1F; uint32 rt MDFN_NOWARN_UNUSED = (instr >> 16) & 0x1F; uint32 immediate = (int32)(int16)(instr & 0xFFFF); /*printf(" rs=%02x(%08x), rt=%02x(%08x), immediate=(%08x) ", rs, GPR[rs], rt, GPR[rt], immediate);*/
-   #define ITYPE_ZE uint32 rs MDFN_NOWARN_UNUSED = (instr >> 21) & 0x1F; uint32 rt MDFN_NOWARN_UNUSED = (instr >> 16) & 0x1F; uint32 immediate = instr & 0xFFFF; /*printf(" rs=%02x(%08x), rt=%02x(%08x), immediate=(%08x) ", rs, GPR[rs], rt, GPR[rt], immediate);*/
+   #define ITYPE uint32 rs MDFN_NOWARN_UNUSED = dec->rs; uint32 rt MDFN_NOWARN_UNUSED = dec->rt; uint32 immediate = dec->immediate; /*printf(" rs=%02x(%08x), rt=%02x(%08x), immediate=(%08x) ", rs, GPR[rs], rt, GPR[rt], immediate);*/
+   #define ITYPE_ZE uint32 rs MDFN_NOWARN_UNUSED = dec->rs; uint32 rt MDFN_NOWARN_UNUSED = dec->rt; uint32 immediate = dec->immediate & 0xFFFF; /*printf(" rs=%02x(%08x), rt=%02x(%08x), immediate=(%08x) ", rs, GPR[rs], rt, GPR[rt], immediate);*/
    #define JTYPE uint32 target = instr & ((1 << 26) - 1); /*printf(" target=(%08x) ", target);*/
-   #define RTYPE uint32 rs MDFN_NOWARN_UNUSED = (instr >> 21) & 0x1F; uint32 rt MDFN_NOWARN_UNUSED = (instr >> 16) & 0x1F; uint32 rd MDFN_NOWARN_UNUSED = (instr >> 11) & 0x1F; uint32 shamt MDFN_NOWARN_UNUSED = (instr >> 6) & 0x1F; /*printf(" rs=%02x(%08x), rt=%02x(%08x), rd=%02x(%08x) ", rs, GPR[rs], rt, GPR[rt], rd, GPR[rd]);*/
+   #define RTYPE uint32 rs MDFN_NOWARN_UNUSED = dec->rs; uint32 rt MDFN_NOWARN_UNUSED = dec->rt; uint32 rd MDFN_NOWARN_UNUSED = dec->rd; uint32 shamt MDFN_NOWARN_UNUSED = dec->shamt; /*printf(" rs=%02x(%08x), rt=%02x(%08x), rd=%02x(%08x) ", rs, GPR[rs], rt, GPR[rt], rd, GPR[rd]);*/
 
 #if HAVE_COMPUTED_GOTO
    #if 0
@@ -1212,6 +1869,10 @@ pscpu_timestamp_t PS_CPU::RunReal(pscpu_timestamp_t timestamp_in)
 		 case CP0REG_SR:
 			CP0.SR = val & ~( (0x3 << 26) | (0x3 << 23) | (0x3 << 6));
 			RecalcIPCache();
+#ifdef HAVE_DYNAREC
+			if(DynarecTier)
+			 dynarec_set_sr(dynarec_state, CP0.SR);
+#endif
 			break;
 		}
 		break;
@@ -2622,15 +3283,55 @@ pscpu_timestamp_t PS_CPU::RunReal(pscpu_timestamp_t timestamp_in)
    }
 
    OpDone: ;
-   PC = new_PC;
-   new_PC = new_PC + 4;
-   BDBT = 0;
-
-   SkipNPCStuff:	;
+#ifdef DYNAREC_LOCKSTEP
+   //
+   // Lockstep verification: stop where the recompiled code would return to dynarec_run.
+   //
+   if(DynarecTier)
+   {
+    const bool block_end = DynarecBlockEnd(PC, new_PC);
+
+    LockstepTrace.push_back(PC);
+
+    PC = new_PC;
+    new_PC = new_PC + 4;
+    BDBT = 0;
+
+    if(block_end)
+     break;
+
+    goto SkipNPCStuff;
+   }
+#endif
+#ifdef HAVE_DYNAREC
+   //
+   // Tiered dynarec: hand control back to the recompiled code on jumps and page crossings once the target page
+   // has been compiled.
+   //
+   if(DynarecTier && (new_PC != PC + 4 || !(new_PC & (DYNAREC_PAGE_SIZE - 1))))
+   {
+    PC = new_PC;
+    new_PC = new_PC + 4;
+    BDBT = 0;
+
+    if(LDWhich == 0x20 && dynarec_tier_ready(dynarec_state, PC))
+     break;
+
+    goto SkipNPCStuff;
+   }
+#endif
+   PC = new_PC;
+   new_PC = new_PC + 4;
+   BDBT = 0;
+
+   SkipNPCStuff:	;
 
    //printf("\n");
   }
- } while(MDFN_LIKELY(PSX_EventHandler(timestamp)));
+
+  if(!DynarecTier && MDFN_UNLIKELY(timestamp >= ProfileNextTS))
+   ProfileSample(timestamp, PC);
+ } while(!DynarecTier && MDFN_LIKELY(PSX_EventHandler(timestamp)));
 
  if(gte_ts_done > 0)
   gte_ts_done -= timestamp;
@@ -2644,55 +3345,1100 @@ pscpu_timestamp_t PS_CPU::RunReal(pscpu_timestamp_t timestamp_in)
 }
 
 #ifdef HAVE_DYNAREC
-pscpu_timestamp_t PS_CPU::RunDynarec(int32_t timestamp)
+/* Convert between the dynarec's cycle counter (number of cycles left
+   before the next event) and the CPU timestamp */
+INLINE pscpu_timestamp_t PS_CPU::DynarecTimestamp(int32 counter)
+{
+   return next_event_ts - DynarecBias - counter;
+}
+
+INLINE int32 PS_CPU::DynarecCounter(pscpu_timestamp_t timestamp)
+{
+   /* If an interrupt is pending we want the recompiled code to return
+      to RunDynarec as soon as possible. Bias the counter so that it
+      reaches 0 right away without changing the timestamp. */
+   if (MDFN_UNLIKELY(IPCache))
+      DynarecBias = next_event_ts - timestamp;
+
+   return next_event_ts - DynarecBias - timestamp;
+}
+
+/* Raise an exception for the instruction at `pc`, as passed by the
+   dynarec (canonical address, DYNAREC_PC_DELAY_SLOT set if in a
+   branch delay slot). Returns the address of the handler. */
+uint32 PS_CPU::DynarecRaise(struct dynarec_state *s, uint32 code, uint32 pc, uint32 instr)
+{
+   uint32 handler;
+
+   /* The dynarec doesn't keep track of whether the branch was taken
+      when the exception occurs in a delay slot so we never set BT */
+   BDBT = (pc & DYNAREC_PC_DELAY_SLOT) ? 2 : 0;
+   pc = (pc & ~3U) | s->region;
+
+   handler = Exception(code, pc, pc + 4, instr);
+
+   dynarec_set_sr(s, CP0.SR);
+
+   return handler;
+}
+
+int32 PS_CPU::DynarecHLEBIOS(struct dynarec_state *s, int32 counter)
+{
+   uint32 args[4];
+   uint32 ret;
+   pscpu_timestamp_t cycles;
+   unsigned i;
+
+   for (i = 0; i < 4; i++)
+      args[i] = dynarec_get_reg(s, 4 + i);
+
+   /* The counter is what's left before the next event (0 if an
+      interrupt is pending) */
+   if (!HLEBIOSCall(dynarec_get_reg(s, 9), args, &ret, &cycles, counter))
+      return counter;
+
+   dynarec_set_reg(s, 2, ret);
+   s->pc = dynarec_get_reg(s, 31);
+
+   return counter - cycles;
+}
+
+int32 PS_CPU::DynarecException(struct dynarec_state *s, uint32 code, uint32 pc, int32 counter, uint32 bad_vaddr)
+{
+   uint32 instr = 0;
+
+   if (code == EXCEPTION_ADEL || code == EXCEPTION_ADES)
+      CP0.BADA = bad_vaddr;
+
+   if (code == EXCEPTION_ADEL && pc == bad_vaddr && (pc & 3))
+   {
+      /* Instruction fetch from an unaligned address, never in a delay
+         slot. EPC keeps the low bits, as in the interpreter. */
+      BDBT = 0;
+      s->pc = Exception(code, pc, pc + 4, 0);
+      dynarec_set_sr(s, CP0.SR);
+
+      return counter;
+   }
+
+   if (code == EXCEPTION_COPU)
+   {
+      /* We need the coprocessor number for CAUSE */
+      instr = PeekMemory<uint32>((pc & ~3U) | s->region);
+   }
+
+   s->pc = DynarecRaise(s, code, pc, instr);
+
+   return counter;
+}
+
+template<typename T>
+int32 PS_CPU::DynarecWrite(struct dynarec_state *s, uint32 val, uint32 addr, int32 counter)
+{
+   pscpu_timestamp_t timestamp = DynarecTimestamp(counter);
+
+   WriteMemory<T>(timestamp, addr, val);
+
+   return DynarecCounter(timestamp);
+}
+
+template<typename T>
+struct dynarec_load_val PS_CPU::DynarecRead(struct dynarec_state *s, uint32 addr, int32 counter)
+{
+   struct dynarec_load_val ret;
+   pscpu_timestamp_t timestamp = DynarecTimestamp(counter);
+
+   ret.value = ReadMemory<T>(timestamp, addr);
+   ret.counter = DynarecCounter(timestamp);
+
+   return ret;
+}
+
+struct dynarec_load_val PS_CPU::DynarecLWL(struct dynarec_state *s, uint32 cur, uint32 address, int32 counter)
+{
+   struct dynarec_load_val ret;
+   pscpu_timestamp_t timestamp = DynarecTimestamp(counter);
+
+   switch(address & 0x3)
+   {
+      case 0:
+         ret.value = (cur & ~(0xFF << 24)) | (ReadMemory<uint8>(timestamp, address & ~3) << 24);
+         break;
+      case 1:
+         ret.value = (cur & ~(0xFFFF << 16)) | (ReadMemory<uint16>(timestamp, address & ~3) << 16);
+         break;
+      case 2:
+         ret.value = (cur & ~(0xFFFFFF << 8)) | (ReadMemory<uint32>(timestamp, address & ~3, true) << 8);
+         break;
+      case 3:
+         ret.value = ReadMemory<uint32>(timestamp, address & ~3);
+         break;
+   }
+
+   ret.counter = DynarecCounter(timestamp);
+
+   return ret;
+}
+
+struct dynarec_load_val PS_CPU::DynarecLWR(struct dynarec_state *s, uint32 cur, uint32 address, int32 counter)
+{
+   struct dynarec_load_val ret;
+   pscpu_timestamp_t timestamp = DynarecTimestamp(counter);
+
+   switch(address & 0x3)
+   {
+      case 0:
+         ret.value = ReadMemory<uint32>(timestamp, address);
+         break;
+      case 1:
+         ret.value = (cur & ~(0xFFFFFF)) | ReadMemory<uint32>(timestamp, address, true);
+         break;
+      case 2:
+         ret.value = (cur & ~(0xFFFF)) | ReadMemory<uint16>(timestamp, address);
+         break;
+      case 3:
+         ret.value = (cur & ~(0xFF)) | ReadMemory<uint8>(timestamp, address);
+         break;
+   }
+
+   ret.counter = DynarecCounter(timestamp);
+
+   return ret;
+}
+
+int32 PS_CPU::DynarecSWL(struct dynarec_state *s, uint32 val, uint32 address, int32 counter)
+{
+   pscpu_timestamp_t timestamp = DynarecTimestamp(counter);
+
+   switch(address & 0x3)
+   {
+      case 0:
+         WriteMemory<uint8>(timestamp, address & ~3, val >> 24);
+         break;
+      case 1:
+         WriteMemory<uint16>(timestamp, address & ~3, val >> 16);
+         break;
+      case 2:
+         WriteMemory<uint32>(timestamp, address & ~3, val >> 8, true);
+         break;
+      case 3:
+         WriteMemory<uint32>(timestamp, address & ~3, val >> 0);
+         break;
+   }
+
+   dynarec_invalidate(s, address);
+
+   return DynarecCounter(timestamp);
+}
+
+int32 PS_CPU::DynarecSWR(struct dynarec_state *s, uint32 val, uint32 address, int32 counter)
+{
+   pscpu_timestamp_t timestamp = DynarecTimestamp(counter);
+
+   switch(address & 0x3)
+   {
+      case 0:
+         WriteMemory<uint32>(timestamp, address, val);
+         break;
+      case 1:
+         WriteMemory<uint32>(timestamp, address, val, true);
+         break;
+      case 2:
+         WriteMemory<uint16>(timestamp, address, val);
+         break;
+      case 3:
+         WriteMemory<uint8>(timestamp, address, val);
+         break;
+   }
+
+   dynarec_invalidate(s, address);
+
+   return DynarecCounter(timestamp);
+}
+
+/* GTE commands, MTC2, CTC2, LWC2 and SWC2 called directly by the
+   recompiled code. The coprocessor and alignment checks have already
+   been done. */
+int32 PS_CPU::DynarecGTE(struct dynarec_state *s, uint32 instr, uint32 operand, int32 counter)
+{
+   pscpu_timestamp_t timestamp = DynarecTimestamp(counter);
+   const uint32 rt = (instr >> 16) & 0x1F;
+   const uint32 rd = (instr >> 11) & 0x1F;
+
+   if(timestamp < gte_ts_done)
+      timestamp = gte_ts_done;
+
+   switch(instr >> 26)
+   {
+      case 0x12: // COP2
+         if(instr & (1U << 25))
+            gte_ts_done = timestamp + GTE_Instruction(instr);
+         else if(((instr >> 21) & 0x1F) == 0x04) // MTC2
+         {
+            GTE_WriteDR(rd, operand);
+
+            if (PGXP_GetModes() & PGXP_MODE_GTE)
+               PGXP_GTE_MTC2(instr, operand, operand);
+         }
+         else // CTC2
+         {
+            GTE_WriteCR(rd, operand);
+
+            if (PGXP_GetModes() & PGXP_MODE_GTE)
+               PGXP_GTE_CTC2(instr, operand, operand);
+         }
+         break;
+
+      case 0x32: // LWC2
+         {
+            const uint32 value = ReadMemory<uint32>(timestamp, operand, false, true);
+
+            GTE_WriteDR(rt, value);
+
+            if (PGXP_GetModes() & PGXP_MODE_GTE)
+               PGXP_GTE_LWC2(instr, value, operand);
+         }
+         break;
+
+      case 0x3A: // SWC2
+         WriteMemory<uint32>(timestamp, operand, GTE_ReadDR(rt));
+         dynarec_invalidate(s, operand);
+
+         if (PGXP_GetModes() & PGXP_MODE_GTE)
+            PGXP_GTE_SWC2(instr, GTE_ReadDR(rt), operand);
+         break;
+   }
+
+   return DynarecCounter(timestamp);
+}
+
+/* MFC2 and CFC2 called directly by the recompiled code */
+struct dynarec_load_val PS_CPU::DynarecGTERead(struct dynarec_state *s, uint32 instr, int32 counter)
+{
+   struct dynarec_load_val ret;
+   pscpu_timestamp_t timestamp = DynarecTimestamp(counter);
+   const uint32 rd = (instr >> 11) & 0x1F;
+
+   if(timestamp < gte_ts_done)
+      timestamp = gte_ts_done;
+
+   if(((instr >> 21) & 0x1F) == 0x00) // MFC2
+   {
+      ret.value = GTE_ReadDR(rd);
+
+      if (PGXP_GetModes() & PGXP_MODE_GTE)
+         PGXP_GTE_MFC2(instr, ret.value, ret.value);
+   }
+   else // CFC2
+   {
+      ret.value = GTE_ReadCR(rd);
+
+      if (PGXP_GetModes() & PGXP_MODE_GTE)
+         PGXP_GTE_CFC2(instr, ret.value, ret.value);
+   }
+
+   ret.counter = DynarecCounter(timestamp);
+
+   return ret;
+}
+
+/* Coprocessor instructions, this mirrors the COPn/LWCn/SWCn opcodes in
+   RunReal except that the load delay is handled by the dynarec. */
+struct dynarec_cop_ret PS_CPU::DynarecCop(struct dynarec_state *s, uint32 instr, uint32 pc, int32 counter, uint32 operand)
+{
+   struct dynarec_cop_ret ret = { 0, 0, 0, 0 };
+   pscpu_timestamp_t timestamp = DynarecTimestamp(counter);
+   const uint32 opcode = instr >> 26;
+   const uint32 sub_op = (instr >> 21) & 0x1F;
+   const uint32 rt = (instr >> 16) & 0x1F;
+   const uint32 rd = (instr >> 11) & 0x1F;
+   const uint32 cop = opcode & 0x3;
+   int exception = -1;
+
+   /* For MFCn/CFCn that don't load anything the register is left
+      untouched */
+   ret.value = dynarec_get_reg(s, rt);
+
+   if (opcode != 0x10 && !(CP0.SR & (1U << (28 + cop))))
+   {
+      if (cop == 2 && (opcode == 0x32 || opcode == 0x3A))
+      {
+         /* LWC2 and SWC2 are not checked by the interpreter */
+      }
+      else
+         exception = EXCEPTION_COPU;
+   }
+
+   if (exception < 0)
+   {
+      switch(opcode)
+      {
+         case 0x10: // COP0
+            switch(sub_op)
+            {
+               case 0x02:
+               case 0x06:
+                  exception = EXCEPTION_RI;
+                  break;
+
+               case 0x00: // MFC0
+                  switch(rd)
+                  {
+                     case 0x00:
+                     case 0x01:
+                     case 0x02:
+                     case 0x04:
+                     case 0x0A:
+                        exception = EXCEPTION_RI;
+                        break;
+
+                     case 0x03:
+                     case 0x05:
+                     case 0x06:
+                     case 0x07:
+                     case 0x08:
+                     case 0x09:
+                     case 0x0B:
+                     case 0x0C:
+                     case 0x0D:
+                     case 0x0E:
+                     case 0x0F:
+                        ret.value = CP0.Regs[rd];
+                        break;
+                  }
+                  break;
+
+               case 0x04: // MTC0
+                  switch(rd)
+                  {
+                     case 0x00:
+                     case 0x01:
+                     case 0x02:
+                     case 0x04:
+                     case 0x0A:
+                        exception = EXCEPTION_RI;
+                        break;
+
+                     case CP0REG_BPC:
+                        CP0.BPC = operand;
+                        break;
+
+                     case CP0REG_BDA:
+                        CP0.BDA = operand;
+                        break;
+
+                     case CP0REG_DCIC:
+                        CP0.DCIC = operand & 0xFF80003F;
+                        break;
+
+                     case CP0REG_BDAM:
+                        CP0.BDAM = operand;
+                        break;
+
+                     case CP0REG_BPCM:
+                        CP0.BPCM = operand;
+                        break;
+
+                     case CP0REG_CAUSE:
+                        CP0.CAUSE &= ~(0x3 << 8);
+                        CP0.CAUSE |= operand & (0x3 << 8);
+                        RecalcIPCache();
+                        break;
+
+                     case CP0REG_SR:
+                        CP0.SR = operand & ~( (0x3 << 26) | (0x3 << 23) | (0x3 << 6));
+                        RecalcIPCache();
+                        break;
+                  }
+                  break;
+
+               case 0x10: case 0x11: case 0x12: case 0x13: case 0x14: case 0x15: case 0x16: case 0x17:
+               case 0x18: case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E: case 0x1F:
+                  {
+                     const uint32 cp0_op = instr & 0x1F;	// Not 0x3F
+
+                     if(MDFN_LIKELY(cp0_op == 0x10))	// RFE
+                     {
+                        // "Pop"
+                        CP0.SR = (CP0.SR & ~0x0F) | ((CP0.SR >> 2) & 0x0F);
+                        RecalcIPCache();
+                     }
+                     else if(cp0_op == 0x01 || cp0_op == 0x02 || cp0_op == 0x06 || cp0_op == 0x08)	// TLBR, TLBWI, TLBWR, TLBP
+                        exception = EXCEPTION_RI;
+                  }
+                  break;
+            }
+
+            dynarec_set_sr(s, CP0.SR);
+            break;
+
+         case 0x12: // COP2
+            switch(sub_op)
+            {
+               case 0x00: // MFC2
+               case 0x02: // CFC2
+                  {
+                     const struct dynarec_load_val v = DynarecGTERead(s, instr, DynarecCounter(timestamp));
+
+                     ret.value = v.value;
+                     timestamp = DynarecTimestamp(v.counter);
+                  }
+                  break;
+
+               case 0x04: // MTC2
+               case 0x06: // CTC2
+               case 0x10: case 0x11: case 0x12: case 0x13: case 0x14: case 0x15: case 0x16: case 0x17:
+               case 0x18: case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E: case 0x1F:
+                  timestamp = DynarecTimestamp(DynarecGTE(s, instr, operand, DynarecCounter(timestamp)));
+                  break;
+            }
+            break;
+
+         case 0x11: // COP1
+         case 0x13: // COP3
+            break;
+
+         case 0x30: // LWC0
+         case 0x31: // LWC1
+         case 0x33: // LWC3
+            if(MDFN_UNLIKELY(operand & 3))
+            {
+               CP0.BADA = operand;
+               exception = EXCEPTION_ADEL;
+            }
+            else
+               ReadMemory<uint32>(timestamp, operand, false, true);
+            break;
+
+         case 0x32: // LWC2
+            if(MDFN_UNLIKELY(operand & 3))
+            {
+               CP0.BADA = operand;
+               exception = EXCEPTION_ADEL;
+            }
+            else
+               timestamp = DynarecTimestamp(DynarecGTE(s, instr, operand, DynarecCounter(timestamp)));
+            break;
+
+         case 0x38: // SWC0
+         case 0x39: // SWC1
+         case 0x3B: // SWC3
+            if(MDFN_UNLIKELY(operand & 3))
+            {
+               CP0.BADA = operand;
+               exception = EXCEPTION_ADES;
+            }
+            break;
+
+         case 0x3A: // SWC2
+            if(MDFN_UNLIKELY(operand & 3))
+            {
+               CP0.BADA = operand;
+               exception = EXCEPTION_ADES;
+            }
+            else
+               timestamp = DynarecTimestamp(DynarecGTE(s, instr, operand, DynarecCounter(timestamp)));
+            break;
+      }
+   }
+
+   if (exception >= 0)
+   {
+      s->pc = DynarecRaise(s, exception, pc, instr);
+      ret.exit = 1;
+   }
+
+   ret.counter = DynarecCounter(timestamp);
+
+   return ret;
+}
+
+/* State bridge between the two engines. The dynarec has no branch
+   delay slot or load delay state between blocks, the interpreter's
+   must be settled before calling DynarecImport (see
+   DynarecSettle). */
+void PS_CPU::DynarecImport(struct dynarec_state *s)
+{
+   unsigned i;
+
+   /* The recompiled code never leaves a load pending when it returns
+      so we commit it now */
+   if (BACKED_LDWhich < 0x20)
+      GPR[BACKED_LDWhich] = BACKED_LDValue;
+   BACKED_LDWhich = 0x20;
+   BACKED_LDValue = 0;
+
+   for (i = 1; i < 32; i++)
+      dynarec_set_reg(s, i, GPR[i]);
+   dynarec_set_reg(s, DYNAREC_REG_HI, HI);
+   dynarec_set_reg(s, DYNAREC_REG_LO, LO);
+   dynarec_set_pc(s, BACKED_PC);
+   dynarec_set_sr(s, CP0.SR);
+}
+
+/* Write the dynarec state back to the interpreter, which is also
+   what StateAction saves */
+void PS_CPU::DynarecExport(struct dynarec_state *s)
+{
+   unsigned i;
+
+   for (i = 1; i < 32; i++)
+      GPR[i] = dynarec_get_reg(s, i);
+   HI = dynarec_get_reg(s, DYNAREC_REG_HI);
+   LO = dynarec_get_reg(s, DYNAREC_REG_LO);
+   BACKED_PC = s->pc;
+   BACKED_new_PC = s->pc + 4;
+   BACKED_LDWhich = 0x20;
+   BACKED_LDValue = 0;
+   BDBT = 0;
+}
+
+/* Tiered mode: interpret the code at the dynarec's PC until we reach
+   a compiled page or the next event */
+pscpu_timestamp_t PS_CPU::DynarecInterpret(struct dynarec_state *s, pscpu_timestamp_t timestamp, bool ILHMode)
+{
+   DynarecExport(s);
+
+   /* RunReal wants them relative to the timestamp we pass, same as
+      for CPUHook */
+   gte_ts_done -= timestamp;
+   muldiv_ts_done -= timestamp;
+
+   if (ILHMode)
+      timestamp = RunReal<false, false, true, true>(timestamp);
+   else
+      timestamp = RunReal<false, false, false, true>(timestamp);
+
+   gte_ts_done += timestamp;
+   muldiv_ts_done += timestamp;
+
+   DynarecImport(s);
+
+   return timestamp;
+}
+
+#ifdef DYNAREC_LOCKSTEP
+/* Return true if the recompiled code would return to dynarec_run
+   after running the instruction at `PC`, `new_PC` being the next
+   one. This has to match the exits generated by the dynarec, see
+   emit_jump_to in dynarec-compiler.c. */
+bool PS_CPU::DynarecBlockEnd(uint32 PC, uint32 new_PC)
+{
+   /* Delay slots are recompiled along with their branch */
+   const uint32 branch = BDBT ? PC - 4 : PC;
+   const int32 page = dynarec_find_page_index(dynarec_state, branch);
+   uint32 instr;
+
+   /* dynarec_run raises the exception for a jump to an unaligned
+      address itself and goes on with the handler */
+   if (PC & 3)
+      return false;
+
+   if (dynarec_find_page_index(dynarec_state, new_PC) != page)
+      return true;
+
+   /* Exceptions always exit */
+   if (!BDBT)
+      return new_PC != PC + 4;
+
+   /* Branch not taken */
+   if (!(BDBT & 1))
+      return false;
+
+   /* JR and JALR */
+   instr = PeekMemory<uint32>(branch);
+   if ((instr >> 26) == 0)
+      return true;
+
+   /* Backward jumps check the counter, which is always exhausted
+      in lockstep mode */
+   return ((new_PC % DYNAREC_PAGE_SIZE) >> 2) <= ((branch % DYNAREC_PAGE_SIZE) >> 2);
+}
+
+/* Record the first difference between the interpreter and the
+   dynarec, it's reported at the end of the block */
+void PS_CPU::LockstepMismatch(const char *format, ...)
+{
+   va_list ap;
+
+   if (LockstepError[0])
+      return;
+
+   va_start(ap, format);
+   vsnprintf(LockstepError, sizeof(LockstepError), format, ap);
+   va_end(ap);
+}
+
+/* Called for every write while in lockstep mode. Returns false if the
+   write must not reach the hardware. */
+bool PS_CPU::LockstepWrite(uint32 address, uint32 value, unsigned size)
+{
+   const uint32 masked = address & addr_mask[address >> 29];
+   const bool isolated = CP0.SR & 0x10000;
+
+   if (!isolated && (masked < 0x00800000 || (masked >= 0x1F800000 && masked <= 0x1F8003FF)))
+   {
+      /* RAM and scratchpad writes are undone after the interpreter
+         run and made again by the dynarec */
+      if (LockstepMode == LOCKSTEP_RECORD)
+      {
+         const LockstepUndo undo = { masked & ~3U, PeekMemory<uint32>(masked & ~3U), 0 };
+
+         LockstepUndos.push_back(undo);
+      }
+
+      return true;
+   }
+
+   if (LockstepMode == LOCKSTEP_REPLAY)
+   {
+      LockstepReplay(masked, value, size, true);
+      return false;
+   }
+
+   const LockstepAccess access = { masked, value, (uint8)size, true };
+
+   LockstepAccesses.push_back(access);
+
+   return true;
+}
+
+/* Device access made by the dynarec: check it against the
+   interpreter's and return the value it read */
+uint32 PS_CPU::LockstepReplay(uint32 address, uint32 value, unsigned size, bool write)
+{
+   const uint32 mask = (size == 4) ? 0xFFFFFFFF : ((1U << (size * 8)) - 1);
+
+   if (LockstepPos >= LockstepAccesses.size())
+   {
+      LockstepMismatch("unexpected %u-byte %s at 0x%08x\n",
+                       size, write ? "write" : "read", address);
+      return 0;
+   }
+
+   const LockstepAccess &access = LockstepAccesses[LockstepPos++];
+
+   if (access.address != address || access.size != size || access.write != write ||
+       (write && ((access.value ^ value) & mask)))
+   {
+      LockstepMismatch("access #%u: interpreter %u-byte %s 0x%08x at 0x%08x, "
+                       "dynarec %u-byte %s 0x%08x at 0x%08x\n",
+                       (unsigned)LockstepPos - 1,
+                       access.size, access.write ? "write" : "read", access.value, access.address,
+                       size, write ? "write" : "read", value, address);
+   }
+
+   return access.value;
+}
+
+void PS_CPU::LockstepSaveGTE(StateMem *sm)
+{
+   sm->loc = 0;
+   sm->len = 0;
+   GTE_StateAction(sm, 0, 0);
+}
+
+/* Lockstep verification: run the next block with the interpreter,
+   undo its side effects and run it again with the dynarec. Device
+   accesses only happen once, during the interpreter run, and the
+   dynarec is fed the values that were logged. Aborts with a trace of
+   the block on the first difference. */
+pscpu_timestamp_t PS_CPU::DynarecLockstep(struct dynarec_state *s, pscpu_timestamp_t timestamp)
+{
+   const uint32 start_pc = s->pc;
+   uint32 start_gpr[32];
+   uint32 start_hi;
+   uint32 start_lo;
+   uint32 start_cp0[32];
+   uint32 ref_gpr[32];
+   uint32 ref_hi;
+   uint32 ref_lo;
+   uint32 ref_pc;
+   uint32 ref_cp0[32];
+   pscpu_timestamp_t ref_timestamp;
+   pscpu_timestamp_t ref_gte_ts_done;
+   pscpu_timestamp_t ref_muldiv_ts_done;
+   size_t i;
+
+   for (i = 1; i < 32; i++)
+      start_gpr[i] = dynarec_get_reg(s, i);
+   start_hi = dynarec_get_reg(s, DYNAREC_REG_HI);
+   start_lo = dynarec_get_reg(s, DYNAREC_REG_LO);
+   memcpy(start_cp0, CP0.Regs, sizeof(start_cp0));
+   LockstepSaveGTE(&LockstepGTE[0]);
+
+   LockstepAccesses.clear();
+   LockstepUndos.clear();
+   LockstepTrace.clear();
+   LockstepError[0] = 0;
+
+   /* Reference run */
+   LockstepMode = LOCKSTEP_RECORD;
+   ref_timestamp = DynarecInterpret(s, timestamp, false);
+   LockstepMode = LOCKSTEP_OFF;
+
+   memcpy(ref_gpr, GPR, sizeof(ref_gpr));
+   ref_hi = HI;
+   ref_lo = LO;
+   ref_pc = BACKED_PC;
+   memcpy(ref_cp0, CP0.Regs, sizeof(ref_cp0));
+   ref_gte_ts_done = gte_ts_done;
+   ref_muldiv_ts_done = muldiv_ts_done;
+   LockstepSaveGTE(&LockstepGTE[1]);
+
+   /* Undo the interpreter's memory writes, newest first */
+   for (i = 0; i < LockstepUndos.size(); i++)
+      LockstepUndos[i].new_value = PeekMemory<uint32>(LockstepUndos[i].address);
+
+   for (i = LockstepUndos.size(); i-- > 0; )
+      PokeMemory<uint32>(LockstepUndos[i].address, LockstepUndos[i].old_value);
+
+   memcpy(CP0.Regs, start_cp0, sizeof(start_cp0));
+   RecalcIPCache();
+   LockstepGTE[0].loc = 0;
+   GTE_StateAction(&LockstepGTE[0], 1, 0);
+
+   for (i = 1; i < 32; i++)
+      dynarec_set_reg(s, i, start_gpr[i]);
+   dynarec_set_reg(s, DYNAREC_REG_HI, start_hi);
+   dynarec_set_reg(s, DYNAREC_REG_LO, start_lo);
+   dynarec_set_pc(s, start_pc);
+   dynarec_set_sr(s, CP0.SR);
+
+   /* Run the same block with the dynarec. With a counter of 1 it
+      returns at the first exit. */
+   LockstepMode = LOCKSTEP_REPLAY;
+   LockstepPos = 0;
+   DynarecBias = next_event_ts - timestamp - 1;
+   dynarec_run(s, 1);
+   DynarecBias = 0;
+   LockstepMode = LOCKSTEP_OFF;
+
+   if (LockstepPos != LockstepAccesses.size())
+      LockstepMismatch("dynarec made %u device accesses, expected %u\n",
+                       (unsigned)LockstepPos, (unsigned)LockstepAccesses.size());
+
+   if ((s->pc & 0x1FFFFFFF) != (ref_pc & 0x1FFFFFFF))
+      LockstepMismatch("PC: interpreter 0x%08x, dynarec 0x%08x\n", ref_pc, s->pc);
+
+   for (i = 1; i < 32; i++)
+   {
+      if (dynarec_get_reg(s, i) != ref_gpr[i])
+         LockstepMismatch("r%u: interpreter 0x%08x, dynarec 0x%08x\n",
+                          (unsigned)i, ref_gpr[i], dynarec_get_reg(s, i));
+   }
+
+   if (dynarec_get_reg(s, DYNAREC_REG_HI) != ref_hi)
+      LockstepMismatch("HI: interpreter 0x%08x, dynarec 0x%08x\n",
+                       ref_hi, dynarec_get_reg(s, DYNAREC_REG_HI));
+
+   if (dynarec_get_reg(s, DYNAREC_REG_LO) != ref_lo)
+      LockstepMismatch("LO: interpreter 0x%08x, dynarec 0x%08x\n",
+                       ref_lo, dynarec_get_reg(s, DYNAREC_REG_LO));
+
+   for (i = 0; i < 32; i++)
+   {
+      if (CP0.Regs[i] != ref_cp0[i])
+         LockstepMismatch("cop0r%u: interpreter 0x%08x, dynarec 0x%08x\n",
+                          (unsigned)i, ref_cp0[i], CP0.Regs[i]);
+   }
+
+   LockstepSaveGTE(&LockstepGTE[0]);
+   if (LockstepGTE[0].len != LockstepGTE[1].len ||
+       memcmp(LockstepGTE[0].data, LockstepGTE[1].data, LockstepGTE[0].len))
+      LockstepMismatch("GTE state differs\n");
+
+   for (i = 0; i < LockstepUndos.size(); i++)
+   {
+      const LockstepUndo &undo = LockstepUndos[i];
+      const uint32 value = PeekMemory<uint32>(undo.address);
+
+      if (value != undo.new_value)
+         LockstepMismatch("memory at 0x%08x: interpreter 0x%08x, dynarec 0x%08x\n",
+                          undo.address, undo.new_value, value);
+   }
+
+   if (LockstepError[0])
+   {
+      DYNAREC_LOG("Lockstep mismatch in block at 0x%08x: %s", start_pc, LockstepError);
+
+      for (i = 0; i < LockstepTrace.size(); i++)
+      {
+         const uint32 pc = LockstepTrace[i];
+
+         DYNAREC_LOG("  0x%08x: %s\n", pc, DisassembleMIPS(pc, PeekMemory<uint32>(pc)).c_str());
+      }
+
+      DYNAREC_FATAL("Lockstep verification failed\n");
+   }
+
+   /* Both agree, the timing is the interpreter's */
+   gte_ts_done = ref_gte_ts_done;
+   muldiv_ts_done = ref_muldiv_ts_done;
+
+   return ref_timestamp;
+}
+#endif /* DYNAREC_LOCKSTEP */
+
+/* Create the dynarec state the first time it's needed. Returns false
+   if the host doesn't let us generate code. */
+bool PS_CPU::DynarecCreate(void)
 {
-   uint32_t PC;
-   uint32_t new_PC;
-   uint32_t new_PC_mask;
-   uint32_t LDWhich;
-   uint32_t LDValue;
+   if (dynarec_state != NULL)
+      return true;
 
-   BACKING_TO_ACTIVE;
+   dynarec_state = dynarec_init(MainRAM.data32,
+                                ScratchRAM.data32,
+                                BIOSROM->data32);
+   if (dynarec_state == NULL)
+      return false;
 
-   if (dynarec_state == NULL) {
-      dynarec_state = dynarec_init(MainRAM.data32,
-                                   ScratchRAM.data32,
-                                   BIOSROM->data32);
-      assert(dynarec_state != NULL);
+   if (retro_save_directory[0])
+   {
+      char cache_dir[4096 + 32];
 
-      dynarec_set_pc(dynarec_state, PC);
+      snprintf(cache_dir, sizeof(cache_dir), "%s/beetle_psx_dynarec", retro_save_directory);
+      dynarec_set_cache_dir(dynarec_state, cache_dir);
    }
 
+   return true;
+}
+
+/* The interpreter may have stopped (or a save state may have been
+   taken) in a branch delay slot or with a load pending, which the
+   dynarec can't represent. Interpret until we're out of it, that's
+   at most a couple of instructions. */
+pscpu_timestamp_t PS_CPU::DynarecSettle(pscpu_timestamp_t timestamp)
+{
+   if (BACKED_new_PC == BACKED_PC + 4 && BACKED_LDWhich == 0x20)
+      return timestamp;
+
+   DynarecSettling = true;
+   timestamp = RunReal<false, false, false, true>(timestamp);
+   DynarecSettling = false;
+
+   return timestamp;
+}
+
+pscpu_timestamp_t PS_CPU::RunDynarec(pscpu_timestamp_t timestamp_in, bool ILHMode)
+{
+   pscpu_timestamp_t timestamp = timestamp_in;
+   struct dynarec_state *s = dynarec_state;
+   uint32 options;
+
+   timestamp = DynarecSettle(timestamp);
+
+   gte_ts_done += timestamp;
+   muldiv_ts_done += timestamp;
+
+   options = 0;
+   if (psx_dynarec_lazy_invalidate)
+      options |= DYNAREC_OPT_LAZY_INVALIDATE;
+   if (psx_dynarec_fast_sp)
+      options |= DYNAREC_OPT_FAST_SP;
+   if (psx_dynarec_fastmem)
+      options |= DYNAREC_OPT_FASTMEM;
+#ifndef DYNAREC_LOCKSTEP
+   /* Lockstep mode does its own interpreting and the reference
+      interpreter doesn't skip idle loops */
+   if (psx_dynarec_tiered)
+      options |= DYNAREC_OPT_TIERED;
+   if (ILHMode)
+      options |= DYNAREC_OPT_IDLE_SKIP;
+   if (psx_cpu_hle_bios)
+      options |= DYNAREC_OPT_HLE_BIOS;
+#endif
+   if (psx_dynarec_cache)
+      options |= DYNAREC_OPT_CODE_CACHE;
+   if (psx_dynarec_jitdump)
+      options |= DYNAREC_OPT_JITDUMP;
+   dynarec_set_options(s, options);
+   DynarecImport(s);
+   s->unsupported = false;
+
    do {
-      int32_t cycles_to_run = next_event_ts - timestamp;
+      while (MDFN_LIKELY(timestamp < next_event_ts)) {
+         if (MDFN_UNLIKELY(IPCache)) {
+            uint32 instr;
+
+            if (Halted) {
+               timestamp = next_event_ts;
+               break;
+            }
+
+            /* Don't take interrupts when the PC points to a GTE
+               instruction, see the comment in RunReal's opcode
+               table. We run it first. */
+            s->region = s->pc & 0xE0000000;
+            instr = (s->pc & 3) ? 0 : PeekMemory<uint32>(s->pc);
+
+            if ((instr >> 26) == 0x12) {
+               const uint32 rt = (instr >> 16) & 0x1F;
+               const uint32 sub_op = (instr >> 21) & 0x1F;
+               const uint32 pc = s->pc;
+               struct dynarec_cop_ret ret;
+
+               DynarecBias = 0;
+               ret = DynarecCop(s, instr, pc & 0x1FFFFFFF, next_event_ts - timestamp,
+                                dynarec_get_reg(s, rt));
+               timestamp = DynarecTimestamp(ret.counter);
+
+               if (!ret.exit) {
+                  if (sub_op == 0x00 || sub_op == 0x02)
+                     dynarec_set_reg(s, rt, ret.value);
+                  s->pc = pc + 4;
+               }
+               continue;
+            }
+
+            s->pc = DynarecRaise(s, EXCEPTION_INT, s->pc & 0x1FFFFFFF, instr);
+         }
+
+#ifdef DYNAREC_LOCKSTEP
+         timestamp = DynarecLockstep(s, timestamp);
+#else
+         int32_t counter;
+
+         DynarecBias = 0;
+         counter = dynarec_run(s, next_event_ts - timestamp);
+         timestamp = DynarecTimestamp(counter);
+
+         /* Tiered mode: the dynarec stopped on code that isn't
+            compiled yet. It also stops on code it can't run at all
+            (outside of RAM and BIOS), in auto mode we then switch
+            to the interpreter from the next frame on. */
+         if (counter > 0)
+            timestamp = DynarecInterpret(s, timestamp, ILHMode);
+
+         if (MDFN_UNLIKELY(s->unsupported) && psx_dynarec_mode == DYNAREC_MODE_AUTO && !DynarecFallback)
+         {
+            DynarecFallback = true;
+            log_cb(RETRO_LOG_WARN, "[Dynarec]: Unsupported code at 0x%08x, falling back to the interpreter\n", s->pc);
+         }
+#endif
+      }
 
-      dynarec_run(dynarec_state, cycles_to_run);
+      if (MDFN_UNLIKELY(timestamp >= ProfileNextTS))
+         ProfileSample(timestamp, s->pc);
    } while(MDFN_LIKELY(PSX_EventHandler(timestamp)));
 
-   ACTIVE_TO_BACKING;
+   DynarecBias = 0;
+
+   if(gte_ts_done > 0)
+      gte_ts_done -= timestamp;
+
+   if(muldiv_ts_done > 0)
+      muldiv_ts_done -= timestamp;
+
+   DynarecExport(s);
+
+   return timestamp;
+}
+
+/* Callbacks used by the dynarec, see dynarec.h */
+extern "C" int32_t dynarec_callback_sb(struct dynarec_state *s, uint32_t val, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecWrite<uint8>(s, val, addr, counter);
+}
+
+extern "C" int32_t dynarec_callback_sh(struct dynarec_state *s, uint32_t val, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecWrite<uint16>(s, val, addr, counter);
+}
 
-   return 0;
+extern "C" int32_t dynarec_callback_sw(struct dynarec_state *s, uint32_t val, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecWrite<uint32>(s, val, addr, counter);
+}
+
+extern "C" struct dynarec_load_val dynarec_callback_lb(struct dynarec_state *s, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecRead<uint8>(s, addr, counter);
+}
+
+extern "C" struct dynarec_load_val dynarec_callback_lh(struct dynarec_state *s, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecRead<uint16>(s, addr, counter);
+}
+
+extern "C" struct dynarec_load_val dynarec_callback_lw(struct dynarec_state *s, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecRead<uint32>(s, addr, counter);
+}
+
+extern "C" struct dynarec_load_val dynarec_callback_lwl(struct dynarec_state *s, uint32_t cur, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecLWL(s, cur, addr, counter);
+}
+
+extern "C" struct dynarec_load_val dynarec_callback_lwr(struct dynarec_state *s, uint32_t cur, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecLWR(s, cur, addr, counter);
+}
+
+extern "C" int32_t dynarec_callback_swl(struct dynarec_state *s, uint32_t val, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecSWL(s, val, addr, counter);
+}
+
+extern "C" int32_t dynarec_callback_swr(struct dynarec_state *s, uint32_t val, uint32_t addr, int32_t counter)
+{
+   return CPU->DynarecSWR(s, val, addr, counter);
+}
+
+extern "C" int32_t dynarec_callback_exception(struct dynarec_state *s, uint32_t code, uint32_t pc, int32_t counter, uint32_t bad_vaddr)
+{
+   return CPU->DynarecException(s, code, pc, counter, bad_vaddr);
+}
+
+extern "C" int32_t dynarec_callback_hle_bios(struct dynarec_state *s, int32_t counter)
+{
+   return CPU->DynarecHLEBIOS(s, counter);
+}
+
+extern "C" struct dynarec_cop_ret dynarec_callback_cop(struct dynarec_state *s, uint32_t instruction, uint32_t pc, int32_t counter, uint32_t operand)
+{
+   return CPU->DynarecCop(s, instruction, pc, counter, operand);
+}
+
+extern "C" int32_t dynarec_callback_gte(struct dynarec_state *s, uint32_t instruction, uint32_t operand, int32_t counter)
+{
+   return CPU->DynarecGTE(s, instruction, operand, counter);
+}
+
+extern "C" struct dynarec_load_val dynarec_callback_gte_read(struct dynarec_state *s, uint32_t instruction, int32_t counter)
+{
+   return CPU->DynarecGTERead(s, instruction, counter);
 }
 #endif /* HAVE_DYNAREC */
 
 pscpu_timestamp_t PS_CPU::Run(pscpu_timestamp_t timestamp_in, bool BIOSPrintMode, bool ILHMode)
 {
+ ProfileStart(timestamp_in);
+
 #ifdef HAVE_DYNAREC
-   bool use_dynarec = true;
+   /* The debugger hooks are only called by the interpreter. Both
+      engines share the interpreter's state between calls so we can
+      switch at any time. */
+   if (psx_dynarec_mode != DYNAREC_MODE_DISABLED && !DynarecFallback && !CPUHook && !ADDBT)
+   {
+      if (DynarecCreate())
+         return(RunDynarec(timestamp_in, ILHMode));
 
-   if (use_dynarec) {
-      return(RunDynarec(timestamp_in));
+      log_cb(RETRO_LOG_WARN, "[Dynarec]: Can't allocate executable memory, falling back to the interpreter\n");
+      DynarecFallback = true;
    }
 #endif /* HAVE_DYNAREC */
 
  if(CPUHook || ADDBT)
-  return(RunReal<true, true, false>(timestamp_in));
-#ifdef DEBUG
+  return(RunReal<true, true, false, false>(timestamp_in));
  if(ILHMode)
-  return(RunReal<false, false, true>(timestamp_in));
+  return(RunReal<false, false, true, false>(timestamp_in));
+#ifdef DEBUG
  if(BIOSPrintMode)
-  return(RunReal<false, true, false>(timestamp_in));
+  return(RunReal<false, true, false, false>(timestamp_in));
 #endif
+ return(RunReal<false, false, false, false>(timestamp_in));
 }
 
 void PS_CPU::SetCPUHook(void (*cpuh)(const pscpu_timestamp_t timestamp, uint32 pc), void (*addbt)(uint32 from, uint32 to, bool exception))
@@ -2871,6 +4617,14 @@ void PS_CPU::PokeMem32(uint32 A, uint32 V)
 #undef BEGIN_OPF
 #undef END_OPF
 #undef MK_OPF
+#undef ITYPE
+#undef ITYPE_ZE
+#undef RTYPE
+
+// No ICache entry here, decode from the instruction word.
+#define ITYPE uint32 rs MDFN_NOWARN_UNUSED = (instr >> 21) & 0x1F; uint32 rt MDFN_NOWARN_UNUSED = (instr >> 16) & 0x1F; uint32 immediate = (int32)(int16)(instr & 0xFFFF);
+#define ITYPE_ZE uint32 rs MDFN_NOWARN_UNUSED = (instr >> 21) & 0x1F; uint32 rt MDFN_NOWARN_UNUSED = (instr >> 16) & 0x1F; uint32 immediate = instr & 0xFFFF;
+#define RTYPE uint32 rs MDFN_NOWARN_UNUSED = (instr >> 21) & 0x1F; uint32 rt MDFN_NOWARN_UNUSED = (instr >> 16) & 0x1F; uint32 rd MDFN_NOWARN_UNUSED = (instr >> 11) & 0x1F; uint32 shamt MDFN_NOWARN_UNUSED = (instr >> 6) & 0x1F;
 
 #define MK_OPF(op, funct)	((op) ? (0x40 | (op)) : (funct))
 #define BEGIN_OPF(op, funct) case MK_OPF(op, funct): {
@@ -61,6 +61,27 @@
 
 #include "gte.h"
 
+#include <algorithm>
+#include <map>
+
+#ifdef HAVE_DYNAREC
+#include "dynarec.h"
+
+extern struct dynarec_state *dynarec_state;
+
+// Values of psx_dynarec_mode
+enum
+{
+ DYNAREC_MODE_DISABLED = 0,	// Always interpret
+ DYNAREC_MODE_ENABLED,		// Code the dynarec can't run is interpreted
+ DYNAREC_MODE_AUTO		// Like enabled, but switch to the interpreter for good when that happens
+};
+
+#ifdef DYNAREC_LOCKSTEP
+#include <vector>
+#endif
+#endif
+
 #if NOT_LIBRETRO
 namespace MDFN_IEN_PSX
 {
@@ -82,7 +103,8 @@ class PS_CPU
 
  INLINE void SetEventNT(const pscpu_timestamp_t next_event_ts_arg)
  {
-  next_event_ts = next_event_ts_arg;
+  EventNT = next_event_ts_arg;
+  next_event_ts = std::min(next_event_ts_arg, ProfileNextTS);
  }
 
  INLINE pscpu_timestamp_t GetEventNT(void) {
@@ -130,6 +152,7 @@ class PS_CPU
  uint32 LDAbsorb;
 
  pscpu_timestamp_t next_event_ts;
+ pscpu_timestamp_t EventNT;	// next_event_ts before it's clamped to ProfileNextTS
  pscpu_timestamp_t gte_ts_done;
  pscpu_timestamp_t muldiv_ts_done;
 
@@ -200,6 +223,26 @@ class PS_CPU
   uint32 ICache_Bulk[2048];
  };
 
+ //
+ // ICache[].Data pre-decoded for RunReal(), updated everywhere Data is written so instructions executed
+ // out of the instruction cache are only decoded once per fill.  Not saved in save states, rebuilt on load.
+ //
+ struct __ICacheDecoded
+ {
+  uint8 opf;		// Index in the opcode table, without the interrupt bits.
+  uint8 rs;
+  uint8 rt;
+  uint8 rd;
+  uint8 shamt;
+  uint32 immediate;	// Sign-extended
+ };
+
+ __ICacheDecoded ICacheDecoded[1024];
+ __ICacheDecoded UncachedDecoded;
+
+ static void DecodeInstruction(__ICacheDecoded *d, uint32 instr);
+ void RedecodeICache(void);
+
    MultiAccessSizeMem<1024, uint32, false> ScratchRAM;
 
  //PS_GTE GTE;
@@ -226,9 +269,120 @@ class PS_CPU
 
  uint32 Exception(uint32 code, uint32 PC, const uint32 NP, const uint32 instr) MDFN_WARN_UNUSED_RESULT;
 
- template<bool DebugMode, bool BIOSPrintMode, bool ILHMode> pscpu_timestamp_t RunReal(pscpu_timestamp_t timestamp_in) NO_INLINE;
+ template<bool DebugMode, bool BIOSPrintMode, bool ILHMode, bool DynarecTier> pscpu_timestamp_t RunReal(pscpu_timestamp_t timestamp_in) NO_INLINE;
+
+ // Idle loop skipping(ILHMode), see IdleLoop()
+ enum { IDLE_LOOP_MAX = 16 };	// In instructions, including the branch and its delay slot
+ uint32 IdleLoopPC;		// Branch of the last candidate loop
+ pscpu_timestamp_t IdleLoopTS;	// Timestamp the last time that branch was taken
+ pscpu_timestamp_t IdleLoopCost;	// Cycles taken by the last iteration
+ bool IdleLoopCandidate;
+
+ pscpu_timestamp_t IdleLoop(pscpu_timestamp_t timestamp, uint32 pc) NO_INLINE;
+ bool IdleLoopCheck(uint32 pc, const uint32 *gpr);
+
+ // HLE of the BIOS library(psx_cpu_hle_bios), see HLEBIOSCall()
+ enum { HLE_BIOS_A_FUNCTIONS = 0xA0 };
+ bool HLEBIOSCall(uint32 fn, const uint32 *args, uint32 *ret, pscpu_timestamp_t *cycles, pscpu_timestamp_t budget) NO_INLINE;
+ bool HLERAMRange(uint32 address, uint32 len, uint32 *offset);
+ bool HLERAMString(uint32 address, uint32 *offset, uint32 *len);
+ void HLERAMWritten(uint32 offset, uint32 len);
+
+ // Guest PC sampling profiler(psx_cpu_profiler), see ProfileSample()
+ enum { PROFILE_SCAN_MAX = 4096 };	// In instructions, how far back we look for the start of a function
+ struct ProfileEntry
+ {
+  uint32 hits;
+  uint32 func;	// Start of the function containing the address
+ };
+ std::map<uint32, ProfileEntry> ProfileHits;
+ uint64 ProfileSamples;
+ pscpu_timestamp_t ProfilePeriod;
+ pscpu_timestamp_t ProfileNextTS;
+
+ void ProfileStart(pscpu_timestamp_t timestamp);
+ void ProfileSample(pscpu_timestamp_t timestamp, uint32 pc) NO_INLINE;
+ uint32 ProfileFunction(uint32 pc);
+
 #ifdef HAVE_DYNAREC
- pscpu_timestamp_t RunDynarec(int32_t timestamp_in);
+ pscpu_timestamp_t RunDynarec(pscpu_timestamp_t timestamp_in, bool ILHMode);
+ pscpu_timestamp_t DynarecInterpret(struct dynarec_state *s, pscpu_timestamp_t timestamp, bool ILHMode);
+ bool DynarecCreate(void);
+ pscpu_timestamp_t DynarecSettle(pscpu_timestamp_t timestamp);
+ // Set while DynarecSettle() runs the interpreter, it stops at the first instruction it can
+ // hand over to the dynarec instead of the next event
+ bool DynarecSettling;
+ void DynarecImport(struct dynarec_state *s);
+ void DynarecExport(struct dynarec_state *s);
+ // Set in DYNAREC_MODE_AUTO once the dynarec failed to run this game
+ bool DynarecFallback;
+ uint32 DynarecRaise(struct dynarec_state *s, uint32 code, uint32 pc, uint32 instr);
+ pscpu_timestamp_t DynarecTimestamp(int32 counter);
+ int32 DynarecCounter(pscpu_timestamp_t timestamp);
+ // Offset between the dynarec's cycle counter and next_event_ts, used
+ // to make the recompiled code return early when an interrupt becomes
+ // pending.
+ int32 DynarecBias;
+
+#ifdef DYNAREC_LOCKSTEP
+ // Lockstep verification: every block is run by the interpreter then
+ // by the dynarec and the results are compared, see DynarecLockstep().
+ enum
+ {
+  LOCKSTEP_OFF = 0,
+  LOCKSTEP_RECORD,	// Interpreter run, log the accesses
+  LOCKSTEP_REPLAY	// Dynarec run, replay the logged device accesses
+ };
+
+ // Access to anything but RAM and the scratchpad
+ struct LockstepAccess
+ {
+  uint32 address;
+  uint32 value;
+  uint8 size;
+  bool write;
+ };
+
+ // RAM or scratchpad write made by the interpreter, to be undone
+ // before running the dynarec
+ struct LockstepUndo
+ {
+  uint32 address;	// Masked and word-aligned
+  uint32 old_value;
+  uint32 new_value;
+ };
+
+ unsigned LockstepMode;
+ size_t LockstepPos;
+ std::vector<LockstepAccess> LockstepAccesses;
+ std::vector<LockstepUndo> LockstepUndos;
+ std::vector<uint32> LockstepTrace;
+ StateMem LockstepGTE[2];
+ char LockstepError[256];
+
+ pscpu_timestamp_t DynarecLockstep(struct dynarec_state *s, pscpu_timestamp_t timestamp);
+ bool DynarecBlockEnd(uint32 PC, uint32 new_PC);
+ bool LockstepWrite(uint32 address, uint32 value, unsigned size);
+ uint32 LockstepReplay(uint32 address, uint32 value, unsigned size, bool write);
+ void LockstepMismatch(const char *format, ...);
+ void LockstepSaveGTE(StateMem *sm);
+#endif
+
+ public:
+ // Called by the dynarec through the dynarec_callback_* functions
+ template<typename T> int32 DynarecWrite(struct dynarec_state *s, uint32 val, uint32 addr, int32 counter);
+ template<typename T> struct dynarec_load_val DynarecRead(struct dynarec_state *s, uint32 addr, int32 counter);
+ struct dynarec_load_val DynarecLWL(struct dynarec_state *s, uint32 cur, uint32 addr, int32 counter);
+ struct dynarec_load_val DynarecLWR(struct dynarec_state *s, uint32 cur, uint32 addr, int32 counter);
+ int32 DynarecSWL(struct dynarec_state *s, uint32 val, uint32 addr, int32 counter);
+ int32 DynarecSWR(struct dynarec_state *s, uint32 val, uint32 addr, int32 counter);
+ int32 DynarecException(struct dynarec_state *s, uint32 code, uint32 pc, int32 counter, uint32 bad_vaddr);
+ int32 DynarecHLEBIOS(struct dynarec_state *s, int32 counter);
+ struct dynarec_cop_ret DynarecCop(struct dynarec_state *s, uint32 instr, uint32 pc, int32 counter, uint32 operand);
+ int32 DynarecGTE(struct dynarec_state *s, uint32 instr, uint32 operand, int32 counter);
+ struct dynarec_load_val DynarecGTERead(struct dynarec_state *s, uint32 instr, int32 counter);
+
+ private:
 #endif
 
 
@@ -237,7 +391,7 @@ class PS_CPU
  template<typename T> T ReadMemory(pscpu_timestamp_t &timestamp, uint32 address, bool DS24 = false, bool LWC_timing = false);
  template<typename T> void WriteMemory(pscpu_timestamp_t &timestamp, uint32 address, uint32 value, bool DS24 = false);
 
- uint32 ReadInstruction(pscpu_timestamp_t &timestamp, uint32 address);
+ uint32 ReadInstruction(pscpu_timestamp_t &timestamp, uint32 address, const __ICacheDecoded **dec);
 
  //
  // Mednafen debugger stuff follows:
@@ -280,6 +434,9 @@ class PS_CPU
  void PokeMem16(uint32 A, uint16 V);
  void PokeMem32(uint32 A, uint32 V);
 
+ bool WriteProfile(const char *path);
+ void ResetProfile(void);
+
  private:
  void (*CPUHook)(const pscpu_timestamp_t timestamp, uint32 pc);
  void (*ADDBT)(uint32 from, uint32 to, bool exception);
@@ -439,7 +439,13 @@ static INLINE void RunChannel(int32_t timestamp, int32_t clocks, int ch)
             ChRW(ch, CRModeCache, DMACH[ch].CurAddr, &vtmp, &voffs);
 
             if(!(CRModeCache & 0x1))
+            {
                MainRAM.WriteU32((DMACH[ch].CurAddr + (voffs << 2)) & 0x1FFFFC, vtmp);
+#ifdef HAVE_DYNAREC
+               if (dynarec_state)
+                  dynarec_invalidate_ram(dynarec_state, (DMACH[ch].CurAddr + (voffs << 2)) & 0x1FFFFC);
+#endif
+            }
          }
 
          if(CRModeCache & 0x2)
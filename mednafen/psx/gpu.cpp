@@ -15,6 +15,11 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+// Before psx.h, retro_miscellaneous.h defines ARRAY_SIZE unconditionally
+#ifdef HAVE_THREADS
+#include <rthreads/rthreads.h>
+#endif
+
 #include "psx.h"
 #include "timer.h"
 #include "../../rsx/rsx_intf.h"
@@ -27,6 +32,14 @@
 
 #include "gpu_common.h"
 
+static const int8 dither_table[4][4] =
+{
+   { -4,  0, -3,  1 },
+   {  2, -2,  3, -1 },
+   { -3,  1, -4,  0 },
+   {  3, -1,  2, -2 },
+};
+
 #include "gpu_polygon.cpp"
 #include "gpu_sprite.cpp"
 #include "gpu_line.cpp"
@@ -67,14 +80,6 @@
    Vertical start and end can be changed during active display, with effect(though it needs to be vs0->ve0->vs1->ve1->..., vs0->vs1->ve0 doesn't apparently do anything
    different from vs0->ve0.
    */
-static const int8 dither_table[4][4] =
-{
-   { -4,  0, -3,  1 },
-   {  2, -2,  3, -1 },
-   { -3,  1, -4,  0 },
-   {  3, -1,  2, -2 },
-};
-
 static FastFIFO<uint32, 0x20> GPU_BlitterFIFO; // 0x10 on an actual PS1 GPU, 0x20 here (see comment at top of gpu.h)
 
 struct CTEntry
@@ -97,6 +102,22 @@ static INLINE void InvalidateTexCache(PS_GPU *gpu)
    unsigned i;
    for (i = 0; i < 256; i++)
       gpu->TexCache[i].Tag = ~0U;
+   gpu->TexCacheFlushes++;
+}
+
+/* Load entry `i` of the texture cache from VRAM with tag `tag`, as
+ * GetTexel() does on a miss */
+static INLINE void FetchTexCache(PS_GPU *gpu, unsigned i, uint32_t tag)
+{
+   unsigned j;
+
+   gpu->TexCache[i].Tag = tag;
+
+   if(tag == ~0U)
+      return;
+
+   for(j = 0; j < 4; j++)
+      gpu->TexCache[i].Data[j] = texel_fetch(gpu, (tag & 1023) + j, tag >> 10);
 }
 
 static INLINE void InvalidateCache(PS_GPU *gpu)
@@ -185,11 +206,14 @@ static void Command_FBFill(PS_GPU* gpu, const uint32 *cb)
 
       gpu->DrawTimeAvail -= (width >> 3) + 9;
 
+      if(gpu->TimingOnly || !BandOwns(gpu, d_y))
+         continue;
+
       for(x = 0; x < width; x++)
       {
          const int32 d_x = (x + destX) & 1023;
 
-         texel_put(d_x, d_y, fill_value);
+         texel_put(gpu, d_x, d_y, fill_value);
       }
    }
 
@@ -217,10 +241,17 @@ static void Command_FBCopy(PS_GPU* g, const uint32 *cb)
 
    g->DrawTimeAvail -= (width * height) * 2;
 
+   // The render thread does the copy
+   if(g->TimingOnly)
+      return;
+
    for(y = 0; y < height; y++)
    {
       unsigned x;
 
+      if(!BandOwns(g, y + destY))
+         continue;
+
       for(x = 0; x < width; x += 128)
       {
          const int32 chunk_x_max = std::min<int32>(width - x, 128);
@@ -241,7 +272,7 @@ static void Command_FBCopy(PS_GPU* g, const uint32 *cb)
             int32 d_x = (x + chunk_x + destX) & 1023;
 
             if(!(texel_fetch(g, d_x, d_y) & g->MaskEvalAND))
-               texel_put(d_x, d_y, tmpbuf[chunk_x] | g->MaskSetOR);
+               texel_put(g, d_x, d_y, tmpbuf[chunk_x] | g->MaskSetOR);
          }
       }
    }
@@ -583,6 +614,15 @@ void GPU_RestoreStateP1(bool);
 void GPU_RestoreStateP2(bool);
 void GPU_RestoreStateP3();
 
+static void GPU_ThreadPushCommand(uint32_t cc, const uint32_t *CB, unsigned len, bool first,
+      uint32_t in_cmd, uint32_t clut_vb);
+static void GPU_ThreadPushFBWrite(uint32_t InData);
+static void GPU_ThreadSync(void);
+static void GPU_ThreadSyncCaches(void);
+static void GPU_ThreadSaveTexCache(uint32_t cc);
+static void GPU_ThreadReload(void);
+static void GPU_ThreadStop(void);
+
 /* Return a ptr to memory with enough space
  * for the VRAM, taking upscaling into account */
 static uint16_t *VRAM_Alloc(uint8 upscale_shift)
@@ -646,6 +686,8 @@ void GPU_Init(bool pal_clock_and_tv,
 
    GPU.upscale_shift = upscale_shift;
    GPU.dither_upscale_shift = 0;
+   GPU.BandMask = ~0U;
+   GPU.TexCacheExact = true;
 }
 
 void GPU_RecalcClockRatio(void) {
@@ -659,6 +701,7 @@ void GPU_RecalcClockRatio(void) {
 
 void GPU_Destroy(void)
 {
+   GPU_ThreadStop();
    delete [] GPU.vram;
 }
 
@@ -672,6 +715,8 @@ void GPU_Destroy(void)
  */
 void GPU_Rescale(uint8 ushift)
 {
+   GPU_ThreadSyncCaches();
+
    if (GPU.upscale_shift == 0) 
    {
       /* VRAM is already at 1x, make the buffer point to the old VRAM
@@ -708,13 +753,15 @@ void GPU_Rescale(uint8 ushift)
    for (unsigned y = 0; y < 512; y++)
    {
       for (unsigned x = 0; x < 1024; x++)
-         texel_put(x, y, vram_new[y * 1024 + x]);
+         texel_put(&GPU, x, y, vram_new[y * 1024 + x]);
    }
 
    /* Cleanup the temporary buffer */
    if (vram_new)
       delete [] vram_new;
    vram_new = NULL;
+
+   GPU_ThreadReload();
 }
 
 void GPU_FillVideoParams(MDFNGI* gi)
@@ -830,6 +877,8 @@ void GPU_SoftReset(void) // Control command 0x00
 
 void GPU_Power(void)
 {
+   GPU_ThreadSync();
+
    memset(GPU.vram, 0, 512 * 1024 * UPSCALE(&GPU) * UPSCALE(&GPU) * sizeof(*GPU.vram));
 
    memset(GPU.CLUT_Cache, 0, sizeof(GPU.CLUT_Cache));
@@ -926,6 +975,8 @@ void GPU_Power(void)
 
    IRQ_Assert(IRQ_VBLANK, GPU.InVBlank);
    TIMER_SetVBlank(GPU.InVBlank);
+
+   GPU_ThreadReload();
 }
 
 void GPU_ResetTS(void)
@@ -934,9 +985,74 @@ void GPU_ResetTS(void)
 }
 
 
+static void FBWriteData(PS_GPU *g, uint32_t InData)
+{
+   unsigned i;
+
+   for(i = 0; i < 2; i++)
+   {
+      if(!g->TimingOnly && BandOwns(g, g->FBRW_CurY))
+      {
+         bool fetch = texel_fetch(g, g->FBRW_CurX & 1023, g->FBRW_CurY & 511) & g->MaskEvalAND;
+
+         if (!fetch)
+            texel_put(g, g->FBRW_CurX & 1023, g->FBRW_CurY & 511, InData | g->MaskSetOR);
+      }
+
+      g->FBRW_CurX++;
+      if(g->FBRW_CurX == (g->FBRW_X + g->FBRW_W))
+      {
+         g->FBRW_CurX = g->FBRW_X;
+         g->FBRW_CurY++;
+         if(g->FBRW_CurY == (g->FBRW_Y + g->FBRW_H))
+         {
+            /* Upload complete, send over to RSX */
+            rsx_intf_load_image(
+                  g->FBRW_X, g->FBRW_Y,
+                  g->FBRW_W, g->FBRW_H,
+                  g->vram,
+                  g->MaskEvalAND,
+                  g->MaskSetOR);
+            g->InCmd = INCMD_NONE;
+            break;   // Break out of the for() loop.
+         }
+      }
+      InData >>= 16;
+   }
+}
+
+static void ExecuteCommand(PS_GPU *g, uint32_t cc, const uint32_t *CB, bool first)
+{
+   const CTEntry *command = &Commands[cc];
+
+   if (first)
+   {
+      // A very very ugly kludge to support
+      // texture mode specialization.
+      // fixme/cleanup/SOMETHING in the future.
+
+      /* Don't alter SpriteFlip here. */
+      if(cc >= 0x20 && cc <= 0x3F && (cc & 0x4))
+         SetTPage(g, CB[4 + ((cc >> 4) & 0x1)] >> 16);
+   }
+
+   if ((cc >= 0x80) && (cc <= 0x9F))
+      Command_FBCopy(g, CB);
+   else if ((cc >= 0xA0) && (cc <= 0xBF))
+      Command_FBWrite(g, CB);
+   else if ((cc >= 0xC0) && (cc <= 0xDF))
+      Command_FBRead(g, CB);
+   else
+   {
+      if (command->func[g->abr][g->TexMode])
+         command->func[g->abr][g->TexMode | (g->MaskEvalAND ? 0x4 : 0x0)](g, CB);
+   }
+}
+
 static void ProcessFIFO(uint32_t in_count)
 {
    uint32_t CB[0x10], InData;
+   uint32_t in_cmd, clut_vb;
    unsigned i;
    unsigned command_len;
    uint32_t cc            = GPU.InCmd_CC;
@@ -951,33 +1067,10 @@ static void ProcessFIFO(uint32_t in_count)
       case INCMD_FBWRITE:
          InData = GPU_BlitterFIFO.Read();
 
-         for(i = 0; i < 2; i++)
-         {
-            bool fetch = texel_fetch(&GPU, GPU.FBRW_CurX & 1023, GPU.FBRW_CurY & 511) & GPU.MaskEvalAND;
-
-            if (!fetch)
-               texel_put(GPU.FBRW_CurX & 1023, GPU.FBRW_CurY & 511, InData | GPU.MaskSetOR);
+         if(GPU.TimingOnly)
+            GPU_ThreadPushFBWrite(InData);
 
-            GPU.FBRW_CurX++;
-            if(GPU.FBRW_CurX == (GPU.FBRW_X + GPU.FBRW_W))
-            {
-               GPU.FBRW_CurX = GPU.FBRW_X;
-               GPU.FBRW_CurY++;
-               if(GPU.FBRW_CurY == (GPU.FBRW_Y + GPU.FBRW_H))
-               {
-                  /* Upload complete, send over to RSX */
-                  rsx_intf_load_image(
-                        GPU.FBRW_X, GPU.FBRW_Y,
-                        GPU.FBRW_W, GPU.FBRW_H,
-                        GPU.vram,
-                        GPU.MaskEvalAND,
-                        GPU.MaskSetOR);
-                  GPU.InCmd = INCMD_NONE;
-                  break;   // Break out of the for() loop.
-               }
-            }
-            InData >>= 16;
-         }
+         FBWriteData(&GPU, InData);
          return;
 
       case INCMD_QUAD:
@@ -1023,31 +1116,21 @@ static void ProcessFIFO(uint32_t in_count)
       CB[i] = GPU_BlitterFIFO.Read();
    }
 
-   if (!read_fifo)
-   {
-      if(!command->ss_cmd)
-         GPU.DrawTimeAvail -= 2;
+   if (!read_fifo && !command->ss_cmd)
+      GPU.DrawTimeAvail -= 2;
 
-      // A very very ugly kludge to support
-      // texture mode specialization.
-      // fixme/cleanup/SOMETHING in the future.
-      
-      /* Don't alter SpriteFlip here. */
-      if(cc >= 0x20 && cc <= 0x3F && (cc & 0x4))
-         SetTPage(&GPU, CB[4 + ((cc >> 4) & 0x1)] >> 16);
-   }
+   in_cmd  = GPU.InCmd;
+   clut_vb = GPU.CLUT_Cache_VB;
 
-   if ((cc >= 0x80) && (cc <= 0x9F))
-      Command_FBCopy(&GPU, CB);
-   else if ((cc >= 0xA0) && (cc <= 0xBF))
-      Command_FBWrite(&GPU, CB);
-   else if ((cc >= 0xC0) && (cc <= 0xDF))
-      Command_FBRead(&GPU, CB);
-   else
-   {
-      if (command->func[GPU.abr][GPU.TexMode])
-         command->func[GPU.abr][GPU.TexMode | (GPU.MaskEvalAND ? 0x4 : 0x0)](&GPU, CB);
-   }
+   if (GPU.TimingOnly)
+      GPU_ThreadSaveTexCache(cc);
+
+   ExecuteCommand(&GPU, cc, CB, !read_fifo);
+
+   // The IRQ is the only command the render threads must not run. The
+   // others are queued after running them here to know the VRAM they use.
+   if (GPU.TimingOnly && cc != 0x1F)
+      GPU_ThreadPushCommand(cc, CB, command_len, !read_fifo, in_cmd, clut_vb);
 }
 
 static INLINE void GPU_WriteCB(uint32_t InData, uint32_t addr)
@@ -1089,7 +1172,9 @@ void GPU_Write(const int32_t timestamp, uint32_t A, uint32_t V)
             break;
          case 0x00:  // Reset GPU
             //printf("\n\n************ Soft Reset %u ********* \n\n", scanline);
+            GPU_ThreadSyncCaches();
             GPU_SoftReset();
+            GPU_ThreadReload();
              rsx_intf_set_draw_area(GPU.ClipX0, GPU.ClipY0,
                                     GPU.ClipX1, GPU.ClipY1);
              UpdateDisplayMode();
@@ -1139,7 +1224,9 @@ void GPU_Write(const int32_t timestamp, uint32_t A, uint32_t V)
             break;
 
          case 0x09:
+            GPU_ThreadSyncCaches();
             GPU.TexDisableAllowChange = V & 1;
+            GPU_ThreadReload();
             break;
 
          case 0x10:  // GPU info(?)
@@ -1203,6 +1290,8 @@ static INLINE uint32_t GPU_ReadData(void)
 {
    unsigned i;
 
+   GPU_ThreadSync();
+
    GPU.DataReadBufferEx = 0;
 
    for(i = 0; i < 2; i++)
@@ -1349,6 +1438,1036 @@ static INLINE void ReorderRGB_Var(uint32_t out_Rshift,
    }
 }
 
+/* Convert one line of the displayed framebuffer to the output surface */
+static void ScanoutLine(PS_GPU *g, int32 dest_line, uint32_t readout_y,
+      int32 dx_start, int32 dx_end, int32 fb_x, uint32_t dmw, bool rgb24)
+{
+   // Convert the necessary variables to the upscaled version
+   uint32_t x;
+   uint32_t y        = readout_y << g->upscale_shift;
+   uint32_t udmw     = dmw      << g->upscale_shift;
+   int32 udx_start   = dx_start << g->upscale_shift;
+   int32 udx_end     = dx_end   << g->upscale_shift;
+   int32 ufb_x       = fb_x     << g->upscale_shift;
+   unsigned _upscale = UPSCALE(g);
+
+   for (uint32_t i = 0; i < _upscale; i++)
+   {
+      const uint16_t *src = g->vram +
+         ((y + i) << (10 + g->upscale_shift));
+
+      // printf("surface: %dx%d (%d) %u %u + %u\n",
+      //       surface->w, surface->h, surface->pitchinpix,
+      //       dest_line, y, i);
+
+      uint32_t *dest = g->surface->pixels +
+         ((dest_line << g->upscale_shift) + i) * g->surface->pitch32;
+      memset(dest, 0, udx_start * sizeof(int32));
+
+      //printf("%d %d %d - %d %d\n", scanline, dx_start, dx_end, HorizStart, HorizEnd);
+      ReorderRGB_Var(
+            RED_SHIFT,
+            GREEN_SHIFT,
+            BLUE_SHIFT,
+            rgb24,
+            src,
+            dest,
+            udx_start,
+            udx_end,
+            ufb_x,
+            g->upscale_shift,
+            _upscale);
+
+      //printf("dx_end: %d, dmw: %d\n", udx_end, udmw);
+      //
+      for(x = udx_end; x < udmw; x++)
+         dest[x] = 0;
+   }
+}
+
+/* Render threads
+ *
+ * With the software renderer, the drawing commands and the scanout can
+ * run on separate threads. The commands still run here on GPU, with
+ * TimingOnly set, to keep the exact same timings (DrawTimeAvail and the
+ * FIFO status bits) without touching VRAM. Their words are then queued
+ * in a ring buffer and each render thread runs them again on its own
+ * copy of the GPU state. All the copies go through the same commands so
+ * they stay in sync.
+ *
+ * With more than one render thread, VRAM is split in bands of lines
+ * interleaved between the threads and each one only draws its own
+ * bands (see BandMask), so the commands touching a band still run in
+ * order. A thread may read what another one draws though (textures,
+ * CLUTs, FB copies), so we keep track of the areas read and written
+ * since the threads last met. A command reading what may not be drawn
+ * yet, or drawing over what may not be read yet, first waits for all
+ * the threads with a barrier. A command reading its own output runs
+ * alone on the first thread, the others then take its texture cache.
+ *
+ * The texture cache usually holds what's in VRAM: then any texel a
+ * thread reads is the same whatever its cache looks like, and it only
+ * goes through the texels of the lines it draws. Once a command draws
+ * over texels that may be cached, the threads take GPU's texture cache
+ * and go through all the texels again until it's invalidated, see
+ * GPU_ThreadTrackTexCache().
+ *
+ * We wait for the render threads whenever we need to look at VRAM (FB
+ * reads, savestates, light guns...) and at the end of each frame. */
+#ifdef HAVE_THREADS
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define GPU_THREAD_LOAD(v)      ((uint32_t)_InterlockedCompareExchange((volatile long *)&(v), 0, 0))
+#define GPU_THREAD_STORE(v, x)  _InterlockedExchange((volatile long *)&(v), (long)(x))
+#define GPU_THREAD_ADD(v, x)    ((uint32_t)(_InterlockedExchangeAdd((volatile long *)&(v), (long)(x)) + (x)))
+#else
+#define GPU_THREAD_LOAD(v)      __atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define GPU_THREAD_STORE(v, x)  __atomic_store_n(&(v), (x), __ATOMIC_SEQ_CST)
+#define GPU_THREAD_ADD(v, x)    __atomic_add_fetch(&(v), (x), __ATOMIC_SEQ_CST)
+#endif
+
+// In 32bit words, must be a power of two
+#define GPU_THREAD_RING_SIZE   0x10000U
+// Don't wake the render threads up for less than that many words
+#define GPU_THREAD_WAKE_WORDS  256U
+// Number of times a render thread polls before going to sleep
+#define GPU_THREAD_SPIN        4096U
+// There are 32 bands of 16 lines
+#define GPU_THREAD_MAX         16U
+
+enum
+{
+   GPU_PACKET_COMMAND,
+   GPU_PACKET_FBWRITE,
+   GPU_PACKET_SCANOUT,
+   GPU_PACKET_LINE_SKIP,
+   GPU_PACKET_BARRIER,
+   GPU_PACKET_TEX_CACHE,
+};
+
+// GPU_PACKET_BARRIER flags
+enum
+{
+   // The next command runs alone on the first thread
+   GPU_BARRIER_SOLO     = 1,
+   // After that command: take the first thread's caches
+   GPU_BARRIER_SOLO_END = 2,
+};
+
+// GPU_PACKET_TEX_CACHE flags
+enum
+{
+   // Go through the texels of all the lines, see PS_GPU::TexCacheExact
+   GPU_TEX_CACHE_EXACT = 1,
+   // Load the texture cache from VRAM for the 256 tags that follow
+   GPU_TEX_CACHE_FETCH = 2,
+};
+
+/* A set of 64x32 blocks of VRAM, one bit per block */
+struct gpu_area
+{
+   uint16_t rows[16];
+};
+
+struct gpu_worker
+{
+   sthread_t *thread;
+   // Only written by this thread
+   uint32_t read_pos;
+   // The bands drawn by this thread
+   uint32_t band_mask;
+   PS_GPU gpu;
+};
+
+static struct
+{
+   slock_t *lock;
+   // Signaled when the render threads have work to do, when they leave
+   // a barrier and when we're waiting for them
+   scond_t *cond;
+   bool quit;
+
+   // Number of render threads sleeping
+   uint32_t sleeping;
+   // Set while we wait for the render threads to catch up
+   uint32_t waiting;
+
+   // Number of render threads in the current barrier
+   uint32_t barrier_count;
+   // Incremented when they all leave it
+   uint32_t barrier_gen;
+
+   // Only written by us
+   uint32_t write_pos;
+   // Last state sent with GPU_PACKET_LINE_SKIP
+   uint32_t line_skip;
+
+   // What the commands queued since the last barrier read and draw
+   struct gpu_area reads;
+   struct gpu_area writes;
+
+   // Whether the render threads keep their texture caches exact
+   bool tex_exact;
+   // GPU.TexCacheFlushes when we last looked
+   uint32_t tex_flushes;
+   // The texture pages read since the texture cache was invalidated
+   struct gpu_area tex_reads;
+   // GPU's texture cache tags before the textured command being run
+   uint32_t tex_tags[256];
+
+   unsigned count;
+   struct gpu_worker workers[GPU_THREAD_MAX];
+
+   uint32_t ring[GPU_THREAD_RING_SIZE];
+} GPUThread;
+
+/* Number of words queued for the render thread that is the most (or the
+ * least) behind */
+static INLINE uint32_t GPU_ThreadPending(bool slowest)
+{
+   uint32_t ret = slowest ? 0 : GPU_THREAD_RING_SIZE;
+   unsigned i;
+
+   for(i = 0; i < GPUThread.count; i++)
+   {
+      uint32_t pending = GPU_THREAD_LOAD(GPUThread.write_pos)
+         - GPU_THREAD_LOAD(GPUThread.workers[i].read_pos);
+
+      if(slowest ? pending > ret : pending < ret)
+         ret = pending;
+   }
+
+   return ret;
+}
+
+static INLINE uint32_t GPU_ThreadFree(void)
+{
+   return GPU_THREAD_RING_SIZE - GPU_ThreadPending(true);
+}
+
+static INLINE void GPU_ThreadWake(void)
+{
+   slock_lock(GPUThread.lock);
+   scond_broadcast(GPUThread.cond);
+   slock_unlock(GPUThread.lock);
+}
+
+/* Wait until at least `words` are free in the ring */
+static void GPU_ThreadWait(uint32_t words)
+{
+   while(GPU_ThreadFree() < words)
+   {
+      slock_lock(GPUThread.lock);
+      GPU_THREAD_STORE(GPUThread.waiting, 1);
+      // They may be sleeping on less than GPU_THREAD_WAKE_WORDS
+      scond_broadcast(GPUThread.cond);
+
+      if(GPU_ThreadFree() < words)
+         scond_wait(GPUThread.cond, GPUThread.lock);
+
+      GPU_THREAD_STORE(GPUThread.waiting, 0);
+      slock_unlock(GPUThread.lock);
+   }
+}
+
+static INLINE void GPU_ThreadPut(uint32_t &pos, uint32_t word)
+{
+   GPUThread.ring[pos++ & (GPU_THREAD_RING_SIZE - 1)] = word;
+}
+
+static INLINE uint32_t GPU_ThreadGet(uint32_t &pos)
+{
+   return GPUThread.ring[pos++ & (GPU_THREAD_RING_SIZE - 1)];
+}
+
+static INLINE void GPU_ThreadCommit(uint32_t pos)
+{
+   GPU_THREAD_STORE(GPUThread.write_pos, pos);
+
+   // A sleeping thread has run everything it had
+   if(GPU_THREAD_LOAD(GPUThread.sleeping)
+         && GPU_ThreadPending(false) >= GPU_THREAD_WAKE_WORDS)
+      GPU_ThreadWake();
+}
+
+/* Bits of the blocks of 1 << `shift` pixels covering `len` pixels from
+ * `start`, wrapping around the 16 blocks */
+static INLINE uint16_t GPU_AreaBlocks(uint32_t start, uint32_t len, unsigned shift)
+{
+   uint32_t first = start >> shift;
+   uint32_t last  = (start + len - 1) >> shift;
+   uint32_t mask;
+
+   if(!len)
+      return 0;
+
+   if(last - first >= 15)
+      return 0xFFFF;
+
+   mask = ((2U << (last - first)) - 1) << first;
+
+   return mask | (mask >> 16);
+}
+
+static void GPU_AreaAdd(struct gpu_area *a, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+   uint16_t cols = GPU_AreaBlocks(x & 1023, w, 6);
+   uint16_t rows = GPU_AreaBlocks(y & 511, h, 5);
+   unsigned i;
+
+   for(i = 0; i < 16; i++)
+   {
+      if((rows >> i) & 1)
+         a->rows[i] |= cols;
+   }
+}
+
+static void GPU_AreaMerge(struct gpu_area *a, const struct gpu_area *b)
+{
+   unsigned i;
+
+   for(i = 0; i < 16; i++)
+      a->rows[i] |= b->rows[i];
+}
+
+static bool GPU_AreaOverlaps(const struct gpu_area *a, const struct gpu_area *b)
+{
+   unsigned i;
+
+   for(i = 0; i < 16; i++)
+   {
+      if(a->rows[i] & b->rows[i])
+         return true;
+   }
+
+   return false;
+}
+
+/* Textured polygons and sprites */
+static INLINE bool GPU_CommandTextured(uint32_t cc)
+{
+   return cc >= 0x20 && cc <= 0x7F && (cc & 0x4) && (cc < 0x40 || cc >= 0x60);
+}
+
+/* The VRAM the command `cc` just run on GPU read and may have drawn to,
+ * `texels` is what it read through the texture cache. `clut_vb` is the
+ * CLUT cache tag before the command. */
+static void GPU_ThreadCommandAreas(uint32_t cc, const uint32_t *CB, uint32_t clut_vb,
+      struct gpu_area *reads, struct gpu_area *writes, struct gpu_area *texels)
+{
+   memset(reads, 0, sizeof(*reads));
+   memset(writes, 0, sizeof(*writes));
+   memset(texels, 0, sizeof(*texels));
+
+   if(cc == 0x02)
+   {
+      GPU_AreaAdd(writes, CB[1] & 0x3F0, CB[1] >> 16,
+            ((CB[2] & 0x3FF) + 0xF) & ~0xF, (CB[2] >> 16) & 0x1FF);
+   }
+   else if(cc >= 0x20 && cc <= 0x7F)
+   {
+      if(GPU.ClipX0 <= GPU.ClipX1 && GPU.ClipY0 <= GPU.ClipY1)
+         GPU_AreaAdd(writes, GPU.ClipX0, GPU.ClipY0,
+               GPU.ClipX1 - GPU.ClipX0 + 1, GPU.ClipY1 - GPU.ClipY0 + 1);
+
+      if(GPU_CommandTextured(cc))
+      {
+         GPU_AreaAdd(texels, GPU.TexPageX, GPU.TexPageY,
+               64 << std::min<uint32>(2, GPU.TexMode), 256);
+         GPU_AreaMerge(reads, texels);
+
+         if(GPU.CLUT_Cache_VB != clut_vb && (GPU.CLUT_Cache_VB >> 16) < 2)
+            GPU_AreaAdd(reads, (GPU.CLUT_Cache_VB & 0x3F) << 4, (GPU.CLUT_Cache_VB >> 6) & 0x1FF,
+                  (GPU.CLUT_Cache_VB >> 16) ? 256 : 16, 1);
+      }
+   }
+   else if(cc >= 0x80 && cc <= 0x9F)
+   {
+      uint32_t w = CB[3] & 0x3FF;
+      uint32_t h = (CB[3] >> 16) & 0x1FF;
+
+      GPU_AreaAdd(reads, CB[1], CB[1] >> 16, w ? w : 0x400, h ? h : 0x200);
+      GPU_AreaAdd(writes, CB[2], CB[2] >> 16, w ? w : 0x400, h ? h : 0x200);
+   }
+   else if(cc >= 0xA0 && cc <= 0xBF)
+      GPU_AreaAdd(writes, GPU.FBRW_X, GPU.FBRW_Y, GPU.FBRW_W, GPU.FBRW_H);
+}
+
+static INLINE void GPU_ThreadPutBarrier(uint32_t &pos, uint32_t flags)
+{
+   GPU_ThreadPut(pos, (GPU_PACKET_BARRIER << 24) | flags);
+   memset(&GPUThread.reads, 0, sizeof(GPUThread.reads));
+   memset(&GPUThread.writes, 0, sizeof(GPUThread.writes));
+}
+
+/* Called before running the command `cc` on GPU. If it's textured, keep
+ * the texture cache tags in case it's the one that makes the render
+ * threads fetch GPU's texture cache. */
+static void GPU_ThreadSaveTexCache(uint32_t cc)
+{
+   unsigned i;
+
+   if(GPUThread.count < 2 || GPUThread.tex_exact || !GPU_CommandTextured(cc))
+      return;
+
+   for(i = 0; i < 256; i++)
+      GPUThread.tex_tags[i] = GPU.TexCache[i].Tag;
+}
+
+/* Decide how the render threads handle their texture caches for the
+ * command `cc` that just ran on GPU, `writes` and `texels` are its
+ * areas.
+ *
+ * A texture cache entry only holds something else than VRAM once the
+ * texels it was loaded from are drawn over. Until then the render
+ * threads don't need the same cache as GPU, they only go through the
+ * texels of the lines they draw. When a command draws over texels read
+ * since the cache was invalidated (possibly by itself), the threads
+ * wait for each other, load the entries GPU had before the command from
+ * VRAM and keep their caches exact until the next invalidation. */
+static void GPU_ThreadTrackTexCache(uint32_t &pos, uint32_t cc,
+      const struct gpu_area *writes, const struct gpu_area *texels)
+{
+   const bool flushed = GPU.TexCacheFlushes != GPUThread.tex_flushes;
+   bool exact;
+   unsigned i;
+
+   // Everything an invalidating command does comes after it
+   if(flushed)
+   {
+      GPUThread.tex_flushes = GPU.TexCacheFlushes;
+      memset(&GPUThread.tex_reads, 0, sizeof(GPUThread.tex_reads));
+   }
+
+   GPU_AreaMerge(&GPUThread.tex_reads, texels);
+
+   exact = (GPUThread.tex_exact && !flushed)
+      || GPU_AreaOverlaps(writes, &GPUThread.tex_reads);
+
+   if(exact == GPUThread.tex_exact)
+      return;
+
+   GPUThread.tex_exact = exact;
+
+   // After an invalidation, there's nothing to load
+   if(!exact || flushed)
+   {
+      GPU_ThreadPut(pos, (GPU_PACKET_TEX_CACHE << 24) | (exact ? GPU_TEX_CACHE_EXACT : 0));
+      return;
+   }
+
+   GPU_ThreadPut(pos, (GPU_PACKET_TEX_CACHE << 24) | GPU_TEX_CACHE_EXACT | GPU_TEX_CACHE_FETCH);
+
+   for(i = 0; i < 256; i++)
+      GPU_ThreadPut(pos, GPU_CommandTextured(cc) ? GPUThread.tex_tags[i] : GPU.TexCache[i].Tag);
+
+   // The threads met
+   memset(&GPUThread.reads, 0, sizeof(GPUThread.reads));
+   memset(&GPUThread.writes, 0, sizeof(GPUThread.writes));
+}
+
+/* The display state used by LineSkipTest(), it's changed by GP1 writes
+ * and at each field rather than by the commands */
+static INLINE uint32_t GPU_ThreadLineSkipState(const PS_GPU *g)
+{
+   return (g->DisplayMode & 0x24) | (g->field_ram_readout << 7) | (g->DisplayFB_YStart << 8);
+}
+
+#ifdef GPU_THREAD_CHECK
+/* Check mode: all the commands also run here on a copy of the GPU with
+ * its own VRAM, as without render threads. Whenever we sync, the render
+ * threads must have the same VRAM and caches. */
+static PS_GPU GPUCheck;
+
+/* Set when something was queued since the last comparison */
+static bool GPUCheckPending;
+
+/* Start over from the current state, must be synced */
+static void GPU_ThreadCheckReset(void)
+{
+   uint16_t *vram = GPUCheck.vram;
+   size_t size    = 512 * 1024 * UPSCALE(&GPU) * UPSCALE(&GPU);
+
+   delete [] vram;
+
+   GPUCheck            = GPU;
+   GPUCheck.TimingOnly = false;
+   GPUCheck.BandMask   = ~0U;
+   GPUCheck.vram       = VRAM_Alloc(GPU.upscale_shift);
+   memcpy(GPUCheck.vram, GPU.vram, size * sizeof(*GPU.vram));
+   GPUCheckPending = false;
+}
+
+static void GPU_ThreadCheckFree(void)
+{
+   delete [] GPUCheck.vram;
+   GPUCheck.vram = NULL;
+}
+
+static void GPU_ThreadCheckCommand(uint32_t cc, const uint32_t *CB, bool first, uint32_t in_cmd)
+{
+   GPUCheck.DisplayMode       = GPU.DisplayMode;
+   GPUCheck.field_ram_readout = GPU.field_ram_readout;
+   GPUCheck.DisplayFB_YStart  = GPU.DisplayFB_YStart;
+   GPUCheck.InCmd             = in_cmd;
+
+   ExecuteCommand(&GPUCheck, cc, CB, first);
+   GPUCheckPending = true;
+}
+
+static void GPU_ThreadCheckFBWrite(uint32_t InData)
+{
+   FBWriteData(&GPUCheck, InData);
+   GPUCheckPending = true;
+}
+
+/* Whether a texture cache entry holds what's in VRAM */
+static bool GPU_ThreadCheckTexEntry(const PS_GPU::TexCache_t *c)
+{
+   unsigned j;
+
+   if(c->Tag == ~0U)
+      return true;
+
+   for(j = 0; j < 4; j++)
+   {
+      if(c->Data[j] != texel_fetch(&GPUCheck, (c->Tag & 1023) + j, c->Tag >> 10))
+         return false;
+   }
+
+   return true;
+}
+
+/* Whether the texture cache of `g` is right: the same as the copy's if
+ * the render threads keep it exact, otherwise both must match VRAM */
+static bool GPU_ThreadCheckTexCache(const PS_GPU *g)
+{
+   unsigned i;
+
+   for(i = 0; i < 256; i++)
+   {
+      const PS_GPU::TexCache_t *a = &g->TexCache[i];
+      const PS_GPU::TexCache_t *b = &GPUCheck.TexCache[i];
+
+      if(GPUThread.tex_exact)
+      {
+         if(a->Tag != b->Tag || (a->Tag != ~0U && memcmp(a->Data, b->Data, sizeof(a->Data))))
+            return false;
+      }
+      else if(!GPU_ThreadCheckTexEntry(a) || !GPU_ThreadCheckTexEntry(b))
+         return false;
+   }
+
+   return true;
+}
+
+/* Compare the render threads with the copy, must be synced */
+static void GPU_ThreadCheckCompare(void)
+{
+   size_t size = 512 * 1024 * UPSCALE(&GPU) * UPSCALE(&GPU);
+   size_t i;
+   unsigned j;
+
+   if(!GPUCheckPending)
+      return;
+
+   GPUCheckPending = false;
+
+   for(i = 0; i < size; i++)
+   {
+      if(GPU.vram[i] != GPUCheck.vram[i])
+      {
+         log_cb(RETRO_LOG_ERROR, "GPU render threads: VRAM mismatch at %u,%u: 0x%04x instead of 0x%04x\n",
+               (unsigned)(i % (1024 << GPU.upscale_shift)), (unsigned)(i / (1024 << GPU.upscale_shift)),
+               GPU.vram[i], GPUCheck.vram[i]);
+         memcpy(GPU.vram, GPUCheck.vram, size * sizeof(*GPU.vram));
+         break;
+      }
+   }
+
+   for(j = 0; j < GPUThread.count; j++)
+   {
+      PS_GPU *g = &GPUThread.workers[j].gpu;
+
+      if(!GPU_ThreadCheckTexCache(g) || memcmp(g->CLUT_Cache, GPUCheck.CLUT_Cache, sizeof(g->CLUT_Cache)))
+      {
+         log_cb(RETRO_LOG_ERROR, "GPU render threads: cache mismatch on thread %u\n", j);
+         memcpy(g->TexCache, GPUCheck.TexCache, sizeof(g->TexCache));
+         memcpy(g->CLUT_Cache, GPUCheck.CLUT_Cache, sizeof(g->CLUT_Cache));
+      }
+   }
+}
+#endif
+
+/* Queue a command that was just run on GPU. `in_cmd` and `clut_vb` are
+ * GPU.InCmd and GPU.CLUT_Cache_VB from before. */
+static void GPU_ThreadPushCommand(uint32_t cc, const uint32_t *CB, unsigned len, bool first,
+      uint32_t in_cmd, uint32_t clut_vb)
+{
+   uint32_t pos       = GPUThread.write_pos;
+   uint32_t line_skip = GPU_ThreadLineSkipState(&GPU);
+   bool solo          = false;
+   unsigned i;
+
+   // Line skip, texture cache and its tags, barrier, command, barrier
+   GPU_ThreadWait(1 + 257 + 1 + 1 + len + 1);
+
+   if(line_skip != GPUThread.line_skip)
+   {
+      GPU_ThreadPut(pos, (GPU_PACKET_LINE_SKIP << 24) | line_skip);
+      GPUThread.line_skip = line_skip;
+   }
+
+   if(GPUThread.count > 1)
+   {
+      struct gpu_area reads, writes, texels;
+
+      GPU_ThreadCommandAreas(cc, CB, clut_vb, &reads, &writes, &texels);
+      GPU_ThreadTrackTexCache(pos, cc, &writes, &texels);
+
+      solo = GPU_AreaOverlaps(&reads, &writes);
+
+      if(solo
+            || GPU_AreaOverlaps(&reads, &GPUThread.writes)
+            || GPU_AreaOverlaps(&writes, &GPUThread.reads))
+         GPU_ThreadPutBarrier(pos, solo ? GPU_BARRIER_SOLO : 0);
+
+      GPU_AreaMerge(&GPUThread.reads, &reads);
+      GPU_AreaMerge(&GPUThread.writes, &writes);
+   }
+
+   // The render threads need InCmd as it was before the command to
+   // handle quads and polylines, it isn't always changed by a command.
+   GPU_ThreadPut(pos, (GPU_PACKET_COMMAND << 24) | (cc << 16) | (in_cmd << 8) | (first << 7) | len);
+
+   for(i = 0; i < len; i++)
+      GPU_ThreadPut(pos, CB[i]);
+
+   if(solo)
+      GPU_ThreadPutBarrier(pos, GPU_BARRIER_SOLO_END);
+
+   GPU_ThreadCommit(pos);
+
+#ifdef GPU_THREAD_CHECK
+   GPU_ThreadCheckCommand(cc, CB, first, in_cmd);
+#endif
+}
+
+static void GPU_ThreadPushFBWrite(uint32_t InData)
+{
+   uint32_t pos = GPUThread.write_pos;
+
+   GPU_ThreadWait(2);
+
+   GPU_ThreadPut(pos, GPU_PACKET_FBWRITE << 24);
+   GPU_ThreadPut(pos, InData);
+
+   GPU_ThreadCommit(pos);
+
+#ifdef GPU_THREAD_CHECK
+   GPU_ThreadCheckFBWrite(InData);
+#endif
+}
+
+static void GPU_ThreadPushScanout(int32 dest_line, uint32_t readout_y,
+      int32 dx_start, int32 dx_end, int32 fb_x, uint32_t dmw, bool rgb24)
+{
+   uint32_t pos = GPUThread.write_pos;
+
+   GPU_ThreadWait(7);
+
+   GPU_ThreadPut(pos, (GPU_PACKET_SCANOUT << 24) | rgb24);
+   GPU_ThreadPut(pos, dest_line);
+   GPU_ThreadPut(pos, readout_y);
+   GPU_ThreadPut(pos, dx_start);
+   GPU_ThreadPut(pos, dx_end);
+   GPU_ThreadPut(pos, fb_x);
+   GPU_ThreadPut(pos, dmw);
+
+   GPU_ThreadCommit(pos);
+}
+
+/* Wait for all the render threads to get there */
+static void GPU_ThreadBarrier(void)
+{
+   uint32_t gen = GPU_THREAD_LOAD(GPUThread.barrier_gen);
+   unsigned spin;
+
+   if(GPU_THREAD_ADD(GPUThread.barrier_count, 1) == GPUThread.count)
+   {
+      GPU_THREAD_STORE(GPUThread.barrier_count, 0);
+
+      slock_lock(GPUThread.lock);
+      GPU_THREAD_STORE(GPUThread.barrier_gen, gen + 1);
+      scond_broadcast(GPUThread.cond);
+      slock_unlock(GPUThread.lock);
+      return;
+   }
+
+   for(spin = 0; spin < GPU_THREAD_SPIN; spin++)
+   {
+      if(GPU_THREAD_LOAD(GPUThread.barrier_gen) != gen)
+         return;
+   }
+
+   slock_lock(GPUThread.lock);
+   while(GPU_THREAD_LOAD(GPUThread.barrier_gen) == gen)
+      scond_wait(GPUThread.cond, GPUThread.lock);
+   slock_unlock(GPUThread.lock);
+}
+
+/* Run the packet at `pos` on the copy of the GPU of render thread `w`,
+ * returns the position of the next one */
+static uint32_t GPU_ThreadExecute(struct gpu_worker *w, uint32_t pos)
+{
+   PS_GPU *g       = &w->gpu;
+   uint32_t header = GPU_ThreadGet(pos);
+
+   switch(header >> 24)
+   {
+      case GPU_PACKET_COMMAND:
+         {
+            uint32_t CB[0x10];
+            unsigned len = header & 0x7F;
+            unsigned i;
+
+            for(i = 0; i < len; i++)
+               CB[i] = GPU_ThreadGet(pos);
+
+            g->InCmd = (header >> 8) & 0xFF;
+            ExecuteCommand(g, (header >> 16) & 0xFF, CB, (header >> 7) & 1);
+         }
+         break;
+      case GPU_PACKET_FBWRITE:
+         FBWriteData(g, GPU_ThreadGet(pos));
+         break;
+      case GPU_PACKET_SCANOUT:
+         {
+            int32 dest_line    = GPU_ThreadGet(pos);
+            uint32_t readout_y = GPU_ThreadGet(pos);
+            int32 dx_start     = GPU_ThreadGet(pos);
+            int32 dx_end       = GPU_ThreadGet(pos);
+            int32 fb_x         = GPU_ThreadGet(pos);
+            uint32_t dmw       = GPU_ThreadGet(pos);
+
+            // The line is read by the thread drawing it
+            if(BandOwns(g, readout_y))
+               ScanoutLine(g, dest_line, readout_y,
+                     dx_start, dx_end, fb_x, dmw, header & 1);
+         }
+         break;
+      case GPU_PACKET_LINE_SKIP:
+         g->DisplayMode       = (g->DisplayMode & ~0x24) | (header & 0x24);
+         g->field_ram_readout = (header >> 7) & 1;
+         g->DisplayFB_YStart  = (header >> 8) & 0x1FF;
+         break;
+      case GPU_PACKET_BARRIER:
+         GPU_ThreadBarrier();
+
+         // Only the first thread went through the texels of the command
+         // that ran alone. The others wait until they all have its caches.
+         if(header & GPU_BARRIER_SOLO_END)
+         {
+            const PS_GPU *first = &GPUThread.workers[0].gpu;
+
+            if(g != first)
+            {
+               memcpy(g->TexCache, first->TexCache, sizeof(g->TexCache));
+               memcpy(g->CLUT_Cache, first->CLUT_Cache, sizeof(g->CLUT_Cache));
+            }
+
+            GPU_ThreadBarrier();
+         }
+
+         if(header & GPU_BARRIER_SOLO)
+            g->BandMask = (w == &GPUThread.workers[0]) ? ~0U : 0;
+         else
+            g->BandMask = w->band_mask;
+         break;
+      case GPU_PACKET_TEX_CACHE:
+         if(header & GPU_TEX_CACHE_FETCH)
+         {
+            unsigned i;
+
+            // Everything before is drawn, and nothing after until all
+            // the threads have their caches
+            GPU_ThreadBarrier();
+
+            for(i = 0; i < 256; i++)
+               FetchTexCache(g, i, GPU_ThreadGet(pos));
+
+            GPU_ThreadBarrier();
+         }
+
+         g->TexCacheExact = header & GPU_TEX_CACHE_EXACT;
+         break;
+   }
+
+   return pos;
+}
+
+static void GPU_ThreadRun(void *data)
+{
+   struct gpu_worker *w = (struct gpu_worker *)data;
+   uint32_t pos         = w->read_pos;
+
+   for(;;)
+   {
+      unsigned spin;
+
+      for(spin = 0; spin < GPU_THREAD_SPIN; spin++)
+      {
+         if(pos != GPU_THREAD_LOAD(GPUThread.write_pos))
+            break;
+      }
+
+      if(pos == GPU_THREAD_LOAD(GPUThread.write_pos))
+      {
+         bool quit;
+
+         slock_lock(GPUThread.lock);
+         GPU_THREAD_ADD(GPUThread.sleeping, 1);
+
+         if(pos == GPU_THREAD_LOAD(GPUThread.write_pos) && !GPUThread.quit)
+            scond_wait(GPUThread.cond, GPUThread.lock);
+
+         GPU_THREAD_ADD(GPUThread.sleeping, -1);
+         quit = GPUThread.quit && pos == GPU_THREAD_LOAD(GPUThread.write_pos);
+         slock_unlock(GPUThread.lock);
+
+         if(quit)
+            break;
+         continue;
+      }
+
+      pos = GPU_ThreadExecute(w, pos);
+      GPU_THREAD_STORE(w->read_pos, pos);
+
+      // Don't wake the emulation up for every packet
+      if(GPU_THREAD_LOAD(GPUThread.waiting)
+            && (pos == GPU_THREAD_LOAD(GPUThread.write_pos)
+               || GPU_ThreadFree() >= GPU_THREAD_RING_SIZE / 2))
+         GPU_ThreadWake();
+   }
+}
+
+/* Copy the state to the render threads */
+static void GPU_ThreadCopyState(void)
+{
+   unsigned i;
+
+   for(i = 0; i < GPUThread.count; i++)
+   {
+      struct gpu_worker *w = &GPUThread.workers[i];
+
+      w->gpu            = GPU;
+      w->gpu.TimingOnly = false;
+      w->gpu.BandMask   = w->band_mask;
+   }
+
+   // We don't know if GPU's texture cache matches VRAM
+   GPUThread.tex_exact   = true;
+   GPUThread.tex_flushes = GPU.TexCacheFlushes;
+
+   GPUThread.line_skip = GPU_ThreadLineSkipState(&GPU);
+   memset(&GPUThread.reads, 0, sizeof(GPUThread.reads));
+   memset(&GPUThread.writes, 0, sizeof(GPUThread.writes));
+
+#ifdef GPU_THREAD_CHECK
+   GPU_ThreadCheckReset();
+#endif
+}
+
+static void GPU_ThreadJoin(void)
+{
+   unsigned i;
+
+   slock_lock(GPUThread.lock);
+   GPUThread.quit = true;
+   scond_broadcast(GPUThread.cond);
+   slock_unlock(GPUThread.lock);
+
+   for(i = 0; i < GPUThread.count; i++)
+   {
+      if(GPUThread.workers[i].thread)
+         sthread_join(GPUThread.workers[i].thread);
+      GPUThread.workers[i].thread = NULL;
+   }
+
+   scond_free(GPUThread.cond);
+   slock_free(GPUThread.lock);
+   GPUThread.cond  = NULL;
+   GPUThread.lock  = NULL;
+   GPUThread.count = 0;
+}
+
+static void GPU_ThreadStart(unsigned count)
+{
+   unsigned i, band;
+
+   GPUThread.count = count;
+
+   for(i = 0; i < count; i++)
+   {
+      struct gpu_worker *w = &GPUThread.workers[i];
+
+      w->thread    = NULL;
+      w->read_pos  = 0;
+      w->band_mask = 0;
+
+      for(band = i; band < 32; band += count)
+         w->band_mask |= 1U << band;
+   }
+
+   GPU_ThreadCopyState();
+
+   GPUThread.quit          = false;
+   GPUThread.sleeping      = 0;
+   GPUThread.waiting       = 0;
+   GPUThread.barrier_count = 0;
+   GPUThread.barrier_gen   = 0;
+   GPUThread.write_pos     = 0;
+
+   GPUThread.lock = slock_new();
+   GPUThread.cond = scond_new();
+
+   if(!GPUThread.lock || !GPUThread.cond)
+   {
+      log_cb(RETRO_LOG_WARN, "Can't start the GPU render threads\n");
+
+      if(GPUThread.cond)
+         scond_free(GPUThread.cond);
+      if(GPUThread.lock)
+         slock_free(GPUThread.lock);
+      GPUThread.cond  = NULL;
+      GPUThread.lock  = NULL;
+      GPUThread.count = 0;
+      return;
+   }
+
+   for(i = 0; i < count; i++)
+   {
+      GPUThread.workers[i].thread = sthread_create(GPU_ThreadRun, &GPUThread.workers[i]);
+
+      if(!GPUThread.workers[i].thread)
+      {
+         log_cb(RETRO_LOG_WARN, "Can't start the GPU render threads\n");
+         GPU_ThreadJoin();
+         return;
+      }
+   }
+
+   GPU.TimingOnly = true;
+}
+
+static void GPU_ThreadStop(void)
+{
+   if(!GPUThread.count)
+      return;
+
+   GPU_ThreadSyncCaches();
+   GPU_ThreadJoin();
+
+   GPU.TimingOnly = false;
+
+#ifdef GPU_THREAD_CHECK
+   GPU_ThreadCheckFree();
+#endif
+}
+
+/* Wait for the render threads to run all the queued packets */
+static void GPU_ThreadSync(void)
+{
+   if(!GPUThread.count)
+      return;
+
+   GPU_ThreadWait(GPU_THREAD_RING_SIZE);
+
+#ifdef GPU_THREAD_CHECK
+   GPU_ThreadCheckCompare();
+#endif
+}
+
+/* Like GPU_ThreadSync(), and also get the contents of the texture and
+ * CLUT caches, we only have the tags. All the threads have the same
+ * CLUT cache, and the same texture cache if they keep it exact.
+ * Otherwise it matches VRAM. */
+static void GPU_ThreadSyncCaches(void)
+{
+   unsigned i;
+
+   if(!GPUThread.count)
+      return;
+
+   GPU_ThreadSync();
+
+   memcpy(GPU.CLUT_Cache, GPUThread.workers[0].gpu.CLUT_Cache, sizeof(GPU.CLUT_Cache));
+
+   for(i = 0; i < 256; i++)
+   {
+      if(GPUThread.tex_exact)
+         memcpy(GPU.TexCache[i].Data, GPUThread.workers[0].gpu.TexCache[i].Data, sizeof(GPU.TexCache[i].Data));
+      else
+         FetchTexCache(&GPU, i, GPU.TexCache[i].Tag);
+   }
+}
+
+/* Copy the state to the render threads after changing it outside of the
+ * commands. Must be synced. */
+static void GPU_ThreadReload(void)
+{
+   if(GPUThread.count)
+      GPU_ThreadCopyState();
+}
+
+/* Start or stop the render threads depending on the settings, between
+ * two frames */
+static void GPU_ThreadCheck(void)
+{
+   unsigned count = 0;
+   unsigned i;
+
+   if(psx_gpu_thread && rsx_intf_is_type() == RSX_SOFTWARE && !PGXP_enabled())
+      count = std::max(1U, std::min(psx_gpu_threads, GPU_THREAD_MAX));
+
+   if(count != GPUThread.count)
+   {
+      GPU_ThreadStop();
+
+      if(count)
+         GPU_ThreadStart(count);
+   }
+
+   for(i = 0; i < GPUThread.count; i++)
+   {
+      PS_GPU *g = &GPUThread.workers[i].gpu;
+
+      g->espec       = GPU.espec;
+      g->surface     = GPU.surface;
+      g->DisplayRect = GPU.DisplayRect;
+      g->LineWidths  = GPU.LineWidths;
+   }
+}
+
+#else
+static void GPU_ThreadPushCommand(uint32_t cc, const uint32_t *CB, unsigned len, bool first,
+      uint32_t in_cmd, uint32_t clut_vb) { }
+static void GPU_ThreadPushFBWrite(uint32_t InData) { }
+static void GPU_ThreadPushScanout(int32 dest_line, uint32_t readout_y,
+      int32 dx_start, int32 dx_end, int32 fb_x, uint32_t dmw, bool rgb24) { }
+static void GPU_ThreadSync(void) { }
+static void GPU_ThreadSyncCaches(void) { }
+static void GPU_ThreadSaveTexCache(uint32_t cc) { }
+static void GPU_ThreadReload(void) { }
+static void GPU_ThreadStop(void) { }
+static void GPU_ThreadCheck(void) { }
+#endif
+
+void GPU_Sync(void)
+{
+   GPU_ThreadSync();
+}
 int32_t GPU_Update(const int32_t sys_timestamp)
 {
    int32 gpu_clocks;
@@ -1484,6 +2603,8 @@ int32_t GPU_Update(const int32_t sys_timestamp)
 
                if (rsx_intf_is_type() == RSX_SOFTWARE && GPU.espec)
                {
+                  GPU_ThreadSync();
+
                   if((bool)(GPU.DisplayMode & DISP_PAL) != GPU.HardwarePALType)
                   {
                      GPU.DisplayRect->x = 0;
@@ -1638,47 +2759,22 @@ int32_t GPU_Update(const int32_t sys_timestamp)
 
                if (rsx_intf_is_type() == RSX_SOFTWARE)
                {
-                  // Convert the necessary variables to the upscaled version
-                  uint32_t x;
-                  uint32_t y        = GPU.DisplayFB_CurLineYReadout << GPU.upscale_shift;
-                  uint32_t udmw     = dmw      << GPU.upscale_shift;
-                  int32 udx_start   = dx_start << GPU.upscale_shift;
-                  int32 udx_end     = dx_end   << GPU.upscale_shift;
-                  int32 ufb_x       = fb_x     << GPU.upscale_shift;
-                  unsigned _upscale = UPSCALE(&GPU);
-
-                  for (uint32_t i = 0; i < _upscale; i++)
-                  {
-                     const uint16_t *src = GPU.vram +
-                        ((y + i) << (10 + GPU.upscale_shift));
-
-                     // printf("surface: %dx%d (%d) %u %u + %u\n",
-                     //       surface->w, surface->h, surface->pitchinpix,
-                     //       dest_line, y, i);
-
-                     dest = GPU.surface->pixels +
-                        ((dest_line << GPU.upscale_shift) + i) * GPU.surface->pitch32;
-                     memset(dest, 0, udx_start * sizeof(int32));
-
-                     //printf("%d %d %d - %d %d\n", scanline, dx_start, dx_end, HorizStart, HorizEnd);
-                     ReorderRGB_Var(
-                           RED_SHIFT,
-                           GREEN_SHIFT,
-                           BLUE_SHIFT,
-                           GPU.DisplayMode & DISP_RGB24,
-                           src,
-                           dest,
-                           udx_start,
-                           udx_end,
-                           ufb_x,
-                           GPU.upscale_shift,
-                           _upscale);
-
-                     //printf("dx_end: %d, dmw: %d\n", udx_end, udmw);
-                     //
-                     for(x = udx_end; x < udmw; x++)
-                        dest[x] = 0;
-                  }
+                  const bool rgb24 = GPU.DisplayMode & DISP_RGB24;
+
+                  if (GPU.TimingOnly)
+                     GPU_ThreadPushScanout(dest_line, GPU.DisplayFB_CurLineYReadout,
+                           dx_start, dx_end, fb_x, dmw, rgb24);
+                  else
+                     ScanoutLine(&GPU, dest_line, GPU.DisplayFB_CurLineYReadout,
+                           dx_start, dx_end, fb_x, dmw, rgb24);
+
+                  // Last line written for this scanline
+                  dest = GPU.surface->pixels +
+                     ((dest_line << GPU.upscale_shift) + UPSCALE(&GPU) - 1) * GPU.surface->pitch32;
+
+                  // Light guns look at the pixels
+                  if (GPU.TimingOnly && PSX_GPULineHookNeedsPixels())
+                     GPU_ThreadSync();
                }
 
                //if(GPU.scanline == 64)
@@ -1735,6 +2831,8 @@ void GPU_StartFrame(EmulateSpecStruct *espec_arg)
    GPU.surface         = GPU.espec->surface;
    GPU.DisplayRect     = &GPU.espec->DisplayRect;
    GPU.LineWidths      = GPU.espec->LineWidths;
+
+   GPU_ThreadCheck();
 }
 
 
@@ -1782,7 +2880,7 @@ void GPU_RestoreStateP2(bool load)
          for (unsigned y = 0; y < 512; y++)
          {
             for (unsigned x = 0; x < 1024; x++)
-               texel_put(x, y, vram_new[y * 1024 + x]);
+               texel_put(&GPU, x, y, vram_new[y * 1024 + x]);
          }
       }
 
@@ -1839,6 +2937,7 @@ void GPU_RestoreStateP3(void)
 
 int GPU_StateAction(StateMem *sm, int load, int data_only)
 {
+   GPU_ThreadSyncCaches();
    GPU_RestoreStateP1(load);
 
    SFORMAT StateRegs[] =
@@ -1967,7 +3066,10 @@ int GPU_StateAction(StateMem *sm, int load, int data_only)
    GPU_RestoreStateP2(load);
 
    if(load)
+   {
       GPU_RestoreStateP3();
+      GPU_ThreadReload();
+   }
 
    return(ret);
 }
@@ -1984,7 +3086,9 @@ unsigned GPU_get_display_change_count(void)
 
 void GPU_set_dither_upscale_shift(uint8 factor)
 {
+   GPU_ThreadSyncCaches();
    GPU.dither_upscale_shift = factor;
+   GPU_ThreadReload();
 }
 
 uint8 GPU_get_dither_upscale_shift(void)
@@ -2009,32 +3113,35 @@ bool GPU_DMACanWrite(void)
 
 uint16 *GPU_get_vram(void)
 {
+   GPU_ThreadSync();
    return GPU.vram;
 }
 
 uint16 GPU_PeekRAM(uint32 A)
 {
+   GPU_ThreadSync();
    return texel_fetch(&GPU, A & 0x3FF, (A >> 10) & 0x1FF);
 }
 
 void GPU_PokeRAM(uint32 A, uint16 V)
 {
-   texel_put(A & 0x3FF, (A >> 10) & 0x1FF, V);
+   GPU_ThreadSync();
+   texel_put(&GPU, A & 0x3FF, (A >> 10) & 0x1FF, V);
 }
 
 /* Set a pixel in VRAM, upscaling it if necessary */
-void texel_put(uint32 x, uint32 y, uint16 v)
+void texel_put(PS_GPU *g, uint32 x, uint32 y, uint16 v)
 {
    uint32_t dy, dx;
-   x <<= GPU.upscale_shift;
-   y <<= GPU.upscale_shift;
+   x <<= g->upscale_shift;
+   y <<= g->upscale_shift;
 
    /* Duplicate the pixel as many times as necessary (nearest
     * neighbour upscaling) */
-   for (dy = 0; dy < UPSCALE(&GPU); dy++)
+   for (dy = 0; dy < UPSCALE(g); dy++)
    {
-      for (dx = 0; dx < UPSCALE(&GPU); dx++)
-         vram_put(&GPU, x + dx, y + dy, v);
+      for (dx = 0; dx < UPSCALE(g); dx++)
+         vram_put(g, x + dx, y + dy, v);
    }
 }
 
@@ -200,6 +200,24 @@ struct PS_GPU
 
    int32 DrawTimeAvail;
 
+   // Set while the render thread draws: the commands only account for
+   // their timings here, see GPU_ThreadStart().
+   bool TimingOnly;
+
+   // Bands of VRAM lines drawn by this copy of the GPU, one bit per
+   // band (see BandOwns()). All of them unless the render threads
+   // split the drawing, none while another render thread runs a
+   // command alone.
+   uint32 BandMask;
+
+   // Go through the texels of the lines we don't draw as well, so that
+   // the texture cache stays the same as if we drew everything. Only
+   // the render threads clear it, see GPU_ThreadTrackTexCache().
+   bool TexCacheExact;
+
+   // Incremented each time the texture cache is invalidated
+   uint32 TexCacheFlushes;
+
    int32_t lastts;
 
    bool sl_zero_reached;
@@ -255,6 +273,8 @@ void GPU_Rescale(uint8 ushift);
 
 int32_t GPU_Update(const int32_t sys_timestamp);
 
+void GPU_Sync(void);
+
 void GPU_FillVideoParams(MDFNGI* gi);
 
 void GPU_Power(void);
@@ -275,6 +295,6 @@ void GPU_PokeRAM(uint32 A, uint16 V);
 
 int32_t GPU_GetScanlineNum(void);
 
-void texel_put(uint32 x, uint32 y, uint16 v);
+void texel_put(PS_GPU *g, uint32 x, uint32 y, uint16 v);
 
 #endif
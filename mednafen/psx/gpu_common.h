@@ -13,6 +13,13 @@ extern enum dither_mode psx_gpu_dither_mode;
 
 #define UPSCALE(gpu)          (1U << (gpu)->upscale_shift)
 
+/* The render threads split VRAM in bands of 16 lines */
+#define GPU_BAND_SHIFT        4
+
+/* True if this copy of the GPU draws VRAM line `y`, ignoring the
+ * internal upscaling */
+#define BandOwns(gpu, y)      (((gpu)->BandMask >> (((y) & 511) >> GPU_BAND_SHIFT)) & 1)
+
 template<int BlendMode>
 static INLINE void PlotPixelBlend(uint16_t bg_pix, uint16_t *fore_pix)
 {
@@ -104,7 +111,7 @@ static INLINE void PlotNativePixel(PS_GPU *gpu, int32_t x, int32_t y, uint16_t f
    }
 
    if(!MaskEval_TA || !(texel_fetch(gpu, x, y) & 0x8000))
-      texel_put(x, y, (textured ? fore_pix : (fore_pix & 0x7FFF)) | gpu->MaskSetOR);
+      texel_put(gpu, x, y, (textured ? fore_pix : (fore_pix & 0x7FFF)) | gpu->MaskSetOR);
 }
 
 #define ModTexel(dither_offset, texel, r, g, b) ((texel & 0x8000) | (dither_offset[(((texel & 0x1F)  * (r))   >> (5 - 1))] << 0) | (dither_offset[(((texel & 0x3E0)  * (g))  >> (10 - 1))] << 5) | (dither_offset[(((texel & 0x7C00) * (b)) >> (15 - 1))] << 10))
@@ -126,11 +133,14 @@ static INLINE void Update_CLUT_Cache(PS_GPU *g, uint16 raw_clut)
 
      g->DrawTimeAvail -= count;
 
-     for(unsigned i = 0; i < count; i++)
+     if(!g->TimingOnly)
+     {
+        for(unsigned i = 0; i < count; i++)
         {
            uint16_t x = (cxo + i) & 0x3FF;
            g->CLUT_Cache[i] = texel_fetch(g, x, y);
         }
+     }
 
    g->CLUT_Cache_VB = new_ccvb;
   }
@@ -212,12 +222,17 @@ static INLINE uint16_t GetTexel(PS_GPU *g, int32_t u_arg, int32_t v_arg)
       //
       g->DrawTimeAvail -= 4;
 
-      uint32_t cache_x= fbtex_x & ~3;
-
-      c->Data[0] = texel_fetch(g, cache_x + 0, fbtex_y);
-      c->Data[1] = texel_fetch(g, cache_x + 1, fbtex_y);
-      c->Data[2] = texel_fetch(g, cache_x + 2, fbtex_y);
-      c->Data[3] = texel_fetch(g, cache_x + 3, fbtex_y);
+      // Only the tags are kept up to date when the render thread
+      // fetches the texels
+      if(!g->TimingOnly)
+      {
+         uint32_t cache_x= fbtex_x & ~3;
+
+         c->Data[0] = texel_fetch(g, cache_x + 0, fbtex_y);
+         c->Data[1] = texel_fetch(g, cache_x + 1, fbtex_y);
+         c->Data[2] = texel_fetch(g, cache_x + 2, fbtex_y);
+         c->Data[3] = texel_fetch(g, cache_x + 3, fbtex_y);
+      }
       c->Tag = (gro &~ 0x3);
      }
 
@@ -115,6 +115,9 @@ static void DrawLine(PS_GPU *gpu, line_point *points)
 
    gpu->DrawTimeAvail -= k * 2;
 
+   if(gpu->TimingOnly)
+      return;
+
    line_points_to_fixed_point_step<goraud>(&points[0], &points[1], k, &step);
    line_point_to_fixed_point_coord<goraud>(&points[0], &step, &cur_point);
 
@@ -154,7 +157,7 @@ static void DrawLine(PS_GPU *gpu, line_point *points)
          }
 
          // FIXME: There has to be a faster way than checking for being inside the drawing area for each pixel.
-         if(x >= gpu->ClipX0 && x <= gpu->ClipX1 && y >= gpu->ClipY0 && y <= gpu->ClipY1)
+         if(x >= gpu->ClipX0 && x <= gpu->ClipX1 && y >= gpu->ClipY0 && y <= gpu->ClipY1 && BandOwns(gpu, y))
             PlotNativePixel<BlendMode, MaskEval_TA, false>(gpu, x, y, pix);
       }
 
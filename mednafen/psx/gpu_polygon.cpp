@@ -1,5 +1,11 @@
 #include <math.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
 #define COORD_FBS 12
 #define COORD_MF_INT(n) ((n) << COORD_FBS)
 #define COORD_POST_PADDING 12
@@ -113,12 +119,235 @@ static INLINE void AddIDeltas_DY(i_group &ig, const i_deltas &idl, uint32_t coun
    }
 }
 
+#if defined(__SSE4_1__)
+/* Vector version of the DrawSpan() loop for untextured polygons, with one
+ * 32bit lane per pixel. It draws 2 * SPAN_LANES pixels at a time and gives
+ * the exact same results, DitherLUT is computed rather than looked up.
+ * Textured spans stay scalar: the texture cache has to be walked one texel
+ * at a time, in order, and that's where their time goes. */
+#if defined(__AVX2__)
+#define SPAN_LANES 8
+
+typedef __m256i span_vec;
+
+#define span_set1(a)          _mm256_set1_epi32(a)
+#define span_add(a, b)        _mm256_add_epi32(a, b)
+#define span_sub(a, b)        _mm256_sub_epi32(a, b)
+#define span_mul(a, b)        _mm256_mullo_epi32(a, b)
+#define span_and(a, b)        _mm256_and_si256(a, b)
+#define span_or(a, b)         _mm256_or_si256(a, b)
+#define span_xor(a, b)        _mm256_xor_si256(a, b)
+#define span_srl(a, n)        _mm256_srli_epi32(a, n)
+#define span_sra(a, n)        _mm256_srai_epi32(a, n)
+#define span_sll(a, n)        _mm256_slli_epi32(a, n)
+#define span_min(a, b)        _mm256_min_epi32(a, b)
+#define span_max(a, b)        _mm256_max_epi32(a, b)
+#define span_eq(a, b)         _mm256_cmpeq_epi32(a, b)
+/* Lanes of `a` where `m` is set, of `b` elsewhere */
+#define span_select(m, a, b)  _mm256_blendv_epi8(b, a, m)
+
+static INLINE span_vec span_lanes(void)
+{
+   return _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+}
+
+static INLINE span_vec span_dither(const int8 *row, int32 x)
+{
+   return _mm256_setr_epi32(row[x & 3], row[(x + 1) & 3], row[(x + 2) & 3], row[(x + 3) & 3],
+                            row[x & 3], row[(x + 1) & 3], row[(x + 2) & 3], row[(x + 3) & 3]);
+}
+
+static INLINE void span_load(const uint16_t *p, span_vec *lo, span_vec *hi)
+{
+   __m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+   *lo = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+   *hi = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+}
+
+static INLINE void span_store(uint16_t *p, span_vec lo, span_vec hi)
+{
+   /* packus works on each 128bit half */
+   _mm256_storeu_si256((__m256i *)p, _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+#else
+#define SPAN_LANES 4
+
+typedef __m128i span_vec;
+
+#define span_set1(a)          _mm_set1_epi32(a)
+#define span_add(a, b)        _mm_add_epi32(a, b)
+#define span_sub(a, b)        _mm_sub_epi32(a, b)
+#define span_mul(a, b)        _mm_mullo_epi32(a, b)
+#define span_and(a, b)        _mm_and_si128(a, b)
+#define span_or(a, b)         _mm_or_si128(a, b)
+#define span_xor(a, b)        _mm_xor_si128(a, b)
+#define span_srl(a, n)        _mm_srli_epi32(a, n)
+#define span_sra(a, n)        _mm_srai_epi32(a, n)
+#define span_sll(a, n)        _mm_slli_epi32(a, n)
+#define span_min(a, b)        _mm_min_epi32(a, b)
+#define span_max(a, b)        _mm_max_epi32(a, b)
+#define span_eq(a, b)         _mm_cmpeq_epi32(a, b)
+/* Lanes of `a` where `m` is set, of `b` elsewhere */
+#define span_select(m, a, b)  _mm_blendv_epi8(b, a, m)
+
+static INLINE span_vec span_lanes(void)
+{
+   return _mm_setr_epi32(0, 1, 2, 3);
+}
+
+static INLINE span_vec span_dither(const int8 *row, int32 x)
+{
+   return _mm_setr_epi32(row[x & 3], row[(x + 1) & 3], row[(x + 2) & 3], row[(x + 3) & 3]);
+}
+
+static INLINE void span_load(const uint16_t *p, span_vec *lo, span_vec *hi)
+{
+   __m128i v = _mm_loadu_si128((const __m128i *)p);
+
+   *lo = _mm_cvtepu16_epi32(v);
+   *hi = _mm_cvtepu16_epi32(_mm_srli_si128(v, 8));
+}
+
+static INLINE void span_store(uint16_t *p, span_vec lo, span_vec hi)
+{
+   _mm_storeu_si128((__m128i *)p, _mm_packus_epi32(lo, hi));
+}
+#endif
+
+/* DitherLUT[][][v] with `dither` the offsets from dither_table */
+static INLINE span_vec SpanDitherLUT(span_vec v, span_vec dither)
+{
+   return span_min(span_max(span_sra(span_add(v, dither), 3), span_set1(0)), span_set1(0x1F));
+}
+
+/* PlotPixelBlend() */
+template<int BlendMode>
+static INLINE span_vec SpanBlend(span_vec bg_pix, span_vec fore_pix)
+{
+   span_vec sum, carry;
+
+   switch(BlendMode)
+   {
+      case BLEND_MODE_AVERAGE:
+         bg_pix   = span_or(bg_pix, span_set1(0x8000));
+         fore_pix = span_srl(span_sub(span_add(fore_pix, bg_pix),
+                  span_and(span_xor(fore_pix, bg_pix), span_set1(0x0421))), 1);
+         break;
+
+      case BLEND_MODE_ADD_FOURTH:
+         fore_pix = span_or(span_and(span_srl(fore_pix, 2), span_set1(0x1CE7)), span_set1(0x8000));
+         /* fallthrough */
+      case BLEND_MODE_ADD:
+         bg_pix   = span_and(bg_pix, span_set1(0x7FFF));
+         sum      = span_add(fore_pix, bg_pix);
+         carry    = span_and(span_sub(sum, span_and(span_xor(fore_pix, bg_pix), span_set1(0x8421))), span_set1(0x8420));
+         fore_pix = span_or(span_sub(sum, carry), span_sub(carry, span_srl(carry, 5)));
+         break;
+
+      case BLEND_MODE_SUBTRACT:
+         {
+            span_vec diff, borrow;
+
+            bg_pix   = span_or(bg_pix, span_set1(0x8000));
+            fore_pix = span_and(fore_pix, span_set1(0x7FFF));
+            diff     = span_add(span_sub(bg_pix, fore_pix), span_set1(0x108420));
+            borrow   = span_and(span_sub(diff, span_and(span_xor(bg_pix, fore_pix), span_set1(0x108420))), span_set1(0x108420));
+            fore_pix = span_and(span_sub(diff, borrow), span_sub(borrow, span_srl(borrow, 5)));
+         }
+         break;
+   }
+
+   return span_and(fore_pix, span_set1(0xFFFF));
+}
+
+/* One vector of pixels of the DrawSpan() loop, returns the new contents
+ * of VRAM */
+template<bool goraud, int BlendMode, bool MaskEval_TA>
+static INLINE span_vec SpanPixels(span_vec r, span_vec g, span_vec b,
+      span_vec dither, bool dither_on, span_vec bg_pix, span_vec mask_set_or)
+{
+   const span_vec bit15 = span_set1(0x8000);
+   span_vec fore_pix;
+
+   if(goraud && dither_on)
+      fore_pix = span_or(span_or(bit15, SpanDitherLUT(r, dither)),
+            span_or(span_sll(SpanDitherLUT(g, dither), 5), span_sll(SpanDitherLUT(b, dither), 10)));
+   else
+      fore_pix = span_or(span_or(bit15, span_srl(r, 3)),
+            span_or(span_sll(span_srl(g, 3), 5), span_sll(span_srl(b, 3), 10)));
+
+   if(BlendMode >= 0)
+      fore_pix = SpanBlend<BlendMode>(bg_pix, fore_pix);
+
+   fore_pix = span_or(span_and(fore_pix, span_set1(0x7FFF)), mask_set_or);
+
+   /* Masked pixels are left alone */
+   if(MaskEval_TA)
+      return span_select(span_eq(span_and(bg_pix, bit15), bit15), bg_pix, fore_pix);
+
+   return fore_pix;
+}
+
+/* Draw as much of the span as possible 2 * SPAN_LANES pixels at a time,
+ * `x`, `w` and `ig` are updated to draw the rest */
+template<bool goraud, int BlendMode, bool MaskEval_TA>
+static INLINE void DrawSpanVector(PS_GPU *gpu, int32 &x, int32 y, int32 &w, i_group &ig, const i_deltas &idl)
+{
+   const int32 count     = 2 * SPAN_LANES;
+   uint16_t *line        = gpu->vram + ((y & ((512 << gpu->upscale_shift) - 1)) << (10 + gpu->upscale_shift));
+   const span_vec lanes  = span_lanes();
+   const span_vec set_or = span_set1(gpu->MaskSetOR);
+   const span_vec dither = span_dither(dither_table[y & 3], x);
+
+   while(w >= count)
+   {
+      span_vec r[2], g[2], b[2], bg_pix[2];
+      unsigned i;
+
+      for(i = 0; i < 2; i++)
+      {
+         if(goraud)
+         {
+            span_vec step = span_add(lanes, span_set1(i * SPAN_LANES));
+
+            r[i] = span_srl(span_add(span_set1(ig.r), span_mul(step, span_set1(idl.dr_dx))), COORD_FBS + COORD_POST_PADDING);
+            g[i] = span_srl(span_add(span_set1(ig.g), span_mul(step, span_set1(idl.dg_dx))), COORD_FBS + COORD_POST_PADDING);
+            b[i] = span_srl(span_add(span_set1(ig.b), span_mul(step, span_set1(idl.db_dx))), COORD_FBS + COORD_POST_PADDING);
+         }
+         else
+         {
+            r[i] = span_set1(ig.r >> (COORD_FBS + COORD_POST_PADDING));
+            g[i] = span_set1(ig.g >> (COORD_FBS + COORD_POST_PADDING));
+            b[i] = span_set1(ig.b >> (COORD_FBS + COORD_POST_PADDING));
+         }
+      }
+
+      span_load(line + x, &bg_pix[0], &bg_pix[1]);
+
+      for(i = 0; i < 2; i++)
+         bg_pix[i] = SpanPixels<goraud, BlendMode, MaskEval_TA>(r[i], g[i], b[i],
+               dither, gpu->dtd, bg_pix[i], set_or);
+
+      span_store(line + x, bg_pix[0], bg_pix[1]);
+
+      AddIDeltas_DX<goraud, false>(ig, idl, count);
+      x += count;
+      w -= count;
+   }
+}
+#endif
+
 template<bool goraud, bool textured, int BlendMode, bool TexMult, uint32 TexMode_TA, bool MaskEval_TA>
 static INLINE void DrawSpan(PS_GPU *gpu, int y, const int32 x_start, const int32 x_bound, i_group ig, const i_deltas &idl)
 {
    if(LineSkipTest(gpu, y >> gpu->upscale_shift))
       return;
 
+   // A render thread waiting for the one running a command alone
+   if(!gpu->BandMask)
+      return;
+
    int32 clipx0 = gpu->ClipX0 << gpu->upscale_shift;
    int32 clipx1 = gpu->ClipX1 << gpu->upscale_shift;
 
@@ -162,6 +391,32 @@ static INLINE void DrawSpan(PS_GPU *gpu, int y, const int32 x_start, const int32
         gpu->DrawTimeAvail -= w >> gpu->upscale_shift;
   }
 
+  // The render thread draws the span, we only need the texture cache
+  // misses. The render threads that don't draw this line only go
+  // through its texels when their texture cache must stay exact.
+  if(gpu->TimingOnly || !BandOwns(gpu, y >> gpu->upscale_shift))
+  {
+   if(textured && gpu->TexCacheExact)
+   {
+    do
+    {
+     GetTexel<TexMode_TA>(gpu, ig.u >> (COORD_FBS + COORD_POST_PADDING), ig.v >> (COORD_FBS + COORD_POST_PADDING));
+     AddIDeltas_DX<false, textured>(ig, idl);
+    } while(MDFN_LIKELY(--w > 0));
+   }
+   return;
+  }
+
+#if defined(__SSE4_1__)
+  if(!textured)
+  {
+   DrawSpanVector<goraud, BlendMode, MaskEval_TA>(gpu, x, y, w, ig, idl);
+
+   if(w <= 0)
+    return;
+  }
+#endif
+
   do
   {
    const uint32 r = ig.r >> (COORD_FBS + COORD_POST_PADDING);
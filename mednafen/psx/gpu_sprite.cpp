@@ -62,6 +62,10 @@ static void DrawSprite(PS_GPU *gpu, int32_t x_arg, int32_t y_arg, int32_t w, int
    if(y_bound > (gpu->ClipY1 + 1))
       y_bound = gpu->ClipY1 + 1;
 
+   // A render thread waiting for the one running a command alone
+   if(!gpu->BandMask)
+      return;
+
    //HeightMode && !dfe && ((y & 1) == ((DisplayFB_YStart + !field_atvs) & 1)) && !DisplayOff
    //printf("%d:%d, %d, %d ---- heightmode=%d displayfb_ystart=%d field_atvs=%d displayoff=%d\n", w, h, scanline, dfe, HeightMode, DisplayFB_YStart, field_atvs, DisplayOff);
 
@@ -74,6 +78,12 @@ static void DrawSprite(PS_GPU *gpu, int32_t x_arg, int32_t y_arg, int32_t w, int
 
       if(!LineSkipTest(gpu, y))
       {
+         // The render thread draws the sprite, we only need the
+         // texture cache misses. The render threads that don't draw
+         // this line only go through its texels when their texture
+         // cache must stay exact.
+         const bool timing_only = gpu->TimingOnly || !BandOwns(gpu, y);
+
          if(y_bound > y_start && x_bound > x_start)
          {
             /* Note(TODO): From tests on a PS1, 
@@ -89,6 +99,16 @@ static void DrawSprite(PS_GPU *gpu, int32_t x_arg, int32_t y_arg, int32_t w, int
 
          for(int32_t x = x_start; MDFN_LIKELY(x < x_bound); x++)
          {
+            if(timing_only)
+            {
+               if(!textured || !gpu->TexCacheExact)
+                  break;
+
+               GetTexel<TexMode_TA>(gpu, u_r, v);
+               u_r += u_inc;
+               continue;
+            }
+
             if(textured)
             {
                uint16_t fbw = GetTexel<TexMode_TA>(gpu, u_r, v);
@@ -31,6 +31,12 @@ extern bool psx_gte_overclock;
 
 #include "../clamp.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
 /* Notes:
 
  AVSZ3/AVSZ4:
@@ -130,7 +136,8 @@ static int16_t Vectors[3][4]; /* Five 3x signed words control vectors: translati
                                  BackgroundColor, FarColor and Zero (which is always equal to
                                  [0, 0, 0]. */
 
-static uint32_t FLAGS;	      /* Overflow flags generated by the GTE commands */
+static uint32_t FLAGS;	      /* Overflow flags generated by the last GTE command, before the
+                                 checksum bit is added. Only kept for savestates, see SetFLAG() */
 
 static int32_t MAC[4];        /* Accumulators for intermediate results, 4 x signed word */
 
@@ -159,6 +166,117 @@ static uint32_t Reg23;        /* Register 23: 32bit read/write but not used for
 #define IR2 IR[2]
 #define IR3 IR[3]
 
+/* The data registers a command may write */
+typedef struct
+{
+   int16_t Vectors[3][4];
+   gtergb RGB;
+   uint16_t OTZ;
+   int16_t IR[4];
+   gtexy XY_FIFO[4];
+   uint16_t Z_FIFO[4];
+   gtergb RGB_FIFO[3];
+   int32_t MAC[4];
+} gtedata;
+
+/* FLAG (CR[31]) of the matrix and colour commands is only computed when it's read,
+ * by running the last one again, see GTE_ResolveFLAG(). Until then we
+ * keep the data registers they read. */
+typedef struct
+{
+   int16_t Vectors[3][4];
+   int16_t IR[4];
+   gtergb RGB;
+} gteinput;
+
+typedef struct
+{
+   uint32_t CR[32];
+   Matrices_t Matrices;
+   int32_t CRVectors[4][4];
+   int32_t OFX;
+   int32_t OFY;
+   uint16_t H;
+   int16_t DQA;
+   int32_t DQB;
+   int16_t ZSF3;
+   int16_t ZSF4;
+} gtectrl;
+
+static bool FLAGPending;      /* CR[31] is stale */
+static uint32_t FLAGInstr;    /* The command to run again */
+static gteinput FLAGInput;    /* Its inputs */
+static bool FLAGCtrlSaved;    /* Control registers were written since, FLAGCtrl has the old ones */
+static gtectrl FLAGCtrl;
+
+static void GTE_ResolveFLAG(void);
+
+static INLINE void SaveInput(gteinput *in)
+{
+   memcpy(in->Vectors, Vectors, sizeof(Vectors));
+   memcpy(in->IR, IR, sizeof(IR));
+   in->RGB = RGB;
+}
+
+static void LoadInput(const gteinput *in)
+{
+   memcpy(Vectors, in->Vectors, sizeof(Vectors));
+   memcpy(IR, in->IR, sizeof(IR));
+   RGB = in->RGB;
+}
+
+static void SaveData(gtedata *d)
+{
+   memcpy(d->Vectors, Vectors, sizeof(Vectors));
+   d->RGB = RGB;
+   d->OTZ = OTZ;
+   memcpy(d->IR, IR, sizeof(IR));
+   memcpy(d->XY_FIFO, XY_FIFO, sizeof(XY_FIFO));
+   memcpy(d->Z_FIFO, Z_FIFO, sizeof(Z_FIFO));
+   memcpy(d->RGB_FIFO, RGB_FIFO, sizeof(RGB_FIFO));
+   memcpy(d->MAC, MAC, sizeof(MAC));
+}
+
+static void LoadData(const gtedata *d)
+{
+   memcpy(Vectors, d->Vectors, sizeof(Vectors));
+   RGB = d->RGB;
+   OTZ = d->OTZ;
+   memcpy(IR, d->IR, sizeof(IR));
+   memcpy(XY_FIFO, d->XY_FIFO, sizeof(XY_FIFO));
+   memcpy(Z_FIFO, d->Z_FIFO, sizeof(Z_FIFO));
+   memcpy(RGB_FIFO, d->RGB_FIFO, sizeof(RGB_FIFO));
+   memcpy(MAC, d->MAC, sizeof(MAC));
+}
+
+static void SaveCtrl(gtectrl *c)
+{
+   memcpy(c->CR, CR, sizeof(CR));
+   c->Matrices = Matrices;
+   memcpy(c->CRVectors, CRVectors.All, sizeof(CRVectors.All));
+   c->OFX = OFX;
+   c->OFY = OFY;
+   c->H = H;
+   c->DQA = DQA;
+   c->DQB = DQB;
+   c->ZSF3 = ZSF3;
+   c->ZSF4 = ZSF4;
+}
+
+static void LoadCtrl(const gtectrl *c)
+{
+   memcpy(CR, c->CR, sizeof(CR));
+   Matrices = c->Matrices;
+   memcpy(CRVectors.All, c->CRVectors, sizeof(CRVectors.All));
+   OFX = c->OFX;
+   OFY = c->OFY;
+   H = c->H;
+   DQA = c->DQA;
+   DQB = c->DQB;
+   ZSF3 = c->ZSF3;
+   ZSF4 = c->ZSF4;
+}
+
 
 // end DR
 
@@ -239,11 +357,15 @@ void GTE_Power(void)
    LZCR = 0;
 
    Reg23 = 0;
+
+   FLAGPending = false;
 }
 
 // TODO: Don't save redundant state, regarding CR cache variables
 int GTE_StateAction(StateMem *sm, int load, int data_only)
 {
+   GTE_ResolveFLAG();
+
    SFORMAT StateRegs[] =
    {
       { CR, (uint32_t)(32 * sizeof(uint32_t)), MDFNSTATE_RLSB32 | 0, "CR" },
@@ -293,7 +415,7 @@ int GTE_StateAction(StateMem *sm, int load, int data_only)
 
    if(load)
    {
-
+      FLAGPending = false;
    }
 
    return(ret);
@@ -318,6 +440,17 @@ void GTE_WriteCR(unsigned int which, uint32_t value)
 
    //PSX_WARNING("[GTE] Write CR %d, 0x%08x", which, value);
 
+   if(FLAGPending)
+   {
+      if(which == 31)
+         FLAGPending = false;
+      else if(!FLAGCtrlSaved)
+      {
+         SaveCtrl(&FLAGCtrl);
+         FLAGCtrlSaved = true;
+      }
+   }
+
    value &= mask_table[which];
 
    CR[which] = value | (CR[which] & ~mask_table[which]);
@@ -417,6 +550,7 @@ uint32_t GTE_ReadCR(unsigned int which)
          break;
 
       case 31:
+         GTE_ResolveFLAG();
          ret = CR[31];
          break;
    }
@@ -719,9 +853,26 @@ uint32_t GTE_ReadDR(unsigned int which)
    return(ret);
 }
 
+#if defined(__SSE4_1__)
+/* Turns a mask with row 0 in bit 0 into one with row 0 in bit 2, the
+ * order of the per-row FLAG bits */
+static const uint8_t LaneFlags[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+
+#endif
+
+//
+// The GTE commands.  They accumulate FLAG in the FLAGS member and it's up to the caller to use it or not: when it
+// doesn't, the compiler drops everything that only computes flags.  "Replay" is set when a command is only run again
+// to get its FLAG, see GTE_ResolveFLAG().
+//
+template<bool Replay>
+struct GTE_Ops
+{
+uint32_t FLAGS;
+
 #define sign_x_to_s64(_bits, _value) (((int64_t)((uint64_t)(_value) << (64 - _bits))) >> (64 - _bits))
 
-static INLINE int64_t A_MV(unsigned which, int64_t value)
+INLINE int64_t A_MV(unsigned which, int64_t value)
 {
    if(value >= (INT64_C(1) << 43))
       FLAGS |= 1 << (30 - which);
@@ -732,7 +883,7 @@ static INLINE int64_t A_MV(unsigned which, int64_t value)
    return sign_x_to_s64(44, value);
 }
 
-static INLINE int64_t F(int64_t value)
+INLINE int64_t F(int64_t value)
 {
    if(value < -2147483648LL)
    {
@@ -751,7 +902,7 @@ static INLINE int64_t F(int64_t value)
 
 /* Truncate i64 value to only keep the low 43 bits + sign and
  * update the flags if an overflow occurs */
-static INLINE int64_t i64_to_i44(unsigned which, int64_t value)
+INLINE int64_t i64_to_i44(unsigned which, int64_t value)
 {
    if(value >= 0x7ffffffffffLL)
       FLAGS |= 1 << (30 - which);
@@ -767,7 +918,7 @@ static INLINE int64_t i64_to_i44(unsigned which, int64_t value)
  * overflow and updating the flags if an overflow occurs. If
  * `flags.clamp_negative` is true negative values will be clamped
  * to 0. */
-static INLINE int16_t i32_to_i16_saturate(unsigned int which, int32_t value, int lm)
+INLINE int16_t i32_to_i16_saturate(unsigned int which, int32_t value, int lm)
 {
    int32_t tmp = lm << 15;
 
@@ -788,7 +939,7 @@ static INLINE int16_t i32_to_i16_saturate(unsigned int which, int32_t value, int
    return(value);
 }
 
-static INLINE int16_t Lm_B_PTZ(unsigned int which, int32_t value, int32_t ftv_value, int lm)
+INLINE int16_t Lm_B_PTZ(unsigned int which, int32_t value, int32_t ftv_value, int lm)
 {
    int32_t tmp = lm << 15;
 
@@ -803,7 +954,7 @@ static INLINE int16_t Lm_B_PTZ(unsigned int which, int32_t value, int32_t ftv_va
    return(value);
 }
 
-static INLINE uint8_t Lm_C(unsigned int which, int32_t value)
+INLINE uint8_t Lm_C(unsigned int which, int32_t value)
 {
    if(value & ~0xFF)
    {
@@ -820,7 +971,7 @@ static INLINE uint8_t Lm_C(unsigned int which, int32_t value)
    return(value);
 }
 
-static INLINE int32_t Lm_D(int32_t value, int unchained)
+INLINE int32_t Lm_D(int32_t value, int unchained)
 {
    // Not sure if we should have it as int64, or just chain on to and special case when the F flags are set.
    if(!unchained)
@@ -854,7 +1005,7 @@ static INLINE int32_t Lm_D(int32_t value, int unchained)
    return(value);
 }
 
-static INLINE int32_t Lm_G(unsigned int which, int32_t value)
+INLINE int32_t Lm_G(unsigned int which, int32_t value)
 {
    if(value < -1024)
    {
@@ -874,7 +1025,7 @@ static INLINE int32_t Lm_G(unsigned int which, int32_t value)
 }
 
 // limit to 4096, not 4095
-static INLINE int32_t Lm_H(int32_t value)
+INLINE int32_t Lm_H(int32_t value)
 {
 #if 0
    if(FLAGS & (1 << 15))
@@ -909,7 +1060,7 @@ static INLINE int32_t Lm_H(int32_t value)
 
 /* Convert a 64bit signed average value to an unsigned halfword
  * while updating the overflow flags */
-static INLINE uint16_t i64_to_otz(int64_t average, int unchained)
+INLINE uint16_t i64_to_otz(int64_t average, int unchained)
 {
    int32_t value = average >> 12;
    /* Not sure if we should have it as int64, or just chain 
@@ -945,7 +1096,7 @@ static INLINE uint16_t i64_to_otz(int64_t average, int unchained)
    return value;
 }
 
-static INLINE int32_t i32_to_i11_saturate(uint8_t flag, int32_t value)
+INLINE int32_t i32_to_i11_saturate(uint8_t flag, int32_t value)
 {
    if(value < -0x400)
    {
@@ -962,7 +1113,7 @@ static INLINE int32_t i32_to_i11_saturate(uint8_t flag, int32_t value)
    return value;
 }
 
-static INLINE uint8_t MAC_to_COLOR(uint8_t flag, int32_t mac)
+INLINE uint8_t MAC_to_COLOR(uint8_t flag, int32_t mac)
 {
    int32_t c = mac >> 4;
 
@@ -979,7 +1130,7 @@ static INLINE uint8_t MAC_to_COLOR(uint8_t flag, int32_t mac)
    return c;
 }
 
-static INLINE void MAC_to_RGB_FIFO(void)
+INLINE void MAC_to_RGB_FIFO(void)
 {
    RGB_FIFO[0] = RGB_FIFO[1];
    RGB_FIFO[1] = RGB_FIFO[2];
@@ -989,7 +1140,7 @@ static INLINE void MAC_to_RGB_FIFO(void)
    RGB_FIFO[2].CD = RGB.CD;
 }
 
-static INLINE int16_t Lm_B(unsigned int which, int32_t value, int lm)
+INLINE int16_t Lm_B(unsigned int which, int32_t value, int lm)
 {
    int32_t tmp = lm << 15;
 
@@ -1010,17 +1161,165 @@ static INLINE int16_t Lm_B(unsigned int which, int32_t value, int lm)
    return(value);
 }
 
-static INLINE void MAC_to_IR(int lm)
+INLINE void MAC_to_IR(int lm)
 {
    IR1 = i32_to_i16_saturate(0, MAC[1], lm);
    IR2 = i32_to_i16_saturate(1, MAC[2], lm);
    IR3 = i32_to_i16_saturate(2, MAC[3], lm);
 }
 
-static INLINE void MultiplyMatrixByVector(const gtematrix *matrix, const int16_t *v, const int32_t *crv, uint32_t sf, int lm)
+#if defined(__SSE4_1__)
+/* MatrixVectorRows() when one of the partial sums overflows. The flags
+ * are returned in "flags" so that the caller's FLAGS isn't spilled. */
+static NO_INLINE __m128i MatrixVectorRowsOverflow(const gtematrix *matrix, const int16_t *v, const int32_t *crv, uint32_t sf, int64_t *z, uint32_t *flags)
 {
+   GTE_Ops ops;
+   int64_t tmp[3];
    unsigned i;
 
+   ops.FLAGS = 0;
+
+   for(i = 0; i < 3; i++)
+   {
+      tmp[i] = (uint64_t)(int64_t)crv[i] << 12;
+      tmp[i] = ops.A_MV(i, tmp[i] + (int32_t)(matrix->MX[i][0] * v[0]));
+      tmp[i] = ops.A_MV(i, tmp[i] + (int32_t)(matrix->MX[i][1] * v[1]));
+      tmp[i] = ops.A_MV(i, tmp[i] + (int32_t)(matrix->MX[i][2] * v[2]));
+   }
+
+   *z     = tmp[2];
+   *flags = ops.FLAGS;
+
+   return _mm_setr_epi32(0, tmp[0] >> sf, tmp[1] >> sf, tmp[2] >> sf);
+}
+
+INLINE __m128i MatrixVectorRowsSlow(const gtematrix *matrix, const int16_t *v, const int32_t *crv, uint32_t sf, int64_t *z)
+{
+   uint32_t flags;
+   const __m128i mac = MatrixVectorRowsOverflow(matrix, v, crv, sf, z, &flags);
+
+   FLAGS |= flags;
+
+   return mac;
+}
+
+/* The three rows of crv << 12 + matrix * v in parallel. Returns the
+ * rows shifted by sf in lanes 1-3 (the new MAC1-3, lane 0 is 0) and
+ * stores the unshifted third row in z. The partial sums are checked all at once, the rare
+ * overflows are redone one row at a time. */
+INLINE __m128i MatrixVectorRows(const gtematrix *matrix, const int16_t *v, const int32_t *crv, uint32_t sf, int64_t *z)
+{
+   /* { MX[0][c], MX[1][c], MX[2][c], 0 } from words 0-7 for columns 0
+    * and 1, column 2 is gathered like column 0 from words 2-9 */
+   const __m128i col0   = _mm_setr_epi8(0, 1, 6, 7, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i col1   = _mm_setr_epi8(2, 3, 8, 9, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+   const __m128i lo     = _mm_loadu_si128((const __m128i *)&matrix->MX[0][0]);
+   const __m128i hi     = _mm_loadu_si128((const __m128i *)&matrix->MX[0][2]);
+   const __m128i m0     = _mm_shuffle_epi8(lo, col0);
+   const __m128i m1     = _mm_shuffle_epi8(lo, col1);
+   const __m128i m2     = _mm_shuffle_epi8(hi, col0);
+   const __m128i shift  = _mm_cvtsi32_si128(sf);
+#if defined(__AVX2__)
+   /* Lanes 0-2 are the rows, lane 3 is 0 */
+   const __m256i bias   = _mm256_set1_epi64x(INT64_C(1) << 43);
+   const __m256i sum0   = _mm256_slli_epi64(_mm256_cvtepi32_epi64(_mm_insert_epi32(_mm_loadu_si128((const __m128i *)crv), 0, 3)), 12);
+   const __m256i sum1   = _mm256_add_epi64(sum0, _mm256_mul_epi32(_mm256_cvtepi16_epi64(m0), _mm256_set1_epi64x(v[0])));
+   const __m256i sum2   = _mm256_add_epi64(sum1, _mm256_mul_epi32(_mm256_cvtepi16_epi64(m1), _mm256_set1_epi64x(v[1])));
+   const __m256i sum3   = _mm256_add_epi64(sum2, _mm256_mul_epi32(_mm256_cvtepi16_epi64(m2), _mm256_set1_epi64x(v[2])));
+   /* A partial sum fits in 44 bits if adding 1 << 43 leaves bits 44-63 clear */
+   const __m256i range  = _mm256_or_si256(_mm256_or_si256(_mm256_add_epi64(sum1, bias), _mm256_add_epi64(sum2, bias)),
+                                          _mm256_add_epi64(sum3, bias));
+
+   if(MDFN_UNLIKELY(!_mm256_testz_si256(range, _mm256_set1_epi64x(~((INT64_C(1) << 44) - 1)))))
+      return MatrixVectorRowsSlow(matrix, v, crv, sf, z);
+
+   *z = _mm256_extract_epi64(sum3, 2);
+
+   /* Only the low 32 bits are kept so a logical shift does */
+   return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_srl_epi64(sum3, shift),
+                                 _mm256_setr_epi32(6, 0, 2, 4, 6, 6, 6, 6)));
+#else
+   /* Rows 0 and 1 in the "a" vectors, row 2 and 0 in the "b" ones */
+   const __m128i bias   = _mm_set1_epi64x(INT64_C(1) << 43);
+   const __m128i v0     = _mm_set1_epi64x(v[0]);
+   const __m128i v1     = _mm_set1_epi64x(v[1]);
+   const __m128i v2     = _mm_set1_epi64x(v[2]);
+   const __m128i a0     = _mm_slli_epi64(_mm_cvtepi32_epi64(_mm_loadl_epi64((const __m128i *)crv)), 12);
+   const __m128i b0     = _mm_slli_epi64(_mm_cvtepi32_epi64(_mm_cvtsi32_si128(crv[2])), 12);
+   const __m128i a1     = _mm_add_epi64(a0, _mm_mul_epi32(_mm_cvtepi16_epi64(m0), v0));
+   const __m128i b1     = _mm_add_epi64(b0, _mm_mul_epi32(_mm_cvtepi16_epi64(_mm_srli_si128(m0, 4)), v0));
+   const __m128i a2     = _mm_add_epi64(a1, _mm_mul_epi32(_mm_cvtepi16_epi64(m1), v1));
+   const __m128i b2     = _mm_add_epi64(b1, _mm_mul_epi32(_mm_cvtepi16_epi64(_mm_srli_si128(m1, 4)), v1));
+   const __m128i a3     = _mm_add_epi64(a2, _mm_mul_epi32(_mm_cvtepi16_epi64(m2), v2));
+   const __m128i b3     = _mm_add_epi64(b2, _mm_mul_epi32(_mm_cvtepi16_epi64(_mm_srli_si128(m2, 4)), v2));
+   /* A partial sum fits in 44 bits if adding 1 << 43 leaves bits 44-63 clear */
+   const __m128i range  = _mm_or_si128(_mm_or_si128(_mm_or_si128(_mm_add_epi64(a1, bias), _mm_add_epi64(b1, bias)),
+                                                    _mm_or_si128(_mm_add_epi64(a2, bias), _mm_add_epi64(b2, bias))),
+                                       _mm_or_si128(_mm_add_epi64(a3, bias), _mm_add_epi64(b3, bias)));
+   __m128 rows;
+
+   if(MDFN_UNLIKELY(!_mm_testz_si128(range, _mm_set1_epi64x(~((INT64_C(1) << 44) - 1)))))
+      return MatrixVectorRowsSlow(matrix, v, crv, sf, z);
+
+   *z = _mm_cvtsi128_si64(b3);
+
+   /* Only the low 32 bits are kept so a logical shift does */
+   rows = _mm_shuffle_ps(_mm_castsi128_ps(_mm_srl_epi64(a3, shift)), _mm_castsi128_ps(_mm_srl_epi64(b3, shift)), _MM_SHUFFLE(0, 0, 2, 0));
+
+   return _mm_slli_si128(_mm_castps_si128(rows), 4);
+#endif
+}
+
+/* Store the output of MatrixVectorRows() to MAC1-3 and saturate it into
+ * IR1-3 like MAC_to_IR() */
+INLINE void MACs_to_IR(__m128i mac, int lm)
+{
+   const __m128i sat  = _mm_min_epi32(_mm_max_epi32(mac, _mm_set1_epi32(lm ? 0 : -32768)), _mm_set1_epi32(32767));
+   const unsigned ovf = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(sat, mac))) ^ 0xF;
+
+   FLAGS |= LaneFlags[ovf >> 1] << 22;
+
+   _mm_storeu_si128((__m128i *)MAC, _mm_insert_epi32(mac, MAC[0], 0));
+   _mm_storel_epi64((__m128i *)IR, _mm_packs_epi32(_mm_insert_epi32(sat, IR0, 0), sat));
+}
+
+/* Second half of RTPS/RTPT, "z" is the unshifted third row */
+INLINE void MACs_to_PT(__m128i mac, int64_t z, int lm)
+{
+   const __m128i sat  = _mm_min_epi32(_mm_max_epi32(mac, _mm_set1_epi32(lm ? 0 : -32768)), _mm_set1_epi32(32767));
+   const unsigned ovf = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(sat, mac))) ^ 0xF;
+   const int32_t ftv  = z >> 12;
+
+   /* IR3 is saturated like the others but the flag depends on the unshifted value, see Lm_B_PTZ() */
+   FLAGS |= LaneFlags[(ovf >> 1) & 3] << 22;
+
+   if(ftv < -32768 || ftv > 32767)
+      FLAGS |= 1 << 22;
+
+   _mm_storeu_si128((__m128i *)MAC, _mm_insert_epi32(mac, MAC[0], 0));
+   _mm_storel_epi64((__m128i *)IR, _mm_packs_epi32(_mm_insert_epi32(sat, IR0, 0), sat));
+
+   Z_FIFO[0] = Z_FIFO[1];
+   Z_FIFO[1] = Z_FIFO[2];
+   Z_FIFO[2] = Z_FIFO[3];
+   Z_FIFO[3] = Lm_D(ftv, true);
+}
+#endif
+
+INLINE void MultiplyMatrixByVector(const gtematrix *matrix, const int16_t *v, const int32_t *crv, uint32_t sf, int lm)
+{
+   unsigned i;
+
+#if defined(__SSE4_1__)
+   if(matrix != &Matrices.AbbyNormal && crv != CRVectors.FC)
+   {
+      int64_t z;
+
+      MACs_to_IR(MatrixVectorRows(matrix, v, crv, sf, &z), lm);
+      return;
+   }
+#endif
+
    for(i = 0; i < 3; i++)
    {
       int64_t tmp;
@@ -1069,8 +1368,14 @@ static INLINE void MultiplyMatrixByVector(const gtematrix *matrix, const int16_t
    MAC_to_IR(lm);
 }
 
-static INLINE void MultiplyMatrixByVector_PT(const gtematrix *matrix, const int16_t *v, const int32_t *crv, uint32_t sf, int lm)
+INLINE void MultiplyMatrixByVector_PT(const gtematrix *matrix, const int16_t *v, const int32_t *crv, uint32_t sf, int lm)
 {
+#if defined(__SSE4_1__)
+   int64_t z;
+   const __m128i mac = MatrixVectorRows(matrix, v, crv, sf, &z);
+
+   MACs_to_PT(mac, z, lm);
+#else
    int64_t tmp[3];
    unsigned i;
 
@@ -1100,6 +1405,7 @@ static INLINE void MultiplyMatrixByVector_PT(const gtematrix *matrix, const int1
    Z_FIFO[1] = Z_FIFO[2];
    Z_FIFO[2] = Z_FIFO[3];
    Z_FIFO[3] = Lm_D(tmp[2] >> 12, true);
+#endif
 }
 
 #define DECODE_FIELDS							\
@@ -1123,7 +1429,7 @@ static INLINE void MultiplyMatrixByVector_PT(const gtematrix *matrix, const int1
  }
 
 /* SQR - Square Vector */
-static int32_t SQR(uint32_t instr)
+INLINE int32_t SQR(uint32_t instr)
 {
    DECODE_FIELDS;
 
@@ -1142,7 +1448,7 @@ static int32_t SQR(uint32_t instr)
 }
 
 /* MVMVA - Multiply Vector by Matrix And Vector Add */
-static int32_t MVMVA(uint32_t instr)
+INLINE int32_t MVMVA(uint32_t instr)
 {
    DECODE_FIELDS;
 
@@ -1151,7 +1457,7 @@ static int32_t MVMVA(uint32_t instr)
    return(8);
 }
 
-static INLINE uint32_t Divide(uint32_t dividend, uint32_t divisor)
+INLINE uint32_t Divide(uint32_t dividend, uint32_t divisor)
 {
    if((divisor * 2) > dividend)
    {
@@ -1172,7 +1478,7 @@ static INLINE uint32_t Divide(uint32_t dividend, uint32_t divisor)
    return 0x1FFFF;
 }
 
-static INLINE void check_mac_overflow(int64_t value)
+INLINE void check_mac_overflow(int64_t value)
 {
    if(value < -2147483648LL)
       FLAGS |= 1 << 15;
@@ -1180,7 +1486,7 @@ static INLINE void check_mac_overflow(int64_t value)
       FLAGS |= 1 << 16;
 }
 
-static INLINE void TransformXY(int64_t h_div_sz, float precise_h_div_sz, uint16 z)
+INLINE void TransformXY(int64_t h_div_sz, float precise_h_div_sz, uint16 z)
 {
 
    MAC[0] = F((int64_t)OFX + IR1 * h_div_sz * ((widescreen_hack) ? 0.75 : 1.00)) >> 16;
@@ -1193,6 +1499,9 @@ static INLINE void TransformXY(int64_t h_div_sz, float precise_h_div_sz, uint16
    XY_FIFO[1] = XY_FIFO[2];
    XY_FIFO[2] = XY_FIFO[3];
 
+   if(Replay)
+      return;
+
    /*
     * PGXP hack to add subpixel precision as well
     */
@@ -1217,13 +1526,13 @@ static INLINE void TransformXY(int64_t h_div_sz, float precise_h_div_sz, uint16
 }
 
 
-static INLINE void TransformDQ(int64_t h_div_sz)
+INLINE void TransformDQ(int64_t h_div_sz)
 {
    MAC[0] = F((int64_t)DQB + DQA * h_div_sz);
    IR0 = Lm_H(((int64_t)DQB + DQA * h_div_sz) >> 12);
 }
 
-static INLINE int32 RTPS(uint32 instr)
+INLINE int32 RTPS(uint32 instr)
 {
  DECODE_FIELDS;
  int64 h_div_sz;
@@ -1240,17 +1549,29 @@ static INLINE int32 RTPS(uint32 instr)
  return(15);
 }
 
-static INLINE int32 RTPT(uint32 instr)
+INLINE int32 RTPT(uint32 instr)
 {
  DECODE_FIELDS;
  int i;
+#if defined(__SSE4_1__)
+ __m128i mac[3];
+ int64 z[3];
+
+ // The vertices don't depend on each other until they're pushed to the FIFOs
+ for(i = 0; i < 3; i++)
+  mac[i] = MatrixVectorRows(&Matrices.Rot, Vectors[i], CRVectors.T, sf, &z[i]);
+#endif
 
  for(i = 0; i < 3; i++)
  {
   int64 h_div_sz;
   float precise_h_div_sz;
 
+#if defined(__SSE4_1__)
+  MACs_to_PT(mac[i], z[i], lm);
+#else
   MultiplyMatrixByVector_PT(&Matrices.Rot, Vectors[i], CRVectors.T, sf, lm);
+#endif
   h_div_sz = Divide(H, Z_FIFO[3]);
 
   precise_h_div_sz  = (float)H / float_max(H/2.f, (float)Z_FIFO[3]);
@@ -1264,7 +1585,7 @@ static INLINE int32 RTPT(uint32 instr)
  return(23);
 }
 
-static INLINE void NormColor(uint32_t sf, int lm, uint32_t v)
+INLINE void NormColor(uint32_t sf, int lm, uint32_t v)
 {
    int16_t tmp_vector[3];
 
@@ -1276,7 +1597,7 @@ static INLINE void NormColor(uint32_t sf, int lm, uint32_t v)
    MAC_to_RGB_FIFO();
 }
 
-static int32_t NCS(uint32_t instr)
+INLINE int32_t NCS(uint32_t instr)
 {
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
    const int      lm = (instr >> 10) & 1;
@@ -1286,7 +1607,7 @@ static int32_t NCS(uint32_t instr)
    return(14);
 }
 
-static int32_t NCT(uint32_t instr)
+INLINE int32_t NCT(uint32_t instr)
 {
    unsigned i;
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
@@ -1300,7 +1621,7 @@ static int32_t NCT(uint32_t instr)
 }
 
 /* NCC - Normal Color Color */
-static INLINE void NCC(uint32_t vector_index, uint32_t sf, int lm)
+INLINE void NCC(uint32_t vector_index, uint32_t sf, int lm)
 {
    int16_t tmp_vector[3];
 
@@ -1317,7 +1638,7 @@ static INLINE void NCC(uint32_t vector_index, uint32_t sf, int lm)
    MAC_to_RGB_FIFO();
 }
 
-static int32_t NCCS(uint32_t instr)
+INLINE int32_t NCCS(uint32_t instr)
 {
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
    const int      lm = (instr >> 10) & 1;
@@ -1327,7 +1648,7 @@ static int32_t NCCS(uint32_t instr)
 }
 
 
-static int32_t NCCT(uint32_t instr)
+INLINE int32_t NCCT(uint32_t instr)
 {
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
    const int      lm = (instr >> 10) & 1;
@@ -1339,7 +1660,7 @@ static int32_t NCCT(uint32_t instr)
    return(39);
 }
 
-static INLINE void DPC(uint32_t instr)
+INLINE void DPC(uint32_t instr)
 {
    int i;
    int32_t RGB_temp[3];
@@ -1363,7 +1684,7 @@ static INLINE void DPC(uint32_t instr)
 
 
 /* DCPL - Depth Cue Color Light */
-static int32_t DCPL(uint32_t instr)
+INLINE int32_t DCPL(uint32_t instr)
 {
    int i;
    int32_t RGB_temp[3];
@@ -1390,7 +1711,7 @@ static int32_t DCPL(uint32_t instr)
 }
 
 
-static int32_t DPCS(uint32_t instr)
+INLINE int32_t DPCS(uint32_t instr)
 {
    int i;
    int32_t RGB_temp[3];
@@ -1415,7 +1736,7 @@ static int32_t DPCS(uint32_t instr)
 }
 
 /* DPCT - Depth Cue Triple */
-static int32_t DPCT(uint32_t instr)
+INLINE int32_t DPCT(uint32_t instr)
 {
    /* Each call uses the oldest entry in the RGB FIFO
     * and pushes the result at the top so the three calls
@@ -1429,7 +1750,7 @@ static int32_t DPCT(uint32_t instr)
 
 /* INTPL - Interpolate Between a vector and the far color */
 
-static int32_t INTPL(uint32_t instr)
+INLINE int32_t INTPL(uint32_t instr)
 {
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
    const int      lm = (instr >> 10) & 1;
@@ -1449,7 +1770,7 @@ static int32_t INTPL(uint32_t instr)
 }
 
 
-static INLINE void NormColorDepthCue(uint32_t instr, uint32_t v)
+INLINE void NormColorDepthCue(uint32_t instr, uint32_t v)
 {
    int16_t tmp_vector[3];
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
@@ -1470,7 +1791,7 @@ static INLINE void NormColorDepthCue(uint32_t instr, uint32_t v)
 }
 
 /* NCDS - Normal Color Depth Cue Single vector */
-static int32_t NCDS(uint32_t instr)
+INLINE int32_t NCDS(uint32_t instr)
 {
    NormColorDepthCue(instr, 0);
 
@@ -1478,7 +1799,7 @@ static int32_t NCDS(uint32_t instr)
 }
 
 /* NDCT - Normal Color Depth Cue Triple */
-static int32_t NCDT(uint32_t instr)
+INLINE int32_t NCDT(uint32_t instr)
 {
    NormColorDepthCue(instr, 0);
    NormColorDepthCue(instr, 1);
@@ -1488,7 +1809,7 @@ static int32_t NCDT(uint32_t instr)
 }
 
 /* CC - Color Color */
-static int32_t CC(uint32_t instr)
+INLINE int32_t CC(uint32_t instr)
 {
    const uint32_t     sf = (instr & (1 << 19)) ? 12 : 0;
    const int          lm = (instr >> 10) & 1;
@@ -1506,7 +1827,7 @@ static int32_t CC(uint32_t instr)
    return(11);
 }
 
-static int32_t CDP(uint32_t instr)
+INLINE int32_t CDP(uint32_t instr)
 {
    int16_t tmp_vector[3];
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
@@ -1523,7 +1844,7 @@ static int32_t CDP(uint32_t instr)
 }
 
 /* Normal Clipping */
-static int32_t NCLIP(uint32_t instr)
+INLINE int32_t NCLIP(uint32_t instr)
 {
    int16_t x0     = XY_FIFO[0].X;
    int16_t y0     = XY_FIFO[0].Y;
@@ -1549,7 +1870,7 @@ static int32_t NCLIP(uint32_t instr)
 }
 
 /* Average three Z Values */
-static int32_t AVSZ3(uint32_t instr)
+INLINE int32_t AVSZ3(uint32_t instr)
 {
    uint32_t z1     = Z_FIFO[1];
    uint32_t z2     = Z_FIFO[2];
@@ -1571,7 +1892,7 @@ static int32_t AVSZ3(uint32_t instr)
 }
 
 /* Average four Z values */
-static int32_t AVSZ4(uint32_t instr)
+INLINE int32_t AVSZ4(uint32_t instr)
 {
    uint32_t z0     = Z_FIFO[0];
    uint32_t z1     = Z_FIFO[1];
@@ -1596,7 +1917,7 @@ static int32_t AVSZ4(uint32_t instr)
 
 // -32768 * -32768 - 32767 * -32768 = 2147450880
 // (2 ^ 31) - 1 =		      2147483647
-static int32_t OP(uint32_t instr)
+INLINE int32_t OP(uint32_t instr)
 {
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
    const int      lm = (instr >> 10) & 1;
@@ -1616,7 +1937,7 @@ static int32_t OP(uint32_t instr)
    return(6);
 }
 
-static int32_t GPF(uint32_t instr)
+INLINE int32_t GPF(uint32_t instr)
 {
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
    const int      lm = (instr >> 10) & 1;
@@ -1632,7 +1953,7 @@ static int32_t GPF(uint32_t instr)
    return(5);
 }
 
-static int32_t GPL(uint32_t instr)
+INLINE int32_t GPL(uint32_t instr)
 {
    const uint32_t sf = (instr & (1 << 19)) ? 12 : 0;
    const int      lm = (instr >> 10) & 1;
@@ -1648,39 +1969,11 @@ static int32_t GPL(uint32_t instr)
    return(5);
 }
 
-/*
-
----------------------------------------------------------------------------------------------
-| 24 23 22 21 20 | 19 | 18 17 | 16 15 | 14 13 | 12  11 | 10 | 9  8  7  6 | 5  4  3  2  1  0 |
-|-------------------------------------------------------------------------------------------|
-|    (unused)    | sf |  mx   |   v   |   cv  |(unused)| lm |  (unused)  |     opcode       |
----------------------------------------------------------------------------------------------
- (unused) = unused, ignored
-
- sf = shift 12
-
- mx = matrix selection
-
- v = source vector
-
- cv = add vector(translation/back/far color(bugged)/none)
-
- (unused) = unused, ignored
-
- lm = limit negative results to 0
-
- (unused) = unused, ignored
-
- opcode = operation code 
-*/
-
-int32_t GTE_Instruction(uint32_t instr)
+INLINE int32_t Run(uint32_t instr)
 {
    const unsigned code = instr & 0x3F;
    int32_t ret = 1;
 
-   FLAGS = 0;
-
    switch(code)
    {
       default: 
@@ -1919,14 +2212,132 @@ int32_t GTE_Instruction(uint32_t instr)
          break;
    }
 
+   return(ret);
+}
+};
+
+/*
+
+---------------------------------------------------------------------------------------------
+| 24 23 22 21 20 | 19 | 18 17 | 16 15 | 14 13 | 12  11 | 10 | 9  8  7  6 | 5  4  3  2  1  0 |
+|-------------------------------------------------------------------------------------------|
+|    (unused)    | sf |  mx   |   v   |   cv  |(unused)| lm |  (unused)  |     opcode       |
+---------------------------------------------------------------------------------------------
+ (unused) = unused, ignored
+
+ sf = shift 12
+
+ mx = matrix selection
+
+ v = source vector
+
+ cv = add vector(translation/back/far color(bugged)/none)
+
+ (unused) = unused, ignored
+
+ lm = limit negative results to 0
+
+ (unused) = unused, ignored
+
+ opcode = operation code 
+*/
+
+static INLINE void SetFLAG(uint32_t flags)
+{
+   if(flags & 0x7f87e000)
+      flags |= 1 << 31;
+
+   FLAGS  = flags;
+   CR[31] = flags;
+}
+
+static NO_INLINE void GTE_ResolveFLAG(void)
+{
+   GTE_Ops<true> ops;
+   gtedata data;
+   gtectrl ctrl;
+
+   if(!FLAGPending)
+      return;
+
+   FLAGPending = false;
+
+   SaveData(&data);
+   LoadInput(&FLAGInput);
+   if(FLAGCtrlSaved)
+   {
+      SaveCtrl(&ctrl);
+      LoadCtrl(&FLAGCtrl);
+   }
+
+   ops.FLAGS = 0;
+   ops.Run(FLAGInstr);
+
+   LoadData(&data);
+   if(FLAGCtrlSaved)
+      LoadCtrl(&ctrl);
+
+   SetFLAG(ops.FLAGS);
+}
+
+int32_t GTE_Instruction(uint32_t instr)
+{
+   int32_t ret;
+
+   switch(instr & 0x3F)
+   {
+      /* The matrix and colour commands, which spend most of their time
+       * computing flags. They only depend on the control registers, the
+       * vectors, IR and RGB. DPCT and GPL aren't here: they also read
+       * RGB_FIFO and MAC, which aren't kept for the replay. */
+      case 0x00:
+      case 0x01:
+      case 0x10:
+      case 0x11:
+      case 0x12:
+      case 0x13:
+      case 0x14:
+      case 0x16:
+      case 0x1A:
+      case 0x1B:
+      case 0x1C:
+      case 0x1E:
+      case 0x20:
+      case 0x29:
+      case 0x30:
+      case 0x3D:
+      case 0x3F:
+         {
+            GTE_Ops<false> ops;
+
+            SaveInput(&FLAGInput);
+            FLAGInstr     = instr;
+            FLAGPending   = true;
+            FLAGCtrlSaved = false;
+
+            /* ops.FLAGS is dead once the command is done, so all that's
+             * left of the flag computations is what affects the results */
+            ops.FLAGS = 0;
+            ret = ops.Run(instr);
+         }
+         break;
+
+      default:
+         {
+            GTE_Ops<false> ops;
+
+            FLAGPending = false;
+
+            ops.FLAGS = 0;
+            ret = ops.Run(instr);
+            SetFLAG(ops.FLAGS);
+         }
+         break;
+   }
+
    // Overclock: force all GTE instruction to have 1 cycle latency
    if (psx_gte_overclock)
       ret = 1;
 
-   if(FLAGS & 0x7f87e000)
-      FLAGS |= 1 << 31;
-
-   CR[31] = FLAGS;
-
    return(ret - 1);
 }
@@ -53,13 +53,6 @@ uint16_t MDFN_FASTCALL PSX_MemRead16(int32_t &timestamp, uint32_t A);
 uint32_t MDFN_FASTCALL PSX_MemRead24(int32_t &timestamp, uint32_t A);
 uint32_t MDFN_FASTCALL PSX_MemRead32(int32_t &timestamp, uint32_t A);
 
-#ifdef HAVE_DYNAREC
-int32_t dynarec_sw_cback(struct dynarec_state *s,
-                         uint32_t val,
-                         uint32_t addr,
-                         int32_t counter);
-#endif /* HAVE_DYNAREC */
-
 uint8_t PSX_MemPeek8(uint32_t A);
 uint16_t PSX_MemPeek16(uint32_t A);
 uint32_t PSX_MemPeek32(uint32_t A);
@@ -91,6 +84,8 @@ void PSX_SetEventNT(const int type, const int32_t next_timestamp);
 void PSX_SetDMACycleSteal(unsigned stealage);
 
 void PSX_GPULineHook(const int32_t timestamp, const int32_t line_timestamp, bool vsync, uint32_t *pixels, const MDFN_PixelFormat* const format, const unsigned width, const unsigned pix_clock_offset, const unsigned pix_clock, const unsigned pix_clock_divide);
+// True if PSX_GPULineHook() needs the pixels of the line (light guns)
+bool PSX_GPULineHookNeedsPixels(void);
 
 uint32_t PSX_GetRandU32(uint32_t mina, uint32_t maxa);
 
@@ -138,5 +133,7 @@ static INLINE void overclock_cpu_to_device(int32_t &clock) {
 }
 
 extern unsigned psx_gpu_overclock_shift;
+extern bool psx_gpu_thread;
+extern unsigned psx_gpu_threads;
 
 #endif